@@ -25,41 +25,27 @@
  **   December 27, 2013
  **==========================================================================*/
 
+#include <stdio.h>
 #include <time.h>
 #include <netcdf.h>
 #include <stdint.h>
-
-/*---------------------------------------------------------------------------*
- *  VARIABLES                                                                *
- *---------------------------------------------------------------------------*/
-
-int num_unique_lats;
-
-int num_xml_vars;         /* # of possible defined in the XML stash file */
-int num_um_vars;          /* # of variables defined in the UM file */ 
-int wordsize;             /* wordsize of the architecture on which the input UM fields file was created: 4 or 8 bytes */
-int num_timesteps;        /* # of timesteps present in the UM fields file */
-int num_stored_um_fields; /* # of UM variables found & processed in input UM fields file */
-
-long header[256];        /* input UM fields file's header */
-long int_constants[46];  /* input UM fields file's integer_constants array */
-
-double **level_constants;   /* input UM fields file's 2d level-dependent constants array */
-double   real_constants[6]; /* input UM fields files's real_constants array */
-
-unsigned short int blacklist[10]; /* STASH CODES of UM variables to be avoided */
-unsigned short int blacklist_cnt;
-
-struct tm forecast_reference;
+#include <stdbool.h>
+#include "libum2netcdf.h"
 
 /*---------------------------------------------------------------------------*
  *  FUNCTION POINTERS                                                        *
+ *---------------------------------------------------------------------------*
+ *  Kernels chosen once per process for the CPU it runs on (when the first   *
+ *  context is opened).  They are defined in libum2netcdf.c.  Everything     *
+ *  that depends on the input UM fields file is held in its conversion       *
+ *  context (um2nc_ctx).                                                     *
  *---------------------------------------------------------------------------*/
 
-void   (*field_interpolation)( double*, float*, int ); /* ptr to appropriate interpolation procedure */
-void   (*endian_swap)( void*, int );                   /* ptr to appropriate endian swap procedure   */
-void   (*endian_swap_4b)( void*, int );                /* ptr to appropriate 4 byte endian swap procedure   */
-double (*ibm2ieee_convert)( uint32_t );                 /* ptr to appropriate IBM float to IEEE float function */
+extern long (*ibm2ieee_convert)( const uint32_t*, float*, long ); /* ptr to IBM float to IEEE float array conversion (returns # of overflows) */
+extern void (*wgdos_unpack_row)( const unsigned char*, const unsigned char*, long, int, int, int,
+                                 float, float, float*, const uint64_t* ); /* ptr to WGDOS row unpacking kernel (scalar/AVX2/AVX-512) */
+extern void (*interp_row_avg2)( const float*, const float*, float*, int, double ); /* ptr to 2 point interpolation row kernel (scalar/AVX2) */
+extern void (*interp_row_avg4)( const float*, const float*, const float*, const float*, float*, int, double ); /* ptr to 4 point interpolation row kernel (scalar/AVX2) */
 
 /*---------------------------------------------------------------------------*
  *  STRUCTS                                                                  *
@@ -97,24 +83,26 @@ typedef struct um_field_metadata {
        char units[25];     /* units for field */
 } um_field_metadata;
 
-um_field_metadata *um_vars;
-
 /**
- ** UM_dataslice - Struct that contains unique information about a 2D slice of an 
- **                UM variable stored in input UM fields file.
+ ** slice_table - Struct (of arrays) that contains unique information about every 2D
+ **               data slice stored in the input UM fields file.  The slices of a
+ **               UM variable occupy a contiguous range of the table, level by
+ **               level within each time.
  **/ 
 
-typedef struct um_dataslice {
-        unsigned short id;
-        unsigned short level;  /* Depth or z-level on which the data slice resides */
-        unsigned short lbpack; /* Code used to denote the packing method used */ 
-        long location;         /* Starting address of dataslice in UM fields file lookup[n][28] */
-        long reclength;        /* Size of the stored dataslice in records */
-        long size;             /* Size of the slice in words */
-        long lbproc;           /* denotes whether post-processing has been performed on variable.  0 if not */
-        double mdi;            /* value used to denote a missing data point */
-        struct tm validity, datatime;
-} um_dataslice;
+typedef struct slice_table {
+        long     num;         /* # of 2D data slices in the table */
+        long    *id;          /* index of the slice's lookup entry */
+        long    *location;    /* Starting address of dataslice in UM fields file lookup[n][28] */
+        long    *reclength;   /* Size of the stored dataslice in records */
+        long    *size;        /* Size of the slice in words */
+        int     *lbproc;      /* denotes whether post-processing has been performed on variable.  0 if not */
+        unsigned short *level;  /* Depth or z-level on which the data slice resides */
+        unsigned short *lbpack; /* Code used to denote the packing method used */ 
+        double  *mdi;         /* value used to denote a missing data point */
+        int64_t *validity;    /* validity time in minutes since 0000-01-01 (see um_date_minutes) */
+        int64_t *datatime;    /* data time in minutes since 0000-01-01 */
+} slice_table;
 
 
 /**
@@ -124,11 +112,11 @@ typedef struct um_dataslice {
 
 typedef struct new_um_variable {
         char           name[55];   /* name of the UM variable */
-        unsigned short stash_code;
+        int            stash_code;
         unsigned short xml_index;  /* location of field in the XML stash description file */ 
-        unsigned short nt;
-        unsigned short nz;
-        unsigned short nx, ny;     /* # of points in the x (lon) and y (lat) directions */
+        int            nt;
+        int            nz;
+        int            nx, ny;     /* # of points in the x (lon) and y (lat) directions */
         unsigned short lbvc;       /* indicates the vertical coordinate system used */
         unsigned short lbpack;     /* packing method used: 0 -> no packing, 1 -> WGDOS packing used */
         unsigned short accum;      /* indicates if field is a product of some sort of accummulation process */
@@ -147,11 +135,41 @@ typedef struct new_um_variable {
                                    /* each stored timestep of the variable */
         float space_bnds[2];       /* start & end points for either spatial accumulation done in the variable */
         float scale_factor;
-        um_dataslice **slices;
+        long first_slice;          /* index in stored_slices of the slice at time 0 & level 0; the */
+                                   /* slice at time T & level Z is first_slice + T*nz + Z          */
         nc_type        vartype;    /* datatype of the UM variable (float/double/int/long) */     
 } new_um_variable;
 
-new_um_variable *stored_um_vars;
+
+/**
+ ** stash_set - Hash set of STASH codes (1000*section + item) used to hold the
+ **             UM variables selected for extraction (-s) or to be avoided (-b).
+ **/ 
+
+typedef struct stash_set {
+        int  num;              /* # of STASH codes in the set */
+        int  size;             /* # of hash slots (a power of 2, 0 if the set is empty) */
+        int *slot;             /* STASH code held in each hash slot (-1 if empty) */
+} stash_set;
+
+
+/**
+ ** stash_index - Hash table grouping a list of entries (lookup records or XML
+ **               variable definitions) by STASH code.  The unique codes are
+ **               kept in order of first appearance and the entries of each code
+ **               in their original order, so that each code's entries can be
+ **               reached without scanning the whole list.
+ **/
+
+typedef struct stash_index {
+        int   size;     /* # of hash slots (a power of 2) */
+        int  *slot;     /* index of the code held in each hash slot (-1 if empty) */
+        int   num;      /* # of unique STASH codes */
+        long *code;     /* unique STASH codes in order of first appearance */
+        int  *count;    /* # of entries of each code */
+        int  *first;    /* position of the first entry of each code in ENTRY */
+        int  *entry;    /* indices of the entries, grouped by code */
+} stash_index;
 
 
 /**
@@ -171,4 +189,150 @@ typedef struct run_details {
         char assim[50];        /* data assimilation method used in run */ 
 } run_details;
 
-run_details run_config;
+
+/**
+ ** um_reader - Struct that gives access to the raw contents of the input UM
+ **             fields file.  The file is memory-mapped where possible; the
+ **             stdio handle and buffer are only used when it cannot be mapped.
+ **/
+
+typedef struct um_reader {
+        int            fd;        /* file descriptor of the input UM fields file */
+        FILE          *fh;        /* stdio handle (only set if the file could not be mapped) */
+        unsigned char *map;       /* start of the read-only mapping of the file (NULL if unmapped) */
+        size_t         map_size;  /* size of the mapping in bytes */
+        unsigned char *buf;       /* buffer holding the last record read through stdio */
+        size_t         buf_size;  /* allocated size of BUF in bytes */
+} um_reader;
+
+
+/**
+ ** slice_request - Struct that describes the read of a single 2D data slice
+ **                 from the input UM fields file.  Requests are sorted by
+ **                 file offset so that the file is read in a single sweep.
+ **/
+
+typedef struct slice_request {
+        int           var_index;  /* index of the slice's variable in stored_um_vars */
+        int           t, z;       /* time & level indices of the slice */
+        long          offset;     /* byte offset of the slice's record in the UM fields file */
+        long          nbytes;     /* # of bytes occupied by the slice's record */
+        int           npts;       /* # of points in the unpacked slice (NX*NY) */
+        long          slice;      /* index of the slice in stored_slices */
+} slice_request;
+
+
+/**
+ ** var_output - Struct that holds the per-variable state needed to write the
+ **              2D data slices of a stored UM variable into the NetCDF file.
+ **/
+
+typedef struct var_output {
+        int    varid;                  /* ID of the variable in the output NetCDF file */
+        int    ndim;                   /* # of dimensions of the NetCDF variable (3 or 4) */
+        size_t count[4];               /* extents of a single 2D slice in the NetCDF variable */
+        int    nx, ny;                 /* extents of a single 2D slice in the UM fields file */
+        float  scale;                  /* scale factor applied to the values of the variable */
+        float  actual[2];              /* running actual range of the written values */
+        nc_type vartype;               /* NetCDF type of the written values (float/double/int) */
+        int    direct;                 /* 1 if unpacked records can be converted straight into the output type */
+        int    halo;                   /* # of input rows below an output row read by its interpolation */
+        int    nyp;                    /* # of rows of the P-point grid (int_constants[6] of the UM fields file) */
+        int  (*interp_row)( const float*, int, float*, int, int, int, int, float ); /* row interpolation procedure for the variable */
+        void (*store_row)( const float*, void*, int, float* );  /* stores a row in the NetCDF type & widens the range */
+} var_output;
+
+
+/**
+ ** wgdos_workspace - Struct that holds the scratch space used to unpack WGDOS-packed
+ **                   records.  It is grown as needed and reused from one record
+ **                   to the next.
+ **/
+
+typedef struct wgdos_workspace {
+        unsigned char **offs;        /* address of each row header of the record */
+        float          *bases;       /* IEEE base value of each row of the record */
+        int             max_rows;    /* allocated length of OFFS & BASES */
+        long            num_overflows; /* # of row bases of the last record too large for IEEE floats */
+        int             cols;        /* # of points in each row of the last indexed record */
+        int             nrows;       /* # of complete rows found in the last indexed record */
+        float           scale;       /* 2^PREC scaling of the packed integers of the last record */
+        uint64_t       *mask;        /* 1 row of combined bitmap words per decoding thread */
+        long            max_words;   /* allocated length of MASK */
+} wgdos_workspace;
+
+
+/**
+ ** slice_buffer - Struct that holds a single 2D data slice as it passes through
+ **                the read, decode and write stages of the conversion.
+ **/
+
+typedef struct slice_buffer {
+        int            index;     /* position of the slice in the read schedule */
+        unsigned char *rec;       /* raw record of the slice copied from the UM fields file */
+        long           avail;     /* # of valid bytes in REC */
+        float         *val;       /* decoded values of the slice */
+        float         *fval;      /* 1 row of interpolated & scaled values of the slice (non-float output only) */
+        void          *out;       /* values of the slice in the NetCDF type of its variable */
+        int            stored;    /* 1 if the decoder stored the values straight into OUT */
+        int            decoded;   /* 0 if the record could not be decoded (the slice is not written) */
+        float          range[2];  /* max & min values of the interpolated & scaled slice */
+        wgdos_workspace ws;       /* scratch space for unpacking WGDOS-packed records */
+} slice_buffer;
+
+
+/**
+ ** um2nc_ctx - Struct that holds the whole state of the conversion of one
+ **             input UM fields file: the user's options, the contents of the
+ **             file's headers, its UM variables & 2D data slices and the XML
+ **             stash definitions of those variables.  It is passed to every
+ **             procedure of the conversion, so that a process can convert
+ **             several UM fields files at the same time (one per thread).
+ **/
+
+struct um2nc_ctx {
+
+     /** Options of the conversion **/
+        int  iflag;               /* 1 if the U/V fields are interpolated onto the P-points */
+        int  rflag;               /* 1 if the fields are written with 32 bit precision */
+        int  netcdf3_flag;        /* 1 if the output file should NOT have any NetCDF4 features (HDF5 chunking and/or compression) */
+        int  io_stats_flag;       /* 1 if statistics on the order in which data slices are read should be printed */
+        int  pipeline_flag;       /* 1 if the reading, decoding and writing of data slices are overlapped in separate threads */
+        int  num_decode_threads;  /* # of threads decoding data slices when the reading, decoding & writing are overlapped */
+        int  num_row_threads;     /* # of threads unpacking the rows of a single WGDOS-packed data slice */
+        int  strip_rows;          /* # of rows in each band when data slices are converted & written in bands of rows */
+                                  /* to bound the memory used (0 if slices are converted whole) */
+        char *um_file;            /* name of the input UM fields file */
+        char *stash_file;         /* name of the XML stash file */
+        char *config_file;        /* name of the run configuration XML file (NULL if none was given) */
+        stash_set   selected_stash;  /* STASH codes of UM variables to be extracted (empty -> all) */
+        stash_set   blacklist;       /* STASH codes of UM variables to be avoided */
+        run_details run_config;      /* attributes of the UM run that produced the input UM fields file */
+
+     /** Input UM fields file **/
+        int     wordsize;            /* wordsize of the architecture on which the input UM fields file was created: 4 or 8 bytes */
+        long    header[256];         /* input UM fields file's header */
+        long    int_constants[46];   /* input UM fields file's integer_constants array */
+        double  real_constants[6];   /* input UM fields files's real_constants array */
+        double **level_constants;    /* input UM fields file's 2d level-dependent constants array */
+        int     num_level_rows;      /* # of rows allocated in LEVEL_CONSTANTS */
+        int     num_um_vars;         /* # of valid lookup entries (2D data slices) in the UM file */ 
+        struct tm forecast_reference;
+        void  (*endian_swap)( void*, int );                           /* endian swap procedure of the file's words */
+        void  (*endian_swap_4b)( void*, int );                        /* 4 byte endian swap procedure */
+        void  (*endian_swap_float)( float*, const void*, int, float );   /* endian swap, scale & convert to float procedure */
+        void  (*endian_swap_double)( double*, const void*, int, float ); /* endian swap, scale & convert to double procedure */
+        void  (*endian_swap_int)( int*, const void*, int );              /* endian swap & convert to int procedure */
+
+     /** XML stash file **/
+        int                num_xml_vars;   /* # of variable definitions read from the XML stash file */
+        um_field_metadata *um_vars;        /* variable definitions, sorted by (model, section, item) */
+        void              *stash_map;      /* mapping of the compiled stash file (NULL if UM_VARS was parsed) */
+        size_t             stash_map_len;
+        stash_index        stash_defs;     /* UM_VARS indexed by STASH code (1000*section + item) */
+
+     /** UM variables to be written **/
+        int              num_stored_um_fields; /* # of UM variables found & processed in input UM fields file */
+        new_um_variable *stored_um_vars;
+        slice_table      stored_slices;
+};
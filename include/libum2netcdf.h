@@ -0,0 +1,121 @@
+/**============================================================================
+    This file is part of UM2NetCDF.
+
+    UM2NetCDF is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    UM2NetCDF is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    A copy of the GNU General Public License can be found in the main UM2NetCDF
+    directory.  Alternatively, please see <http://www.gnu.org/licenses/>.
+ **============================================================================*/
+
+
+/** LIBUM2NETCDF
+ **
+ ** Public interface of the UM2NetCDF library (libum2netcdf.a/.so).  Each input
+ ** UM fields file is converted through its own conversion context, so that a
+ ** process can convert several files at the same time, one context per thread:
+ **
+ **      um2nc_options opts;
+ **      um2nc_ctx    *ctx;
+ **
+ **      um2nc_default_options( &opts );
+ **      opts.real32 = 1;
+ **      ctx = um2nc_open( "input.um", "stash2cf.xml", &opts );
+ **      if ( ctx!=NULL ) {
+ **         um2nc_convert( ctx, "output.nc" );
+ **         um2nc_close( ctx );
+ **      }
+ **
+ ** A context must not be used by more than one thread at a time.  Calls into
+ ** the NetCDF library (which is not thread-safe) are serialized internally.
+ **==========================================================================*/
+
+#ifndef LIBUM2NETCDF_H
+#define LIBUM2NETCDF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ ** um2nc_ctx - Conversion context of a single input UM fields file (opaque).
+ **/
+
+typedef struct um2nc_ctx um2nc_ctx;
+
+/**
+ ** um2nc_options - Options of a conversion, matching the options of the
+ **                 um2netcdf.x command.
+ **/
+
+typedef struct um2nc_options {
+        int  interpolate;          /* 1 -> interpolate all fields onto the P-points (-i) */
+        int  real32;               /* 1 -> write fields in 32 bit precision (-r) */
+        int  netcdf3;              /* 1 -> no NetCDF-4 chunking or compression (-n) */
+        int  io_stats;             /* 1 -> print statistics on the order in which slices are read (-d) */
+        int  pipeline;             /* 1 -> overlap the reading, decoding & writing of slices (-p) */
+        int  decode_threads;       /* # of threads decoding data slices when pipelined (-t) */
+        int  row_threads;          /* # of threads unpacking the rows of a single WGDOS-packed slice (-w) */
+        int  strip_rows;           /* # of rows in each band when slices are converted in bands, 0 -> whole (-m) */
+        const char  *config_file;  /* run configuration XML file, NULL -> default run attributes (-c) */
+        const char **select;       /* NULL-terminated list of STASH code specifications to be */
+                                   /* extracted, NULL -> all UM variables (-s) */
+        const char **blacklist;    /* NULL-terminated list of STASH code specifications to be */
+                                   /* ignored, NULL -> none (-b) */
+} um2nc_options;
+
+/**
+ ** um2nc_var_info - Description of a UM variable found in the input file.
+ **/
+
+typedef struct um2nc_var_info {
+        int         stash_code;    /* 1000*section + item */
+        const char *name;          /* name of the NetCDF variable (valid until um2nc_close) */
+        int         nx, ny;        /* # of points of each 2D data slice */
+        int         nz;            /* # of levels */
+        int         nt;            /* # of times */
+        int         lbproc;        /* post-processing code of the UM variable */
+} um2nc_var_info;
+
+
+/** Sets the default options (those of um2netcdf.x without any option flags) **/
+void um2nc_default_options( um2nc_options *opts );
+
+/** Opens an input UM fields file, reads its headers & lookup table and the  **/
+/** XML stash definitions of its UM variables.  Returns NULL on failure.     **/
+um2nc_ctx *um2nc_open( const char *um_file, const char *stash_file, const um2nc_options *opts );
+
+/** Returns the # of UM variables that will be written **/
+int um2nc_num_variables( const um2nc_ctx *ctx );
+
+/** Describes UM variable N (0 <= N < um2nc_num_variables).  Returns 1 on  **/
+/** success and 0 if N is out of range.                                    **/
+int um2nc_inspect( const um2nc_ctx *ctx, int n, um2nc_var_info *info );
+
+/** Writes the UM variables into the NetCDF file NC_FILE (NULL -> the name  **/
+/** of the input file with a .nc suffix).  Returns 1 on success, 0 otherwise. **/
+int um2nc_convert( um2nc_ctx *ctx, const char *nc_file );
+
+/** Releases a conversion context **/
+void um2nc_close( um2nc_ctx *ctx );
+
+/** Returns the # of STASH codes described by a STASH code specification    **/
+/** (16202, 16200-16299, 16:202 or 16:*), or 0 if it is not one.            **/
+int um2nc_check_stash_spec( const char *spec );
+
+/** Compiles an XML stash file into its binary form (BIN_FILE NULL -> the   **/
+/** name of the XML file with a .bin suffix).  Returns 1 on success.        **/
+int um2nc_compile_stash( const char *xml_file, const char *bin_file );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,96 @@
+/**============================================================================
+                 U M 2 N e t C D F  V e r s i o n 2 . 0
+                 --------------------------------------
+
+    Main author: Mark Cheeseman
+                 National Institute of Water & Atmospheric Research (Ltd)
+                 Wellington, New Zealand
+                 February 2014
+
+    UM2NetCDF is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    UM2NetCDF is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    A copy of the GNU General Public License can be found in the main UM2NetCDF
+    directory.  Alternatively, please see <http://www.gnu.org/licenses/>.
+ **============================================================================*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include "field_def.h"
+
+
+/***
+ *** UM_CALENDAR_NAME
+ ***
+ *** Returns the CF name of the calendar used by the input UM fields file.
+ ***
+ ***  INPUT:  calendar -> calendar code of the file (header[7]): 1 -> Gregorian,
+ ***                      2 -> 360-day, 4 -> 365-day
+ ***/
+
+const char *um_calendar_name( long calendar ) {
+
+     if ( calendar==1 ) { return "gregorian"; }
+     if ( calendar==4 ) { return "365_day"; }
+     return "360_day";
+}
+
+
+/***
+ *** UM_DATE_MINUTES
+ ***
+ *** Converts a UM date (year, month, day, hour & minute in consecutive words
+ *** of a lookup entry or the fixed-length header) to the # of minutes since
+ *** 0000-01-01 00:00 in the calendar of the input UM fields file.  Only
+ *** integer arithmetic is used, so the result does not depend on the time
+ *** zone of the process.  Out-of-range days, hours & minutes simply carry
+ *** into the next larger unit.
+ ***
+ ***  INPUT:  w        -> 5 consecutive date words: year, month, day, hour, minute
+ ***          calendar -> calendar code of the file (header[7])
+ ***/
+
+int64_t um_date_minutes( const long *w, long calendar ) {
+
+     static const int cum_days[12] = { 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334 };
+
+     int64_t y, m, days, era, yoe, doy, doe;
+
+     y = (int64_t ) w[0];
+     m = (int64_t ) w[1];
+
+  /** Bring months outside 1..12 into range **/
+     y += ( m>0 ) ? (m-1)/12 : (m-12)/12;
+     m  = ((m-1)%12 + 12)%12 + 1;
+
+     if ( calendar==1 ) {
+
+     /** Proleptic Gregorian calendar (days from civil date, years starting in March) **/
+        if ( m<=2 ) { y--; }
+        era  = ( y>=0 ? y : y-399 )/400;
+        yoe  = y - era*400;
+        doy  = (153*( m>2 ? m-3 : m+9 ) + 2)/5;
+        doe  = yoe*365 + yoe/4 - yoe/100 + doy;
+        days = era*146097 + doe + 60;
+
+     } else if ( calendar==4 ) {
+
+     /** 365-day calendar (no leap years) **/
+        days = y*365 + cum_days[m-1];
+
+     } else {
+
+     /** 360-day calendar (twelve 30-day months) **/
+        days = (y*12 + (m-1))*30;
+     }
+     days += (int64_t ) w[2] - 1;
+
+     return (days*24 + (int64_t ) w[3])*60 + (int64_t ) w[4];
+}
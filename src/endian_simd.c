@@ -0,0 +1,357 @@
+/**============================================================================
+                 U M 2 N e t C D F  V e r s i o n 2 . 0
+                 --------------------------------------
+
+    Main author: Mark Cheeseman
+                 National Institute of Water & Atmospheric Research (Ltd)
+                 Wellington, New Zealand
+                 February 2014
+
+    UM2NetCDF is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    UM2NetCDF is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    A copy of the GNU General Public License can be found in the main UM2NetCDF
+    directory.  Alternatively, please see <http://www.gnu.org/licenses/>.
+ **============================================================================*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "field_def.h"
+
+/** Function prototypes **/
+
+void endian_swap_8bytes( void *ptr, int N );
+void endian_swap_4bytes( void *ptr, int nchunk );
+void no_endian_swap( void *ptr, int nchunk );
+void endian_swap_float_8bytes( float *dst, const void *src, int N, float scale );
+void endian_swap_double_8bytes( double *dst, const void *src, int N, float scale );
+void endian_swap_int_8bytes( int *dst, const void *src, int N );
+void endian_swap_float_4bytes( float *dst, const void *src, int N, float scale );
+void endian_swap_double_4bytes( double *dst, const void *src, int N, float scale );
+void endian_swap_int_4bytes( int *dst, const void *src, int N );
+void no_endian_swap_float_8bytes( float *dst, const void *src, int N, float scale );
+void no_endian_swap_double_8bytes( double *dst, const void *src, int N, float scale );
+void no_endian_swap_int_8bytes( int *dst, const void *src, int N );
+void no_endian_swap_float_4bytes( float *dst, const void *src, int N, float scale );
+void no_endian_swap_double_4bytes( double *dst, const void *src, int N, float scale );
+void no_endian_swap_int_4bytes( int *dst, const void *src, int N );
+long ibm2ieee_array( const uint32_t *ibm, float *ieee, long n );
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__PGI)
+#define SWAP_SIMD
+#endif
+
+#ifdef SWAP_SIMD
+
+#include <immintrin.h>
+
+/** Byte shuffles reversing each 8 or 4 byte word of a 256 bit vector **/
+#define BSWAP64_MASK _mm256_setr_epi8( 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8, \
+                                       7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 )
+#define BSWAP32_MASK _mm256_setr_epi8( 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, \
+                                       3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 )
+
+
+/***
+ *** SWAP_#BYTES_AVX2
+ ***
+ *** AVX2 versions of ENDIAN_SWAP_#BYTES: 32 bytes are byte-swapped per
+ *** iteration with a single vpshufb.  The last words are left to the
+ *** scalar procedures.
+ ***/
+
+__attribute__((target("avx2")))
+static void swap_8bytes_avx2( void *ptr, int N )
+{
+   const __m256i  mask = BSWAP64_MASK;
+   unsigned char *p = (unsigned char *) ptr;
+   int            i;
+
+   for (i = 0; i + 4 <= N; i += 4)
+      _mm256_storeu_si256( (__m256i *) (p + 8L*i),
+                           _mm256_shuffle_epi8( _mm256_loadu_si256( (const __m256i *) (p + 8L*i) ), mask ) );
+   if (i < N) endian_swap_8bytes( p + 8L*i, N - i );
+}
+
+__attribute__((target("avx2")))
+static void swap_4bytes_avx2( void *ptr, int N )
+{
+   const __m256i  mask = BSWAP32_MASK;
+   unsigned char *p = (unsigned char *) ptr;
+   int            i;
+
+   for (i = 0; i + 8 <= N; i += 8)
+      _mm256_storeu_si256( (__m256i *) (p + 4L*i),
+                           _mm256_shuffle_epi8( _mm256_loadu_si256( (const __m256i *) (p + 4L*i) ), mask ) );
+   if (i < N) endian_swap_4bytes( p + 4L*i, N - i );
+}
+
+
+/** Loads 8 big-endian doubles and narrows them to single precision **/
+__attribute__((target("avx2")))
+static inline __m256 load_be_8bytes_ps( const unsigned char *p )
+{
+   const __m256i mask = BSWAP64_MASK;
+   __m128        lo, hi;
+
+   lo = _mm256_cvtpd_ps( _mm256_castsi256_pd( _mm256_shuffle_epi8( _mm256_loadu_si256( (const __m256i *) p ), mask ) ) );
+   hi = _mm256_cvtpd_ps( _mm256_castsi256_pd( _mm256_shuffle_epi8( _mm256_loadu_si256( (const __m256i *) (p + 32) ), mask ) ) );
+   return _mm256_set_m128( hi, lo );
+}
+
+/** Loads 8 big-endian floats **/
+__attribute__((target("avx2")))
+static inline __m256 load_be_4bytes_ps( const unsigned char *p )
+{
+   return _mm256_castsi256_ps( _mm256_shuffle_epi8( _mm256_loadu_si256( (const __m256i *) p ), BSWAP32_MASK ) );
+}
+
+/** Stores 8 single precision values as doubles **/
+__attribute__((target("avx2")))
+static inline void store_pd( double *dst, __m256 v )
+{
+   _mm256_storeu_pd( dst,     _mm256_cvtps_pd( _mm256_castps256_ps128( v ) ) );
+   _mm256_storeu_pd( dst + 4, _mm256_cvtps_pd( _mm256_extractf128_ps( v, 1 ) ) );
+}
+
+
+/***
+ *** SWAP_{FLOAT,DOUBLE,INT}_#BYTES_AVX2
+ ***
+ *** AVX2 versions of ENDIAN_SWAP_{FLOAT,DOUBLE,INT}_#BYTES converting 8 words
+ *** per iteration.  Conversions & scaling are done with the same single
+ *** precision operations as the scalar procedures, so results are identical.
+ ***/
+
+__attribute__((target("avx2")))
+static void swap_float_8bytes_avx2( float *dst, const void *src, int N, float scale )
+{
+   const unsigned char *p = (const unsigned char *) src;
+   const __m256         vscale = _mm256_set1_ps( scale );
+   int                  i;
+
+   for (i = 0; i + 8 <= N; i += 8)
+      _mm256_storeu_ps( dst + i, _mm256_mul_ps( vscale, load_be_8bytes_ps( p + 8L*i ) ) );
+   if (i < N) endian_swap_float_8bytes( dst + i, p + 8L*i, N - i, scale );
+}
+
+__attribute__((target("avx2")))
+static void swap_double_8bytes_avx2( double *dst, const void *src, int N, float scale )
+{
+   const unsigned char *p = (const unsigned char *) src;
+   const __m256         vscale = _mm256_set1_ps( scale );
+   int                  i;
+
+   for (i = 0; i + 8 <= N; i += 8)
+      store_pd( dst + i, _mm256_mul_ps( vscale, load_be_8bytes_ps( p + 8L*i ) ) );
+   if (i < N) endian_swap_double_8bytes( dst + i, p + 8L*i, N - i, scale );
+}
+
+__attribute__((target("avx2")))
+static void swap_int_8bytes_avx2( int *dst, const void *src, int N )
+{
+   /* Keep the byte-swapped low 32 bits of each 64 bit word, packed into the low half of each lane */
+   const __m256i        mask = _mm256_setr_epi8( 7, 6, 5, 4, 15, 14, 13, 12, -1, -1, -1, -1, -1, -1, -1, -1,
+                                                 7, 6, 5, 4, 15, 14, 13, 12, -1, -1, -1, -1, -1, -1, -1, -1 );
+   const unsigned char *p = (const unsigned char *) src;
+   __m256i              w;
+   int                  i;
+
+   for (i = 0; i + 4 <= N; i += 4) {
+      w = _mm256_shuffle_epi8( _mm256_loadu_si256( (const __m256i *) (p + 8L*i) ), mask );
+      w = _mm256_permute4x64_epi64( w, 0x08 );
+      _mm_storeu_si128( (__m128i *) (dst + i), _mm256_castsi256_si128( w ) );
+   }
+   if (i < N) endian_swap_int_8bytes( dst + i, p + 8L*i, N - i );
+}
+
+__attribute__((target("avx2")))
+static void swap_float_4bytes_avx2( float *dst, const void *src, int N, float scale )
+{
+   const unsigned char *p = (const unsigned char *) src;
+   const __m256         vscale = _mm256_set1_ps( scale );
+   int                  i;
+
+   for (i = 0; i + 8 <= N; i += 8)
+      _mm256_storeu_ps( dst + i, _mm256_mul_ps( vscale, load_be_4bytes_ps( p + 4L*i ) ) );
+   if (i < N) endian_swap_float_4bytes( dst + i, p + 4L*i, N - i, scale );
+}
+
+__attribute__((target("avx2")))
+static void swap_double_4bytes_avx2( double *dst, const void *src, int N, float scale )
+{
+   const unsigned char *p = (const unsigned char *) src;
+   const __m256         vscale = _mm256_set1_ps( scale );
+   int                  i;
+
+   for (i = 0; i + 8 <= N; i += 8)
+      store_pd( dst + i, _mm256_mul_ps( vscale, load_be_4bytes_ps( p + 4L*i ) ) );
+   if (i < N) endian_swap_double_4bytes( dst + i, p + 4L*i, N - i, scale );
+}
+
+__attribute__((target("avx2")))
+static void swap_int_4bytes_avx2( int *dst, const void *src, int N )
+{
+   const unsigned char *p = (const unsigned char *) src;
+   int                  i;
+
+   for (i = 0; i + 8 <= N; i += 8)
+      _mm256_storeu_si256( (__m256i *) (dst + i),
+                           _mm256_shuffle_epi8( _mm256_loadu_si256( (const __m256i *) (p + 4L*i) ), BSWAP32_MASK ) );
+   if (i < N) endian_swap_int_4bytes( dst + i, p + 4L*i, N - i );
+}
+
+
+/***
+ *** IBM2IEEE_ARRAY_AVX2
+ ***
+ *** AVX2 version of IBM2IEEE_ARRAY converting 8 values per iteration.  AVX2
+ *** has no vector leading zero count, so the position of the leading bit of
+ *** each (24 bit) mantissa is read off the exponent of its exact conversion
+ *** to single precision.  Results are identical to IBM2IEEE_ARRAY.
+ ***/
+
+__attribute__((target("avx2")))
+static long ibm2ieee_array_avx2( const uint32_t *ibm, float *ieee, long n )
+{
+   const __m256i vsign = _mm256_set1_epi32( (int) 0x80000000 );
+   const __m256i vtiss = _mm256_set1_epi32( 0x00FFFFFF );
+   const __m256i vetis = _mm256_set1_epi32( 0x007FFFFF );
+   const __m256i vinf  = _mm256_set1_epi32( 0x7F800000 );
+   const __m256i v150  = _mm256_set1_epi32( 150 );
+   const __m256i v254  = _mm256_set1_epi32( 254 );
+   const __m256i zero  = _mm256_setzero_si256();
+   __m256i       w, s, m, p, e, r, ovf, keep;
+   long          i, novf;
+
+   novf = 0;
+   for (i = 0; i + 8 <= n; i += 8) {
+      w = _mm256_loadu_si256( (const __m256i *) (ibm + i) );
+      s = _mm256_and_si256( w, vsign );
+      m = _mm256_and_si256( w, vtiss );
+
+      /* P = biased exponent of (float) M, ie. 127 + position of the leading bit of M */
+      p = _mm256_srli_epi32( _mm256_castps_si256( _mm256_cvtepi32_ps( m ) ), 23 );
+
+      /* IEEE exponent 4E - 130 - K with K = 23 - (P - 127) leading zeros */
+      e = _mm256_sub_epi32( _mm256_slli_epi32( _mm256_srli_epi32( _mm256_slli_epi32( w, 1 ), 25 ), 2 ),
+                            _mm256_set1_epi32( 280 ) );
+      e = _mm256_add_epi32( e, p );
+
+      r = _mm256_and_si256( _mm256_sllv_epi32( m, _mm256_sub_epi32( v150, p ) ), vetis );
+      r = _mm256_or_si256( r, _mm256_slli_epi32( e, 23 ) );
+
+      /* Zero mantissas & underflows keep only the sign; overflows become infinity */
+      keep = _mm256_andnot_si256( _mm256_or_si256( _mm256_cmpeq_epi32( m, zero ), _mm256_cmpgt_epi32( zero, e ) ),
+                                  _mm256_set1_epi32( -1 ) );
+      ovf  = _mm256_and_si256( keep, _mm256_cmpgt_epi32( e, v254 ) );
+      r    = _mm256_and_si256( r, keep );
+      r    = _mm256_blendv_epi8( r, vinf, ovf );
+
+      _mm256_storeu_si256( (__m256i *) (ieee + i), _mm256_or_si256( r, s ) );
+      novf += __builtin_popcount( (unsigned int) _mm256_movemask_ps( _mm256_castsi256_ps( ovf ) ) );
+   }
+   if (i < n) novf += ibm2ieee_array( ibm + i, ieee + i, n - i );
+
+   return novf;
+}
+
+#endif
+
+
+/***
+ *** SELECT_IBM2IEEE_KERNEL
+ ***
+ *** Sets the IBM to IEEE float conversion procedure for the whole process: the
+ *** AVX2 kernel when the CPU supports it (as reported by CPUID), otherwise the
+ *** portable scalar procedure.
+ ***
+ *** Function returns the name of the selected kernel.
+ ***/
+
+const char *select_ibm2ieee_kernel( void ) {
+
+     ibm2ieee_convert = &ibm2ieee_array;
+#ifdef SWAP_SIMD
+     __builtin_cpu_init();
+     if ( __builtin_cpu_supports("avx2") ) { 
+        ibm2ieee_convert = &ibm2ieee_array_avx2; 
+        return "AVX2";
+     }
+#endif
+     return "scalar";
+}
+
+
+/***
+ *** SELECT_SWAP_KERNELS
+ ***
+ *** Sets the endian swap & conversion procedures of a conversion context for 
+ *** an input UM fields file with WORD_SIZE byte words, which does (SWAP=1) or
+ *** does not (SWAP=0) have to be byte-swapped.  The AVX2 kernels are used when
+ *** the CPU supports them (as reported by CPUID), otherwise the portable scalar
+ *** procedures.
+ ***
+ *** Function returns the name of the selected kernels.
+ ***/
+
+const char *select_swap_kernels( um2nc_ctx *ctx, int word_size, int swap ) {
+
+     if ( swap==0 ) {
+        ctx->endian_swap    = &no_endian_swap;
+        ctx->endian_swap_4b = &no_endian_swap;
+        if ( word_size==8 ) {
+           ctx->endian_swap_float  = &no_endian_swap_float_8bytes;
+           ctx->endian_swap_double = &no_endian_swap_double_8bytes;
+           ctx->endian_swap_int    = &no_endian_swap_int_8bytes;
+        } else {
+           ctx->endian_swap_float  = &no_endian_swap_float_4bytes;
+           ctx->endian_swap_double = &no_endian_swap_double_4bytes;
+           ctx->endian_swap_int    = &no_endian_swap_int_4bytes;
+        }
+        return "none";
+     }
+
+#ifdef SWAP_SIMD
+     __builtin_cpu_init();
+     if ( __builtin_cpu_supports("avx2") ) {
+        ctx->endian_swap_4b = &swap_4bytes_avx2;
+        if ( word_size==8 ) {
+           ctx->endian_swap        = &swap_8bytes_avx2;
+           ctx->endian_swap_float  = &swap_float_8bytes_avx2;
+           ctx->endian_swap_double = &swap_double_8bytes_avx2;
+           ctx->endian_swap_int    = &swap_int_8bytes_avx2;
+        } else {
+           ctx->endian_swap        = &swap_4bytes_avx2;
+           ctx->endian_swap_float  = &swap_float_4bytes_avx2;
+           ctx->endian_swap_double = &swap_double_4bytes_avx2;
+           ctx->endian_swap_int    = &swap_int_4bytes_avx2;
+        }
+        return "AVX2";
+     }
+#endif
+
+     ctx->endian_swap_4b = &endian_swap_4bytes;
+     if ( word_size==8 ) {
+        ctx->endian_swap        = &endian_swap_8bytes;
+        ctx->endian_swap_float  = &endian_swap_float_8bytes;
+        ctx->endian_swap_double = &endian_swap_double_8bytes;
+        ctx->endian_swap_int    = &endian_swap_int_8bytes;
+     } else {
+        ctx->endian_swap        = &endian_swap_4bytes;
+        ctx->endian_swap_float  = &endian_swap_float_4bytes;
+        ctx->endian_swap_double = &endian_swap_double_4bytes;
+        ctx->endian_swap_int    = &endian_swap_int_4bytes;
+     }
+     return "scalar";
+}
@@ -35,6 +35,7 @@
  *** rotated lon/lat grid used in the UM model.  
  ***
  *** INPUT: 
+ ***      ctx -> conversion context of the input UM fields file
  ***      lon -> 2D longitude array
  ***      lat -> 2D latitude array
  ***
@@ -42,7 +43,7 @@
  ***   May 1, 2014
  ***/
 
-void construct_rotated_lat_lon_arrays( float *lon, float *lat ) {
+void construct_rotated_lat_lon_arrays( um2nc_ctx *ctx, float *lon, float *lat ) {
 
      int    i, j;
      double tlat, tlon, degtorad, radtodeg, sock, cpart, t1, t2, longitude, latitude;
@@ -52,20 +53,20 @@ void construct_rotated_lat_lon_arrays( float *lon, float *lat ) {
 
      degtorad = PI / 180.0;
      radtodeg = 180.0 / PI;
-     if ( real_constants[4]==0 ) { sock = 0; }
-     else                        { sock = real_constants[5] - PI; }
+     if ( ctx->real_constants[4]==0 ) { sock = 0; }
+     else                             { sock = ctx->real_constants[5] - PI; }
 
-     for ( j=0; j<int_constants[6]; j++ ) {
+     for ( j=0; j<ctx->int_constants[6]; j++ ) {
 
          tlat = lat[j]*degtorad;
-         t1   = -cos(real_constants[4])*sin(tlat);
-         for ( i=0; i<int_constants[5]; i++ ) {
+         t1   = -cos(ctx->real_constants[4])*sin(tlat);
+         for ( i=0; i<ctx->int_constants[5]; i++ ) {
 
             tlon = lon[i]*degtorad;
             cpart = cos(tlon) * cos(tlat);
-            t2    = sin(real_constants[4])*cpart;
+            t2    = sin(ctx->real_constants[4])*cpart;
 
-            latitude = asin((cos(real_constants[4])*cpart)+(sin(real_constants[4])*sin(tlat)));
+            latitude = asin((cos(ctx->real_constants[4])*cpart)+(sin(ctx->real_constants[4])*sin(tlat)));
             if ( fabs(cos(latitude)+(t1+t2))<=1.0e-8 ) { longitude = PI; }
             else                                       { longitude = -acos((t1+t2)/cos(latitude)); }
 
@@ -73,8 +74,8 @@ void construct_rotated_lat_lon_arrays( float *lon, float *lat ) {
             longitude += sock;
             if ( longitude<0.0 ) { longitude += 2.0*PI; }
 
-            lat[i+int_constants[5]*j] = (float )(latitude * radtodeg);
-            lon[i+int_constants[5]*j] = (float )(longitude * radtodeg);
+            lat[i+ctx->int_constants[5]*j] = (float )(latitude * radtodeg);
+            lon[i+ctx->int_constants[5]*j] = (float )(longitude * radtodeg);
 
          }
      }
@@ -82,25 +83,25 @@ void construct_rotated_lat_lon_arrays( float *lon, float *lat ) {
      return;
 }
 
-void construct_reg_lat_lon_arrays( float *lon, float *lat ) {
+void construct_reg_lat_lon_arrays( um2nc_ctx *ctx, float *lon, float *lat ) {
 
      int    i, j, ind;
      double val;
 
   /** Construct the "model" latitude values **/
-     for ( j=0; j<int_constants[6]; j++ ) {
-         val = real_constants[2] + real_constants[1]*((double ) j);
-         for ( i=0; i<int_constants[5]; i++ ) {
-             ind = j*int_constants[5] + i;
+     for ( j=0; j<ctx->int_constants[6]; j++ ) {
+         val = ctx->real_constants[2] + ctx->real_constants[1]*((double ) j);
+         for ( i=0; i<ctx->int_constants[5]; i++ ) {
+             ind = j*ctx->int_constants[5] + i;
              lat[ind] = (float ) val;
          }
      }
 
   /** Construct the "model" longitude values **/
-     for ( j=0; j<int_constants[6]; j++ ) {
-     for ( i=0; i<int_constants[5]; i++ ) {
-         val = real_constants[3] + real_constants[0]*((double ) i);
-         ind = j*int_constants[5] + i;
+     for ( j=0; j<ctx->int_constants[6]; j++ ) {
+     for ( i=0; i<ctx->int_constants[5]; i++ ) {
+         val = ctx->real_constants[3] + ctx->real_constants[0]*((double ) i);
+         ind = j*ctx->int_constants[5] + i;
          lon[ind] = (float ) val;
      }
      }
@@ -117,23 +118,24 @@ void construct_reg_lat_lon_arrays( float *lon, float *lat ) {
  *** in curvilinear coordinates. 
  ***
  ***   INPUT: 
+ ***           ctx  -> conversion context of the input UM fields file
  ***           ncid -> file handler for the newly created NetCDF file 
  ***
  ***   Mark Cheeseman, NIWA
  ***   December 17, 2013
  ***/ 
 
-void construct_lat_lon_arrays( int ncid ) {
+void construct_lat_lon_arrays( um2nc_ctx *ctx, int ncid ) {
 
      int    varID, ierr;
      float *lat, *lon, val;
 
-     lat = (float *) malloc( int_constants[5]*int_constants[6]*sizeof(float) );
-     lon = (float *) malloc( int_constants[5]*int_constants[6]*sizeof(float) );
+     lat = (float *) malloc( ctx->int_constants[5]*ctx->int_constants[6]*sizeof(float) );
+     lon = (float *) malloc( ctx->int_constants[5]*ctx->int_constants[6]*sizeof(float) );
 
   /** Check if a rotated coordinate system is being used **/
-     if ( header[3]<99 ) { construct_reg_lat_lon_arrays( lon, lat ); }
-     else                { construct_rotated_lat_lon_arrays( lon, lat ); }
+     if ( ctx->header[3]<99 ) { construct_reg_lat_lon_arrays( ctx, lon, lat ); }
+     else                { construct_rotated_lat_lon_arrays( ctx, lon, lat ); }
 
   /** Output latitude values to hard disk **/
      ierr = nc_inq_varid( ncid, "latitude", &varID );
@@ -29,206 +29,188 @@
 
 
 /***
- *** INTERP_DO_NOTHING
+ *** INTERP_AVG2_ROW / INTERP_AVG4_ROW
  ***
- *** No interpolation is done to the field.  Only the scale factor is applied. 
+ *** Portable row kernels of the interpolation procedures: each of the N output
+ *** points is FACTOR times the sum of the corresponding points of 2 (or 4) 
+ *** input rows.  The sums are formed in double precision, in argument order.
+ *** They are used when no SIMD kernel is available and to finish the points
+ *** left over by the SIMD kernels.
+ ***/
+
+void interp_avg2_row( const float *a, const float *b, float *out, int n, double factor ) {
+
+       int i;
+
+       for ( i=0; i<n; i++ ) 
+           out[i] = (float ) (factor*( (double ) a[i] + b[i] ));
+
+       return;
+}
+
+void interp_avg4_row( const float *a, const float *b, const float *c, const float *d, float *out, 
+                      int n, double factor ) {
+
+       int i;
+
+       for ( i=0; i<n; i++ ) 
+           out[i] = (float ) (factor*( (double ) a[i] + b[i] + c[i] + d[i] ));
+
+       return;
+}
+
+
+/***
+ *** INTERP_ROW_DO_NOTHING
+ ***
+ *** No interpolation is done: computes row J of the field scaled by SCALE.
+ *** Rows beyond the field's NY rows are copies of its last row.
  ***
  *** INPUT:
- ***      val       --> data array ( double precision )
- ***      fval      --> data array ( single precision )
- ***      var_index --> index denoting the current variable in the global array
- ***                    of stored UM variables
+ ***      val       --> data array ( single precision )
+ ***      first     --> index of the first row of the field held in VAL
+ ***      j         --> index of the output row 
+ ***      nx        --> # of data points in X (longitude) direction of the field
+ ***      ny        --> # of data points in Y (latitude) direction of the field
+ ***      nyp       --> # of rows of the P-point grid (INT_CONSTANTS[6])
+ ***      scale     --> scale factor applied to the field
+ ***
+ *** OUTPUT:
+ ***      row       --> row J of the scaled field (unless it is a copy)
  ***
- ***   Mark Cheeseman, NIWA
- ***   May 28, 2014
- ***/ 
+ *** Function returns J, or the index of the earlier row that row J is a copy of.
+ ***/
 
-void interp_do_nothing(  double *val, float *fval, int var_index ) {
+int interp_row_do_nothing( const float *val, int first, float *row, int j, int nx, int ny, int nyp, float scale ) {
 
-       int n, cnt;
+       int  i;
+       long index;
 
-       cnt = (int )( stored_um_vars[var_index].nx*stored_um_vars[var_index].ny );
+       if ( j>=ny ) { return ny-1; }
 
-       for ( n=0; n<cnt; n++ ) 
-           fval[n] = stored_um_vars[var_index].scale_factor*((float ) val[n]); 
+       index = (long ) (j-first)*nx;
+       for ( i=0; i<nx; i++ ) 
+           row[i] = scale*val[index+i];
 
-       return;
+       return j;
 }
 
 
 /***
- *** V_TO_P_POINT_INTERP_C_GRID 
+ *** V_TO_P_ROW_C_GRID 
  ***
- *** Subroutine that performs interpolation on a 2D array of points on 
- *** an Arakawa-C grid.  The data points are located on the V points
- *** and need to be translated onto the P points
+ *** Computes row J of a field on the V-points of an Arakawa-C grid translated
+ *** onto the P-points.  Row J (J = 2 to NY-1) is the average of rows J-2 and J 
+ *** of the V-point field; rows 0 & 1 are equal to row 2 and rows NY to
+ *** NYP-1 are copies of row NY-1.
  ***
  *** INPUT:
- ***      val        --> data array with its points located on V-points of a C-grid
- ***      var_index --> index denoting the current variable in the global array
- ***                    of stored UM variables
+ ***      val       --> data array with its points located on V-points of a C-grid
+ ***      first     --> index of the first row of the field held in VAL
+ ***      j         --> index of the output row
+ ***      nx        --> # of data points in X (longitude) direction of the field
+ ***      ny        --> # of data points in Y (latitude) direction of the field
+ ***      nyp       --> # of rows of the P-point grid (INT_CONSTANTS[6])
+ ***      scale     --> scale factor applied to the field
+ ***
+ *** OUTPUT:
+ ***      row       --> row J of the interpolated field (unless it is a copy)
  ***
- ***   Mark Cheeseman, NIWA
- ***   May 28, 2014
+ *** Function returns J, or the index of the earlier row that row J is a copy of.
  ***/
 
-void v_to_p_point_interp_c_grid( double *val, float *fval, int var_index ) {
-
-       int    NY, i, j, index, index2, index3;
-       double factor, tmp;
-
-       NY = (int ) stored_um_vars[var_index].ny;
-       if ( int_constants[6]<NY ) { NY = int_constants[6]; }
-       factor = 0.5*((double )stored_um_vars[var_index].scale_factor);
-
-
-       /** Interpolate in the Y direction from rows 1 to NY-2 **/
-          for ( j=1; j<NY-1; j++ ) {
-          for ( i=0; i<stored_um_vars[var_index].nx; i++ ) {
-              index = i + j*stored_um_vars[var_index].nx;
-              index2= index - stored_um_vars[var_index].nx;
-              index3= index + stored_um_vars[var_index].nx;
-              tmp = factor*( val[index2] + val[index3] );
-              fval[index3] = (float ) tmp;
-          }
-          }
-
-       /** Copy contents of Row 1 into Row 0 **/
-          for ( i=0; i<stored_um_vars[var_index].nx; i++ ) {
-              index = i + stored_um_vars[var_index].nx;
-              fval[i] = fval[index];
-          }
-
-       /** Copy contents of Row NY-2 into Rows NY to INT_CONSTANTS[6]-1 **/
-          for ( j=NY; j<int_constants[6]; j++ ) {
-          for ( i=0; i<stored_um_vars[var_index].nx; i++ ) {
-              index = i + (NY-1)*stored_um_vars[var_index].nx;
-              index2= i + j*stored_um_vars[var_index].nx;
-              fval[index2] = fval[index];
-          }
-          }
+int v_to_p_row_c_grid( const float *val, int first, float *row, int j, int nx, int ny, int nyp, float scale ) {
 
-       return;
+       int  NY, k;
+
+       NY = ( nyp<ny ) ? nyp : ny;
+       if ( j>=NY ) { return NY-1; }
+
+       k = ( j<2 ) ? 2 : j;
+       interp_row_avg2( val+(long )(k-2-first)*nx, val+(long )(k-first)*nx, row, nx, 0.5*((double )scale) );
+
+       return j;
 }
 
 
 /***
- *** U_TO_P_POINT_INTERP_C_GRID 
+ *** U_TO_P_ROW_C_GRID 
  ***
- *** Subroutine that performs interpolation on a 2D array of points on 
- *** an Arakawa-C grid.  The data points are located on the V points
- *** and need to be translated onto the P points
+ *** Computes row J of a field on the U-points of an Arakawa-C grid translated
+ *** onto the P-points.  Each point is the average of its western & eastern 
+ *** neighbours; columns 0 & NX-1 are copies of columns 1 & NX-2 and rows NY
+ *** to NYP-1 are copies of row NY-1.
  ***
  *** INPUT:
- ***      val        --> data array with its points located on U-points of a C-grid
- ***      var_index --> index denoting the current variable in the global array
- ***                    of stored UM variables
+ ***      val       --> data array with its points located on U-points of a C-grid
+ ***      first     --> index of the first row of the field held in VAL
+ ***      j         --> index of the output row
+ ***      nx        --> # of data points in X (longitude) direction of the field
+ ***      ny        --> # of data points in Y (latitude) direction of the field
+ ***      nyp       --> # of rows of the P-point grid (INT_CONSTANTS[6])
+ ***      scale     --> scale factor applied to the field
  ***
- ***   Mark Cheeseman, NIWA
- ***   May 29, 2014
+ *** OUTPUT:
+ ***      row       --> row J of the interpolated field (unless it is a copy)
+ ***
+ *** Function returns J, or the index of the earlier row that row J is a copy of.
  ***/
 
-void u_to_p_point_interp_c_grid( double *val, float *fval, int var_index ) {
+int u_to_p_row_c_grid( const float *val, int first, float *row, int j, int nx, int ny, int nyp, float scale ) {
 
-       int    i, j, index, index2, NY;
-       double factor, tmp;
+       int  NY;
+       long index;
 
-       NY = (int ) stored_um_vars[var_index].ny;
-       if ( int_constants[6]<NY ) { NY = int_constants[6]; }
-       factor = 0.5*((double )stored_um_vars[var_index].scale_factor);
+       NY = ( nyp<ny ) ? nyp : ny;
+       if ( j>=NY ) { return NY-1; }
 
+       index = (long ) (j-first)*nx;
+       interp_row_avg2( val+index, val+index+2, row+1, nx-2, 0.5*((double )scale) );
+       row[0] = row[1];
+       row[nx-1] = row[nx-2];
 
-       /** Interpolate in the X direction from rows 1 to NY-2 **/
-          for ( j=0; j<NY; j++ ) {
-          for ( i=1; i<stored_um_vars[var_index].nx-1; i++ ) {
-              index = i + j*stored_um_vars[var_index].nx;
-              tmp = factor*(val[index-1] + fval[index+1]);
-              fval[index] = (float ) tmp;
-          }
-          }
- 
-          for ( j=0; j<NY; j++ ) {
-              index = j*stored_um_vars[var_index].nx;
-              fval[index] = fval[index+1];
-              index += stored_um_vars[var_index].nx-1;
-              fval[index] = fval[index-1];
-          }
-
-          for ( j=NY; j<int_constants[6]; j++ ) {
-          for ( i=0; i<stored_um_vars[var_index].nx; i++ ) {
-              index = i + (NY-1)*stored_um_vars[var_index].nx;
-              index2= i + j*stored_um_vars[var_index].nx;
-              fval[index2] = fval[index];
-          }
-          }
-
-       return;
+       return j;
 }
 
 
 /***
- *** B_TO_C_GRID_INTERP_U_POINTS 
+ *** B_TO_C_ROW_U_POINTS 
  ***
- *** Subroutine that performs the interpolation of a 2D array of U-points on 
- *** an Arakawa-B grid to the corresponding P-points on an Arakawa-C grid.
+ *** Computes row J of a field on the U-points of an Arakawa-B grid translated
+ *** onto the P-points of an Arakawa-C grid.  Each point is the average of the
+ *** point and its western, eastern & southern neighbours; columns 0 & NX-1 are
+ *** copies of columns 1 & NX-2, row 0 is equal to row 1 and rows NY-1 to 
+ *** NYP-1 are copies of row NY-2.
  ***
  *** INPUT:
- ***      val -> data array with its points located on U-points of a B-grid
- ***       nx -> # of data points in X (longitude) direction of the original field
- ***       ny -> # of data points in Y (latitude) direction of the original field
+ ***      val       --> data array with its points located on U-points of a B-grid
+ ***      first     --> index of the first row of the field held in VAL
+ ***      j         --> index of the output row
+ ***      nx        --> # of data points in X (longitude) direction of the field
+ ***      ny        --> # of data points in Y (latitude) direction of the field
+ ***      nyp       --> # of rows of the P-point grid (INT_CONSTANTS[6])
+ ***      scale     --> scale factor applied to the field
  ***
- ***   Mark Cheeseman, NIWA
- ***   January 6, 2013
+ *** OUTPUT:
+ ***      row       --> row J of the interpolated field (unless it is a copy)
+ ***
+ *** Function returns J, or the index of the earlier row that row J is a copy of.
  ***/
 
-void b_to_c_grid_interp_u_points( double *val, float *fval, int var_index ) {
-
-     int     NY, i, j, index[5];
-     double  factor, tmp;
-
-     NY = (int ) stored_um_vars[var_index].ny;
-     if ( int_constants[6]<NY ) { NY = int_constants[6]; }
-     factor = (double ) (0.25*stored_um_vars[var_index].scale_factor); 
-
-
-     /** Take the average of the 4 horizontal points surrounding the desired P-point location **/
-        for ( j=1; j<NY-1; j++ ) {
-        for ( i=1; i<stored_um_vars[var_index].nx-1; i++ ) {
-            index[0] = j*stored_um_vars[var_index].nx + i; 
-            index[1] = index[0] - 1; 
-            index[2] = index[0] + 1; 
-            index[3] = index[0] - stored_um_vars[var_index].nx; 
-            index[4] = index[0] + stored_um_vars[var_index].nx; 
-            tmp = factor*( val[index[0]] + val[index[1]] + val[index[2]] + val[index[3]] ); 
-            fval[index[0]] = (float ) tmp; 
-        }
-        }
-
-     /** Fill the missing columns [0 and NX-1] **/
-        for ( j=1; j<NY-1; j++ ) {
-            index[0] = j*stored_um_vars[var_index].nx;
-            index[1] = index[0] + 1;
-            fval[index[0]] = fval[index[1]];
-            index[0] += stored_um_vars[var_index].nx-1;
-            index[1] = index[0] - 1;
-            fval[index[0]] = fval[index[1]];
-        }
-
-     /** Copy contents of row 1 into row 0 **/
-        for ( i=0; i<stored_um_vars[var_index].nx-1; i++ ) {
-            index[0] = i + stored_um_vars[var_index].nx;
-            fval[i] = fval[index[0]];
-        } 
-
-     /** Copy contents of row NY-2 into rows NY-1 to INT_CONSTANTS[6] **/
-        for ( j=NY-1; j<int_constants[6]; j++ ) {
-        for ( i=0; i<stored_um_vars[var_index].nx; i++ ) {
-            index[0] = i + stored_um_vars[var_index].nx*(NY-2);
-            index[1] = i + stored_um_vars[var_index].nx*j;
-            fval[index[1]] = fval[index[0]]; 
-        }
-        }
-
-     return;
-}
+int b_to_c_row_u_points( const float *val, int first, float *row, int j, int nx, int ny, int nyp, float scale ) {
 
+       int  NY, k;
+       long index;
+
+       NY = ( nyp<ny ) ? nyp : ny;
+       if ( j>=NY-1 ) { return NY-2; }
+
+       k = ( j<1 ) ? 1 : j;
+       index = (long ) (k-first)*nx;
+       interp_row_avg4( val+index+1, val+index, val+index+2, val+index+1-nx, row+1, nx-2, 
+                        (double ) (0.25*scale) );
+       row[0] = row[1];
+       row[nx-1] = row[nx-2];
+
+       return j;
+}
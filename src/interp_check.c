@@ -0,0 +1,307 @@
+/**============================================================================
+                 U M 2 N e t C D F  V e r s i o n 2 . 0
+                 --------------------------------------
+
+    Main author: Mark Cheeseman
+                 National Institute of Water & Atmospheric Research (Ltd)
+                 Wellington, New Zealand
+                 February 2014
+
+    UM2NetCDF is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    UM2NetCDF is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    A copy of the GNU General Public License can be found in the main UM2NetCDF
+    directory.  Alternatively, please see <http://www.gnu.org/licenses/>.
+ **============================================================================*/
+
+
+/***
+ *** INTERP_CHECK
+ ***
+ *** Checks that the C-grid & B-grid row interpolation procedures, with each
+ *** set of row kernels supported by the CPU (scalar & AVX2), give the same
+ *** fields as the original whole-field interpolation routines, including the
+ *** edge columns & the edge rows they fill.  Random fields of odd & even
+ *** widths are interpolated onto P-point grids with as many rows as the
+ *** input field, more rows or fewer rows.  Values must agree to within the
+ *** float tolerance; the number of points that are not bit-identical is
+ *** also reported.
+ ***
+ *** Built & run from the src directory with:  make ARCH=x86 CC=gcc interp_check
+ ***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include "field_def.h"
+
+#define NUM_FIELDS  3000   /* # of random fields interpolated by each procedure & kernel */
+#define MAX_NX       300   /* max # of points in a row of a random field */
+#define MAX_NY       120   /* max # of rows of a random field */
+
+/** Function prototypes **/
+
+const char *select_interp_kernels( void );
+int force_interp_kernels( const char *name );
+int v_to_p_row_c_grid( const float *val, int first, float *row, int j, int nx, int ny, int nyp, float scale );
+int u_to_p_row_c_grid( const float *val, int first, float *row, int j, int nx, int ny, int nyp, float scale );
+int b_to_c_row_u_points( const float *val, int first, float *row, int j, int nx, int ny, int nyp, float scale );
+
+
+/***
+ *** REFERENCE_V_TO_P / REFERENCE_U_TO_P / REFERENCE_B_TO_C
+ ***
+ *** The original whole-field interpolation routines, against which the row
+ *** procedures are checked.  NYP replaces INT_CONSTANTS[6].
+ ***/
+
+static void reference_v_to_p( float *val, float *fval, int nx, int ny, int nyp, float scale ) {
+
+       int    NY, i, j, index, index2, index3;
+       double factor, tmp;
+
+       NY = (int ) ny;
+       if ( nyp<NY ) { NY = nyp; }
+       factor = 0.5*((double )scale);
+
+       for ( j=1; j<NY-1; j++ ) {
+       for ( i=0; i<nx; i++ ) {
+           index = i + j*nx;
+           index2= index - nx;
+           index3= index + nx;
+           tmp = factor*( (double ) val[index2] + val[index3] );
+           fval[index3] = (float ) tmp;
+       }
+       }
+
+       for ( i=0; i<nx; i++ ) {
+           index = i + 2*nx;
+           fval[i] = fval[index];
+           fval[i+nx] = fval[index];
+       }
+
+       for ( j=NY; j<nyp; j++ ) {
+       for ( i=0; i<nx; i++ ) {
+           index = i + (NY-1)*nx;
+           index2= i + j*nx;
+           fval[index2] = fval[index];
+       }
+       }
+
+       return;
+}
+
+static void reference_u_to_p( float *val, float *fval, int nx, int ny, int nyp, float scale ) {
+
+       int    i, j, index, index2, NY;
+       double factor, tmp;
+
+       NY = (int ) ny;
+       if ( nyp<NY ) { NY = nyp; }
+       factor = 0.5*((double )scale);
+
+       for ( j=0; j<NY; j++ ) {
+       for ( i=1; i<nx-1; i++ ) {
+           index = i + j*nx;
+           tmp = factor*( (double ) val[index-1] + val[index+1] );
+           fval[index] = (float ) tmp;
+       }
+       }
+
+       for ( j=0; j<NY; j++ ) {
+           index = j*nx;
+           fval[index] = fval[index+1];
+           index += nx-1;
+           fval[index] = fval[index-1];
+       }
+
+       for ( j=NY; j<nyp; j++ ) {
+       for ( i=0; i<nx; i++ ) {
+           index = i + (NY-1)*nx;
+           index2= i + j*nx;
+           fval[index2] = fval[index];
+       }
+       }
+
+       return;
+}
+
+static void reference_b_to_c( float *val, float *fval, int nx, int ny, int nyp, float scale ) {
+
+     int     NY, i, j, index[5];
+     double  factor, tmp;
+
+     NY = (int ) ny;
+     if ( nyp<NY ) { NY = nyp; }
+     factor = (double ) (0.25*scale);
+
+     for ( j=1; j<NY-1; j++ ) {
+     for ( i=1; i<nx-1; i++ ) {
+         index[0] = j*nx + i;
+         index[1] = index[0] - 1;
+         index[2] = index[0] + 1;
+         index[3] = index[0] - nx;
+         tmp = factor*( (double ) val[index[0]] + val[index[1]] + val[index[2]] + val[index[3]] );
+         fval[index[0]] = (float ) tmp;
+     }
+     }
+
+     for ( j=1; j<NY-1; j++ ) {
+         index[0] = j*nx;
+         index[1] = index[0] + 1;
+         fval[index[0]] = fval[index[1]];
+         index[0] += nx-1;
+         index[1] = index[0] - 1;
+         fval[index[0]] = fval[index[1]];
+     }
+
+     for ( i=0; i<nx; i++ ) {
+         index[0] = i + nx;
+         fval[i] = fval[index[0]];
+     }
+
+     for ( j=NY-1; j<nyp; j++ ) {
+     for ( i=0; i<nx; i++ ) {
+         index[0] = i + nx*(NY-2);
+         index[1] = i + nx*j;
+         fval[index[1]] = fval[index[0]];
+     }
+     }
+
+     return;
+}
+
+
+/***
+ *** INTERP_BY_ROWS
+ ***
+ *** Builds the NYP rows of an interpolated field with a row procedure, as
+ *** the slices of a UM variable are written.  Rows that are copies of an
+ *** earlier row are copied from it.
+ ***/
+
+static void interp_by_rows( int (*interp_row)( const float*, int, float*, int, int, int, int, float ),
+                            const float *val, float *fval, int nx, int ny, int nyp, float scale ) {
+
+       int j, k;
+
+       for ( j=0; j<nyp; j++ ) {
+           k = interp_row( val, 0, fval+(long )j*nx, j, nx, ny, nyp, scale );
+           if ( k<j ) { memcpy( fval+(long )j*nx, fval+(long )k*nx, (size_t ) nx*sizeof(float) ); }
+       }
+
+       return;
+}
+
+
+/***
+ *** CHECK_FIELD
+ ***
+ *** Interpolates a random NX x NY field onto NYP rows with row procedure P
+ *** (0: V to P, 1: U to P, 2: B to C) and with the matching original routine
+ *** and compares the results.  NDIFF is incremented by the # of points that
+ *** are not bit-identical.
+ ***
+ *** Function returns 1 if all points agree to within the float tolerance and
+ *** 0 otherwise.
+ ***/
+
+static int check_field( int p, int nx, int ny, int nyp, long *ndiff ) {
+
+     static const char *names[3] = { "v_to_p_row_c_grid", "u_to_p_row_c_grid", "b_to_c_row_u_points" };
+     static float val[MAX_NX*MAX_NY], out[MAX_NX*(MAX_NY+8)], ref[MAX_NX*(MAX_NY+8)];
+
+     int   i, npts;
+     float scale;
+
+     for ( i=0; i<nx*ny; i++ ) { val[i] = (float ) (20000.0*rand()/RAND_MAX - 10000.0); }
+     switch ( rand()%3 ) {
+             case 0:  scale = 1.0f; break;
+             case 1:  scale = 0.01f; break;
+             default: scale = (float ) (2.0*rand()/RAND_MAX); break;
+     }
+
+     npts = nx*nyp;
+     memset( out, 0, npts*sizeof(float) );
+     memset( ref, 0, npts*sizeof(float) );
+     switch ( p ) {
+             case 0:
+                    interp_by_rows( &v_to_p_row_c_grid, val, out, nx, ny, nyp, scale );
+                    reference_v_to_p( val, ref, nx, ny, nyp, scale );
+                    break;
+             case 1:
+                    interp_by_rows( &u_to_p_row_c_grid, val, out, nx, ny, nyp, scale );
+                    reference_u_to_p( val, ref, nx, ny, nyp, scale );
+                    break;
+             default:
+                    interp_by_rows( &b_to_c_row_u_points, val, out, nx, ny, nyp, scale );
+                    reference_b_to_c( val, ref, nx, ny, nyp, scale );
+                    break;
+     }
+
+     for ( i=0; i<npts; i++ ) {
+         if ( memcmp( &out[i], &ref[i], sizeof(float) )==0 ) { continue; }
+         (*ndiff)++;
+         if ( fabsf( out[i]-ref[i] )>2.0f*FLT_EPSILON*fabsf( ref[i] ) ) {
+            printf( "   MISMATCH: %s nx=%d ny=%d nyp=%d at row %d column %d: %.9g instead of %.9g\n",
+                    names[p], nx, ny, nyp, i/nx, i%nx, out[i], ref[i] );
+            return 0;
+         }
+     }
+
+     return 1;
+}
+
+
+int main( int argc, char *argv[] ) {
+
+     static const char *kernels[2] = { "scalar", "AVX2" };
+
+     int  k, p, f, nx, ny, nyp, nfail, total;
+     long ndiff;
+
+     select_interp_kernels();
+
+     total = 0;
+     for ( k=0; k<2; k++ ) {
+         if ( force_interp_kernels( kernels[k] )==0 ) {
+            printf( "%-7s: not supported by this CPU, skipped\n", kernels[k] );
+            continue;
+         }
+
+         srand( 12345 );
+         nfail = 0;
+         ndiff = 0;
+         for ( f=0; f<NUM_FIELDS; f++ ) {
+             p   = f%3;
+             nx  = 3 + rand()%(MAX_NX-2);
+             ny  = 3 + rand()%(MAX_NY-2);
+             switch ( (f/3)%3 ) {
+                     case 0:  nyp = ny; break;
+                     case 1:  nyp = ny + 1 + rand()%8; break;
+                     default: nyp = ( ny>3 ) ? ny - 1 - rand()%(ny-3 < 8 ? ny-3 : 8) : ny; break;
+             }
+             nfail += 1 - check_field( p, nx, ny, nyp, &ndiff );
+         }
+
+         printf( "%-7s: %d mismatching fields, %ld points not bit-identical\n", kernels[k], nfail, ndiff );
+         total += nfail;
+     }
+
+     if ( total>0 ) {
+        printf( "\nFAILED: the interpolation procedures do not match the original routines\n\n" );
+        return 1;
+     }
+     printf( "\nPASSED\n\n" );
+
+     return 0;
+}
@@ -0,0 +1,176 @@
+/**============================================================================
+                 U M 2 N e t C D F  V e r s i o n 2 . 0
+                 --------------------------------------
+
+    Main author: Mark Cheeseman
+                 National Institute of Water & Atmospheric Research (Ltd)
+                 Wellington, New Zealand
+                 February 2014
+
+    UM2NetCDF is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    UM2NetCDF is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    A copy of the GNU General Public License can be found in the main UM2NetCDF
+    directory.  Alternatively, please see <http://www.gnu.org/licenses/>.
+ **============================================================================*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "field_def.h"
+
+/** Function prototypes **/
+
+void interp_avg2_row( const float *a, const float *b, float *out, int n, double factor );
+void interp_avg4_row( const float *a, const float *b, const float *c, const float *d, float *out, 
+                      int n, double factor );
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__PGI)
+#define INTERP_SIMD
+#endif
+
+#ifdef INTERP_SIMD
+
+#include <immintrin.h>
+
+/*
+ * The kernels widen each group of 4 floats to double, add and scale in double
+ * precision in the same order as the scalar kernels and narrow the result, so 
+ * both give bit-identical output.
+ */
+
+/***
+ *** INTERP_AVG2_ROW_AVX2
+ ***
+ *** AVX2 version of INTERP_AVG2_ROW; 8 output points per iteration.
+ ***/
+
+__attribute__((target("avx2")))
+static void interp_avg2_row_avx2( const float *a, const float *b, float *out, int n, double factor ) {
+
+     int     i;
+     __m256  va, vb;
+     __m256d vf, lo, hi;
+
+     vf = _mm256_set1_pd( factor );
+
+     for ( i=0; i+8<=n; i+=8 ) {
+         va = _mm256_loadu_ps( a+i );
+         vb = _mm256_loadu_ps( b+i );
+         lo = _mm256_add_pd( _mm256_cvtps_pd( _mm256_castps256_ps128( va ) ),
+                             _mm256_cvtps_pd( _mm256_castps256_ps128( vb ) ) );
+         hi = _mm256_add_pd( _mm256_cvtps_pd( _mm256_extractf128_ps( va, 1 ) ),
+                             _mm256_cvtps_pd( _mm256_extractf128_ps( vb, 1 ) ) );
+         lo = _mm256_mul_pd( vf, lo );
+         hi = _mm256_mul_pd( vf, hi );
+         _mm256_storeu_ps( out+i, _mm256_set_m128( _mm256_cvtpd_ps( hi ), _mm256_cvtpd_ps( lo ) ) );
+     }
+
+     if ( i<n ) { interp_avg2_row( a+i, b+i, out+i, n-i, factor ); }
+}
+
+
+/***
+ *** INTERP_AVG4_ROW_AVX2
+ ***
+ *** AVX2 version of INTERP_AVG4_ROW; 8 output points per iteration.
+ ***/
+
+__attribute__((target("avx2")))
+static void interp_avg4_row_avx2( const float *a, const float *b, const float *c, const float *d, 
+                                  float *out, int n, double factor ) {
+
+     int     i;
+     __m256  va, vb, vc, vd;
+     __m256d vf, lo, hi;
+
+     vf = _mm256_set1_pd( factor );
+
+     for ( i=0; i+8<=n; i+=8 ) {
+         va = _mm256_loadu_ps( a+i );
+         vb = _mm256_loadu_ps( b+i );
+         vc = _mm256_loadu_ps( c+i );
+         vd = _mm256_loadu_ps( d+i );
+         lo = _mm256_add_pd( _mm256_cvtps_pd( _mm256_castps256_ps128( va ) ),
+                             _mm256_cvtps_pd( _mm256_castps256_ps128( vb ) ) );
+         hi = _mm256_add_pd( _mm256_cvtps_pd( _mm256_extractf128_ps( va, 1 ) ),
+                             _mm256_cvtps_pd( _mm256_extractf128_ps( vb, 1 ) ) );
+         lo = _mm256_add_pd( lo, _mm256_cvtps_pd( _mm256_castps256_ps128( vc ) ) );
+         hi = _mm256_add_pd( hi, _mm256_cvtps_pd( _mm256_extractf128_ps( vc, 1 ) ) );
+         lo = _mm256_add_pd( lo, _mm256_cvtps_pd( _mm256_castps256_ps128( vd ) ) );
+         hi = _mm256_add_pd( hi, _mm256_cvtps_pd( _mm256_extractf128_ps( vd, 1 ) ) );
+         lo = _mm256_mul_pd( vf, lo );
+         hi = _mm256_mul_pd( vf, hi );
+         _mm256_storeu_ps( out+i, _mm256_set_m128( _mm256_cvtpd_ps( hi ), _mm256_cvtpd_ps( lo ) ) );
+     }
+
+     if ( i<n ) { interp_avg4_row( a+i, b+i, c+i, d+i, out+i, n-i, factor ); }
+}
+
+#endif
+
+
+/***
+ *** SELECT_INTERP_KERNELS
+ ***
+ *** Sets the row kernels used by the C-grid & B-grid interpolation procedures
+ *** to the AVX2 kernels if the CPU supports them (as reported by CPUID), 
+ *** falling back on the portable scalar kernels.  All kernels give 
+ *** bit-identical results.
+ ***
+ *** Function returns the name of the selected kernels.
+ ***/
+
+const char *select_interp_kernels( void ) {
+
+#ifdef INTERP_SIMD
+     __builtin_cpu_init();
+     if ( __builtin_cpu_supports("avx2") ) {
+        interp_row_avg2 = &interp_avg2_row_avx2;
+        interp_row_avg4 = &interp_avg4_row_avx2;
+        return "AVX2";
+     }
+#endif
+
+     interp_row_avg2 = &interp_avg2_row;
+     interp_row_avg4 = &interp_avg4_row;
+     return "scalar";
+}
+
+
+/***
+ *** FORCE_INTERP_KERNELS
+ ***
+ *** Sets the interpolation row kernels to the named ones ("scalar" or "AVX2"),
+ *** so that the kernels can be checked against each other.
+ ***
+ *** Function returns 1 if the kernels are supported by the CPU and 0 otherwise.
+ ***/
+
+int force_interp_kernels( const char *name ) {
+
+     if ( strcmp( name, "scalar" )==0 ) {
+        interp_row_avg2 = &interp_avg2_row;
+        interp_row_avg4 = &interp_avg4_row;
+        return 1;
+     }
+
+#ifdef INTERP_SIMD
+     __builtin_cpu_init();
+     if ( (strcmp( name, "AVX2" )==0)&&__builtin_cpu_supports("avx2") ) {
+        interp_row_avg2 = &interp_avg2_row_avx2;
+        interp_row_avg4 = &interp_avg4_row_avx2;
+        return 1;
+     }
+#endif
+
+     return 0;
+}
@@ -35,27 +35,32 @@
  *** Subroutine that constructs the 2D array giving the 'true longitude' value on earth 
  *** for each model X,Y point.
  ***
+ *** INPUT:    ctx -> conversion context of the input UM fields file
+ ***        first -> index of the first model row to construct
+ ***            ny -> # of model rows to construct
+ ***
  *** INPUT/OUTPUT:  lon -> ptr to 2D array that will hold the true lon values
+ ***                       (NY rows, starting with row FIRST)
  ***
  ***   Mark Cheeseman, NIWA
  ***   May 2, 2014
  ***/
 
-void construct_lon_array( int ny, float *lon ) {
+void construct_lon_array( um2nc_ctx *ctx, int first, int ny, float *lon ) {
 
      int    i, j, ind;
      double tlat, tlon, tol, degtorad, sock, cpart, t1, t2, longitude, latitude;
      double pseudolat, pseudolon;
 
-     if ( header[3]<99 ) {
+     if ( ctx->header[3]<99 ) {
 
      /** For an unrotated coordinate system, don't do anything.  Just copy the **/
      /** lon values into the correct position in the 2D array.                 **/
 
         for ( j=0; j<ny; j++ ) {
-        for ( i=0; i<int_constants[5]; i++ ) {
-            ind = j*int_constants[5] + i;
-            tlon = real_constants[3] + real_constants[0]*((double ) i);
+        for ( i=0; i<ctx->int_constants[5]; i++ ) {
+            ind = j*ctx->int_constants[5] + i;
+            tlon = ctx->real_constants[3] + ctx->real_constants[0]*((double ) i);
             lon[ind] = (float ) tlon;
         }
         }
@@ -64,13 +69,13 @@ void construct_lon_array( int ny, float *lon ) {
 
   /** Convert lon/lat position of rotated pole from degrees to radians**/
         degtorad=3.1415926535898/180.0;
-        pseudolat = real_constants[4] * degtorad;
-        pseudolon = real_constants[5] * degtorad;
+        pseudolat = ctx->real_constants[4] * degtorad;
+        pseudolon = ctx->real_constants[5] * degtorad;
 
         for ( j=0; j<ny; j++ ) {
-        for ( i=0; i<int_constants[5]; i++ ) {
-             tlat = (real_constants[2] + real_constants[1]*((double ) j))*degtorad;
-             tlon = (real_constants[3] + real_constants[0]*((double ) i))*degtorad;
+        for ( i=0; i<ctx->int_constants[5]; i++ ) {
+             tlat = (ctx->real_constants[2] + ctx->real_constants[1]*((double ) (j+first)))*degtorad;
+             tlon = (ctx->real_constants[3] + ctx->real_constants[0]*((double ) i))*degtorad;
 
              sock = pseudolon - 3.1415926535898;
              tol = pseudolon*pseudolon;
@@ -90,7 +95,7 @@ void construct_lon_array( int ny, float *lon ) {
              longitude += sock;
 
              if ( longitude<0.0 ) { longitude += 2.0*3.1415926535898; }
-             lon[i+int_constants[5]*j] = (float ) (longitude / degtorad);
+             lon[i+ctx->int_constants[5]*j] = (float ) (longitude / degtorad);
         }
         }
 
@@ -105,27 +110,32 @@ void construct_lon_array( int ny, float *lon ) {
  *** Subroutine that constructs the 2D array giving the 'true latitude' value on earth 
  *** for each model X,Y point.
  ***
+ *** INPUT:    ctx -> conversion context of the input UM fields file
+ ***        first -> index of the first model row to construct
+ ***            ny -> # of model rows to construct
+ ***
  *** INPUT/OUTPUT:  lat -> ptr to 2D array that will hold the true lat values
+ ***                       (NY rows, starting with row FIRST)
  ***
  ***   Mark Cheeseman, NIWA
  ***   May 2, 2014
  ***/
 
-void construct_lat_array( int ny, float *lat ) {
+void construct_lat_array( um2nc_ctx *ctx, int first, int ny, float *lat ) {
 
      int    i, j, ind;
      double tlat, tlon, degtorad, sock, cpart, latitude;
      double pseudolat, pseudolon, cos_pseudolat, sin_pseudolat;
 
-     if ( header[3]<99 ) {
+     if ( ctx->header[3]<99 ) {
 
      /** For an unrotated coordinate system, don't do anything.  Just copy the **/
      /** lat values into the correct position in the 2D array.                 **/
 
         for ( j=0; j<ny; j++ ) {
-            tlat = real_constants[2] + real_constants[1]*((double ) j);
-            for ( i=0; i<int_constants[5]; i++ ) {
-                ind = j*int_constants[5] + i;
+            tlat = ctx->real_constants[2] + ctx->real_constants[1]*((double ) (j+first));
+            for ( i=0; i<ctx->int_constants[5]; i++ ) {
+                ind = j*ctx->int_constants[5] + i;
                 lat[ind] = (float ) tlat;
             }
         }
@@ -134,8 +144,8 @@ void construct_lat_array( int ny, float *lat ) {
 
      /** Convert lon/lat position of rotated pole from degrees to radians**/
         degtorad=3.1415926535898/180.0;
-        pseudolat = real_constants[4] * degtorad;
-        pseudolon = real_constants[5] * degtorad;
+        pseudolat = ctx->real_constants[4] * degtorad;
+        pseudolon = ctx->real_constants[5] * degtorad;
 
      /** Take cosine/sine functions of the newly converted rotated pole lat/lon **/
         cos_pseudolat = cos( pseudolat );
@@ -145,17 +155,17 @@ void construct_lat_array( int ny, float *lat ) {
         else                { sock = pseudolon - 3.1415926535898; }
 
      /** Determine latitude values on 'unrotated' grid **/
-        for ( i=0; i<int_constants[5]; i++) {
+        for ( i=0; i<ctx->int_constants[5]; i++) {
 
        /*** Find lon along model column j ***/
-            tlon = ( real_constants[3] + ((double ) i)*real_constants[0] )*degtorad;
+            tlon = ( ctx->real_constants[3] + ((double ) i)*ctx->real_constants[0] )*degtorad;
             tlon = cos( tlon );
 
             for ( j=0; j<ny; j++) {
-                tlat = ( real_constants[2] + ((double ) j)*real_constants[1] )*degtorad;
+                tlat = ( ctx->real_constants[2] + ((double ) (j+first))*ctx->real_constants[1] )*degtorad;
                 cpart = tlon*cos(tlat);
                 latitude = asin( cos_pseudolat*cpart + sin_pseudolat*sin(tlat) );
-                lat[i+int_constants[5]*j] = (float ) (latitude / degtorad);
+                lat[i+ctx->int_constants[5]*j] = (float ) (latitude / degtorad);
             }
         }
 
@@ -169,13 +179,18 @@ void construct_lat_array( int ny, float *lat ) {
  *** Subroutine that constructs the 3D array giving the 'true longitude' value on earth 
  *** for the 4 sides of each rectangular grid cell at each model X,Y point.
  ***
+ *** INPUT:    ctx -> conversion context of the input UM fields file
+ ***        first -> index of the first model row to construct
+ ***            ny -> # of model rows to construct
+ ***
  *** INPUT/OUTPUT:  lon -> ptr to 3D array that will hold the true lon values
+ ***                       (4 sides x NY rows, starting with row FIRST)
  ***
  ***   Mark Cheeseman, NIWA
  ***   May 2, 2014
  ***/
 
-void construct_lon_bounds_array( int ny, float *lon ) {
+void construct_lon_bounds_array( um2nc_ctx *ctx, int first, int ny, float *lon ) {
 
      int    i, j, k, ind;
      double tlat, tlon, tol, degtorad, sock, cpart, t1, t2, longitude, latitude;
@@ -184,25 +199,25 @@ void construct_lon_bounds_array( int ny, float *lon ) {
   /** For an unrotated coordinate system, just add/subtract one half of a grid **/
   /** cell width/height to find the proper cell bound values.                  **/
 
-     if ( header[3]<99 ) {
+     if ( ctx->header[3]<99 ) {
         for ( j=0; j<ny; j++ ) {
-        for ( i=0; i<int_constants[5]; i++ ) {
+        for ( i=0; i<ctx->int_constants[5]; i++ ) {
 
         /*** Find longitude of center of grid cell at (i,j) ***/
-            tlon = real_constants[3] + real_constants[0]*((double ) i);
+            tlon = ctx->real_constants[3] + ctx->real_constants[0]*((double ) i);
 
         /*** Find & store longitude of sides 1 and 2 ***/
-            t1 = tlon - 0.5*real_constants[0];
-            ind = j*int_constants[5] + i;
+            t1 = tlon - 0.5*ctx->real_constants[0];
+            ind = j*ctx->int_constants[5] + i;
             lon[ind] = (float ) t1;
-            ind += int_constants[5]*ny;
+            ind += ctx->int_constants[5]*ny;
             lon[ind] = (float ) t1;
 
         /*** Find & store longitude of sides 3 and 4 ***/
-            t1 = tlon + 0.5*real_constants[0];
-            ind += int_constants[5]*ny;
+            t1 = tlon + 0.5*ctx->real_constants[0];
+            ind += ctx->int_constants[5]*ny;
             lon[ind] = (float ) t1;
-            ind += int_constants[5]*ny;
+            ind += ctx->int_constants[5]*ny;
             lon[ind] = (float ) t1;
         }
         }
@@ -211,8 +226,8 @@ void construct_lon_bounds_array( int ny, float *lon ) {
 
   /** Convert lon/lat position of rotated pole from degrees to radians**/
         degtorad=3.1415926535898/180.0;
-        pseudolat = real_constants[4] * degtorad;
-        pseudolon = real_constants[5] * degtorad;
+        pseudolat = ctx->real_constants[4] * degtorad;
+        pseudolon = ctx->real_constants[5] * degtorad;
 
   /** Take cosine/sine functions of the newly converted rotated pole lat/lon **/
         cos_pseudolat = cos( pseudolat );
@@ -221,27 +236,27 @@ void construct_lon_bounds_array( int ny, float *lon ) {
         if ( pseudolon==0 ) { sock = 0.0; }
         else                { sock = pseudolon - 3.1415926535898; }
 
-        for ( i=0; i<int_constants[5]; i++) {
+        for ( i=0; i<ctx->int_constants[5]; i++) {
         for ( j=0; j<ny; j++) {
         for ( k=1; k<5; k++ ) {
 
            /** Determine lat & lon for the grid cell side k**/
             switch( k ){
                   case 1:
-                       tlon = ( real_constants[3] + ((double ) i - 0.5)*real_constants[0] )*degtorad;
-                       tlat = ( real_constants[2] + ((double ) j - 0.5)*real_constants[1] )*degtorad;
+                       tlon = ( ctx->real_constants[3] + ((double ) i - 0.5)*ctx->real_constants[0] )*degtorad;
+                       tlat = ( ctx->real_constants[2] + ((double ) (j+first) - 0.5)*ctx->real_constants[1] )*degtorad;
                        break;
                   case 2:
-                       tlon = ( real_constants[3] + ((double ) i - 0.5)*real_constants[0] )*degtorad;
-                       tlat = ( real_constants[2] + ((double ) j + 0.5)*real_constants[1] )*degtorad;
+                       tlon = ( ctx->real_constants[3] + ((double ) i - 0.5)*ctx->real_constants[0] )*degtorad;
+                       tlat = ( ctx->real_constants[2] + ((double ) (j+first) + 0.5)*ctx->real_constants[1] )*degtorad;
                        break;
                   case 3:
-                       tlon = ( real_constants[3] + ((double ) i + 0.5)*real_constants[0] )*degtorad;
-                       tlat = ( real_constants[2] + ((double ) j + 0.5)*real_constants[1] )*degtorad;
+                       tlon = ( ctx->real_constants[3] + ((double ) i + 0.5)*ctx->real_constants[0] )*degtorad;
+                       tlat = ( ctx->real_constants[2] + ((double ) (j+first) + 0.5)*ctx->real_constants[1] )*degtorad;
                        break;
                   case 4:
-                       tlon = ( real_constants[3] + ((double ) i + 0.5)*real_constants[0] )*degtorad;
-                       tlat = ( real_constants[2] + ((double ) j - 0.5)*real_constants[1] )*degtorad;
+                       tlon = ( ctx->real_constants[3] + ((double ) i + 0.5)*ctx->real_constants[0] )*degtorad;
+                       tlat = ( ctx->real_constants[2] + ((double ) (j+first) - 0.5)*ctx->real_constants[1] )*degtorad;
                        break;
             }
 
@@ -261,7 +276,7 @@ void construct_lon_bounds_array( int ny, float *lon ) {
             longitude = factor*longitude + sock;
             if ( longitude<0.0 ) { longitude += 2.0*3.1415926535898; }
 
-            ind = (k-1)*ny*int_constants[5] + int_constants[5]*j + i;
+            ind = (k-1)*ny*ctx->int_constants[5] + ctx->int_constants[5]*j + i;
             lon[ind] = (float ) (longitude / degtorad);
 
         }
@@ -279,13 +294,18 @@ void construct_lon_bounds_array( int ny, float *lon ) {
  *** Subroutine that constructs the 3D array giving the 'true latitude' value on earth 
  *** for the 4 sides of each rectangular grid cell at each model X,Y point.
  ***
+ *** INPUT:    ctx -> conversion context of the input UM fields file
+ ***        first -> index of the first model row to construct
+ ***            ny -> # of model rows to construct
+ ***
  *** INPUT/OUTPUT:  lat -> ptr to 3D array that will hold the true lat values
+ ***                       (4 sides x NY rows, starting with row FIRST)
  ***
  ***   Mark Cheeseman, NIWA
  ***   May 2, 2014
  ***/
 
-void construct_lat_bounds_array( int ny, float *lat ) {
+void construct_lat_bounds_array( um2nc_ctx *ctx, int first, int ny, float *lat ) {
 
      int    i, j, k, ind;
      double tlat, tlon, degtorad, sock, cpart, t1, t2, latitude;
@@ -294,30 +314,30 @@ void construct_lat_bounds_array( int ny, float *lat ) {
   /** For an unrotated coordinate system, just add/subtract one half of a grid **/
   /** cell width/height to find the proper cell bound values.                  **/
 
-     if ( header[3]<99 ) {
+     if ( ctx->header[3]<99 ) {
         for ( j=0; j<ny; j++ ) {
 
         /*** Find latitude at center of grid cell at (i,j) ***/
-            tlat = real_constants[2] + real_constants[1]*((double ) j);
-            t1 = tlat - 0.5*real_constants[1];
-            t2 = tlat + 0.5*real_constants[1];
+            tlat = ctx->real_constants[2] + ctx->real_constants[1]*((double ) (j+first));
+            t1 = tlat - 0.5*ctx->real_constants[1];
+            t2 = tlat + 0.5*ctx->real_constants[1];
 
-            for ( i=0; i<int_constants[5]; i++ ) {
+            for ( i=0; i<ctx->int_constants[5]; i++ ) {
             
             /*** Store latitude of side 1 ***/
-                ind = j*int_constants[5] + i;
+                ind = j*ctx->int_constants[5] + i;
                 lat[ind] = (float ) t1;
             
             /*** Store latitude of side 2 ***/
-                ind += int_constants[5]*ny;
+                ind += ctx->int_constants[5]*ny;
                 lat[ind] = (float ) t2;
             
             /*** Store latitude of side 3 ***/
-                ind += int_constants[5]*ny;
+                ind += ctx->int_constants[5]*ny;
                 lat[ind] = (float ) t2;
             
             /*** Store latitude of side 4 ***/
-                ind += int_constants[5]*ny;
+                ind += ctx->int_constants[5]*ny;
                 lat[ind] = (float ) t1;
             }
         }
@@ -326,8 +346,8 @@ void construct_lat_bounds_array( int ny, float *lat ) {
 
   /** Convert lon/lat position of rotated pole from degrees to radians**/
         degtorad=3.1415926535898/180.0;
-        pseudolat = real_constants[4] * degtorad;
-        pseudolon = real_constants[5] * degtorad;
+        pseudolat = ctx->real_constants[4] * degtorad;
+        pseudolon = ctx->real_constants[5] * degtorad;
 
   /** Take cosine/sine functions of the newly converted rotated pole lat/lon **/
         cos_pseudolat = cos( pseudolat );
@@ -336,27 +356,27 @@ void construct_lat_bounds_array( int ny, float *lat ) {
         if ( pseudolon==0 ) { sock = 0.0; }
         else                { sock = pseudolon - 3.1415926535898; }
 
-        for ( i=0; i<int_constants[5]; i++) {
+        for ( i=0; i<ctx->int_constants[5]; i++) {
         for ( j=0; j<ny; j++) {
         for ( k=1; k<5; k++ ) {
 
            /** Determine lat & lon for the grid cell side k**/
             switch( k ){
                   case 1:
-                       tlon = ( real_constants[3] + ((double ) i - 0.5)*real_constants[0] )*degtorad;
-                       tlat = ( real_constants[2] + ((double ) j - 0.5)*real_constants[1] )*degtorad;
+                       tlon = ( ctx->real_constants[3] + ((double ) i - 0.5)*ctx->real_constants[0] )*degtorad;
+                       tlat = ( ctx->real_constants[2] + ((double ) (j+first) - 0.5)*ctx->real_constants[1] )*degtorad;
                        break;
                   case 2:
-                       tlon = ( real_constants[3] + ((double ) i - 0.5)*real_constants[0] )*degtorad;
-                       tlat = ( real_constants[2] + ((double ) j + 0.5)*real_constants[1] )*degtorad;
+                       tlon = ( ctx->real_constants[3] + ((double ) i - 0.5)*ctx->real_constants[0] )*degtorad;
+                       tlat = ( ctx->real_constants[2] + ((double ) (j+first) + 0.5)*ctx->real_constants[1] )*degtorad;
                        break;
                   case 3:
-                       tlon = ( real_constants[3] + ((double ) i + 0.5)*real_constants[0] )*degtorad;
-                       tlat = ( real_constants[2] + ((double ) j + 0.5)*real_constants[1] )*degtorad;
+                       tlon = ( ctx->real_constants[3] + ((double ) i + 0.5)*ctx->real_constants[0] )*degtorad;
+                       tlat = ( ctx->real_constants[2] + ((double ) (j+first) + 0.5)*ctx->real_constants[1] )*degtorad;
                        break;
                   case 4:
-                       tlon = ( real_constants[3] + ((double ) i + 0.5)*real_constants[0] )*degtorad;
-                       tlat = ( real_constants[2] + ((double ) j - 0.5)*real_constants[1] )*degtorad;
+                       tlon = ( ctx->real_constants[3] + ((double ) i + 0.5)*ctx->real_constants[0] )*degtorad;
+                       tlat = ( ctx->real_constants[2] + ((double ) (j+first) - 0.5)*ctx->real_constants[1] )*degtorad;
                        break;
             }
 
@@ -364,7 +384,7 @@ void construct_lat_bounds_array( int ny, float *lat ) {
             cpart = tlon*cos(tlat);
             latitude = asin( cos_pseudolat*cpart + sin_pseudolat*sin(tlat) );
 
-            ind = (k-1)*ny*int_constants[5] + int_constants[5]*j + i;
+            ind = (k-1)*ny*ctx->int_constants[5] + ctx->int_constants[5]*j + i;
             lat[ind] = (float ) (latitude / degtorad);
 
         }
@@ -382,41 +402,42 @@ void construct_lat_bounds_array( int ny, float *lat ) {
  *** in curvilinear coordinates. 
  ***
  ***   INPUT: 
+ ***            ctx -> conversion context of the input UM fields file
  ***           ncid -> file handler for the newly created NetCDF file 
  ***
  ***   Mark Cheeseman, NIWA
  ***   December 17, 2013
  ***/ 
 
-void construct_lat_lon_arrays( int ncid ) {
+void construct_lat_lon_arrays( um2nc_ctx *ctx, int ncid ) {
 
      int    varID, ierr, ny, dimid;
      float *buf;
      size_t dimlength;
 
   /** Compute/output the values for the 2D longitude & latitude UM variables **/
-     ny = (int ) int_constants[6];
+     ny = (int ) ctx->int_constants[6];
 
-     buf = (float *) malloc( int_constants[5]*ny*sizeof(float) );
-     construct_lon_array( ny, buf );
+     buf = (float *) malloc( ctx->int_constants[5]*ny*sizeof(float) );
+     construct_lon_array( ctx, 0, ny, buf );
 
      ierr = nc_inq_varid( ncid, "longitude", &varID );
      ierr = nc_put_var_float( ncid, varID, buf );
 
-     construct_lat_array( ny, buf );
+     construct_lat_array( ctx, 0, ny, buf );
 
      ierr = nc_inq_varid( ncid, "latitude", &varID );
      ierr = nc_put_var_float( ncid, varID, buf );
      free( buf );
 
   /** Compute/output the values for the 3D longitude & latitude cell bounds UM variables **/
-     buf = (float *) malloc( 4*int_constants[5]*ny*sizeof(float) );
-     construct_lon_bounds_array( ny, buf );
+     buf = (float *) malloc( 4*ctx->int_constants[5]*ny*sizeof(float) );
+     construct_lon_bounds_array( ctx, 0, ny, buf );
 
      ierr = nc_inq_varid( ncid, "longitude_cell_bnd", &varID );
      ierr = nc_put_var_float( ncid, varID, buf );
 
-     construct_lat_bounds_array( ny, buf );
+     construct_lat_bounds_array( ctx, 0, ny, buf );
 
      ierr = nc_inq_varid( ncid, "latitude_cell_bnd", &varID );
      ierr = nc_put_var_float( ncid, varID, buf );
@@ -428,25 +449,25 @@ void construct_lat_lon_arrays( int ncid ) {
         ierr = nc_inq_dimlen( ncid, dimid, &dimlength );
         ny = (int ) dimlength;
 
-        buf = (float *) malloc( int_constants[5]*ny*sizeof(float) );
-        construct_lon_array( ny, buf );
+        buf = (float *) malloc( ctx->int_constants[5]*ny*sizeof(float) );
+        construct_lon_array( ctx, 0, ny, buf );
 
         ierr = nc_inq_varid( ncid, "longitude0", &varID );
         ierr = nc_put_var_float( ncid, varID, buf );
 
-        construct_lat_array( ny, buf );
+        construct_lat_array( ctx, 0, ny, buf );
 
         ierr = nc_inq_varid( ncid, "latitude0", &varID );
         ierr = nc_put_var_float( ncid, varID, buf );
         free( buf );
 
-        buf = (float *) malloc( 4*int_constants[5]*ny*sizeof(float) );
-        construct_lon_bounds_array( ny, buf );
+        buf = (float *) malloc( 4*ctx->int_constants[5]*ny*sizeof(float) );
+        construct_lon_bounds_array( ctx, 0, ny, buf );
 
         ierr = nc_inq_varid( ncid, "longitude_cell_bnd0", &varID );
         ierr = nc_put_var_float( ncid, varID, buf );
 
-        construct_lat_bounds_array( ny, buf );
+        construct_lat_bounds_array( ctx, 0, ny, buf );
 
         ierr = nc_inq_varid( ncid, "latitude_cell_bnd0", &varID );
         ierr = nc_put_var_float( ncid, varID, buf );
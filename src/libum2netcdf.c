@@ -0,0 +1,432 @@
+/**============================================================================
+                 U M 2 N e t C D F  V e r s i o n 2 . 0
+                 --------------------------------------
+
+    Main author: Mark Cheeseman
+                 National Institute of Water & Atmospheric Research (Ltd)
+                 Wellington, New Zealand
+                 February 2014
+
+    UM2NetCDF is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    UM2NetCDF is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    A copy of the GNU General Public License can be found in the main UM2NetCDF
+    directory.  Alternatively, please see <http://www.gnu.org/licenses/>.
+ **============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <libxml/parser.h>
+#include "field_def.h"
+
+/** Function prototypes **/
+
+int  read_stash_file( um2nc_ctx *ctx, const char *filename, stash_set *keep );
+int  compile_stash_file( const char *filename, const char *cache_name );
+void free_stash_table( um2nc_ctx *ctx );
+int  read_config_file( um2nc_ctx *ctx, const char *filename );
+int  check_um_file( um2nc_ctx *ctx, const char *filename );
+void assign_stash_metadata( um2nc_ctx *ctx );
+int  create_netcdf_file( um2nc_ctx *ctx, const char *output_filename );
+int  fill_netcdf_file( um2nc_ctx *ctx, int ncid );
+const char *select_ibm2ieee_kernel( void );
+const char *select_wgdos_kernel( void );
+const char *select_interp_kernels( void );
+void free_slice_table( um2nc_ctx *ctx );
+void add_stash_code( stash_set *set, int code );
+int  add_stash_spec( stash_set *set, const char *spec );
+int  parse_stash_spec( const char *spec, long *lo, long *hi );
+void free_stash_set( stash_set *set );
+
+/** The CPU kernels & the XML parser are set up once per process **/
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+long (*ibm2ieee_convert)( const uint32_t*, float*, long );
+void (*wgdos_unpack_row)( const unsigned char*, const unsigned char*, long, int, int, int,
+                          float, float, float*, const uint64_t* );
+void (*interp_row_avg2)( const float*, const float*, float*, int, double );
+void (*interp_row_avg4)( const float*, const float*, const float*, const float*, float*, int, double );
+
+
+/***
+ *** INIT_KERNELS
+ ***
+ *** Selects the IBM float conversion, WGDOS unpacking & interpolation kernels
+ *** best suited to the CPU and initializes the XML parser.  Run only once,
+ *** by whichever thread opens the first conversion context.
+ ***/
+
+static void init_kernels( void ) {
+
+     xmlInitParser();
+     select_ibm2ieee_kernel();
+     select_wgdos_kernel();
+     select_interp_kernels();
+
+     return;
+}
+
+
+/***
+ *** COPY_STRING
+ ***/
+
+static char *copy_string( const char *str ) {
+
+     char *dst;
+
+     if ( str==NULL ) { return NULL; }
+     dst = (char *) malloc( strlen( str )+1 );
+     if ( dst!=NULL ) { strcpy( dst, str ); }
+
+     return dst;
+}
+
+
+/***
+ *** ADD_STASH_SPECS
+ ***
+ *** Adds a NULL-terminated list of STASH code specifications to a set of
+ *** STASH codes.  Returns 0 if one of them is not a STASH code specification.
+ ***/
+
+static int add_stash_specs( stash_set *set, const char **specs ) {
+
+     int i;
+
+     if ( specs==NULL ) { return 1; }
+     for ( i=0; specs[i]!=NULL; i++ ) {
+         if ( add_stash_spec( set, specs[i] )==0 ) {
+            printf( "ERROR: %s is not a STASH code specification\n", specs[i] );
+            return 0;
+         }
+     }
+
+     return 1;
+}
+
+
+/***
+ *** UM2NC_DEFAULT_OPTIONS
+ ***
+ *** Sets the options of a conversion to those of um2netcdf.x when no option
+ *** flags are given.
+ ***
+ ***  INPUT: opts -> options to be set
+ ***/
+
+void um2nc_default_options( um2nc_options *opts ) {
+
+     memset( opts, 0, sizeof(um2nc_options) );
+     opts->decode_threads = 1;
+     opts->row_threads    = 1;
+
+     return;
+}
+
+
+/***
+ *** UM2NC_OPEN
+ ***
+ *** Creates the conversion context of an input UM fields file: the run
+ *** configuration is read, the headers & lookup table of the UM fields file
+ *** are read & condensed into the UM variables to be written, and these are
+ *** named after their definitions in the XML stash file.
+ ***
+ ***  INPUT: um_file    -> name of the input UM fields file
+ ***         stash_file -> name of the XML stash file
+ ***         opts       -> options of the conversion (NULL -> default options)
+ ***
+ *** Function returns the new conversion context, or NULL on failure.
+ ***/
+
+um2nc_ctx *um2nc_open( const char *um_file, const char *stash_file, const um2nc_options *opts ) {
+
+     int           i;
+     um2nc_ctx    *ctx;
+     um2nc_options defaults;
+     stash_set     stored_stash = { 0, 0, NULL };
+
+     pthread_once( &kernels_once, init_kernels );
+
+     if ( opts==NULL ) {
+        um2nc_default_options( &defaults );
+        opts = &defaults;
+     }
+
+     ctx = (um2nc_ctx *) calloc( 1, sizeof(um2nc_ctx) );
+     if ( ctx==NULL ) { return NULL; }
+
+ /*
+  * Copy the options of the conversion
+  *---------------------------------------------------------------------------*/
+     ctx->iflag              = opts->interpolate;
+     ctx->rflag              = opts->real32;
+     ctx->netcdf3_flag       = opts->netcdf3;
+     ctx->io_stats_flag      = opts->io_stats;
+     ctx->pipeline_flag      = opts->pipeline;
+     ctx->num_decode_threads = opts->decode_threads;
+     ctx->num_row_threads    = opts->row_threads;
+     ctx->strip_rows         = opts->strip_rows;
+
+     if ( (ctx->num_decode_threads<1)||(ctx->num_decode_threads>256) ) {
+        printf( "ERROR: the number of decode threads must be between 1 and 256\n" );
+        goto fail;
+     }
+     if ( (ctx->num_row_threads<1)||(ctx->num_row_threads>256) ) {
+        printf( "ERROR: the number of row decoding threads must be between 1 and 256\n" );
+        goto fail;
+     }
+     if ( ctx->strip_rows<0 ) {
+        printf( "ERROR: the number of rows in each band must be at least 1\n" );
+        goto fail;
+     }
+     if ( (ctx->strip_rows>0)&&(ctx->pipeline_flag==1) ) {
+        printf( "WARNING: data slices are converted in bands of rows (-m option); the -p/-t options are ignored\n" );
+        ctx->pipeline_flag = 0;
+     }
+
+     ctx->um_file     = copy_string( um_file );
+     ctx->stash_file  = copy_string( stash_file );
+     ctx->config_file = copy_string( opts->config_file );
+     if ( (ctx->um_file==NULL)||(ctx->stash_file==NULL) ) { goto fail; }
+
+     if ( add_stash_specs( &ctx->selected_stash, opts->select )==0 ) { goto fail; }
+     if ( add_stash_specs( &ctx->blacklist, opts->blacklist )==0 ) { goto fail; }
+
+ /*
+  * Read in the run configuration XML file
+  *---------------------------------------------------------------------------*/
+     if ( ctx->config_file==NULL ) {
+        printf( "\n\nWARNING: no run configuration file specified. Use the '-c' option to specify one.\n" );
+        printf( "         Default values will be used.\n" );
+        ctx->run_config.ps      = 0;
+        ctx->run_config.eps     = 0;
+        ctx->run_config.rose_id = 0;
+        strcpy( ctx->run_config.institution, "ACME Corporation" );
+        strcpy( ctx->run_config.model, "my UM model" );
+        strcpy( ctx->run_config.ref, "no references listed" );
+        strcpy( ctx->run_config.comment, "no comment" );
+        strcpy( ctx->run_config.title, "Model Output" );
+        strcpy( ctx->run_config.assim, "no data assimilation used" );
+     } else if ( read_config_file( ctx, ctx->config_file )==0 ) {
+        printf( "\n ERROR: could not parse run configuration file \n\n" );
+        goto fail;
+     }
+
+ /*
+  * Determine the type of input UM file, its endianness and word size
+  *---------------------------------------------------------------------------*/
+     if ( check_um_file( ctx, ctx->um_file )==0 ) {
+        printf( "\n ERROR: could not determine UM filetype \n\n" );
+        goto fail;
+     }
+
+ /*
+  * Read in the XML stash file definitions of the STASH codes found in the
+  * input UM file & name the UM variables after them
+  *---------------------------------------------------------------------------*/
+     for ( i=0; i<ctx->num_stored_um_fields; i++ )
+         add_stash_code( &stored_stash, ctx->stored_um_vars[i].stash_code );
+
+     i = read_stash_file( ctx, ctx->stash_file, &stored_stash );
+     free_stash_set( &stored_stash );
+     if ( i==0 ) {
+        printf( "\n ERROR: could not parse XML stash file \n\n" );
+        goto fail;
+     }
+
+     assign_stash_metadata( ctx );
+
+     return ctx;
+
+fail:
+     um2nc_close( ctx );
+     return NULL;
+}
+
+
+/***
+ *** UM2NC_NUM_VARIABLES
+ ***
+ ***  INPUT: ctx -> conversion context of the input UM fields file
+ ***
+ *** Function returns the # of UM variables that will be written.
+ ***/
+
+int um2nc_num_variables( const um2nc_ctx *ctx ) {
+
+     return ctx->num_stored_um_fields;
+}
+
+
+/***
+ *** UM2NC_INSPECT
+ ***
+ *** Describes one of the UM variables that will be written.
+ ***
+ ***  INPUT: ctx  -> conversion context of the input UM fields file
+ ***         n    -> index of the UM variable
+ ***         info -> description of the UM variable
+ ***
+ *** Function returns 1 on success and 0 if N is out of range.
+ ***/
+
+int um2nc_inspect( const um2nc_ctx *ctx, int n, um2nc_var_info *info ) {
+
+     const new_um_variable *var;
+
+     if ( (n<0)||(n>=ctx->num_stored_um_fields) ) { return 0; }
+
+     var = &ctx->stored_um_vars[n];
+     info->stash_code = var->stash_code;
+     info->name       = var->name;
+     info->nx         = var->nx;
+     info->ny         = var->ny;
+     info->nz         = var->nz;
+     info->nt         = var->nt;
+     info->lbproc     = (int ) var->lbproc;
+
+     return 1;
+}
+
+
+/***
+ *** UM2NC_CONVERT
+ ***
+ *** Writes the UM variables of a conversion context into a new NetCDF file.
+ ***
+ ***  INPUT: ctx     -> conversion context of the input UM fields file
+ ***         nc_file -> name of the NetCDF file (NULL -> named after the input
+ ***                    UM fields file with a .nc suffix)
+ ***
+ *** Function returns 1 on success and 0 otherwise.
+ ***/
+
+int um2nc_convert( um2nc_ctx *ctx, const char *nc_file ) {
+
+     int ncid;
+
+     printf( "\n==============================================================\n" );
+     printf( "                           UM2NetCDF\n" );
+     printf( "==============================================================\n\n" );
+     printf( "XML Files\n" );
+     printf( "--------------------------------------------------------------\n" );
+     printf( "   UM Stash Code->CF Metadata File : %s\n", ctx->stash_file );
+     printf( "   Run Configuration File          : " );
+     if ( ctx->config_file==NULL ) { printf( "Not Specified\n\n" ); }
+     else                          { printf( "%s\n\n", ctx->config_file ); }
+
+     printf( "Input UM Data File\n" );
+     printf( "--------------------------------------------------------------\n" );
+     printf( "   Filename  : %s\n", ctx->um_file );
+     printf( "   Wordsize  : %d\n\n", ctx->wordsize );
+
+ /*
+  * Create a NetCDF file to hold the UM data
+  *---------------------------------------------------------------------------*/
+     ncid = create_netcdf_file( ctx, nc_file );
+     if ( ncid==999 ) {
+        printf( "\n ERROR: could not create NetCDF file \n\n" );
+        return 0;
+     }
+
+ /*
+  * Write the UM data into the NetCDF file
+  *---------------------------------------------------------------------------*/
+     if ( fill_netcdf_file( ctx, ncid )==0 ) {
+        printf( "\n ERROR: data write to NetCDF file failed \n\n" );
+        return 0;
+     }
+
+     return 1;
+}
+
+
+/***
+ *** UM2NC_CLOSE
+ ***
+ *** Releases a conversion context and all the memory it holds.
+ ***
+ ***  INPUT: ctx -> conversion context of the input UM fields file
+ ***/
+
+void um2nc_close( um2nc_ctx *ctx ) {
+
+     int i, k;
+     new_um_variable *var;
+
+     if ( ctx==NULL ) { return; }
+
+     for ( i=0; i<ctx->num_stored_um_fields; i++ ) {
+         var = &ctx->stored_um_vars[i];
+         free( var->times );
+         if ( (var->lbproc==32)||(var->lbproc==128)||(var->lbproc==4096)||(var->lbproc==8192) ) {
+            for ( k=0; k<var->nt; k++ ) { free( var->time_bnds[k] ); }
+            free( var->time_bnds );
+         }
+     }
+     free( ctx->stored_um_vars );
+     free_slice_table( ctx );
+     free_stash_table( ctx );
+
+     for ( i=0; i<ctx->num_level_rows; i++ ) { free( ctx->level_constants[i] ); }
+     free( ctx->level_constants );
+
+     free_stash_set( &ctx->selected_stash );
+     free_stash_set( &ctx->blacklist );
+     free( ctx->um_file );
+     free( ctx->stash_file );
+     free( ctx->config_file );
+     free( ctx );
+
+     return;
+}
+
+
+/***
+ *** UM2NC_CHECK_STASH_SPEC
+ ***
+ ***  INPUT: spec -> STASH code specification (16202, 16200-16299, 16:202 or 16:*)
+ ***
+ *** Function returns the # of STASH codes described by SPEC, or 0 if it is
+ *** not a STASH code specification.
+ ***/
+
+int um2nc_check_stash_spec( const char *spec ) {
+
+     long lo, hi;
+
+     if ( parse_stash_spec( spec, &lo, &hi )==0 ) { return 0; }
+
+     return (int ) (hi-lo+1);
+}
+
+
+/***
+ *** UM2NC_COMPILE_STASH
+ ***
+ *** Compiles an XML stash file into its binary form.
+ ***
+ ***  INPUT: xml_file -> name of the XML stash file
+ ***         bin_file -> name of the binary stash file (NULL -> named after the
+ ***                     XML stash file with a .bin suffix)
+ ***
+ *** Function returns 1 on success and 0 otherwise.
+ ***/
+
+int um2nc_compile_stash( const char *xml_file, const char *bin_file ) {
+
+     pthread_once( &kernels_once, init_kernels );
+
+     return compile_stash_file( xml_file, bin_file );
+}
@@ -182,12 +182,12 @@ int main( int argc, char *argv[] ) {
  **---------------------------------------------------------------------------*/
      fseek( fid, (header[149]-1)*wordsize, SEEK_SET );
      lookup = (long **) malloc( header[151]*sizeof(long *) );
+     lookup[0] = (long *) malloc( header[150]*header[151]*sizeof(long) );
 
-     for ( nrec=0; nrec<header[151]; nrec++ ) {
-         lookup[nrec] = (long *) malloc( header[150]*sizeof(long) );
-         c = fread( lookup[nrec], wordsize, header[150], fid );
-         endian_swap( lookup[nrec],header[150] );
-     }
+     c = fread( lookup[0], wordsize, header[150]*header[151], fid );
+     endian_swap( lookup[0], header[150]*header[151] );
+     for ( nrec=1; nrec<header[151]; nrec++ )
+         lookup[nrec] = lookup[0] + nrec*header[150];
  
 /**
  ** Look for the specified variable 
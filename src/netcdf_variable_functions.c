@@ -29,200 +29,805 @@
 #include <math.h>
 #include <stdint.h>
 
+/** Max # of input rows below an output row read by the interpolation procedures **/
+#define STRIP_HALO 2
+
 /** Function prototypes **/
 
-void interp_do_nothing( double *val, float *fval, int index );
-void u_to_p_point_interp_c_grid( double *val, float *fval, int index );
-void v_to_p_point_interp_c_grid( double *val, float *fval, int index );
-void b_to_c_grid_interp_u_points( double *val, float *fval, int index );
-void wgdos_unpack( FILE *fh, double *val, double mdi );
+int interp_row_do_nothing( const float *val, int first, float *row, int j, int nx, int ny, int nyp, float scale );
+int u_to_p_row_c_grid( const float *val, int first, float *row, int j, int nx, int ny, int nyp, float scale );
+int v_to_p_row_c_grid( const float *val, int first, float *row, int j, int nx, int ny, int nyp, float scale );
+int b_to_c_row_u_points( const float *val, int first, float *row, int j, int nx, int ny, int nyp, float scale );
+int wgdos_index_record( unsigned char *rec, long nbytes, long npts, int nthreads, wgdos_workspace *ws );
+void wgdos_unpack_rows( wgdos_workspace *ws, int first, int last, double mdi, int nthreads, 
+                        long npts, float *unpacked_data );
+void free_wgdos_workspace( wgdos_workspace *ws );
+unsigned char *read_um_record( um_reader *rd, long offset, long nbytes, long *avail );
+int build_slice_schedule( um2nc_ctx *ctx, slice_request **list );
+void prefetch_slices( um_reader *rd, slice_request *list, int num, int current, int *next );
+int run_slice_pipeline( um2nc_ctx *ctx, int ncid, um_reader *rd, slice_request *list, int num, var_output *out,
+                        int max_in, int max_out, size_t max_bytes, int nworkers );
+size_t slice_element_size( nc_type vartype );
+void lock_netcdf( void );
+void unlock_netcdf( void );
+
 
 /***
- *** WRITE_FIELDS 
+ *** INDEX_DATA_SLICE
+ ***
+ *** Prepares the raw record of a 2D data slice for decoding.  The row table &
+ *** row bases of WGDOS-packed records are built in the slice buffer's WGDOS
+ *** workspace; unpacked records need no preparation.  A slice whose record
+ *** is missing, invalid or truncated (so that some of its points could not be
+ *** decoded) is reported & must not be written: its position in the NetCDF
+ *** variable is left holding the fill value, whichever way it is converted.
+ ***
+ ***  INPUT:   ctx -> conversion context of the input UM fields file
+ ***           req -> read request for the 2D data slice
+ ***           rec -> raw record of the 2D data slice
+ ***         avail -> # of bytes available in REC
+ ***
+ ***  INPUT/OUTPUT: b -> slice buffer whose WGDOS workspace receives the index
+ ***
+ *** Function returns 1 if the whole record can be decoded and 0 otherwise.
+ ***/
+
+int index_data_slice( um2nc_ctx *ctx, slice_request *req, unsigned char *rec, long avail, slice_buffer *b ) {
+
+     int ierr;
+
+     if ( (rec==NULL)||(avail<=0) ) {
+        printf( "WARNING: could not read the record of stash code %d at offset %ld\n", 
+                ctx->stored_um_vars[req->var_index].stash_code, req->offset ); 
+        return 0;
+     }
+
+     if ( ctx->stored_slices.lbpack[req->slice]!=1 ) { 
+        if ( avail/ctx->wordsize<(long ) req->npts ) {
+           printf( "WARNING: truncated record for stash code %d at offset %ld\n", 
+                   ctx->stored_um_vars[req->var_index].stash_code, req->offset ); 
+           return 0;
+        }
+        return 1; 
+     }
+
+     ierr = wgdos_index_record( rec, avail, (long ) req->npts, ctx->num_row_threads, &b->ws );
+     if ( (ierr==1)&&((long ) b->ws.cols*b->ws.nrows!=(long ) req->npts) ) { ierr = 0; }
+     if ( ierr==0 ) { 
+        printf( "WARNING: invalid WGDOS record for stash code %d at offset %ld\n", 
+                ctx->stored_um_vars[req->var_index].stash_code, req->offset ); 
+     }
+     else if ( b->ws.num_overflows>0 ) {
+        printf( "WARNING: %ld row base values of stash code %d at offset %ld overflowed\n", 
+                b->ws.num_overflows, ctx->stored_um_vars[req->var_index].stash_code, req->offset ); 
+     }
+
+     return ierr;
+}
+
+
+/***
+ *** DECODE_DATA_ROWS
+ ***
+ *** Decodes rows FIRST to LAST-1 of the raw record of a 2D data slice into 
+ *** single precision values, held in VAL starting with row FIRST.  WGDOS-packed
+ *** records are unpacked (they must have been indexed by INDEX_DATA_SLICE) and
+ *** unpacked records are endian-swapped and converted in a single pass.  
+ *** Unpacked records of variables that are not interpolated are swapped, 
+ *** scaled & converted straight into OUT, in the NetCDF type of the variable,
+ *** and STORED is set.  Unpacked words are taken as integers for integer 
+ *** variables and as reals otherwise, in 32 or 64-bit fieldsfiles alike.
+ ***
+ ***  INPUT:   ctx -> conversion context of the input UM fields file
+ ***           req -> read request for the 2D data slice
+ ***           rec -> raw record of the 2D data slice
+ ***         avail -> # of bytes available in REC
+ ***             v -> output state of the slice's UM variable
+ ***         first -> index of the first row to decode
+ ***          last -> index just past the last row to decode
+ ***
+ ***  INPUT/OUTPUT: b -> slice buffer receiving the decoded rows in VAL (or OUT)
+ ***/
+
+void decode_data_rows( um2nc_ctx *ctx, slice_request *req, unsigned char *rec, long avail, var_output *v, 
+                       slice_buffer *b, int first, int last ) {
+
+     int  i, n;
+     long skip, cnt;
+
+     b->stored = 0;
+     if ( (rec==NULL)||(avail<=0)||(last<=first) ) { return; }
+
+     cnt = (long ) (last-first)*v->nx;
+
+     if ( ctx->stored_slices.lbpack[req->slice]==1 ) { 
+        wgdos_unpack_rows( &b->ws, first, last, ctx->stored_slices.mdi[req->slice], ctx->num_row_threads, cnt, b->val );
+        return;
+     }
+
+     skip = (long ) first*v->nx;
+     if ( avail/ctx->wordsize-skip<cnt ) { cnt = avail/ctx->wordsize - skip; }
+     if ( cnt<=0 ) { return; }
+     n   = (int ) cnt;
+     rec = rec + skip*ctx->wordsize;
+
+     if ( v->direct==1 ) {
+        b->stored = 1;
+        switch ( v->vartype ) {
+                case NC_DOUBLE: ctx->endian_swap_double( (double *) b->out, rec, n, v->scale ); break;
+                case NC_INT:    ctx->endian_swap_int( (int *) b->out, rec, n );                 break;
+                default:        ctx->endian_swap_float( (float *) b->out, rec, n, v->scale );   break;
+        }
+     }
+     else if ( v->vartype==NC_INT ) {
+        ctx->endian_swap_int( (int *) b->val, rec, n );
+        for ( i=0; i<n; i++ ) { b->val[i] = (float ) ((int *) b->val)[i]; }
+     }
+     else { ctx->endian_swap_float( b->val, rec, n, 1.0f ); }
+
+     return;
+}
+
+
+/***
+ *** DECODE_DATA_SLICE
+ ***
+ *** Decodes the raw record of a 2D data slice into single precision values
+ *** (see DECODE_DATA_ROWS).  Slices that cannot be decoded are flagged in the
+ *** slice buffer (DECODED is 0) and must not be written.
+ ***
+ ***  INPUT:   ctx -> conversion context of the input UM fields file
+ ***           req -> read request for the 2D data slice
+ ***           rec -> raw record of the 2D data slice
+ ***         avail -> # of bytes available in REC
+ ***             v -> output state of the slice's UM variable
+ ***
+ ***  INPUT/OUTPUT: b -> slice buffer receiving the decoded values in VAL (or OUT)
+ ***
+ *** Function returns 1 if the slice was decoded and 0 otherwise.
+ ***/
+
+int decode_data_slice( um2nc_ctx *ctx, slice_request *req, unsigned char *rec, long avail, var_output *v, slice_buffer *b ) {
+
+     b->stored  = 0;
+     b->decoded = index_data_slice( ctx, req, rec, avail, b );
+     if ( b->decoded==1 ) { decode_data_rows( ctx, req, rec, avail, v, b, 0, v->ny ); }
+
+     return b->decoded;
+}
+
+
+/***
+ *** READ_DATA_SLICE
+ ***
+ *** Fetches the raw record of a 2D data slice from the input UM fields file 
+ *** in a single read and decodes it straight out of the reader's memory 
+ *** mapping (or its buffer if the file is not mapped).
+ ***
+ ***  INPUT:   ctx -> conversion context of the input UM fields file
+ ***            rd -> reader for the input UM fields file
+ ***           req -> read request for the 2D data slice
+ ***             v -> output state of the slice's UM variable
+ ***
+ ***  INPUT/OUTPUT: b -> slice buffer receiving the decoded values
+ ***
+ *** Function returns 1 if the slice was decoded and 0 otherwise.
+ ***/
+
+int read_data_slice( um2nc_ctx *ctx, um_reader *rd, slice_request *req, var_output *v, slice_buffer *b ) {
+
+     long           avail;
+     unsigned char *rec;
+
+     rec = read_um_record( rd, req->offset, req->nbytes, &avail );
+
+     return decode_data_slice( ctx, req, rec, avail, v, b );
+}
+
+
+/***
+ *** STORE_ROW_FLOAT / STORE_ROW_DOUBLE / STORE_ROW_INT
+ ***
+ *** Store a row of interpolated & scaled values in the NetCDF type of their
+ *** variable and widen RANGE to take in the row's max & min values, in a 
+ *** single pass over the row.  Float rows are interpolated straight into the
+ *** output, so only their range is taken.  NaN values are left out of RANGE.
+ ***
+ ***  INPUT:   row -> interpolated & scaled values of the row
+ ***           cnt -> # of values in the row
+ ***
+ ***  OUTPUT:  out -> values of the row in the NetCDF type of the variable
+ ***
+ ***  INPUT/OUTPUT: range -> max & min values found so far in the slice
+ ***/
+
+void store_row_float( const float *row, void *out, int cnt, float range[2] ) {
+
+     int   i;
+     float hi, lo;
+
+     hi = range[0];
+     lo = range[1];
+     for ( i=0; i<cnt; i++ ) {
+         hi = ( row[i]>hi ) ? row[i] : hi;
+         lo = ( row[i]<lo ) ? row[i] : lo;
+     }
+     range[0] = hi;
+     range[1] = lo;
+
+     return;
+}
+
+void store_row_double( const float *row, void *out, int cnt, float range[2] ) {
+
+     int     i;
+     float   hi, lo;
+     double *dout = (double *) out;
+
+     hi = range[0];
+     lo = range[1];
+     for ( i=0; i<cnt; i++ ) {
+         hi = ( row[i]>hi ) ? row[i] : hi;
+         lo = ( row[i]<lo ) ? row[i] : lo;
+         dout[i] = (double ) row[i];
+     }
+     range[0] = hi;
+     range[1] = lo;
+
+     return;
+}
+
+void store_row_int( const float *row, void *out, int cnt, float range[2] ) {
+
+     int     i;
+     float   hi, lo;
+     int    *iout = (int *) out;
+
+     hi = range[0];
+     lo = range[1];
+     for ( i=0; i<cnt; i++ ) {
+         hi = ( row[i]>hi ) ? row[i] : hi;
+         lo = ( row[i]<lo ) ? row[i] : lo;
+         iout[i] = (int ) row[i];
+     }
+     range[0] = hi;
+     range[1] = lo;
+
+     return;
+}
+
+
+/***
+ *** SLICE_RANGE
+ ***
+ *** Determines the max & min values of a 2D data slice held in the NetCDF 
+ *** type of its variable.  NaN values are left out of RANGE.
+ ***
+ ***  INPUT:  vartype -> NetCDF type of the values
+ ***          out     -> values of the 2D data slice
+ ***          cnt     -> # of values in OUT
+ ***
+ ***  OUTPUT: range   -> max & min values found in OUT
+ ***/
+
+void slice_range( nc_type vartype, void *out, int cnt, float range[2] ) {
+
+     int     i, ihi, ilo;
+     double  dhi, dlo;
+     double *dout = (double *) out;
+     int    *iout = (int *) out;
+
+     range[0] = -HUGE_VALF;
+     range[1] = HUGE_VALF;
+
+     switch ( vartype ) {
+             case NC_DOUBLE:
+                    dhi = -HUGE_VAL;
+                    dlo = HUGE_VAL;
+                    for ( i=0; i<cnt; i++ ) {
+                        dhi = ( dout[i]>dhi ) ? dout[i] : dhi;
+                        dlo = ( dout[i]<dlo ) ? dout[i] : dlo;
+                    }
+                    range[0] = (float ) dhi;
+                    range[1] = (float ) dlo;
+                    break;
+             case NC_INT:
+                    if ( cnt<1 ) { break; }
+                    ihi = ilo = iout[0];
+                    for ( i=1; i<cnt; i++ ) {
+                        ihi = ( iout[i]>ihi ) ? iout[i] : ihi;
+                        ilo = ( iout[i]<ilo ) ? iout[i] : ilo;
+                    }
+                    range[0] = (float ) ihi;
+                    range[1] = (float ) ilo;
+                    break;
+             default:
+                    store_row_float( (float *) out, out, cnt, range );
+                    break;
+     }
+
+     return;
+}
+
+
+/***
+ *** PREPARE_ROWS
+ ***
+ *** Interpolates rows J0 to J1-1 of a decoded 2D data slice onto the output
+ *** grid and stores them in the NetCDF type of its variable, one row at a 
+ *** time: each row is interpolated & scaled, then converted into OUT in the
+ *** same pass that widens the slice's RANGE, while it is still in cache.  
+ *** Float rows are interpolated straight into OUT; other types go through
+ *** the single row held in FVAL.  Rows that are copies of an earlier row are
+ *** copied in the output type, or computed again if that row is not in OUT.
+ ***
+ *** The row procedure & the store procedure of each variable are chosen once
+ *** by SETUP_VAR_OUTPUT.
  ***
- *** Subroutine that reads in each UM variable by 1 2D data slice at a time.
- *** Each slice is interpolated until the P-grid (if required) and the resulting
- *** 2D slice is written into the appropriate NetCDF variable. 
+ ***  INPUT:      v -> output state of the slice's UM variable
+ ***          first -> index of the first row of the decoded slice held in VAL
+ ***             j0 -> index of the first output row (held at the start of OUT)
+ ***             j1 -> index just past the last output row
+ ***
+ ***  INPUT/OUTPUT: b -> slice buffer holding the decoded rows in VAL
+ ***/
+
+void prepare_rows( var_output *v, slice_buffer *b, int first, int j0, int j1 ) {
+
+     int     j, k, nx;
+     size_t  rowsize;
+     char   *out, *dst;
+     float  *row;
+
+     nx = (int ) v->count[v->ndim-1];
+     rowsize = nx*slice_element_size( v->vartype );
+     out = (char *) b->out;
+
+     for ( j=j0; j<j1; j++ ) {
+         dst = out + (j-j0)*rowsize;
+         if ( v->vartype==NC_FLOAT ) { row = (float *) dst; }
+         else                        { row = b->fval; }
+
+         k = v->interp_row( b->val, first, row, j, v->nx, v->ny, v->nyp, v->scale );
+         if ( (k<j)&&(k>=j0) ) { memcpy( dst, out + (k-j0)*rowsize, rowsize ); }
+         else {
+              if ( k<j ) { v->interp_row( b->val, first, row, k, v->nx, v->ny, v->nyp, v->scale ); }
+              v->store_row( row, dst, nx, b->range );
+         }
+     }
+
+     return;
+}
+
+
+/***
+ *** PREPARE_SLICE
+ ***
+ *** Interpolates a whole decoded 2D data slice onto the output grid and stores
+ *** it in the NetCDF type of its variable (see PREPARE_ROWS).  Slices already
+ *** STORED in OUT by the decoder only have their min & max found.
+ ***
+ ***  INPUT:      v -> output state of the slice's UM variable
+ ***
+ ***  INPUT/OUTPUT: b -> slice buffer holding the decoded values in VAL (or OUT)
+ ***/
+
+void prepare_slice( var_output *v, slice_buffer *b ) {
+
+     int ny;
+
+     ny = (int ) v->count[v->ndim-2];
+
+     if ( b->stored==1 ) {
+        slice_range( v->vartype, b->out, ny*(int ) v->count[v->ndim-1], b->range );
+        return;
+     }
+
+     b->range[0] = -HUGE_VALF;
+     b->range[1] = HUGE_VALF;
+     prepare_rows( v, b, 0, 0, ny );
+
+     return;
+}
+
+
+/***
+ *** PUT_ROWS
+ ***
+ *** Writes a band of rows of a prepared 2D data slice into its time (& level)
+ *** position in the NetCDF variable.  The NetCDF library is not thread-safe,
+ *** so the write is made while holding the process-wide NetCDF lock.
+ ***
+ ***  INPUT:  ncid -> ID of the newly created NetCDF file 
+ ***            v  -> output state of the slice's UM variable
+ ***           req -> read request for the 2D data slice
+ ***           out -> prepared values of the rows
+ ***         first -> index of the first row of the band
+ ***         nrows -> # of rows in the band
+ ***
+ *** Function returns 1 on success and 0 if the rows could not be written.
+ ***/
+
+int put_rows( int ncid, var_output *v, slice_request *req, void *out, int first, int nrows ) {
+
+     int    ierr;
+     size_t offset[4], count[4];
+
+     memcpy( count, v->count, 4*sizeof(size_t) );
+     count[v->ndim-2] = (size_t ) nrows;
+
+     offset[0] = req->t;
+     offset[1] = 0;
+     if ( v->ndim==4 ) { offset[1] = req->z; }
+     offset[v->ndim-2] = (size_t ) first;
+     offset[v->ndim-1] = 0;
+
+     lock_netcdf();
+     switch ( v->vartype ) {
+             case NC_DOUBLE:
+                    ierr = nc_put_vara_double( ncid, v->varid, offset, count, (double *) out );
+                    break;
+             case NC_INT:
+                    ierr = nc_put_vara_int( ncid, v->varid, offset, count, (int *) out );
+                    break;
+             default:
+                    ierr = nc_put_vara_float( ncid, v->varid, offset, count, (float *) out );
+                    break;
+     }
+     unlock_netcdf();
+
+     if ( ierr!=NC_NOERR ) {
+        printf( "ERROR: could not write rows %d-%d of time %d level %d of NetCDF variable %d: %s\n",
+                first, first+nrows-1, req->t, req->z, v->varid, nc_strerror(ierr) );
+        return 0;
+     }
+
+     return 1;
+}
+
+
+/***
+ *** PUT_SLICE
+ ***
+ *** Writes a prepared 2D data slice into its time (& level) position in the
+ *** NetCDF variable and updates the variable's actual range.
  ***
  ***  INPUT:  ncid -> ID of the newly created NetCDF file 
- ***           fid -> file pointer to the UM fields file
- ***         rflag -> denotes whether 32 or 64-bit output is desired
- ***                  (0->64 bit, 1->32 bit)
- ***         iflag -> denotes whether interpolation is to be used 
- ***                  (0->No, 1->Yes)
- ***          
- ***   Mark Cheeseman, NIWA
- ***   June 26, 2014
+ ***            v  -> output state of the slice's UM variable
+ ***           req -> read request for the 2D data slice
+ ***             b -> slice buffer holding the prepared values
+ ***
+ *** Function returns 1 on success and 0 if the slice could not be written.
+ ***/
+
+int put_slice( int ncid, var_output *v, slice_request *req, slice_buffer *b ) {
+
+     v->actual[0] = fmax( v->actual[0], b->range[0] );
+     v->actual[1] = fmin( v->actual[1], b->range[1] );
+
+     return put_rows( ncid, v, req, b->out, 0, (int ) v->count[v->ndim-2] );
+}
+
+
+/***
+ *** WRITE_SLICE_STRIPS
+ ***
+ *** Converts a 2D data slice in bands of HEIGHT rows, so that the memory used
+ *** does not depend on the size of the grid.  For each band of output rows,
+ *** only the rows of the input slice that its interpolation reads (the band
+ *** & up to STRIP_HALO rows below it) are decoded; the band is then 
+ *** interpolated, converted & written into the NetCDF variable as a 
+ *** hyperslab.  The record itself is read (or mapped) & indexed only once.
+ ***
+ ***  INPUT:   ctx -> conversion context of the input UM fields file
+ ***          ncid -> ID of the newly created NetCDF file 
+ ***            rd -> reader for the input UM fields file
+ ***           req -> read request for the 2D data slice
+ ***            v  -> output state of the slice's UM variable
+ ***        height -> # of rows in each band
+ ***
+ ***  INPUT/OUTPUT: b -> slice buffer holding HEIGHT+STRIP_HALO decoded rows in
+ ***                     VAL and HEIGHT output rows in OUT
+ ***
+ *** Function returns 0 if a band could not be written (the remaining bands
+ *** are then skipped) and 1 otherwise, including for a slice whose record
+ *** could not be decoded (and is not written).
  ***/
 
-void write_fields( int ncid, FILE *fid, int rflag, int iflag ) {
-
-     int     n, i, j=0, k, ndim, cnt, varid;
-     size_t *count, *offset;
-     double *buf=NULL;
-     float  *fbuf=NULL, actual[2];
-     char    name[45];
-
-     for ( n=0; n<num_stored_um_fields; n++ ) {
-
-         strcpy( name, stored_um_vars[n].name );
-         i = nc_inq_varid( ncid, name, &varid );
-
-       /** Determine # of dimensions for current UM variable **/
-         ndim = 3;
-         if ( stored_um_vars[n].nz>1 ) { ndim = 4; }
-
-       /*** Allocate & set the sizes of a 2D slice in the UM variable ***/
-       /*** Remember that COUNT = COUNT[NT,NZ,NY,NX]                  ***/
-
-         offset = (size_t *) calloc( ndim,sizeof(size_t) );
-         count = (size_t *) malloc( ndim*sizeof(size_t) );
-         if ( iflag==1 ) { count[ndim-2] = int_constants[6];     }
-         else            { count[ndim-2] = stored_um_vars[n].ny; }
-         count[ndim-1] = stored_um_vars[n].nx;
-         count[0]      = 1;   // only 1 timeslice printed at a time
-
-       /*** Count the number of elements to be read for a single 2D data slice ***/
-
-         cnt = stored_um_vars[n].nx*stored_um_vars[n].ny;
-         buf = (double *) malloc( cnt*sizeof(double) );
-         fbuf = (float *) malloc( count[ndim-1]*count[ndim-2]*sizeof(float) ); 
-
-       /*** Initialize function pointer to proper interpolation function ***/
-
-         switch ( iflag*stored_um_vars[n].grid_type ) {
-                 case 0:
-                        field_interpolation = &interp_do_nothing; 
-                        break;
-                 case 11:
-                        field_interpolation = &b_to_c_grid_interp_u_points; 
-                        break;
-                 case 18: 
-                        field_interpolation = &u_to_p_point_interp_c_grid; 
-                        break;
-                 case 19: 
-                        field_interpolation = &v_to_p_point_interp_c_grid; 
-                        break;
-                 default:
-                        field_interpolation = &interp_do_nothing; 
-                        if ( int_constants[6]!=stored_um_vars[n].ny ) {
-                           printf( "ERROR: NY dimension of %s is not equal to %ld\n", name, int_constants[6] );
-                           printf( "       Check the umgrid value in the XML stashfile for this field\n\n" );
-                           exit(1);
-                        }
-                        break;
+int write_slice_strips( um2nc_ctx *ctx, int ncid, um_reader *rd, slice_request *req, var_output *v, 
+                        slice_buffer *b, int height ) {
+
+     int            j0, j1, lo, hi, ny;
+     long           avail;
+     float          range[2];
+     unsigned char *rec;
+
+     rec = read_um_record( rd, req->offset, req->nbytes, &avail );
+     if ( !index_data_slice( ctx, req, rec, avail, b ) ) { return 1; }
+
+     ny = (int ) v->count[v->ndim-2];
+     b->range[0] = -HUGE_VALF;
+     b->range[1] = HUGE_VALF;
+
+     for ( j0=0; j0<ny; j0+=height ) {
+         j1 = ( j0+height<ny ) ? j0+height : ny;
+
+     /** Input rows read by the interpolation of output rows J0 to J1-1 **/
+         lo = ( j0<v->ny ) ? j0 : v->ny-1;
+         lo = ( lo-v->halo>0 ) ? lo-v->halo : 0;
+         hi = ( j1>v->halo+1 ) ? j1 : v->halo+1;
+         if ( hi>v->ny ) { hi = v->ny; }
+
+         decode_data_rows( ctx, req, rec, avail, v, b, lo, hi );
+         if ( b->stored==1 ) {
+            slice_range( v->vartype, b->out, (hi-lo)*(int ) v->count[v->ndim-1], range );
+            b->range[0] = ( range[0]>b->range[0] ) ? range[0] : b->range[0];
+            b->range[1] = ( range[1]<b->range[1] ) ? range[1] : b->range[1];
          }
+         else { prepare_rows( v, b, lo, j0, j1 ); }
+
+         if ( put_rows( ncid, v, req, b->out, j0, j1-j0 )==0 ) { return 0; }
+     }
 
-       /*** For a 3D UM variable [NX,NY,NT], read in a single 2D data slice per data time   ***/
-       /*** valid for this UM variable.  Then apply the appropriate interpolation and write ***/
-       /*** the final field to hard disk.                                                   ***/
-
-         actual[0] = um_vars[stored_um_vars[n].xml_index].validmin;
-         actual[1] = um_vars[stored_um_vars[n].xml_index].validmax;
-
-         if ( ndim==3 ) {
-
-               offset[0] = 0;
-               for ( k=0; k<stored_um_vars[n].nt; k++ ) {
-
-               /* Read in a 2D data slice. Apply appropriate endian swap on the data */
-                   fseek( fid, stored_um_vars[n].slices[k][0].location*wordsize, SEEK_SET );
-                   if ( stored_um_vars[n].slices[k][0].lbpack==1 ) { 
-                          wgdos_unpack( fid, buf, stored_um_vars[n].slices[k][0].mdi ); 
-                   }else { fread( buf, wordsize, cnt, fid );
-                          endian_swap( buf, cnt );
-                   }
-
-               /* Apply appropriate interpolation on values */
-                   field_interpolation( buf, fbuf, n );
-
-               /* Determine actual min & max values of 2D data slice */
-                   for ( i=0; i<count[ndim-1]*count[ndim-2]; i++ ) {
-                       actual[0] = fmax( actual[0], fbuf[i] );
-                       actual[1] = fmin( actual[1], fbuf[i] );
-                   }
-
-               /* Write interpolated 2D slice to hard disk */
-                   if ( rflag==1 ) { i = nc_put_vara_float( ncid, varid, offset, count, fbuf ); }
-                   else {
-                        free( buf );
-                        buf = (double *) malloc( count[ndim-1]*count[ndim-2]*sizeof(double) ); 
-                        for ( i=0; i<count[ndim-1]*count[ndim-2]; i++ ) { buf[i] = (double ) fbuf[i]; }
-
-                        i = nc_put_vara_double( ncid, varid, offset, count, buf ); 
-                        free( buf );
-                        buf  = (double *) malloc( cnt*sizeof(double) );
-                   }
-
-               /* Update the time counter for this UM variable */
-                   offset[0]++;
-
-               }
-
-         } 
-
-       /*** For a 4D UM variable [NX,NY,NZ,NT], read in a single 2D data slice per level and ***/
-       /*** data time valid for this UM variable.  Then apply the appropriate interpolation  ***/
-       /*** and write the final field to hard disk.                                          ***/
-
-         else if ( ndim==4 ) {
-              count[1] = 1; 
-              for ( k=0; k<stored_um_vars[n].nt; k++ ) {
-                  offset[1] = 0;
-                  for ( j=0; j<stored_um_vars[n].nz; j++ ) {
-
-               /* Read in a 2D data slice. Apply appropriate endian swap on the data */
-                      fseek( fid, stored_um_vars[n].slices[k][j].location*wordsize, SEEK_SET );
-                      if ( stored_um_vars[n].slices[k][j].lbpack==1 ) { wgdos_unpack( fid, buf, stored_um_vars[n].slices[k][j].mdi ); }
-                      else { fread( buf, wordsize, cnt, fid );
-                             endian_swap( buf, cnt );
-                      }
-
-               /* Apply appropriate interpolation on values */
-                      field_interpolation( buf, fbuf, n );
-
-               /* Determine actual min & max values of 2D data slice */
-                   for ( i=0; i<count[ndim-1]*count[ndim-2]; i++ ) {
-                       actual[0] = fmax( actual[0], fbuf[i] );
-                       actual[1] = fmin( actual[1], fbuf[i] );
-                   }
-
-               /* Write interpolated 2D slice to hard disk */
-                      if ( rflag==1 ) { i = nc_put_vara_float( ncid, varid, offset, count, fbuf ); }
-                      else {
-                           free( buf );
-                           buf = (double *) malloc( count[ndim-1]*count[ndim-2]*sizeof(double) );
-                           for ( i=0; i<count[ndim-1]*count[ndim-2]; i++ ) { buf[i] = (double ) fbuf[i]; }
-
-                           i = nc_put_vara_double( ncid, varid, offset, count, buf );
-                           free( buf );
-                           buf  = (double *) malloc( cnt*sizeof(double) );
-                      }
-                      
-               /* Update the level counter for this UM variable */
-                      offset[1]++;
-                  }
-               /* Update the time counter for this UM variable */
-                  offset[0]++;
+     v->actual[0] = fmax( v->actual[0], b->range[0] );
+     v->actual[1] = fmin( v->actual[1], b->range[1] );
+
+     return 1;
+}
+
+
+/***
+ *** SLICE_ELEMENT_SIZE
+ ***
+ *** Returns the # of bytes taken up by a single value of a written 2D data
+ *** slice of the given NetCDF type.
+ ***/
+
+size_t slice_element_size( nc_type vartype ) {
+
+     if ( vartype==NC_DOUBLE ) { return sizeof(double); }
+     if ( vartype==NC_INT )    { return sizeof(int); }
+     return sizeof(float);
+}
+
+
+/***
+ *** SETUP_VAR_OUTPUT
+ ***
+ *** Determines the NetCDF variable ID, the extents of a single 2D slice and
+ *** the row interpolation & row store procedures to be used for a stored UM
+ *** variable.
+ ***
+ ***  INPUT:  ctx   -> conversion context of the input UM fields file (ctx->iflag
+ ***                  denotes whether interpolation is to be used)
+ ***         ncid  -> ID of the newly created NetCDF file 
+ ***         n     -> index of the UM variable in stored_um_vars
+ ***
+ ***  OUTPUT: out   -> output state for the UM variable
+ ***
+ *** Function returns 1 on success and 0 if the NetCDF variable does not exist
+ *** or the variable's grid does not match the P-point grid of the input UM
+ *** fields file.
+ ***/
+
+int setup_var_output( um2nc_ctx *ctx, int ncid, int n, var_output *out ) {
+
+     int ierr;
+
+     lock_netcdf();
+     ierr = nc_inq_varid( ncid, ctx->stored_um_vars[n].name, &out->varid );
+     unlock_netcdf();
+     if ( ierr!=NC_NOERR ) {
+        printf( "ERROR: could not find NetCDF variable %s: %s\n", ctx->stored_um_vars[n].name, nc_strerror(ierr) );
+        return 0;
+     }
+
+  /** Determine # of dimensions for current UM variable **/
+     out->ndim = 3;
+     if ( ctx->stored_um_vars[n].nz>1 ) { out->ndim = 4; }
+
+  /*** Remember that COUNT = COUNT[NT,NZ,NY,NX] ***/
+     out->count[0] = 1;   // only 1 timeslice printed at a time
+     out->count[1] = 1;
+     if ( ctx->iflag==1 ) { out->count[out->ndim-2] = ctx->int_constants[6];     }
+     else            { out->count[out->ndim-2] = ctx->stored_um_vars[n].ny; }
+     out->count[out->ndim-1] = ctx->stored_um_vars[n].nx;
+     out->nx    = (int ) ctx->stored_um_vars[n].nx;
+     out->ny    = (int ) ctx->stored_um_vars[n].ny;
+     out->nyp   = (int ) ctx->int_constants[6];
+     out->scale = ctx->stored_um_vars[n].scale_factor;
+     out->vartype = ctx->stored_um_vars[n].vartype;
+
+  /*** Initialize function pointer to proper row interpolation function ***/
+     switch ( ctx->iflag*ctx->stored_um_vars[n].grid_type ) {
+             case 0:
+                    out->interp_row = &interp_row_do_nothing; 
+                    out->halo = 0;
+                    break;
+             case 11:
+                    out->interp_row = &b_to_c_row_u_points; 
+                    out->halo = STRIP_HALO;
+                    break;
+             case 18: 
+                    out->interp_row = &u_to_p_row_c_grid; 
+                    out->halo = 0;
+                    break;
+             case 19: 
+                    out->interp_row = &v_to_p_row_c_grid; 
+                    out->halo = STRIP_HALO;
+                    break;
+             default:
+                    out->interp_row = &interp_row_do_nothing; 
+                    out->halo = 0;
+                    if ( ctx->int_constants[6]!=ctx->stored_um_vars[n].ny ) {
+                       printf( "ERROR: NY dimension of %s is not equal to %ld\n", ctx->stored_um_vars[n].name, ctx->int_constants[6] );
+                       printf( "       Check the umgrid value in the XML stashfile for this field\n\n" );
+                       return 0;
+                    }
+                    break;
+     }
+
+  /*** Unpacked records of fields that are not interpolated can be stored directly ***/
+  /*** (integer fields only if they are not rescaled)                              ***/
+  /*** Initialize function pointer to the row store function of the output type ***/
+     switch ( out->vartype ) {
+             case NC_DOUBLE: out->store_row = &store_row_double; break;
+             case NC_INT:    out->store_row = &store_row_int;    break;
+             default:        out->store_row = &store_row_float;  break;
+     }
+
+     out->direct = 0;
+     if ( out->interp_row==&interp_row_do_nothing ) {
+        if ( (out->vartype!=NC_INT)||(out->scale==1.0) ) { out->direct = 1; }
+     }
+
+  /*** UM variables without an XML stash file definition have no valid range ***/
+     if ( ctx->stored_um_vars[n].xml_index!=9999 ) {
+        out->actual[0] = ctx->um_vars[ctx->stored_um_vars[n].xml_index].validmin;
+        out->actual[1] = ctx->um_vars[ctx->stored_um_vars[n].xml_index].validmax;
+     } else {
+        out->actual[0] = -HUGE_VALF;
+        out->actual[1] =  HUGE_VALF;
+     }
+
+     return 1;
+}
+
+
+/***
+ *** WRITE_FIELDS 
+ ***
+ *** Subroutine that reads in every 2D data slice of the stored UM variables in
+ *** ascending order of their position in the input UM fields file.  Each slice
+ *** is interpolated onto the P-grid (if required) and the resulting 2D slice
+ *** is written into the appropriate NetCDF variable.  Readahead hints are
+ *** issued for the slices that are about to be read.  Slices are decoded in
+ *** single precision and stored once in the NetCDF type of their variable
+ *** (the 32 or 64-bit output choice is carried by each variable's type).
+ ***
+ *** If pipelining was requested, reading, decoding and writing are done in
+ *** separate threads, with the decoding spread over a pool of worker threads
+ *** (see slice_pipeline.c).  If a strip height was given, each slice is 
+ *** instead converted in bands of STRIP_ROWS rows (see WRITE_SLICE_STRIPS),
+ *** so that the memory used does not grow with the size of the grid.
+ ***
+ ***  INPUT:   ctx -> conversion context of the input UM fields file
+ ***          ncid -> ID of the newly created NetCDF file 
+ ***            rd -> reader for the input UM fields file
+ ***
+ *** Function returns 1 on success and 0 if a UM variable cannot be set up, a
+ *** slice cannot be written (the remaining slices are then skipped) or the
+ *** threads of the pipeline could not be started.
+ ***/
+
+int write_fields( um2nc_ctx *ctx, int ncid, um_reader *rd ) {
+
+     int            n, m, num, next, cnt, max_in, max_out, max_nx, status;
+     size_t         max_bytes;
+     var_output    *out;
+     slice_request *list;
+     slice_buffer   b;
+
+  /*** Set up the output state of every UM variable & size the work buffers ***/
+
+     out = (var_output *) malloc( ctx->num_stored_um_fields*sizeof(var_output) );
+     max_in    = 0;
+     max_out   = 0;
+     max_bytes = 0;
+     max_nx    = 0;
+     for ( n=0; n<ctx->num_stored_um_fields; n++ ) {
+         if ( setup_var_output( ctx, ncid, n, &out[n] )==0 ) {
+            free( out );
+            return 0;
+         }
+         if ( out[n].nx>max_nx ) { max_nx = out[n].nx; }
+         cnt = ctx->stored_um_vars[n].nx*ctx->stored_um_vars[n].ny;
+         if ( cnt>max_in ) { max_in = cnt; }
+         cnt = (int ) out[n].count[out[n].ndim-1];
+         if ( (out[n].vartype!=NC_FLOAT)&&(cnt>max_out) ) { max_out = cnt; }
+         cnt *= (int ) out[n].count[out[n].ndim-2];
+         if ( cnt*slice_element_size(out[n].vartype)>max_bytes ) { max_bytes = cnt*slice_element_size(out[n].vartype); }
+     }
+
+  /*** Read the 2D data slices in the order in which they are stored on disk ***/
+
+     num = build_slice_schedule( ctx, &list );
+
+     status = 1;
+     if ( ctx->strip_rows>0 ) {
+          memset( &b, 0, sizeof(slice_buffer) );
+          b.val = (float *) malloc( (size_t ) (ctx->strip_rows+STRIP_HALO)*max_nx*sizeof(float) );
+          b.out = malloc( (size_t ) ctx->strip_rows*max_nx*sizeof(double) );
+          if ( max_out>0 ) { b.fval = (float *) malloc( max_out*sizeof(float) ); }
+
+          next = 0;
+          for ( m=0; m<num; m++ ) {
+              prefetch_slices( rd, list, num, m, &next );
+              n = list[m].var_index;
+              if ( write_slice_strips( ctx, ncid, rd, &list[m], &out[n], &b, ctx->strip_rows )==0 ) {
+                 status = 0;
+                 break;
               }
-         } // End of NDIM if block 
+          }
 
-         free( count );
-         free( offset );
-             
-      /* Output actual min and max values of the UM variable */
-         j = nc_put_att_float( ncid, varid, "actual_range", NC_FLOAT, 2, actual ); 
+          free( b.val );
+          free( b.fval ); 
+          free( b.out ); 
+          free_wgdos_workspace( &b.ws );
+     }
+     else if ( ctx->pipeline_flag==1 ) { status = run_slice_pipeline( ctx, ncid, rd, list, num, out, max_in, max_out, max_bytes, ctx->num_decode_threads ); }
+     else {
+          memset( &b, 0, sizeof(slice_buffer) );
+          b.val = (float *) malloc( max_in*sizeof(float) );
+          b.out = malloc( max_bytes );
+          if ( max_out>0 ) { b.fval = (float *) malloc( max_out*sizeof(float) ); }
+
+          next = 0;
+          for ( m=0; m<num; m++ ) {
+              prefetch_slices( rd, list, num, m, &next );
+              n = list[m].var_index;
+
+              if ( read_data_slice( ctx, rd, &list[m], &out[n], &b )==0 ) { continue; }
+              prepare_slice( &out[n], &b );
+              if ( put_slice( ncid, &out[n], &list[m], &b )==0 ) {
+                 status = 0;
+                 break;
+              }
+          }
 
-     }  // End of FOR LOOP
-                      
-     free( buf );
-     free( fbuf ); 
+          free( b.val );
+          free( b.fval ); 
+          free( b.out ); 
+          free_wgdos_workspace( &b.ws );
+     }
 
-     return;
+  /* Output actual min and max values of each UM variable */
+     lock_netcdf();
+     for ( n=0; n<ctx->num_stored_um_fields; n++ )
+         m = nc_put_att_float( ncid, out[n].varid, "actual_range", NC_FLOAT, 2, out[n].actual ); 
+     unlock_netcdf();
+
+     free( list );
+     free( out );
+
+     return status;
 }
 
 
-int output_um_fields( int ncid, FILE *fid, int iflag, int rflag ) {
+/***
+ *** OUTPUT_UM_FIELDS
+ ***
+ *** Lists the UM variables to be written, writes all their 2D data slices
+ *** (see WRITE_FIELDS) and then the coefficients of the ETA arrays.
+ ***
+ ***  INPUT:   ctx -> conversion context of the input UM fields file
+ ***          ncid -> ID of the newly created NetCDF file 
+ ***            rd -> reader for the input UM fields file
+ ***
+ *** Function returns 1 on success and 0 otherwise.
+ ***/
+
+int output_um_fields( um2nc_ctx *ctx, int ncid, um_reader *rd ) {
 
      int    ierr, n, varid, flag; //, i,j,k;
      size_t dimlen;
@@ -236,18 +841,18 @@ int output_um_fields( int ncid, FILE *fid, int iflag, int rflag ) {
      printf( "----------------------------------------------------------------\n" );
 
      flag = 0;
-     for ( n=0; n<num_stored_um_fields; n++ ) {
-         printf( "     %5d %27s", stored_um_vars[n].stash_code, stored_um_vars[n].name );
-         if ( (iflag==1)&&((stored_um_vars[n].grid_type==11)||(stored_um_vars[n].grid_type==18)||(stored_um_vars[n].grid_type==19)) ) { 
+     for ( n=0; n<ctx->num_stored_um_fields; n++ ) {
+         printf( "     %5d %27s", ctx->stored_um_vars[n].stash_code, ctx->stored_um_vars[n].name );
+         if ( (ctx->iflag==1)&&((ctx->stored_um_vars[n].grid_type==11)||(ctx->stored_um_vars[n].grid_type==18)||(ctx->stored_um_vars[n].grid_type==19)) ) { 
             printf( "*" );
             flag = 1; 
          } else { printf( " " ); }
-         printf( "    [%4d x %4d", stored_um_vars[n].nx, stored_um_vars[n].ny ); 
-         if ( stored_um_vars[n].nz>1 ) { printf( " x %d", stored_um_vars[n].nz ); } 
+         printf( "    [%4d x %4d", ctx->stored_um_vars[n].nx, ctx->stored_um_vars[n].ny ); 
+         if ( ctx->stored_um_vars[n].nz>1 ) { printf( " x %d", ctx->stored_um_vars[n].nz ); } 
          printf( "]\n" );
      }
      printf( "----------------------------------------------------------------\n\n" );
-     if ( (flag==1) && (iflag==1) ) {
+     if ( (flag==1) && (ctx->iflag==1) ) {
         printf( "  * denotes that field is interpolated onto the P-points of \n" );
         printf( "    an Arakawa C grid.\n\n" );
      }
@@ -255,23 +860,25 @@ int output_um_fields( int ncid, FILE *fid, int iflag, int rflag ) {
   /*
    * Write the UM field to hard disk one 2D data slice at a time. 
    *-------------------------------------------------------------------*/
-     write_fields( ncid, fid, rflag, iflag ); 
+     if ( write_fields( ctx, ncid, rd )==0 ) { return 0; }
 
     /*** Output the coefficients for the ETA arrays ***/
 
-     dimlen = (size_t ) header[110];
+     dimlen = (size_t ) ctx->header[110];
 
+     lock_netcdf();
      buf = (float *) malloc( dimlen*sizeof(float) );
-     for ( n=0; n<dimlen; n++ ) { buf[n] = level_constants[0][n]; } 
+     for ( n=0; n<dimlen; n++ ) { buf[n] = ctx->level_constants[0][n]; } 
      ierr = nc_inq_varid( ncid, "eta_theta", &varid );   
      ierr = nc_put_var_float( ncid, varid, buf );
      free( buf ); 
 
      buf = (float *) malloc( (dimlen-1)*sizeof(float) );
-     for ( n=0; n<dimlen-1; n++ ) { buf[n] = level_constants[1][n]; } 
+     for ( n=0; n<dimlen-1; n++ ) { buf[n] = ctx->level_constants[1][n]; } 
      ierr = nc_inq_varid( ncid, "eta_rho", &varid );   
      ierr = nc_put_var_float( ncid, varid, buf );
      free( buf ); 
+     unlock_netcdf();
 
      return 1;
 }
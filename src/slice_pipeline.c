@@ -0,0 +1,342 @@
+/**============================================================================
+                 U M 2 N e t C D F  V e r s i o n 2 . 0
+                 --------------------------------------
+
+    Main author: Mark Cheeseman
+                 National Institute of Water & Atmospheric Research (Ltd)
+                 Wellington, New Zealand
+                 February 2014
+
+    UM2NetCDF is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    UM2NetCDF is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    A copy of the GNU General Public License can be found in the main UM2NetCDF
+    directory.  Alternatively, please see <http://www.gnu.org/licenses/>.
+ **============================================================================*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "field_def.h"
+
+#define BUFFERS_PER_WORKER 2   /* # of slice buffers in flight per decode worker */
+
+/** Function prototypes **/
+
+unsigned char *read_um_record( um_reader *rd, long offset, long nbytes, long *avail );
+void prefetch_slices( um_reader *rd, slice_request *list, int num, int current, int *next );
+int  decode_data_slice( um2nc_ctx *ctx, slice_request *req, unsigned char *rec, long avail, var_output *v, slice_buffer *b );
+void free_wgdos_workspace( wgdos_workspace *ws );
+void prepare_slice( var_output *v, slice_buffer *b );
+int  put_slice( int ncid, var_output *v, slice_request *req, slice_buffer *b );
+
+
+/**
+ ** slice_queue - bounded FIFO of slice buffers passed between two stages.
+ **               A NULL entry marks the end of the stream.
+ **/
+
+typedef struct slice_queue {
+        slice_buffer  **items;
+        int             size, head, count;
+        pthread_mutex_t lock;
+        pthread_cond_t  not_empty, not_full;
+} slice_queue;
+
+/**
+ ** pipeline_state - everything shared by the read, decode & write stages.
+ **/
+
+typedef struct pipeline_state {
+        um2nc_ctx      *ctx;        /* conversion context of the input UM fields file */
+        um_reader      *rd;
+        slice_request  *list;
+        int             num;
+        var_output     *out;
+        int             nworkers;   /* # of decode worker threads */
+        int             depth;      /* # of slice buffers in flight */
+        slice_queue     free_q;     /* empty buffers waiting to be filled by the reader */
+        slice_queue     decode_q;   /* raw records waiting to be decoded */
+        slice_buffer  **done;       /* decoded slices, indexed by schedule position modulo DEPTH */
+        pthread_mutex_t done_lock;
+        pthread_cond_t  done_cond;
+} pipeline_state;
+
+
+/***
+ *** INIT_SLICE_QUEUE / DESTROY_SLICE_QUEUE
+ ***
+ *** Set up & release the storage, lock and condition variables of a slice
+ *** queue able to hold SIZE entries.
+ ***/
+
+void init_slice_queue( slice_queue *q, int size ) {
+
+     q->items = (slice_buffer **) malloc( size*sizeof(slice_buffer *) );
+     q->size  = size;
+     q->head  = 0;
+     q->count = 0;
+     pthread_mutex_init( &q->lock, NULL );
+     pthread_cond_init( &q->not_empty, NULL );
+     pthread_cond_init( &q->not_full, NULL );
+
+     return;
+}
+
+
+void destroy_slice_queue( slice_queue *q ) {
+
+     free( q->items );
+     pthread_mutex_destroy( &q->lock );
+     pthread_cond_destroy( &q->not_empty );
+     pthread_cond_destroy( &q->not_full );
+
+     return;
+}
+
+
+/***
+ *** PUSH_SLICE / POP_SLICE
+ ***
+ *** Append a slice buffer to (or remove the oldest one from) a slice queue,
+ *** blocking while the queue is full (or empty).
+ ***/
+
+void push_slice( slice_queue *q, slice_buffer *b ) {
+
+     pthread_mutex_lock( &q->lock );
+     while ( q->count==q->size ) { pthread_cond_wait( &q->not_full, &q->lock ); }
+     q->items[(q->head+q->count)%q->size] = b;
+     q->count++;
+     pthread_cond_signal( &q->not_empty );
+     pthread_mutex_unlock( &q->lock );
+
+     return;
+}
+
+
+slice_buffer *pop_slice( slice_queue *q ) {
+
+     slice_buffer *b;
+
+     pthread_mutex_lock( &q->lock );
+     while ( q->count==0 ) { pthread_cond_wait( &q->not_empty, &q->lock ); }
+     b = q->items[q->head];
+     q->head = (q->head+1)%q->size;
+     q->count--;
+     pthread_cond_signal( &q->not_full );
+     pthread_mutex_unlock( &q->lock );
+
+     return b;
+}
+
+
+/***
+ *** READ_STAGE
+ ***
+ *** Thread copying the raw record of every scheduled slice out of the input
+ *** UM fields file into a free slice buffer.  Touching the records here means
+ *** that any page faults or disk reads are taken outside of the decoders.
+ ***/
+
+void *read_stage( void *arg ) {
+
+     int             m, next;
+     unsigned char  *rec;
+     slice_buffer   *b;
+     pipeline_state *p = (pipeline_state *) arg;
+
+     next = 0;
+     for ( m=0; m<p->num; m++ ) {
+         prefetch_slices( p->rd, p->list, p->num, m, &next );
+
+         b = pop_slice( &p->free_q );
+         b->index = m;
+         rec = read_um_record( p->rd, p->list[m].offset, p->list[m].nbytes, &b->avail );
+         if ( rec!=NULL ) { memcpy( b->rec, rec, b->avail ); }
+         else             { b->avail = 0; }
+
+         push_slice( &p->decode_q, b );
+     }
+
+  /** One end-of-stream marker per decode worker **/
+     for ( m=0; m<p->nworkers; m++ ) { push_slice( &p->decode_q, NULL ); }
+
+     return NULL;
+}
+
+
+/***
+ *** DECODE_STAGE
+ ***
+ *** Worker thread unpacking, interpolating and converting the raw records
+ *** handed over by the read stage.  All the work is done in the slice buffer
+ *** owned by the worker, so workers share no scratch space.  Finished slices
+ *** are posted in the slot of their schedule position for the writer.
+ ***/
+
+void *decode_stage( void *arg ) {
+
+     slice_buffer   *b;
+     slice_request  *req;
+     pipeline_state *p = (pipeline_state *) arg;
+
+     while ( (b = pop_slice(&p->decode_q))!=NULL ) {
+           req = &p->list[b->index];
+           if ( decode_data_slice( p->ctx, req, b->rec, b->avail, &p->out[req->var_index], b )==1 ) {
+              prepare_slice( &p->out[req->var_index], b );
+           }
+
+           pthread_mutex_lock( &p->done_lock );
+           p->done[b->index%p->depth] = b;
+           pthread_cond_broadcast( &p->done_cond );
+           pthread_mutex_unlock( &p->done_lock );
+     }
+
+     return NULL;
+}
+
+
+/***
+ *** RUN_SLICE_PIPELINE
+ ***
+ *** Converts the scheduled 2D data slices with reading, decoding and writing
+ *** overlapped.  A reader thread feeds a pool of NWORKERS decode threads while
+ *** the calling thread is the only one of them to call the (non thread-safe)
+ *** NetCDF library.  Slices are written in schedule order whatever the order in
+ *** which they were decoded, so the output does not depend on NWORKERS.
+ ***
+ *** The reader and the workers are joined by bounded queues over a fixed set
+ *** of BUFFERS_PER_WORKER*NWORKERS+1 preallocated slice buffers.  As at most
+ *** DEPTH slices are in flight, their schedule positions modulo DEPTH are
+ *** distinct and are used to hand decoded slices to the writer.
+ ***
+ ***  INPUT:  ctx      -> conversion context of the input UM fields file
+ ***         ncid     -> ID of the newly created NetCDF file 
+ ***         rd       -> reader for the input UM fields file
+ ***         list     -> slice requests in read order
+ ***         num      -> # of slice requests in LIST
+ ***         out      -> output state of every stored UM variable
+ ***         max_in   -> max # of points in a decoded 2D data slice
+ ***         max_out  -> max # of points in a row of an output 2D data slice
+ ***                     that is not written in single precision (0 if none)
+ ***        max_bytes -> max # of bytes taken up by an output 2D data slice
+ ***         nworkers -> # of decode worker threads
+ ***
+ *** Function returns 1 on success and 0 if a thread could not be created (no
+ *** slice is written then) or a slice could not be written.
+ ***/
+
+int run_slice_pipeline( um2nc_ctx *ctx, int ncid, um_reader *rd, slice_request *list, int num, var_output *out,
+                        int max_in, int max_out, size_t max_bytes, int nworkers ) {
+
+     int            i, m, ierr, nstarted, status, werr;
+     long           max_rec;
+     pthread_t      reader, *workers;
+     pipeline_state p;
+     slice_buffer  *bufs, *b;
+
+     if ( nworkers<1 ) { nworkers = 1; }
+
+     p.ctx      = ctx;
+     p.rd       = rd;
+     p.list     = list;
+     p.num      = num;
+     p.out      = out;
+     p.nworkers = nworkers;
+     p.depth    = BUFFERS_PER_WORKER*nworkers + 1;
+     init_slice_queue( &p.free_q, p.depth );
+     init_slice_queue( &p.decode_q, p.depth+nworkers );
+     p.done = (slice_buffer **) calloc( p.depth, sizeof(slice_buffer *) );
+     pthread_mutex_init( &p.done_lock, NULL );
+     pthread_cond_init( &p.done_cond, NULL );
+
+  /** Preallocate the slice buffers **/
+     max_rec = 0;
+     for ( i=0; i<num; i++ ) {
+         if ( list[i].nbytes>max_rec ) { max_rec = list[i].nbytes; }
+     }
+
+     bufs = (slice_buffer *) calloc( p.depth, sizeof(slice_buffer) );
+     for ( i=0; i<p.depth; i++ ) {
+         bufs[i].rec  = (unsigned char *) malloc( max_rec*sizeof(unsigned char) );
+         bufs[i].val  = (float *) malloc( max_in*sizeof(float) );
+         bufs[i].out  = malloc( max_bytes );
+         if ( max_out>0 ) { bufs[i].fval = (float *) malloc( max_out*sizeof(float) ); }
+         push_slice( &p.free_q, &bufs[i] );
+     }
+
+  /*
+   * Start the decode workers before the read stage, so that if a thread
+   * cannot be created, the workers already running can be stopped with
+   * end-of-stream markers without any slice in flight
+   *-------------------------------------------------------------------*/
+     status  = 0;
+     werr    = 0;
+     workers = (pthread_t *) malloc( nworkers*sizeof(pthread_t) );
+     for ( nstarted=0; nstarted<nworkers; nstarted++ ) {
+         ierr = pthread_create( &workers[nstarted], NULL, decode_stage, &p );
+         if ( ierr!=0 ) {
+            printf( "ERROR: could not create decode thread %d\n", nstarted );
+            goto stop_workers;
+         }
+     }
+
+     ierr = pthread_create( &reader, NULL, read_stage, &p );
+     if ( ierr!=0 ) {
+        printf( "ERROR: could not create the reader thread\n" );
+        goto stop_workers;
+     }
+
+  /** Write stage: write each decoded slice in schedule order & recycle its buffer.  **/
+  /** After a failed write the remaining slices are only drained, not written.      **/
+     for ( m=0; m<num; m++ ) {
+         pthread_mutex_lock( &p.done_lock );
+         while ( p.done[m%p.depth]==NULL ) { pthread_cond_wait( &p.done_cond, &p.done_lock ); }
+         b = p.done[m%p.depth];
+         p.done[m%p.depth] = NULL;
+         pthread_mutex_unlock( &p.done_lock );
+
+         if ( (b->decoded==1)&&(werr==0) ) {
+            if ( put_slice( ncid, &out[list[m].var_index], &list[m], b )==0 ) { werr = 1; }
+         }
+         push_slice( &p.free_q, b );
+     }
+
+     pthread_join( reader, NULL );
+     status = 1;
+
+  /** The reader has pushed one end-of-stream marker per worker on success **/
+stop_workers:
+     if ( status==0 ) {
+        for ( i=0; i<nstarted; i++ ) { push_slice( &p.decode_q, NULL ); }
+     }
+     for ( i=0; i<nstarted; i++ ) { pthread_join( workers[i], NULL ); }
+     free( workers );
+
+     for ( i=0; i<p.depth; i++ ) {
+         free( bufs[i].rec );
+         free( bufs[i].val );
+         free( bufs[i].fval );
+         free( bufs[i].out );
+         free_wgdos_workspace( &bufs[i].ws );
+     }
+     free( bufs );
+     free( p.done );
+     pthread_mutex_destroy( &p.done_lock );
+     pthread_cond_destroy( &p.done_cond );
+     destroy_slice_queue( &p.free_q );
+     destroy_slice_queue( &p.decode_q );
+
+     if ( werr==1 ) { status = 0; }
+     return status;
+}
@@ -0,0 +1,208 @@
+/**============================================================================
+                 U M 2 N e t C D F  V e r s i o n 2 . 0
+                 --------------------------------------
+
+    Main author: Mark Cheeseman
+                 National Institute of Water & Atmospheric Research (Ltd)
+                 Wellington, New Zealand
+                 February 2014
+
+    UM2NetCDF is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    UM2NetCDF is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    A copy of the GNU General Public License can be found in the main UM2NetCDF
+    directory.  Alternatively, please see <http://www.gnu.org/licenses/>.
+ **============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "field_def.h"
+
+#define READAHEAD_WINDOW 33554432   /* # of bytes hinted ahead of the current read position */
+#define READAHEAD_GAP    65536      /* records closer than this are hinted as one range */
+
+/** Function prototypes **/
+
+void advise_um_records( um_reader *rd, long offset, long nbytes );
+
+
+/***
+ *** SLICE_RECORD_BYTES
+ ***
+ *** Returns the # of bytes occupied by a 2D data slice's record in the input
+ *** UM fields file.  Unpacked slices hold exactly NX*NY words; the length of
+ *** a packed slice is taken from its lookup entry.
+ ***
+ ***  INPUT: ctx   -> conversion context of the input UM fields file
+ ***        s     -> index of the 2D data slice in the slice table
+ ***        cnt   -> # of points in the unpacked 2D data slice
+ ***/
+
+long slice_record_bytes( um2nc_ctx *ctx, long s, int cnt ) {
+
+     long nwords;
+
+     if ( ctx->stored_slices.lbpack[s]==1 ) {
+        nwords = ctx->stored_slices.size[s];
+        if ( ctx->stored_slices.reclength[s]>nwords ) { nwords = ctx->stored_slices.reclength[s]; }
+     } else {
+        nwords = (long ) cnt;
+     }
+
+     return nwords*ctx->wordsize;
+}
+
+
+/***
+ *** COMPARE_SLICE_OFFSETS
+ ***
+ *** qsort comparison function ordering slice requests by their position in
+ *** the input UM fields file.  Ties are broken on variable, time and level so
+ *** that the resulting order is deterministic.
+ ***/
+
+int compare_slice_offsets( const void *p1, const void *p2 ) {
+
+     const slice_request *a = (const slice_request *) p1;
+     const slice_request *b = (const slice_request *) p2;
+
+     if ( a->offset!=b->offset )       { return (a->offset<b->offset) ? -1 : 1; }
+     if ( a->var_index!=b->var_index ) { return a->var_index - b->var_index; }
+     if ( a->t!=b->t )                 { return a->t - b->t; }
+     return a->z - b->z;
+}
+
+
+/***
+ *** SEEK_DISTANCE
+ ***
+ *** Total # of bytes skipped over (forwards or backwards) when the records of
+ *** a list of slice requests are read in the given order.
+ ***/
+
+double seek_distance( slice_request *list, int num ) {
+
+     int    i;
+     long   pos;
+     double dist;
+
+     dist = 0.0;
+     pos  = 0;
+     for ( i=0; i<num; i++ ) {
+         if ( list[i].offset>pos ) { dist += (double ) (list[i].offset - pos); }
+         else                      { dist += (double ) (pos - list[i].offset); }
+         pos = list[i].offset + list[i].nbytes;
+     }
+
+     return dist;
+}
+
+
+/***
+ *** BUILD_SLICE_SCHEDULE
+ ***
+ *** Collects every 2D data slice of every stored UM variable and orders them
+ *** by ascending file offset, so that the input UM fields file is swept once
+ *** from start to end rather than once per variable.
+ ***
+ ***  INPUT:  ctx  -> conversion context of the input UM fields file
+ ***
+ ***  OUTPUT: list -> newly allocated array of slice requests in read order
+ ***
+ ***  Function returns the # of slice requests in LIST.
+ ***/
+
+int build_slice_schedule( um2nc_ctx *ctx, slice_request **list ) {
+
+     int  n, k, j, num, cnt;
+     long s;
+     double before, after;
+
+     num = 0;
+     for ( n=0; n<ctx->num_stored_um_fields; n++ )
+         num += ctx->stored_um_vars[n].nt*ctx->stored_um_vars[n].nz;
+
+     *list = (slice_request *) malloc( num*sizeof(slice_request) );
+
+  /** Gather the slices in variable->time->level order **/
+     num = 0;
+     for ( n=0; n<ctx->num_stored_um_fields; n++ ) {
+         cnt = ctx->stored_um_vars[n].nx*ctx->stored_um_vars[n].ny;
+         for ( k=0; k<ctx->stored_um_vars[n].nt; k++ ) {
+         for ( j=0; j<ctx->stored_um_vars[n].nz; j++ ) {
+             (*list)[num].var_index = n;
+             (*list)[num].t         = k;
+             (*list)[num].z         = j;
+             s = ctx->stored_um_vars[n].first_slice + (long ) k*ctx->stored_um_vars[n].nz + j;
+             (*list)[num].slice     = s;
+             (*list)[num].offset    = ctx->stored_slices.location[s]*ctx->wordsize;
+             (*list)[num].nbytes    = slice_record_bytes( ctx, s, cnt );
+             (*list)[num].npts      = cnt;
+             num++;
+         }
+         }
+     }
+
+  /** Re-order them by their position in the input UM fields file **/
+     before = seek_distance( *list, num );
+     qsort( *list, num, sizeof(slice_request), compare_slice_offsets );
+     after = seek_distance( *list, num );
+
+     if ( ctx->io_stats_flag==1 ) {
+        printf( "I/O Schedule\n" );
+        printf( "--------------------------------------------------------------\n" );
+        printf( "   Data slices           : %d\n", num );
+        printf( "   Seek distance (vars)  : %.1f MB\n", before/1048576.0 );
+        printf( "   Seek distance (file)  : %.1f MB\n", after/1048576.0 );
+        printf( "   Seek distance saved   : %.1f MB", (before-after)/1048576.0 );
+        if ( before>0.0 ) { printf( " (%.1f%%)", 100.0*(before-after)/before ); }
+        printf( "\n\n" );
+     }
+
+     return num;
+}
+
+
+/***
+ *** PREFETCH_SLICES
+ ***
+ *** Issues readahead hints for the records of the slice requests lying within
+ *** READAHEAD_WINDOW bytes of the current request.  Records that are nearly
+ *** contiguous are merged into a single hint.
+ ***
+ ***  INPUT: rd      -> reader for the input UM fields file
+ ***         list    -> slice requests in read order
+ ***         num     -> # of slice requests in LIST
+ ***         current -> index of the request about to be read
+ ***
+ ***  INPUT/OUTPUT: next -> index of the first request not yet hinted
+ ***/
+
+void prefetch_slices( um_reader *rd, slice_request *list, int num, int current, int *next ) {
+
+     long start, end, limit;
+
+     if ( *next<current ) { *next = current; }
+     limit = list[current].offset + READAHEAD_WINDOW;
+
+     while ( (*next<num)&&(list[*next].offset<limit) ) {
+           start = list[*next].offset;
+           end   = start + list[*next].nbytes;
+           (*next)++;
+           while ( (*next<num)&&(list[*next].offset<limit)&&(list[*next].offset<=end+READAHEAD_GAP) ) {
+                 if ( list[*next].offset+list[*next].nbytes>end ) { end = list[*next].offset + list[*next].nbytes; }
+                 (*next)++;
+           }
+           advise_um_records( rd, start, end-start );
+     }
+
+     return;
+}
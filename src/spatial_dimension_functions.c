@@ -26,10 +26,68 @@
 #include <string.h>
 #include "field_def.h"
 
-void construct_lon_array( int ny, float *lon );
-void construct_lat_array( int ny, float *lat );
-void construct_lon_bounds_array( int ny, float *lon );
-void construct_lat_bounds_array( int ny, float *lat );
+void construct_lon_array( um2nc_ctx *ctx, int first, int ny, float *lon );
+void construct_lat_array( um2nc_ctx *ctx, int first, int ny, float *lat );
+void construct_lon_bounds_array( um2nc_ctx *ctx, int first, int ny, float *lon );
+void construct_lat_bounds_array( um2nc_ctx *ctx, int first, int ny, float *lat );
+
+
+/***
+ *** PUT_COORDINATE_ROWS
+ ***
+ *** Constructs the values of a 2D lon/lat variable (or of a 3D lon/lat cell 
+ *** bounds variable) and writes them into the NetCDF file.  If a strip height
+ *** was given, the values are constructed & written in bands of STRIP_ROWS
+ *** rows, so that the memory used does not grow with the size of the grid.
+ ***
+ *** INPUT:  ctx       -> conversion context of the input UM fields file
+ ***         ncid      -> file ID for the new NetCDF file
+ ***         varID     -> ID of the lon/lat variable
+ ***         ny        -> # of rows of the variable
+ ***         nsides    -> 1 for a lon/lat variable, 4 for a cell bounds variable
+ ***         construct -> procedure constructing the values of a band of rows
+ ***
+ *** Function returns 1 on success and 0 if a band could not be written (the
+ *** remaining bands are then skipped).
+ ***/
+
+int put_coordinate_rows( um2nc_ctx *ctx, int ncid, int varID, int ny, int nsides, 
+                         void (*construct)( um2nc_ctx*, int, int, float* ) ) {
+
+     int    ierr, j, band;
+     size_t start[3], count[3];
+     float *buf;
+
+     band = ny;
+     if ( (ctx->strip_rows>0)&&(ctx->strip_rows<ny) ) { band = ctx->strip_rows; }
+
+     buf = (float *) malloc( (size_t ) nsides*band*ctx->int_constants[5]*sizeof(float) );
+
+     for ( j=0; j<ny; j+=band ) {
+         if ( j+band>ny ) { band = ny - j; }
+         construct( ctx, j, band, buf );
+
+         if ( nsides==1 ) {
+            start[0] = (size_t ) j;   count[0] = (size_t ) band;
+            start[1] = 0;             count[1] = (size_t ) ctx->int_constants[5];
+         } else {
+            start[0] = 0;             count[0] = (size_t ) nsides;
+            start[1] = (size_t ) j;   count[1] = (size_t ) band;
+            start[2] = 0;             count[2] = (size_t ) ctx->int_constants[5];
+         }
+         ierr = nc_put_vara_float( ncid, varID, start, count, buf );
+         if ( ierr!=NC_NOERR ) {
+            printf( "ERROR: could not write rows %d-%d of lon/lat variable %d: %s\n", j, j+band-1, varID,
+                    nc_strerror(ierr) );
+            free( buf );
+            return 0;
+         }
+     }
+
+     free( buf );
+     return 1;
+}
+
 
 /***
  *** SET_LON_LAT_DIMENSIONS
@@ -38,21 +96,24 @@ void construct_lat_bounds_array( int ny, float *lat );
  *** fields in the input UM fields file.  The dimensions are created
  *** in the new NetCDF file.
  ***
- *** INPUT:  ncid    -> file ID for the new NetCDF file
- ***         iflag   -> value of 1 indicates that interpolation is being used
- ***         rflag   -> value of 1 indicates that 32-bit output is to be used (64-bit otherwise) 
+ *** INPUT:  ctx     -> conversion context of the input UM fields file (ctx->iflag
+ ***                    is 1 if interpolation is being used)
+ ***         ncid    -> file ID for the new NetCDF file
+ ***
+ *** Function returns 1 on success and 0 if the values of a lon/lat variable
+ *** could not be written.
  ***
  ***    Mark Cheeseman, NIWA
  ***    December 19, 2013
  ***/
 
-void set_lon_lat_dimensions( int ncid, int iflag, int rflag ) {
+int set_lon_lat_dimensions( um2nc_ctx *ctx, int ncid ) {
 
      int     n, ierr, varID, dim_1d[1], i, dim_3d[3], 
              dim_2d[2], lon_bnd_dimid, lat_bnd_dimid;
      float   tmp, *buf;
-     char    latname[8], lat2name[12], lonname[13], lonbndname[23], coord_str[30],
-             latbndname[22];
+     char    latname[16], lat2name[20], lonname[21], lonbndname[30], coord_str[44],
+             latbndname[29];
 
   /*** Define dimensions for the lat/lon extents for cells on the coordinate grid ***/
 
@@ -61,11 +122,11 @@ void set_lon_lat_dimensions( int ncid, int iflag, int rflag ) {
 
   /*** Create a longitudinal dimension, Set each stored UM variable's lon dimension **/
 
-     ierr = nc_def_dim( ncid, "rlon", int_constants[5], &dim_1d[0] );
+     ierr = nc_def_dim( ncid, "rlon", ctx->int_constants[5], &dim_1d[0] );
      dim_2d[1] = dim_1d[0];
      dim_3d[2] = dim_1d[0];
-     for ( n=0; n<num_stored_um_fields; n++ )
-         stored_um_vars[n].x_dim = (unsigned short int ) dim_1d[0];
+     for ( n=0; n<ctx->num_stored_um_fields; n++ )
+         ctx->stored_um_vars[n].x_dim = (unsigned short int ) dim_1d[0];
 
   /*** Create & fill the 1D longitudinal NetCDF variable  **/
 
@@ -75,15 +136,15 @@ void set_lon_lat_dimensions( int ncid, int iflag, int rflag ) {
      ierr = nc_put_att_text( ncid, varID, "standard_name", 14, "grid_longitude" );
      ierr = nc_put_att_text( ncid, varID, "point_spacing",  4, "even" );
      ierr = nc_put_att_text( ncid, varID,     "long_name", 27, "longitude on a rotated grid" );
-     tmp = (float ) real_constants[4];
+     tmp = (float ) ctx->real_constants[4];
      ierr = nc_put_att_float( ncid, varID, "grid_north_pole_latitude",  NC_FLOAT, 1, &tmp );
-     tmp = (float ) real_constants[5];
+     tmp = (float ) ctx->real_constants[5];
      ierr = nc_put_att_float( ncid, varID, "grid_north_pole_longitude", NC_FLOAT, 1, &tmp );
 
-     buf = (float *) malloc( int_constants[5]*sizeof(float) );
-     buf[0] = (float ) real_constants[3];
-     tmp = (float ) real_constants[0];
-     for ( n=1; n<int_constants[5]; n++ ) { buf[n] = buf[n-1] + tmp; }
+     buf = (float *) malloc( ctx->int_constants[5]*sizeof(float) );
+     buf[0] = (float ) ctx->real_constants[3];
+     tmp = (float ) ctx->real_constants[0];
+     for ( n=1; n<ctx->int_constants[5]; n++ ) { buf[n] = buf[n-1] + tmp; }
 
      ierr = nc_enddef( ncid );
      ierr = nc_put_var( ncid, varID, buf );
@@ -92,28 +153,28 @@ void set_lon_lat_dimensions( int ncid, int iflag, int rflag ) {
 
   /*** Create a latitudinal dimension, Set each stored UM variable's lon dimension **/
    
-     if ( iflag==0 ) {
+     if ( ctx->iflag==0 ) {
     
-     for ( n=0; n<num_stored_um_fields; n++ ) {
-         sprintf( latname, "rlat%hu", stored_um_vars[n].ny );
+     for ( n=0; n<ctx->num_stored_um_fields; n++ ) {
+         sprintf( latname, "rlat%d", ctx->stored_um_vars[n].ny );
          ierr = nc_inq_dimid( ncid, latname, &dim_1d[0] );
          if ( ierr!=NC_NOERR ) { 
-            ierr = nc_def_dim( ncid, latname, (int )stored_um_vars[n].ny, &dim_1d[0] );
+            ierr = nc_def_dim( ncid, latname, (int )ctx->stored_um_vars[n].ny, &dim_1d[0] );
             ierr = nc_def_var( ncid, latname, NC_FLOAT, 1, dim_1d, &varID );
             ierr = nc_put_att_text( ncid, varID, "units", 7, "degrees" );
             ierr = nc_put_att_text( ncid, varID,  "axis",  1, "Y" );
             ierr = nc_put_att_text( ncid, varID, "standard_name", 13, "grid_latitude" );
             ierr = nc_put_att_text( ncid, varID, "long_name", 26, "latitude on a rotated grid" );
             ierr = nc_put_att_text( ncid, varID, "point_spacing", 4, "even" );
-            tmp = (float ) real_constants[4];
+            tmp = (float ) ctx->real_constants[4];
             ierr = nc_put_att_float( ncid, varID, "grid_north_pole_latitude",  NC_FLOAT, 1, &tmp );
-            tmp = (float ) real_constants[5];
+            tmp = (float ) ctx->real_constants[5];
             ierr = nc_put_att_float( ncid, varID, "grid_north_pole_longitude", NC_FLOAT, 1, &tmp );
          
-            buf = (float *) malloc( (int )stored_um_vars[n].ny*sizeof(float) );
-            buf[0] = (float ) real_constants[2];
-            tmp = (float ) real_constants[1];
-            for ( i=1; i<stored_um_vars[n].ny; i++ ) { buf[i] = buf[i-1] + tmp; }
+            buf = (float *) malloc( (int )ctx->stored_um_vars[n].ny*sizeof(float) );
+            buf[0] = (float ) ctx->real_constants[2];
+            tmp = (float ) ctx->real_constants[1];
+            for ( i=1; i<ctx->stored_um_vars[n].ny; i++ ) { buf[i] = buf[i-1] + tmp; }
 
             ierr = nc_enddef( ncid );
             ierr = nc_put_var( ncid, varID, buf );
@@ -121,61 +182,41 @@ void set_lon_lat_dimensions( int ncid, int iflag, int rflag ) {
             free( buf );
 
          dim_2d[0] = dim_1d[0];
-         sprintf( lonname, "longitude%hu", stored_um_vars[n].ny );
+         sprintf( lonname, "longitude%d", ctx->stored_um_vars[n].ny );
          ierr = nc_def_var( ncid, lonname, NC_FLOAT, 2, dim_2d, &varID );
          ierr = nc_put_att_text( ncid, varID, "standard_name", 9, "longitude" );
          ierr = nc_put_att_text( ncid, varID,     "long_name",18, "longitude on earth" );
          ierr = nc_put_att_text( ncid, varID,         "units",12, "degrees_east" );
          ierr = nc_put_att_text( ncid, varID,          "axis", 1, "X" );
-         sprintf( lonbndname, "longitude_cell_bnd%hu", stored_um_vars[n].ny );
-         if ( stored_um_vars[n].ny<100 ) { i=20; }
-         else if ( (stored_um_vars[n].ny>99)&&(stored_um_vars[n].ny<1000) ) { i=21; }
-         else if ( (stored_um_vars[n].ny>999)&&(stored_um_vars[n].ny<10000) ) { i=22; }
-         else { i=23; }
-         ierr = nc_put_att_text( ncid, varID, "bounds", i, lonbndname );
-         sprintf( coord_str, "latitude%hu longitude%hu", stored_um_vars[n].ny, stored_um_vars[n].ny );
-         if ( stored_um_vars[n].ny<100 ) { i=22; }
-         else if ( (stored_um_vars[n].ny>99)&&(stored_um_vars[n].ny<1000) ) { i=24; }
-         else if ( (stored_um_vars[n].ny>999)&&(stored_um_vars[n].ny<10000) ) { i=26; }
-         else { i=28; }
-         ierr = nc_put_att_text( ncid, varID, "coordinates", i, coord_str );
-
-         i = (int ) stored_um_vars[n].ny;
-         buf = (float *) malloc( i*int_constants[5]*sizeof(float) );
-         construct_lon_array( i, buf );
+         sprintf( lonbndname, "longitude_cell_bnd%d", ctx->stored_um_vars[n].ny );
+         ierr = nc_put_att_text( ncid, varID, "bounds", strlen(lonbndname), lonbndname );
+         sprintf( coord_str, "latitude%d longitude%d", ctx->stored_um_vars[n].ny, ctx->stored_um_vars[n].ny );
+         ierr = nc_put_att_text( ncid, varID, "coordinates", strlen(coord_str), coord_str );
+
+         i = (int ) ctx->stored_um_vars[n].ny;
          ierr = nc_enddef( ncid );
-         ierr = nc_put_var( ncid, varID, buf );
+         if ( put_coordinate_rows( ctx, ncid, varID, i, 1, &construct_lon_array )==0 ) { return 0; }
          ierr = nc_redef( ncid );
  
-         sprintf( lat2name, "latitude%hu", stored_um_vars[n].ny );
+         sprintf( lat2name, "latitude%d", ctx->stored_um_vars[n].ny );
          ierr = nc_def_var( ncid, lat2name, NC_FLOAT, 2, dim_2d, &varID );
          ierr = nc_put_att_text(  ncid, varID, "standard_name", 8, "latitude" );
          ierr = nc_put_att_text(  ncid, varID,     "long_name",17, "latitude on earth" );
          ierr = nc_put_att_text(  ncid, varID,         "units",13, "degrees_north" );
          ierr = nc_put_att_text(  ncid, varID,          "axis", 1, "Y" );
-         sprintf( latbndname, "latitude_cell_bnd%hu", stored_um_vars[n].ny );
-         if ( stored_um_vars[n].ny<100 ) { i=19; }
-         else if ( (stored_um_vars[n].ny>99)&&(stored_um_vars[n].ny<1000) ) { i=20; }
-         else if ( (stored_um_vars[n].ny>999)&&(stored_um_vars[n].ny<10000) ) { i=21; }
-         else { i=22; }
-         ierr = nc_put_att_text( ncid, varID, "bounds", i, latbndname );
-         sprintf( coord_str, "latitude%hu longitude%hu", stored_um_vars[n].ny, stored_um_vars[n].ny );
-         if ( stored_um_vars[n].ny<100 ) { i=22; }
-         else if ( (stored_um_vars[n].ny>99)&&(stored_um_vars[n].ny<1000) ) { i=24; }
-         else if ( (stored_um_vars[n].ny>999)&&(stored_um_vars[n].ny<10000) ) { i=26; }
-         else { i=28; }
-         ierr = nc_put_att_text( ncid, varID, "coordinates", i, coord_str );
+         sprintf( latbndname, "latitude_cell_bnd%d", ctx->stored_um_vars[n].ny );
+         ierr = nc_put_att_text( ncid, varID, "bounds", strlen(latbndname), latbndname );
+         sprintf( coord_str, "latitude%d longitude%d", ctx->stored_um_vars[n].ny, ctx->stored_um_vars[n].ny );
+         ierr = nc_put_att_text( ncid, varID, "coordinates", strlen(coord_str), coord_str );
          tmp = 90.0;
          ierr = nc_put_att_float( ncid, varID, "valid_max", NC_FLOAT, 1, &tmp );
          tmp = -90.0;
          ierr = nc_put_att_float( ncid, varID, "valid_min", NC_FLOAT, 1, &tmp );
 
-         i = (int ) stored_um_vars[n].ny;
-         construct_lat_array( i, buf );
+         i = (int ) ctx->stored_um_vars[n].ny;
          ierr = nc_enddef( ncid );
-         ierr = nc_put_var( ncid, varID, buf );
+         if ( put_coordinate_rows( ctx, ncid, varID, i, 1, &construct_lat_array )==0 ) { return 0; }
          ierr = nc_redef( ncid ); 
-         free( buf );
         
          dim_3d[0] = lon_bnd_dimid;
          dim_3d[1] = dim_1d[0];
@@ -183,11 +224,9 @@ void set_lon_lat_dimensions( int ncid, int iflag, int rflag ) {
          ierr = nc_put_att_text( ncid, varID, "long_name", 33, "longitude of cell bounds on earth" );
          ierr = nc_put_att_text(  ncid, varID,    "units", 12, "degrees_east" );
 
-         i = (int ) stored_um_vars[n].ny;
-         buf = (float *) malloc( 4*i*int_constants[5]*sizeof(float) );
-         construct_lon_bounds_array( i, buf );
+         i = (int ) ctx->stored_um_vars[n].ny;
          ierr = nc_enddef( ncid );
-         ierr = nc_put_var( ncid, varID, buf );
+         if ( put_coordinate_rows( ctx, ncid, varID, i, 4, &construct_lon_bounds_array )==0 ) { return 0; }
          ierr = nc_redef( ncid );
  
          dim_3d[0] = lat_bnd_dimid;
@@ -195,41 +234,39 @@ void set_lon_lat_dimensions( int ncid, int iflag, int rflag ) {
          ierr = nc_put_att_text( ncid, varID,"long_name", 32, "latitude of cell bounds on earth" );
          ierr = nc_put_att_text( ncid, varID,    "units", 13, "degrees_north" );
 
-         construct_lat_bounds_array( i, buf );
          ierr = nc_enddef( ncid );
-         ierr = nc_put_var( ncid, varID, buf );
+         if ( put_coordinate_rows( ctx, ncid, varID, i, 4, &construct_lat_bounds_array )==0 ) { return 0; }
          ierr = nc_redef( ncid );
-         free( buf );
          }
-         stored_um_vars[n].y_dim = (unsigned short int ) dim_1d[0]; 
+         ctx->stored_um_vars[n].y_dim = (unsigned short int ) dim_1d[0]; 
      }
 
      } else {
 
-       ierr = nc_def_dim( ncid, "rlat", (int ) int_constants[6], &dim_1d[0] );
+       ierr = nc_def_dim( ncid, "rlat", (int ) ctx->int_constants[6], &dim_1d[0] );
        ierr = nc_def_var( ncid, "rlat", NC_FLOAT, 1, dim_1d, &varID );
        ierr = nc_put_att_text( ncid, varID, "units", 7, "degrees" );
        ierr = nc_put_att_text( ncid, varID,  "axis",  1, "Y" );
        ierr = nc_put_att_text( ncid, varID, "standard_name", 13, "grid_latitude" );
        ierr = nc_put_att_text( ncid, varID, "long_name", 26, "latitude on a rotated grid" );
        ierr = nc_put_att_text( ncid, varID, "point_spacing", 4, "even" );
-       tmp = (float ) real_constants[4];
+       tmp = (float ) ctx->real_constants[4];
        ierr = nc_put_att_float( ncid, varID, "grid_north_pole_latitude",  NC_FLOAT, 1, &tmp );
-       tmp = (float ) real_constants[5];
+       tmp = (float ) ctx->real_constants[5];
        ierr = nc_put_att_float( ncid, varID, "grid_north_pole_longitude", NC_FLOAT, 1, &tmp );
          
-       buf = (float *) malloc( (int )int_constants[6]*sizeof(float) );
-       buf[0] = (float ) real_constants[2];
-       tmp = (float ) real_constants[1];
-       for ( i=1; i<int_constants[6]; i++ ) { buf[i] = buf[i-1] + tmp; }
+       buf = (float *) malloc( (int )ctx->int_constants[6]*sizeof(float) );
+       buf[0] = (float ) ctx->real_constants[2];
+       tmp = (float ) ctx->real_constants[1];
+       for ( i=1; i<ctx->int_constants[6]; i++ ) { buf[i] = buf[i-1] + tmp; }
 
        ierr = nc_enddef( ncid );
        ierr = nc_put_var( ncid, varID, buf );
        ierr = nc_redef( ncid );
        free( buf );
 
-       for ( n=0; n<num_stored_um_fields; n++ )
-           stored_um_vars[n].y_dim = (unsigned short int ) dim_1d[0]; 
+       for ( n=0; n<ctx->num_stored_um_fields; n++ )
+           ctx->stored_um_vars[n].y_dim = (unsigned short int ) dim_1d[0]; 
 
        dim_2d[0] = dim_1d[0];
        ierr = nc_def_var( ncid, "longitude", NC_FLOAT, 2, dim_2d, &varID );
@@ -240,11 +277,9 @@ void set_lon_lat_dimensions( int ncid, int iflag, int rflag ) {
        ierr = nc_put_att_text( ncid, varID, "bounds", 18, "longitude_cell_bnd" );
        ierr = nc_put_att_text( ncid, varID, "coordinates", 18, "latitude longitude" );
 
-       i = (int ) int_constants[6];
-       buf = (float *) malloc( i*int_constants[5]*sizeof(float) );
-       construct_lon_array( i, buf );
+       i = (int ) ctx->int_constants[6];
        ierr = nc_enddef( ncid );
-       ierr = nc_put_var( ncid, varID, buf );
+       if ( put_coordinate_rows( ctx, ncid, varID, i, 1, &construct_lon_array )==0 ) { return 0; }
        ierr = nc_redef( ncid );
 
        ierr = nc_def_var( ncid, "latitude", NC_FLOAT, 2, dim_2d, &varID );
@@ -259,11 +294,9 @@ void set_lon_lat_dimensions( int ncid, int iflag, int rflag ) {
        tmp = -90.0;
        ierr = nc_put_att_float( ncid, varID, "valid_min", NC_FLOAT, 1, &tmp );
 
-       construct_lat_array( i, buf );
        ierr = nc_enddef( ncid );
-       ierr = nc_put_var( ncid, varID, buf );
+       if ( put_coordinate_rows( ctx, ncid, varID, i, 1, &construct_lat_array )==0 ) { return 0; }
        ierr = nc_redef( ncid );
-       free( buf );
 
        dim_3d[0] = lon_bnd_dimid;
        dim_3d[1] = dim_1d[0];
@@ -271,10 +304,8 @@ void set_lon_lat_dimensions( int ncid, int iflag, int rflag ) {
        ierr = nc_put_att_text( ncid, varID, "long_name", 33, "longitude of cell bounds on earth" );
        ierr = nc_put_att_text(  ncid, varID,    "units", 12, "degrees_east" );
 
-       buf = (float *) malloc( 4*i*int_constants[5]*sizeof(float) );
-       construct_lon_bounds_array( i, buf );
        ierr = nc_enddef( ncid );
-       ierr = nc_put_var( ncid, varID, buf );
+       if ( put_coordinate_rows( ctx, ncid, varID, i, 4, &construct_lon_bounds_array )==0 ) { return 0; }
        ierr = nc_redef( ncid );
 
        dim_3d[0] = lat_bnd_dimid;
@@ -282,21 +313,19 @@ void set_lon_lat_dimensions( int ncid, int iflag, int rflag ) {
        ierr = nc_put_att_text( ncid, varID,"long_name", 32, "latitude of cell bounds on earth" );
        ierr = nc_put_att_text( ncid, varID,    "units", 13, "degrees_north" );
 
-       construct_lat_bounds_array( i, buf );
        ierr = nc_enddef( ncid );
-       ierr = nc_put_var( ncid, varID, buf );
+       if ( put_coordinate_rows( ctx, ncid, varID, i, 4, &construct_lat_bounds_array )==0 ) { return 0; }
        ierr = nc_redef( ncid );
-       free( buf );
      }
 
   /*** If a rotated lon/lat grid is being used, create a rotated pole NetCDF variable ***/
 
-     if ( header[3]>99 ) {
+     if ( ctx->header[3]>99 ) {
         ierr = nc_def_var( ncid, "rotated_pole", NC_CHAR, 1, dim_1d, &varID );
         ierr = nc_put_att_text( ncid, varID, "grid_mapping_name", 26, "rotated_latitude_longitude" );
-        tmp = (float ) real_constants[4];
+        tmp = (float ) ctx->real_constants[4];
         ierr = nc_put_att_float( ncid, varID, "grid_north_pole_latitude",  NC_FLOAT, 1, &tmp );
-        tmp = (float ) real_constants[5];
+        tmp = (float ) ctx->real_constants[5];
         ierr = nc_put_att_float( ncid, varID, "grid_north_pole_longitude", NC_FLOAT, 1, &tmp );
      }
      
@@ -305,13 +334,13 @@ void set_lon_lat_dimensions( int ncid, int iflag, int rflag ) {
   ==========================================================================================*
      ierr = nc_enddef( ncid );
      for ( n=0; n<num_stored_um_fields; n++ )
-         printf( "%hu %hu %hu\n", stored_um_vars[n].stash_code, stored_um_vars[n].x_dim,
+         printf( "%d %hu %hu\n", stored_um_vars[n].stash_code, stored_um_vars[n].x_dim,
                                   stored_um_vars[n].y_dim );
      exit(1);
  *==========================================================================================
    END OF SANITY CHECK
   ==========================================================================================*/
 
-     return;
+     return 1;
 }
 
@@ -21,220 +21,258 @@
     directory.  Alternatively, please see <http://www.gnu.org/licenses/>.
  **============================================================================*/
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <libxml/xmlmemory.h>
 #include <libxml/parser.h>
+#include <libxml/xmlreader.h>
 #include "field_def.h"
 
+/** Function prototypes **/
+
+int has_stash_code( stash_set *set, int code );
+void build_stash_index( const long *codes, int n, stash_index *si );
+int find_stash( stash_index *si, long code );
+void free_stash_index( stash_index *si );
+void free_stash_table( um2nc_ctx *ctx );
+
+#define STASH_CACHE_MAGIC   "UMSTASH"   /* identifies a compiled stash file */
+#define STASH_CACHE_VERSION 1           /* bumped whenever the layout of the compiled stash file changes */
+
+/**
+ ** stash_cache_header - Header of a compiled stash file.  It is followed by
+ **                      NUM um_field_metadata records sorted by (model, 
+ **                      section, item), so the records can be mapped straight
+ **                      into memory.
+ **/
+
+typedef struct stash_cache_header {
+        char     magic[8];     /* STASH_CACHE_MAGIC */
+        uint32_t version;      /* STASH_CACHE_VERSION */
+        uint32_t byte_order;   /* 0x01020304 written in the byte order of the compiling machine */
+        uint32_t record_size;  /* sizeof(um_field_metadata) */
+        uint32_t num;          /* # of variable definitions */
+        int64_t  xml_mtime;    /* modification time of the XML stash file */
+        int64_t  xml_size;     /* size (in bytes) of the XML stash file */
+        uint64_t xml_hash;     /* FNV-1a hash of the contents of the XML stash file */
+        char     pad[16];      /* pads the header to 64 bytes */
+} stash_cache_header;
+
+/**
+ ** stash_order - Position of a variable definition in the XML stash file,
+ **               sorted together with its (model, section, item).
+ **/
+
+typedef struct stash_order {
+        int model;
+        int section;
+        int code;
+        int pos;
+} stash_order;
+
+/***
+ *** COPY_TEXT
+ ***
+ *** Copies the text of an XML element into a fixed-length string field of a
+ *** variable definition (truncating it if it does not fit).
+ ***/
+
+void copy_text( char *dst, size_t size, const xmlChar *str ) {
+
+     memset( dst, '\0', size );
+     if ( str!=NULL ) { strncpy( dst, (const char *) str, size-1 ); }
+
+     return;
+}
+
+
 /***
- *** PARSE_ITEM 
+ *** PARSE_ITEM_FIELD 
  ***
- *** Subroutine that reads all the metadata characteristics of a variable 
- *** defined in the user-specified stash file.  
+ *** Subroutine that stores one metadata characteristic (the text STR of the
+ *** child element NAME of an <item>) of a variable defined in the 
+ *** user-specified stash file.
  ***
  ***   Mark Cheeseman, NIWA
  ***   November 29, 2013
  ***/
 
-void parse_item( xmlDocPtr doc, xmlNodePtr cur, um_field_metadata *fd, int cnt ) {
-
-     xmlChar *str;
-     cur = cur->xmlChildrenNode;
-     while ( cur!=NULL ) {
-          if ((!xmlStrcmp(cur->name, (const xmlChar *)"stash_code"))) {
-             str = xmlNodeListGetString(doc, cur->xmlChildrenNode, 1);
-             fd[cnt].code = atoi((const char *) str);
-             xmlFree( str );
-             str=NULL;
-          } else if ((!xmlStrcmp(cur->name, (const xmlChar *)"varname"))) {
-             str = xmlNodeListGetString(doc, cur->xmlChildrenNode, 1);
-             if ( str!=NULL ) {
-                memset( fd[cnt].varname, '\0', sizeof(fd[cnt].varname) );
-                strcpy( fd[cnt].varname,(const char *)str );
-             }
-             xmlFree( str );
-             str=NULL;
-          } else if ((!xmlStrcmp(cur->name, (const xmlChar *)"longname"))) {
-             str = xmlNodeListGetString(doc, cur->xmlChildrenNode, 1);
-             if ( str!=NULL ) { 
-                memset( fd[cnt].longname, '\0', sizeof(fd[cnt].longname) );
-                strcpy( fd[cnt].longname,(const char *)str ); 
-             }
-             xmlFree( str );
-             str=NULL;
-          } else if ((!xmlStrcmp(cur->name, (const xmlChar *)"standardname"))) {
-             str = xmlNodeListGetString(doc, cur->xmlChildrenNode, 1);
-             if ( str!=NULL ) { 
-                memset( fd[cnt].stdname, '\0', sizeof(fd[cnt].stdname) );
-                strcpy( fd[cnt].stdname,(const char *)str ); 
-             }
-             xmlFree( str );
-             str=NULL;
-          } else if ((!xmlStrcmp(cur->name, (const xmlChar *)"units"))) {
-             str = xmlNodeListGetString(doc, cur->xmlChildrenNode, 1);
-             if ( str!=NULL ) { 
-                memset( fd[cnt].units, '\0', sizeof(fd[cnt].units) );
-                strcpy( fd[cnt].units,(const char *)str ); 
-             }
-             xmlFree( str );
-             str=NULL;
-          } else if ((!xmlStrcmp(cur->name, (const xmlChar *)"validmax"))) {
-             str = xmlNodeListGetString(doc, cur->xmlChildrenNode, 1);
-             if ( str!=NULL ) { fd[cnt].validmax = atof((const char *)str); }
-             xmlFree( str );
-             str=NULL;
-          } else if ((!xmlStrcmp(cur->name, (const xmlChar *)"validmin"))) {
-             str = xmlNodeListGetString(doc, cur->xmlChildrenNode, 1);
-             if ( str!=NULL ) { fd[cnt].validmin = atof((const char *)str); }
-             xmlFree( str );
-             str=NULL;
-          } else if ((!xmlStrcmp(cur->name, (const xmlChar *)"scalefact"))) {
-             str = xmlNodeListGetString(doc, cur->xmlChildrenNode, 1);
-             if ( str!=NULL ) { fd[cnt].scale = atof((const char *)str); }
-             else             { fd[cnt].scale = 1.0; }
-             xmlFree( str );
-             str=NULL;
-          } else if ((!xmlStrcmp(cur->name, (const xmlChar *)"umgrid"))) {
-             str = xmlNodeListGetString(doc, cur->xmlChildrenNode, 1);
-             fd[cnt].umgrid = atoi((const char *) str);
-             xmlFree( str );
-             str=NULL;
-          } else if ((!xmlStrcmp(cur->name, (const xmlChar *)"accum_field"))) {
-             str = xmlNodeListGetString(doc, cur->xmlChildrenNode, 1);
-             fd[cnt].accum = atoi((const char *) str);
-             xmlFree( str );
-             str=NULL;
-          } else if ((!xmlStrcmp(cur->name, (const xmlChar *)"level_type"))) {
-             str = xmlNodeListGetString(doc, cur->xmlChildrenNode, 1);
-             if ( str!=NULL ) { fd[cnt].level_type = atoi((const char *) str); } 
-             else             { fd[cnt].level_type = 2; } 
-             xmlFree( str );
-             str=NULL;
-          }
-          cur = cur->next;
+void parse_item_field( const xmlChar *name, const xmlChar *str, um_field_metadata *fd ) {
+
+     if ((!xmlStrcmp(name, (const xmlChar *)"stash_code"))) {
+        if ( str!=NULL ) { fd->code = atoi((const char *) str); }
+     } else if ((!xmlStrcmp(name, (const xmlChar *)"varname"))) {
+        copy_text( fd->varname, sizeof(fd->varname), str );
+     } else if ((!xmlStrcmp(name, (const xmlChar *)"longname"))) {
+        copy_text( fd->longname, sizeof(fd->longname), str );
+     } else if ((!xmlStrcmp(name, (const xmlChar *)"standardname"))) {
+        copy_text( fd->stdname, sizeof(fd->stdname), str );
+     } else if ((!xmlStrcmp(name, (const xmlChar *)"units"))) {
+        copy_text( fd->units, sizeof(fd->units), str );
+     } else if ((!xmlStrcmp(name, (const xmlChar *)"validmax"))) {
+        if ( str!=NULL ) { fd->validmax = atof((const char *)str); }
+     } else if ((!xmlStrcmp(name, (const xmlChar *)"validmin"))) {
+        if ( str!=NULL ) { fd->validmin = atof((const char *)str); }
+     } else if ((!xmlStrcmp(name, (const xmlChar *)"scalefact"))) {
+        if ( str!=NULL ) { fd->scale = atof((const char *)str); }
+        else             { fd->scale = 1.0; }
+     } else if ((!xmlStrcmp(name, (const xmlChar *)"umgrid"))) {
+        if ( str!=NULL ) { fd->umgrid = atoi((const char *) str); }
+     } else if ((!xmlStrcmp(name, (const xmlChar *)"accum_field"))) {
+        if ( str!=NULL ) { fd->accum = atoi((const char *) str); }
+     } else if ((!xmlStrcmp(name, (const xmlChar *)"level_type"))) {
+        if ( str!=NULL ) { fd->level_type = atoi((const char *) str); } 
+        else             { fd->level_type = 2; } 
      }
-     return;
 
+     return;
 }
 
+
 /***
- *** READ_STASH_FILE 
+ *** STORE_ITEM
  ***
- *** Subroutine that opens the user-specified XML stash file and reads 
- *** in the metadata associated with each variable defined in the file. 
+ *** Appends a completely read variable definition to UM_VARS (growing it as
+ *** needed) after applying defaults to non-sensical values, unless its STASH
+ *** code is not wanted.
  ***
- ***   Mark Cheeseman, NIWA
- ***   November 29, 2013
+ ***  INPUT:  ctx  -> conversion context receiving the definition
+ ***          fd   -> the variable definition
+ ***          keep -> STASH codes whose definitions are wanted (NULL for all)
+ ***          size -> # of definitions UM_VARS currently has room for
  ***/
 
-int read_stash_file( char *filename ) {
+void store_item( um2nc_ctx *ctx, um_field_metadata *fd, stash_set *keep, int *size ) {
 
-     int cnt, model_num, section_num;
-     xmlDocPtr doc;
-     xmlNodePtr model, section, item;
-     xmlChar *id;
+     if ( (keep!=NULL)&&(has_stash_code( keep, 1000*fd->section + fd->code )==0) ) { return; }
 
-/**
- ** Open the XML file and verify its layout
- **---------------------------------------------------------------------------*/
-     doc = xmlParseFile( filename );
-     if ( doc==NULL ) { return 0; }
-     else {
-          model = xmlDocGetRootElement(doc);
-          if (model == NULL) { return 0; }
-          else { 
-              if (xmlStrcmp(model->name, (const xmlChar *) "stash2cf")) { return 0; } 
-          }
-     }           
+     if ( (fd->level_type!=1)&&(fd->level_type!=2) ) { fd->level_type = 2; }
+     if ( (fd->scale<0.00000001)||(fd->scale>1000000.0) ) { fd->scale = 1.0; }
 
-/**
- ** Determine number of variables defined in XML file (num_xml_vars) 
- **---------------------------------------------------------------------------*/
-     model = model->xmlChildrenNode;
-     num_xml_vars = 0;
-     while ( model!= NULL ) {
-           if ((!xmlStrcmp(model->name, (const xmlChar *)"model"))) {
-              section = model->xmlChildrenNode;
-              while ( section!= NULL ) {
-                    if ((!xmlStrcmp(section->name, (const xmlChar *)"section"))) {
-                       item = section->xmlChildrenNode;
-                       while ( item!= NULL ) {
-                             if ((!xmlStrcmp(item->name, (const xmlChar *)"item"))) { num_xml_vars++; }
-                             item = item->next;
-                       }
-                    }
-                     section = section->next;
-              }
-           }
-           model = model->next;
+     if ( ctx->num_xml_vars==*size ) {
+        *size = ( *size==0 ) ? 256 : 2*(*size);
+        ctx->um_vars = (um_field_metadata *) realloc( ctx->um_vars, (*size)*sizeof(um_field_metadata) );
      }
-     xmlFreeDoc( doc );
+     ctx->um_vars[ctx->num_xml_vars] = *fd;
+     ctx->num_xml_vars++;
 
-/**
- ** Reopen XML file 
- **---------------------------------------------------------------------------*/
-     doc = xmlParseFile( filename );
-     model = xmlDocGetRootElement(doc);
+     return;
+}
 
-/**
- ** Allocate memory to hold metadata for each defined variable  
- **---------------------------------------------------------------------------*/
-     um_vars = (um_field_metadata *)malloc( num_xml_vars*sizeof(um_field_metadata) );
 
-/**
- ** Loop over the different models
- **---------------------------------------------------------------------------*/
-     cnt = 0;
-     model = xmlDocGetRootElement(doc);
-     model = model->xmlChildrenNode;
-     while ( model!= NULL ) {
-           if ((!xmlStrcmp(model->name, (const xmlChar *)"model"))) {
-              id = xmlGetProp( model, (const xmlChar *)"model_id" );
-              model_num = atoi((const char *)id);
-              xmlFree( id );
+/***
+ *** PARSE_STASH_FILE 
+ ***
+ *** Subroutine that streams through the user-specified XML stash file in a
+ *** single pass and reads in the metadata associated with each variable 
+ *** defined in it.  Only the definitions of the wanted STASH codes are kept,
+ *** so the rest of the (large) file costs no memory.
+ ***
+ ***  INPUT:  ctx      -> conversion context receiving the definitions
+ ***          filename -> name of the XML stash file
+ ***          keep     -> STASH codes whose definitions are wanted (NULL for all)
+ ***
+ ***   Mark Cheeseman, NIWA
+ ***   November 29, 2013
+ ***/
+
+int parse_stash_file( um2nc_ctx *ctx, const char *filename, stash_set *keep ) {
+
+     int size, status, depth, model_num, section_num, in_model, in_section, in_item;
+     xmlTextReaderPtr reader;
+     const xmlChar *name;
+     xmlChar *str;
+     um_field_metadata item;
 
 /**
- ** Now loop over the sections within that model's domain
+ ** Open the XML file 
  **---------------------------------------------------------------------------*/
-              section = model->xmlChildrenNode;
-              while ( section!= NULL ) {
-                    if ((!xmlStrcmp(section->name, (const xmlChar *)"section"))) {
-                       id = xmlGetProp( section, (const xmlChar *)"section_id" );
-                       section_num = atoi((const char *)id);
-                       xmlFree( id );
+     reader = xmlReaderForFile( filename, NULL, 0 );
+     if ( reader==NULL ) { return 0; }
+
+     ctx->um_vars      = NULL;
+     ctx->num_xml_vars = 0;
+     size         = 0;
+     model_num    = 0;
+     section_num  = 0;
+     in_model     = 0;
+     in_section   = 0;
+     in_item      = 0;
 
 /**
- ** Now loop over the individual items within each section
+ ** Walk through the elements of the file.  Models are found at depth 1, their
+ ** sections at depth 2, the items of each section at depth 3 and the metadata
+ ** of each item at depth 4.  An item is stored once its end tag is reached.
  **---------------------------------------------------------------------------*/
-                       item = section->xmlChildrenNode;
-                       while ( item!= NULL ) {
-                             if ((!xmlStrcmp(item->name, (const xmlChar *)"item"))) {
-                                um_vars[cnt].model = model_num;
-                                um_vars[cnt].section = section_num;
-                                parse_item( doc, item, um_vars, cnt );
-                                cnt++;
-                             }
-                             item = item->next;
-                       } 
-
-                    }
-                    section = section->next;
-              } 
+     while ( (status = xmlTextReaderRead( reader ))==1 ) {
+
+           depth = xmlTextReaderDepth( reader );
+           name  = xmlTextReaderConstName( reader );
+
+           if ( xmlTextReaderNodeType( reader )==XML_READER_TYPE_END_ELEMENT ) {
+              if ( (depth==3)&&(in_item==1) ) { 
+                 store_item( ctx, &item, keep, &size ); 
+                 in_item = 0;
+              }
+              continue;
+           }
+           if ( xmlTextReaderNodeType( reader )!=XML_READER_TYPE_ELEMENT ) { continue; }
+
+           switch ( depth ) {
+                  case 0: 
+                       if (xmlStrcmp(name, (const xmlChar *) "stash2cf")) { status = -1; }
+                       break;
+                  case 1:
+                       in_model = (!xmlStrcmp(name, (const xmlChar *)"model"));
+                       if ( in_model ) {
+                          str = xmlTextReaderGetAttribute( reader, (const xmlChar *)"model_id" );
+                          model_num = ( str!=NULL ) ? atoi((const char *)str) : 0;
+                          xmlFree( str );
+                       }
+                       break;
+                  case 2:
+                       in_section = in_model && (!xmlStrcmp(name, (const xmlChar *)"section"));
+                       if ( in_section ) {
+                          str = xmlTextReaderGetAttribute( reader, (const xmlChar *)"section_id" );
+                          section_num = ( str!=NULL ) ? atoi((const char *)str) : 0;
+                          xmlFree( str );
+                       }
+                       break;
+                  case 3:
+                       if ( in_section && (!xmlStrcmp(name, (const xmlChar *)"item")) ) {
+                          memset( &item, 0, sizeof(um_field_metadata) );
+                          item.model   = model_num;
+                          item.section = section_num;
+                          in_item = 1;
+                          if ( xmlTextReaderIsEmptyElement( reader )==1 ) {
+                             store_item( ctx, &item, keep, &size ); 
+                             in_item = 0;
+                          }
+                       }
+                       break;
+                  case 4:
+                       if ( in_item ) {
+                          str = xmlTextReaderReadString( reader );
+                          parse_item_field( name, str, &item );
+                          xmlFree( str );
+                       }
+                       break;
            }
-           model = model->next;
+           if ( status==-1 ) { break; }
      }
-     xmlFreeDoc( doc );
+     xmlFreeTextReader( reader );
 
-/**
- ** Check for non-sensical values and apply defaults if necessary 
- **---------------------------------------------------------------------------*/
-     for ( cnt=0; cnt<num_xml_vars; cnt++ ) {
-         if ( (um_vars[cnt].level_type!=1)&&(um_vars[cnt].level_type!=2) ) {
-            um_vars[cnt].level_type = 2; 
-         }
-         if ( (um_vars[cnt].scale<0.00000001)||(um_vars[cnt].scale>1000000.0) ) {
-            um_vars[cnt].scale = 1.0;
-         }
+     if ( status!=0 ) {
+        free( ctx->um_vars );
+        ctx->um_vars      = NULL;
+        ctx->num_xml_vars = 0;
+        return 0;
      }
 
 /*==============================================================================
@@ -252,17 +290,349 @@ int read_stash_file( char *filename ) {
 }
 
 
+/***
+ *** COMPARE_STASH_ENTRIES
+ ***
+ *** Orders variable definitions by model, section & item (and then by their
+ *** position in the XML stash file, so that the first definition of an item
+ *** stays first).
+ ***/
+
+int compare_stash_entries( const void *a, const void *b ) {
+
+     const stash_order *x = (const stash_order *) a, *y = (const stash_order *) b;
+
+     if ( x->model!=y->model )     { return ( x->model<y->model ) ? -1 : 1; }
+     if ( x->section!=y->section ) { return ( x->section<y->section ) ? -1 : 1; }
+     if ( x->code!=y->code )       { return ( x->code<y->code ) ? -1 : 1; }
+     return x->pos - y->pos;
+}
+
+
+/***
+ *** SORT_STASH_TABLE
+ ***
+ *** Sorts the variable definitions read from the XML stash file by (model,
+ *** section, item), which is the order in which they are compiled.
+ ***/
+
+void sort_stash_table( um2nc_ctx *ctx ) {
+
+     int i;
+     stash_order *order;
+     um_field_metadata *sorted;
+
+     order = (stash_order *) malloc( (ctx->num_xml_vars+1)*sizeof(stash_order) );
+     for ( i=0; i<ctx->num_xml_vars; i++ ) { 
+         order[i].model   = ctx->um_vars[i].model;
+         order[i].section = ctx->um_vars[i].section;
+         order[i].code    = ctx->um_vars[i].code;
+         order[i].pos     = i;
+     }
+     qsort( order, ctx->num_xml_vars, sizeof(stash_order), compare_stash_entries );
+
+     sorted = (um_field_metadata *) malloc( (ctx->num_xml_vars+1)*sizeof(um_field_metadata) );
+     for ( i=0; i<ctx->num_xml_vars; i++ ) { sorted[i] = ctx->um_vars[order[i].pos]; }
+
+     free( ctx->um_vars );
+     ctx->um_vars = sorted;
+     free( order );
+
+     return;
+}
+
+
+/***
+ *** HASH_STASH_FILE
+ ***
+ *** Computes the FNV-1a hash & the size of the contents of the XML stash file.
+ ***
+ *** Function returns 1 if the file could be read and 0 otherwise.
+ ***/
+
+int hash_stash_file( const char *filename, uint64_t *hash, int64_t *size ) {
+
+     FILE  *fh;
+     unsigned char buf[65536];
+     size_t i, n;
+
+     fh = fopen( filename, "rb" );
+     if ( fh==NULL ) { return 0; }
+
+     *hash = 14695981039346656037ULL;
+     *size = 0;
+     while ( (n = fread( buf, 1, sizeof(buf), fh ))>0 ) {
+           for ( i=0; i<n; i++ ) { *hash = (*hash ^ buf[i]) * 1099511628211ULL; }
+           *size += (int64_t ) n;
+     }
+     fclose( fh );
+
+     return 1;
+}
+
+
+/***
+ *** STASH_CACHE_NAME
+ ***
+ *** Constructs the default name of the compiled version of an XML stash file:
+ *** its .xml suffix (if any) replaced by .bin.  The returned string must be
+ *** freed by the caller.
+ ***/
+
+char *stash_cache_name( const char *filename ) {
+
+     char  *name;
+     size_t n;
+
+     n = strlen( filename );
+     name = (char *) malloc( n+5 );
+     strcpy( name, filename );
+     if ( (n>4)&&(strcmp( name+n-4, ".xml" )==0) ) { name[n-4] = '\0'; }
+     strcat( name, ".bin" );
+
+     return name;
+}
+
+
+/***
+ *** COMPILE_STASH_FILE
+ ***
+ *** Parses the XML stash file and writes its variable definitions, sorted by
+ *** (model, section, item), into a compiled stash file that later runs map
+ *** into memory instead of parsing the XML.  The compiled file records the
+ *** modification time, size & hash of the XML file it was compiled from.
+ ***
+ ***  INPUT:  filename   -> name of the XML stash file
+ ***          cache_name -> name of the compiled stash file (NULL for the 
+ ***                        default name, see STASH_CACHE_NAME)
+ ***
+ *** Function returns 1 if the compiled stash file was written and 0 otherwise.
+ ***/
+
+int compile_stash_file( const char *filename, const char *cache_name ) {
+
+     stash_cache_header hdr;
+     struct stat st;
+     um2nc_ctx *ctx;
+     FILE  *fh;
+     char  *name;
+     int    ok;
+
+     ctx = (um2nc_ctx *) calloc( 1, sizeof(um2nc_ctx) );
+     if ( parse_stash_file( ctx, filename, NULL )==0 ) { free( ctx ); return 0; }
+     sort_stash_table( ctx );
+
+     memset( &hdr, 0, sizeof(stash_cache_header) );
+     strcpy( hdr.magic, STASH_CACHE_MAGIC );
+     hdr.version     = STASH_CACHE_VERSION;
+     hdr.byte_order  = 0x01020304;
+     hdr.record_size = (uint32_t ) sizeof(um_field_metadata);
+     hdr.num         = (uint32_t ) ctx->num_xml_vars;
+     ok = 0;
+     if ( stat( filename, &st )!=0 ) { goto done; }
+     hdr.xml_mtime   = (int64_t ) st.st_mtime;
+     if ( hash_stash_file( filename, &hdr.xml_hash, &hdr.xml_size )==0 ) { goto done; }
+
+     name = ( cache_name==NULL ) ? stash_cache_name( filename ) : (char *) cache_name;
+     fh = fopen( name, "wb" );
+     if ( fh!=NULL ) {
+        ok = ( fwrite( &hdr, sizeof(stash_cache_header), 1, fh )==1 );
+        if ( ctx->num_xml_vars>0 ) { ok = ok && ( fwrite( ctx->um_vars, sizeof(um_field_metadata), ctx->num_xml_vars, fh )==(size_t ) ctx->num_xml_vars ); }
+        ok = ( fclose( fh )==0 ) && ok;
+        if ( ok ) { printf( "Compiled %d variable definitions from %s into %s\n", ctx->num_xml_vars, filename, name ); }
+     }
+
+     if ( cache_name==NULL ) { free( name ); }
+
+done:
+     free_stash_table( ctx );
+     free( ctx );
+     return ok;
+}
+
+
+/***
+ *** LOAD_STASH_CACHE
+ ***
+ *** Maps the compiled version of an XML stash file into memory, provided it
+ *** was written by this version of um2netcdf on a machine of the same byte 
+ *** order and is up to date: the XML file must have the recorded modification
+ *** time & size, or (if it was touched since) the recorded contents hash.
+ ***
+ *** If only some STASH codes are wanted, their definitions are copied out of
+ *** the compiled file and the rest is released.
+ ***
+ *** Function returns 1 if the UM_VARS of the conversion context now hold the
+ *** compiled definitions and 0 if the XML stash file must be parsed.
+ ***/
+
+int load_stash_cache( um2nc_ctx *ctx, const char *filename, const char *cache_name, stash_set *keep ) {
+
+     stash_cache_header *hdr;
+     um_field_metadata  *rec;
+     struct stat st, cst;
+     uint64_t hash;
+     int64_t  size;
+     void    *map;
+     int      fd, i;
+
+     if ( stat( filename, &st )!=0 ) { return 0; }
+
+     fd = open( cache_name, O_RDONLY );
+     if ( fd<0 ) { return 0; }
+     if ( (fstat( fd, &cst )!=0)||(cst.st_size<(off_t ) sizeof(stash_cache_header)) ) { close( fd ); return 0; }
+
+     map = mmap( NULL, (size_t ) cst.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0 );
+     close( fd );
+     if ( map==MAP_FAILED ) { return 0; }
+
+  /** Check that the compiled file has the expected layout **/
+     hdr = (stash_cache_header *) map;
+     if ( (memcmp( hdr->magic, STASH_CACHE_MAGIC, sizeof(STASH_CACHE_MAGIC) )!=0)||
+          (hdr->version!=STASH_CACHE_VERSION)||(hdr->byte_order!=0x01020304)||
+          (hdr->record_size!=(uint32_t ) sizeof(um_field_metadata))||
+          ((off_t ) (sizeof(stash_cache_header) + (size_t ) hdr->num*sizeof(um_field_metadata))!=cst.st_size) ) {
+        munmap( map, (size_t ) cst.st_size );
+        return 0;
+     }
+
+  /** Check that it is up to date with the XML stash file **/
+     if ( (hdr->xml_mtime!=(int64_t ) st.st_mtime)||(hdr->xml_size!=(int64_t ) st.st_size) ) {
+        if ( (hash_stash_file( filename, &hash, &size )==0)||(hash!=hdr->xml_hash)||(size!=hdr->xml_size) ) {
+           munmap( map, (size_t ) cst.st_size );
+           return 0;
+        }
+     }
+
+     rec = (um_field_metadata *) ((char *) map + sizeof(stash_cache_header));
+     if ( keep==NULL ) {
+        ctx->stash_map     = map;
+        ctx->stash_map_len = (size_t ) cst.st_size;
+        ctx->num_xml_vars  = (int ) hdr->num;
+        ctx->um_vars       = rec;
+        return 1;
+     }
+
+     ctx->num_xml_vars = 0;
+     for ( i=0; i<(int ) hdr->num; i++ ) 
+         if ( has_stash_code( keep, 1000*rec[i].section + rec[i].code )==1 ) { ctx->num_xml_vars++; }
+
+     ctx->um_vars = (um_field_metadata *) malloc( (ctx->num_xml_vars+1)*sizeof(um_field_metadata) );
+     ctx->num_xml_vars = 0;
+     for ( i=0; i<(int ) hdr->num; i++ ) {
+         if ( has_stash_code( keep, 1000*rec[i].section + rec[i].code )==0 ) { continue; }
+         ctx->um_vars[ctx->num_xml_vars] = rec[i];
+         ctx->num_xml_vars++;
+     }
+     munmap( map, (size_t ) cst.st_size );
+
+     return 1;
+}
+
+
+/***
+ *** INDEX_STASH_TABLE
+ ***
+ *** Indexes the variable definitions in UM_VARS by STASH code.
+ ***/
+
+void index_stash_table( um2nc_ctx *ctx ) {
+
+     long *codes;
+     int   i;
+
+     codes = (long *) malloc( (ctx->num_xml_vars+1)*sizeof(long) );
+     for ( i=0; i<ctx->num_xml_vars; i++ ) { codes[i] = 1000L*ctx->um_vars[i].section + ctx->um_vars[i].code; }
+     build_stash_index( codes, ctx->num_xml_vars, &ctx->stash_defs );
+     free( codes );
+
+     return;
+}
+
+
+/***
+ *** READ_STASH_FILE 
+ ***
+ *** Reads the variable definitions of the user-specified XML stash file into
+ *** a conversion context, sorted by (model, section, item) and indexed by 
+ *** STASH code.  Its compiled
+ *** version (see COMPILE_STASH_FILE) is used if present & up to date; 
+ *** otherwise the XML is streamed through.  
+ ***
+ ***  INPUT:  ctx      -> conversion context receiving the definitions
+ ***          filename -> name of the XML stash file
+ ***          keep     -> STASH codes whose definitions are wanted (NULL for all)
+ ***/
+
+int read_stash_file( um2nc_ctx *ctx, const char *filename, stash_set *keep ) {
+
+     char *name;
+     int   ok;
+
+     name = stash_cache_name( filename );
+     ok = load_stash_cache( ctx, filename, name, keep );
+     free( name );
+
+     if ( ok==0 ) {
+        if ( parse_stash_file( ctx, filename, keep )==0 ) { return 0; }
+        sort_stash_table( ctx );
+     }
+     index_stash_table( ctx );
+
+     return 1;
+}
+
+
+/***
+ *** FIND_STASH_DEFINITION
+ ***
+ *** Returns the index in UM_VARS of the first definition of STASH code 
+ *** STASH_CODE (1000*section + item), or -1 if it is not defined.
+ ***/
+
+int find_stash_definition( um2nc_ctx *ctx, int stash_code ) {
+
+     int g;
+
+     if ( ctx->stash_defs.slot==NULL ) { return -1; }
+     g = find_stash( &ctx->stash_defs, (long ) stash_code );
+
+     return ( g<0 ) ? -1 : ctx->stash_defs.entry[ctx->stash_defs.first[g]];
+}
+
+
+/***
+ *** FREE_STASH_TABLE
+ ***
+ *** Releases the variable definitions of a conversion context, whether parsed
+ *** or mapped, and their index.
+ ***/
+
+void free_stash_table( um2nc_ctx *ctx ) {
+
+     if ( ctx->stash_map!=NULL ) { munmap( ctx->stash_map, ctx->stash_map_len ); }
+     else                   { free( ctx->um_vars ); }
+     if ( ctx->stash_defs.slot!=NULL ) { free_stash_index( &ctx->stash_defs ); }
+
+     ctx->stash_map     = NULL;
+     ctx->stash_map_len = 0;
+     ctx->um_vars       = NULL;
+
+     return;
+}
+
+
 /***
  *** READ_CONFIG_FILE
  ***
  *** Subroutine that opens the user-specified XML config file and reads
- *** in the metadata associated with the UM run.
+ *** in the metadata associated with the UM run into a conversion context.
  ***
  ***   Mark Cheeseman, NIWA
  ***   May 22, 2014
  ***/
 
-int read_config_file( char *filename ) {
+int read_config_file( um2nc_ctx *ctx, const char *filename ) {
 
      xmlDocPtr doc;
      xmlNodePtr run;
@@ -286,66 +656,66 @@ int read_config_file( char *filename ) {
            if ((!xmlStrcmp(run->name, (const xmlChar *)"institution"))) {
               str = xmlNodeListGetString(doc, run->xmlChildrenNode, 1);
               if ( str!=NULL ) {
-                 memset( run_config.institution, '\0', sizeof(run_config.institution) );
-                 strcpy( run_config.institution,(const char *)str );
+                 memset( ctx->run_config.institution, '\0', sizeof(ctx->run_config.institution) );
+                 strcpy( ctx->run_config.institution,(const char *)str );
               }
               xmlFree( str );
            }
            if ((!xmlStrcmp(run->name, (const xmlChar *)"ps"))) {
               str = xmlNodeListGetString(doc, run->xmlChildrenNode, 1);
-              if ( str!=NULL ) { run_config.eps = atoi((const char *) str); }
-              else             { run_config.eps = 34; }
+              if ( str!=NULL ) { ctx->run_config.eps = atoi((const char *) str); }
+              else             { ctx->run_config.eps = 34; }
               xmlFree( str );
            }
            if ((!xmlStrcmp(run->name, (const xmlChar *)"niwa_eps"))) {
               str = xmlNodeListGetString(doc, run->xmlChildrenNode, 1);
-              if ( str!=NULL ) { run_config.eps = atoi((const char *) str); }
-              else             { run_config.eps = 0; }
+              if ( str!=NULL ) { ctx->run_config.eps = atoi((const char *) str); }
+              else             { ctx->run_config.eps = 0; }
               xmlFree( str );
            }
            if ((!xmlStrcmp(run->name, (const xmlChar *)"rose_id"))) {
               str = xmlNodeListGetString(doc, run->xmlChildrenNode, 1);
-              if ( str!=NULL ) { run_config.rose_id = atoi((const char *) str); }
-              else             { run_config.rose_id = 0; }
+              if ( str!=NULL ) { ctx->run_config.rose_id = atoi((const char *) str); }
+              else             { ctx->run_config.rose_id = 0; }
               xmlFree( str );
            }
            if ((!xmlStrcmp(run->name, (const xmlChar *)"model_name"))) {
               str = xmlNodeListGetString(doc, run->xmlChildrenNode, 1);
               if ( str!=NULL ) {
-                 memset( run_config.model, '\0', sizeof(run_config.model) );
-                 strcpy( run_config.model,(const char *)str );
+                 memset( ctx->run_config.model, '\0', sizeof(ctx->run_config.model) );
+                 strcpy( ctx->run_config.model,(const char *)str );
               }
               xmlFree( str );
            }
            if ((!xmlStrcmp(run->name, (const xmlChar *)"references"))) {
               str = xmlNodeListGetString(doc, run->xmlChildrenNode, 1);
               if ( str!=NULL ) {
-                 memset( run_config.ref, '\0', sizeof(run_config.ref) );
-                 strcpy( run_config.ref,(const char *)str );
+                 memset( ctx->run_config.ref, '\0', sizeof(ctx->run_config.ref) );
+                 strcpy( ctx->run_config.ref,(const char *)str );
               }
               xmlFree( str );
            }
            if ((!xmlStrcmp(run->name, (const xmlChar *)"comment"))) {
               str = xmlNodeListGetString(doc, run->xmlChildrenNode, 1);
               if ( str!=NULL ) {
-                 memset( run_config.comment, '\0', sizeof(run_config.comment) );
-                 strcpy( run_config.comment,(const char *)str );
+                 memset( ctx->run_config.comment, '\0', sizeof(ctx->run_config.comment) );
+                 strcpy( ctx->run_config.comment,(const char *)str );
               }
               xmlFree( str );
            }
            if ((!xmlStrcmp(run->name, (const xmlChar *)"title"))) {
               str = xmlNodeListGetString(doc, run->xmlChildrenNode, 1);
               if ( str!=NULL ) {
-                 memset( run_config.title, '\0', sizeof(run_config.title) );
-                 strcpy( run_config.title,(const char *)str );
+                 memset( ctx->run_config.title, '\0', sizeof(ctx->run_config.title) );
+                 strcpy( ctx->run_config.title,(const char *)str );
               }
               xmlFree( str );
            }
            if ((!xmlStrcmp(run->name, (const xmlChar *)"data_assimilation_method"))) {
               str = xmlNodeListGetString(doc, run->xmlChildrenNode, 1);
               if ( str!=NULL ) {
-                 memset( run_config.assim, '\0', sizeof(run_config.assim) );
-                 strcpy( run_config.assim,(const char *)str );
+                 memset( ctx->run_config.assim, '\0', sizeof(ctx->run_config.assim) );
+                 strcpy( ctx->run_config.assim,(const char *)str );
               }
               xmlFree( str );
            }
@@ -26,6 +26,10 @@
 #include <string.h>
 #include "field_def.h"
 
+/** Function prototypes **/
+
+const char *um_calendar_name( long calendar );
+
 /***
  *** SET_TIME_BND
  ***
@@ -33,23 +37,24 @@
  *** accummulation data fields.  If so, the time bounds for each accummulation
  *** are determined.
  ***
- ***  INPUT:  ncid -> ID of the newly created NetCDF file
+ ***  INPUT:  ctx  -> conversion context of the input UM fields file
+ ***          ncid -> ID of the newly created NetCDF file
  ***          dt   -> current timestep 
  ***
  ***    Mark Cheeseman, NIWA
  ***    May 1, 2014
  ***/
 
-void set_time_bnd( int ncid, int var_index ) {
+void set_time_bnd( um2nc_ctx *ctx, int ncid, int var_index ) {
 
     int   i, ierr, dim_ids[2], varID;
-    char  time_bnd_str[9], dim_name[6];
+    char  time_bnd_str[16], dim_name[12];
     float dt, tval[2];
     size_t index[2];
 
  /** Get the dimensions for the new time bounds variable **/
 
-     sprintf( dim_name, "time%i", stored_um_vars[var_index].t_dim );
+     sprintf( dim_name, "time%i", ctx->stored_um_vars[var_index].t_dim );
      ierr = nc_inq_dimid( ncid, dim_name, &dim_ids[0] );
 
      ierr = nc_inq_dimid( ncid,     "nv", &dim_ids[1] );
@@ -57,7 +62,7 @@ void set_time_bnd( int ncid, int var_index ) {
 
  /** Create a time_bnd variable if an appropriate one is not present **/
  
-     sprintf( time_bnd_str, "time_bnd%hu", stored_um_vars[var_index].t_dim );
+     sprintf( time_bnd_str, "time_bnd%hu", ctx->stored_um_vars[var_index].t_dim );
      ierr = nc_inq_varid( ncid, time_bnd_str, &varID );
      if ( ierr!=NC_NOERR ) {
         ierr = nc_def_var( ncid, time_bnd_str, NC_FLOAT, 2, dim_ids, &varID ); 
@@ -67,19 +72,19 @@ void set_time_bnd( int ncid, int var_index ) {
      ierr = nc_enddef( ncid );
 
  /** Determine the time values for the operation **/
-     if ( stored_um_vars[var_index].nt==1 ) {
+     if ( ctx->stored_um_vars[var_index].nt==1 ) {
         tval[0] = 0.0;
-        tval[1] = stored_um_vars[var_index].times[0];
+        tval[1] = ctx->stored_um_vars[var_index].times[0];
         ierr = nc_put_var_float( ncid, varID, tval );
      } else {
-        dt = 0.5*(stored_um_vars[var_index].times[1] - stored_um_vars[var_index].times[0]);
-        for ( i=0; i<stored_um_vars[var_index].nt; i++ ) {
+        dt = 0.5*(ctx->stored_um_vars[var_index].times[1] - ctx->stored_um_vars[var_index].times[0]);
+        for ( i=0; i<ctx->stored_um_vars[var_index].nt; i++ ) {
             index[0] = i;
             index[1] = 0;
-            tval[0] = stored_um_vars[var_index].times[i] - dt;
+            tval[0] = ctx->stored_um_vars[var_index].times[i] - dt;
             ierr = nc_put_var1_float( ncid, varID, index, &tval[0] );
             index[1] = 1;
-            tval[1] = stored_um_vars[var_index].times[i] + dt;
+            tval[1] = ctx->stored_um_vars[var_index].times[i] + dt;
             ierr = nc_put_var1_float( ncid, varID, index, &tval[1] );
         } 
      }   
@@ -88,25 +93,25 @@ void set_time_bnd( int ncid, int var_index ) {
      return;
 }
 
-void create_time_dim( int ncid, int var_index, int time_dim_cnt ) {
+void create_time_dim( um2nc_ctx *ctx, int ncid, int var_index, int time_dim_cnt ) {
 
      int  dimID[1], ierr, varID;
-     char time_des[40], dim_name[6], calendar[9];
+     char time_des[40], dim_name[12];
+     const char *calendar;
 
    /** Construct an appropriate name for the time dimension **/
      sprintf( dim_name, "time%i", time_dim_cnt );
 
    /** Define the dimension & a corresponding variable **/
-     ierr = nc_def_dim( ncid, dim_name, (size_t ) stored_um_vars[var_index].nt, &dimID[0] );
+     ierr = nc_def_dim( ncid, dim_name, (size_t ) ctx->stored_um_vars[var_index].nt, &dimID[0] );
      ierr = nc_def_var( ncid, dim_name, NC_FLOAT, 1, dimID, &varID );
 
    /** Add some attributes to the time variable **/
 
-     if ( header[7]==1 ) { sprintf( calendar, "gregorian" ); }
-     else                { sprintf( calendar, "360_day" ); }
-     ierr = nc_put_att_text( ncid, varID, "calendar", 9, calendar );
+     calendar = um_calendar_name( ctx->header[7] );
+     ierr = nc_put_att_text( ncid, varID, "calendar", strlen(calendar), calendar );
 
-     strftime( time_des, 33, "hours since %Y-%m-%d %H:%M:%S", &forecast_reference );
+     strftime( time_des, 33, "hours since %Y-%m-%d %H:%M:%S", &ctx->forecast_reference );
      ierr = nc_put_att_text( ncid, varID, "units", 31, time_des );
 
      ierr = nc_put_att_text( ncid, varID,          "axis",  1, "T" );
@@ -115,80 +120,103 @@ void create_time_dim( int ncid, int var_index, int time_dim_cnt ) {
 
    /** Write time offset values that correspond to the newly created time dimension **/
      ierr = nc_enddef( ncid );
-     ierr = nc_put_var_float( ncid, varID, stored_um_vars[var_index].times );
+     ierr = nc_put_var_float( ncid, varID, ctx->stored_um_vars[var_index].times );
      ierr = nc_redef( ncid );
 
      return;
 
 }
 
+/***
+ *** HASH_TIMES
+ ***
+ *** Returns a hash (FNV-1a) of the # of time values and the bytes of the time 
+ *** values of a UM variable.
+ ***/
+
+unsigned long hash_times( um2nc_ctx *ctx, int var_index ) {
+
+     unsigned long h;
+     const unsigned char *c;
+     size_t i, n;
+
+     h = 14695981039346656037UL;
+     h = (h ^ (unsigned long ) ctx->stored_um_vars[var_index].nt) * 1099511628211UL;
+
+     c = (const unsigned char *) ctx->stored_um_vars[var_index].times;
+     n = (size_t ) ctx->stored_um_vars[var_index].nt*sizeof(float);
+     for ( i=0; i<n; i++ ) { h = (h ^ (unsigned long ) c[i]) * 1099511628211UL; }
+
+     return h;
+}
+
+
+/***
+ *** SAME_TIMES
+ ***
+ *** Returns 1 if 2 UM variables have exactly the same time values, 0 if not.
+ ***/
+
+int same_times( um2nc_ctx *ctx, int a, int b ) {
+
+     if ( ctx->stored_um_vars[a].nt!=ctx->stored_um_vars[b].nt ) { return 0; }
+     return memcmp( ctx->stored_um_vars[a].times, ctx->stored_um_vars[b].times, 
+                    (size_t ) ctx->stored_um_vars[a].nt*sizeof(float) )==0;
+}
+
+
 /***
  *** SET_TEMPORAL_DIMENSIONS
  ***
- *** Construct all time-related dimensions for the new NetCDF file.
+ *** Construct all time-related dimensions for the new NetCDF file.  UM 
+ *** variables share a time dimension if their time values are identical; 
+ *** each variable's time values are looked up in a hash table of the time
+ *** dimensions created so far.
  ***
- *** INPUT:   ncid -> ID of the newly created NetCDF file
+ *** INPUT:   ctx  -> conversion context of the input UM fields file
+ ***          ncid -> ID of the newly created NetCDF file
  ***
  ***    Mark Cheeseman, NIWA
  ***    December 28, 2013
  ***/
 
- void set_temporal_dimensions( int ncid ) {
+ void set_temporal_dimensions( um2nc_ctx *ctx, int ncid ) {
 
-    float *sums, tol, flag;
-    int    i, j, num_unique_times; //,k;
+    int   i, size, num_unique_times, *slot;
+    unsigned long h;
 
  /*
-  * Start by determining the # of time dimensions required
+  * Give each set of unique time values its own NetCDF time dimension (in
+  * order of first appearance) & point the t_dim value of each UM field to it
   *-----------------------------------------------------------------------*/
-    sums = (float *) calloc( num_stored_um_fields,sizeof(float) );
-    for ( i=0; i<num_stored_um_fields; i++ ) {
-    for ( j=0; j<stored_um_vars[i].nt; j++ ) {
-        sums[i] += stored_um_vars[i].times[j]; 
-    } 
-    } 
-
-    flag = -1.0;
-    for ( i=0;   i<num_stored_um_fields; i++ ) {
-        if ( sums[i]>-0.5 ) {
-           for ( j=i+1; j<num_stored_um_fields; j++ ) {
-               if ( sums[j]>-0.5 ) {
-                  tol = (sums[i]-sums[j])*(sums[i]-sums[j]);
-                  if ( tol<0.0001 ) { sums[j] = flag; }
-               }
-           }
-           flag = flag-1.0;
+    size = 16;
+    while ( size<2*ctx->num_stored_um_fields ) { size *= 2; }
+    slot = (int *) malloc( size*sizeof(int) );
+    for ( i=0; i<size; i++ ) { slot[i] = -1; }
+
+    num_unique_times = 0;
+    for ( i=0; i<ctx->num_stored_um_fields; i++ ) {
+        h = hash_times( ctx, i ) & (unsigned long ) (size-1);
+        while ( (slot[h]!=-1)&&(same_times( ctx, slot[h], i )==0) ) { h = (h+1) & (unsigned long ) (size-1); }
+
+        if ( slot[h]==-1 ) { 
+           slot[h] = i;
+           create_time_dim( ctx, ncid, i, num_unique_times ); 
+           ctx->stored_um_vars[i].t_dim = (unsigned short int) num_unique_times;
+           num_unique_times++; 
+        } else {
+           ctx->stored_um_vars[i].t_dim = ctx->stored_um_vars[slot[h]].t_dim;
         }
-    } 
-    
-    num_unique_times = (int )(-1.0*(flag+1.0));
-
- /*
-  * Create a NetCDF dimension for each required time dimension 
-  *-----------------------------------------------------------------------*/
-    j = 0;
-    for ( i=0; i<num_stored_um_fields; i++ ) 
-        if ( sums[i]>-0.5 ) { create_time_dim( ncid, i, j ); j++; }
-
- /*
-  * Set t_dim value of each UM field to point to the appropriate NetCDF
-  * time dimension for that variable.
-  *-----------------------------------------------------------------------*/
-    j = 0;
-    for ( i=0; i<num_stored_um_fields; i++ ) {
-        if ( sums[i]>-0.5 ) { stored_um_vars[i].t_dim = (unsigned short int) j; j++; }
-        else                { stored_um_vars[i].t_dim = (unsigned short int) ( -1.0*(sums[i]+1.0) ); }
     }
-    free( sums );
+    free( slot );
 
  /*
   * If any UM variable is some sort of temporal accummulation, we need to
   * set temporal bounds for that variable. 
   *-----------------------------------------------------------------------*/
-    for ( i=0; i<num_stored_um_fields; i++ ) {
-        if ( (stored_um_vars[i].lbproc==128)||(stored_um_vars[i].lbproc==4096)||(stored_um_vars[i].lbproc==8192) ) {
-           set_time_bnd( ncid, i );
-           j++;
+    for ( i=0; i<ctx->num_stored_um_fields; i++ ) {
+        if ( (ctx->stored_um_vars[i].lbproc==128)||(ctx->stored_um_vars[i].lbproc==4096)||(ctx->stored_um_vars[i].lbproc==8192) ) {
+           set_time_bnd( ctx, ncid, i );
         }
     }
 
@@ -200,7 +228,7 @@ void create_time_dim( int ncid, int var_index, int time_dim_cnt ) {
         printf( "T_DIM = %d STASH_CODES = ", j );
         for ( i=0; i<num_stored_um_fields; i++ ) {
             if ( stored_um_vars[i].t_dim==(unsigned short int) j ) { 
-               printf( "%hu ", stored_um_vars[i].stash_code ); 
+               printf( "%d ", stored_um_vars[i].stash_code ); 
                k++;
             }
         }
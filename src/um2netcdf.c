@@ -36,24 +36,49 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <netcdf.h>
-#include "field_def.h"
-#include "flag_def.h"
+#include "libum2netcdf.h"
 
 /** Function prototypes **/
 
 void status_check( int status, char *message );
 void usage();
-int read_stash_file( char *filename );
-int read_config_file( char *filename );
-int check_um_file( char *filename, int rflag);
-int create_netcdf_file( char *um_file, int iflag, int rflag, char *output_file );
-int fill_netcdf_file( int ncid, char *filename, int iflag, int rflag );
+const char **collect_stash_specs( int argc, char *argv[], const char **specs );
+
+
+/***
+ *** COLLECT_STASH_SPECS
+ ***
+ *** Appends the STASH code specifications following a -s/-b option to a 
+ *** NULL-terminated list of them (the list ends at the first argument that
+ *** is not a STASH code specification).
+ ***/
+
+const char **collect_stash_specs( int argc, char *argv[], const char **specs ) {
+
+     int n;
+
+     n = 0;
+     if ( specs!=NULL ) { while ( specs[n]!=NULL ) { n++; } }
+
+     optind--;
+     while ( optind<argc ) {
+        if ( um2nc_check_stash_spec( argv[optind] )==0 ) { break; }
+        specs = (const char **) realloc( specs, (n+2)*sizeof(char *) );
+        specs[n++] = argv[optind];
+        specs[n]   = NULL;
+        optind++;
+     }
+
+     return specs;
+}
+
 
 int main( int argc, char *argv[] ) {
 
-     int ncid, status, c, iflag, rflag, n, i, tmp[25];
-     char *netcdf_filename=NULL, *dest, *run_config_filename=NULL;;
+     int c, status;
+     char *netcdf_filename=NULL, *dest;
+     um2nc_options opts;
+     um2nc_ctx *ctx;
 
  /*
   * Check if the user has included the correct number of commandline arguments
@@ -64,21 +89,27 @@ int main( int argc, char *argv[] ) {
         exit(1);
      } 
 
-     iflag = 0;
-     rflag = 0;
-     num_stored_um_fields = 0;
-     blacklist_cnt = 0;
-     netcdf3_flag = 0;
-     while ( (c = getopt(argc,argv,"hirs:o:c:b:n")) != EOF ) { 
+ /*
+  * Compile the XML stash file into its binary form if requested 
+  * (um2netcdf.x --compile-stash stash2cf.xml [-o stash2cf.bin])
+  *---------------------------------------------------------------------------*/ 
+     if ( strcmp( argv[1], "--compile-stash" )==0 ) {
+        status = um2nc_compile_stash( argv[2], ( (argc>4)&&(strcmp( argv[3], "-o" )==0) ) ? argv[4] : NULL );
+        status_check( status, "ERROR: could not compile XML stash file" ); 
+        return 0;
+     }
+
+     um2nc_default_options( &opts );
+     while ( (c = getopt(argc,argv,"hirs:o:c:b:ndpt:w:m:")) != EOF ) { 
            switch(c) {
                case 'h':
                        usage();
                        exit(1);
                case 'i':
-                       iflag = 1;
+                       opts.interpolate = 1;
                        break;
                case 'r':
-                       rflag = 1;
+                       opts.real32 = 1;
                        break;
                case 'o':
                        netcdf_filename = optarg;
@@ -86,123 +117,64 @@ int main( int argc, char *argv[] ) {
                        if ( dest==NULL ) { printf("ERROR: specified output filename must have .nc suffix\n"); exit(1); } 
                        break;
                case 'c':
-                       run_config_filename = optarg;
+                       opts.config_file = optarg;
                        break;
                case 's':
-                       optind--;
-                       while ( optind<argc ) {
-                          tmp[num_stored_um_fields] = atoi( argv[optind] );
-                          if ( tmp[num_stored_um_fields]==0 ) { break; }
-                          num_stored_um_fields++;
-                          if ( num_stored_um_fields==25 ) { 
-                             printf( "ERROR: one can only specify up to 25 stash codes for extraction\n" ); 
-                             exit(1); 
-                          }
-                          optind++;
-                       }
+                       opts.select = collect_stash_specs( argc, argv, opts.select );
                        break;
                case 'b':
-                       optind--;
-                       while ( optind<argc ) {
-                          blacklist[blacklist_cnt] = atoi( argv[optind] );
-                          if ( blacklist[blacklist_cnt]==0 ) { break; }
-                          blacklist_cnt++;
-                          if ( blacklist_cnt==10 ) { 
-                             printf( "ERROR: one can only specify up to 10 stash codes for blacklisting\n" ); 
-                             exit(1); 
-                          }
-                          optind++;
-                       }
+                       opts.blacklist = collect_stash_specs( argc, argv, opts.blacklist );
                        break;
                case 'n':
-                       netcdf3_flag = 1;
+                       opts.netcdf3 = 1;
+                       break;
+               case 'd':
+                       opts.io_stats = 1;
+                       break;
+               case 'p':
+                       opts.pipeline = 1;
+                       break;
+               case 't':
+                       opts.decode_threads = atoi( optarg );
+                       if ( (opts.decode_threads<1)||(opts.decode_threads>256) ) { 
+                          printf( "ERROR: the number of decode threads must be between 1 and 256\n" ); 
+                          exit(1); 
+                       }
+                       opts.pipeline = 1;
+                       break;
+               case 'w':
+                       opts.row_threads = atoi( optarg );
+                       if ( (opts.row_threads<1)||(opts.row_threads>256) ) { 
+                          printf( "ERROR: the number of row decoding threads must be between 1 and 256\n" ); 
+                          exit(1); 
+                       }
+                       break;
+               case 'm':
+                       opts.strip_rows = atoi( optarg );
+                       if ( opts.strip_rows<1 ) { 
+                          printf( "ERROR: the number of rows in each band must be at least 1\n" ); 
+                          exit(1); 
+                       }
                        break;
            }
      }
 
  /*
-  * If the user has requested specific stash codes (-s option), allocate 
-  * space to hold the corresponding UM variables. 
+  * Read the run configuration, the headers & lookup table of the input UM
+  * file and the XML stash file definitions of its UM variables
   *---------------------------------------------------------------------------*/ 
-     if ( num_stored_um_fields>0 ) {
-        stored_um_vars = (new_um_variable *) malloc( num_stored_um_fields*sizeof(new_um_variable) );
-        for ( n=0; n<num_stored_um_fields; n++ ) {
-            stored_um_vars[n].stash_code = (unsigned short int ) tmp[n];
-            stored_um_vars[n].nt = 0;
-            stored_um_vars[n].nz = 0;
-        }
-     }
+     ctx = um2nc_open( argv[argc-2], argv[argc-1], &opts );
+     if ( ctx==NULL ) { exit(1); }
 
  /*
-  * Read in the variable definitions in the XML stash file 
+  * Write the UM data into a new NetCDF file 
   *---------------------------------------------------------------------------*/ 
-     status = read_stash_file( argv[argc-1] );
-     status_check( status, "ERROR: could not parse XML stash file" ); 
+     status = um2nc_convert( ctx, netcdf_filename );
+     um2nc_close( ctx );
+     if ( status==0 ) { exit(1); }
 
- /*
-  * Read in the run configuration XML file 
-  *---------------------------------------------------------------------------*/ 
-     if (run_config_filename==NULL ) {
-        printf( "\n\nWARNING: no run configuration file specified. Use the '-c' option to specify one.\n" );
-        printf( "         Default values will be used.\n" );
-        run_config.ps      = 0; 
-        run_config.eps     = 0; 
-        run_config.rose_id = 0; 
-        strcpy( run_config.institution, "ACME Corporation" );
-        strcpy( run_config.model, "my UM model" );
-        strcpy( run_config.ref, "no references listed" );
-        strcpy( run_config.comment, "no comment" );
-        strcpy( run_config.title, "Model Output" );
-        strcpy( run_config.assim, "no data assimilation used" );
-     } else {
-        status = read_config_file( run_config_filename );
-        status_check( status, "ERROR: could not parse run configuration file" ); 
-     }
-
- /*
-  * Determine the type of input UM file specified by user, its endianness
-  * and word size. 
-  *---------------------------------------------------------------------------*/ 
-     status = check_um_file( argv[argc-2], rflag ); 
-     status_check( status, "ERROR: could not determine UM filetype" );
-
- /*
-  * Create a NetCDF file to hold the UM data 
-  *---------------------------------------------------------------------------*/ 
-     printf( "\n==============================================================\n" );
-     printf( "                           UM2NetCDF\n" );
-     printf( "==============================================================\n\n" );
-     printf( "XML Files\n" );
-     printf( "--------------------------------------------------------------\n" );
-     printf( "   UM Stash Code->CF Metadata File : %s\n", argv[argc-1] );
-      printf( "   Run Configuration File          : " );
-     if (run_config_filename==NULL ) { printf( "Not Specified\n\n" ); }
-     else                            { printf( "%s\n\n", run_config_filename ); }  
-
-     printf( "Input UM Data File\n" );
-     printf( "--------------------------------------------------------------\n" );
-     printf( "   Filename  : %s\n", argv[argc-2] );
-     printf( "   Wordsize  : %d\n\n", wordsize );
-
-     ncid = create_netcdf_file( argv[argc-2], iflag, rflag, netcdf_filename );  
- 
- /*
-  * Write the UM data into the NetCDF file 
-  *---------------------------------------------------------------------------*/ 
-     status = fill_netcdf_file( ncid, argv[argc-2], iflag, rflag );  
-     status_check( status, "ERROR: data write to NetCDF file failed" );
-
- /*
-  * Free allocated memory 
-  *---------------------------------------------------------------------------*/ 
-     for ( i=0; i<num_stored_um_fields; i++ ) {
-         free( stored_um_vars[i].times );
-         for ( n=0; n<stored_um_vars[i].nt; n++ )
-             free( stored_um_vars[i].slices[n] );
-         free( stored_um_vars[i].slices );
-     }
- 
-     free( stored_um_vars );  
+     free( opts.select );
+     free( opts.blacklist );
 
      return 0;
 }
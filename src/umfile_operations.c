@@ -30,8 +30,10 @@
 
 /** Function prototypes **/
 
-double ibm2ieee( uint32_t ibm );
-double ibm2ieee_do_nothing( uint32_t ibm );
+void widen_int_words( long *buf, long N );
+const char *select_swap_kernels( um2nc_ctx *ctx, int word_size, int swap );
+int64_t um_date_minutes( const long *w, long calendar );
+int find_stash_definition( um2nc_ctx *ctx, int stash_code );
 
 
 /***
@@ -80,19 +82,241 @@ void endian_swap_4bytes( void *ptr, int nchunk ) {
 void no_endian_swap( void *ptr, int nchunk ) { return; }
 
 
+/***
+ *** ENDIAN_SWAP_{FLOAT,DOUBLE,INT}_#BYTES 
+ ***
+ *** Same as the ENDIAN_SWAP_#BYTES procedures except that the byte-swapped
+ *** words are converted to the type of a separate destination array in the
+ *** same pass.  Used to move data out of the read-only mapping of the input
+ *** UM fields file straight into the values written to the NetCDF file.
+ ***
+ *** Real words are narrowed to single precision and multiplied by SCALE 
+ *** (also in single precision) before being stored, so the values stored in
+ *** a double precision array are the widened single precision results.
+ *** Integer words are truncated to 32 bits.  The NO_ENDIAN_SWAP_* variants
+ *** do the same conversions for files with the endianness of the host.
+ *** 
+ ***  INPUT: dst   -> pointer to the array receiving the converted values
+ ***         src   -> pointer to the words to be byte-swapped
+ ***         N     -> # of words to be converted
+ ***         scale -> scale factor applied to real words
+ ***/
+
+static inline double real_8bytes( const unsigned char *p, int swap ) {
+
+     union { unsigned char b[8]; double d; } u;
+
+     if ( swap ) {
+        u.b[0]=p[7]; u.b[1]=p[6]; u.b[2]=p[5]; u.b[3]=p[4];
+        u.b[4]=p[3]; u.b[5]=p[2]; u.b[6]=p[1]; u.b[7]=p[0];
+     } else { memcpy( u.b, p, 8 ); }
+     return u.d;
+}
+
+static inline float real_4bytes( const unsigned char *p, int swap ) {
+
+     union { unsigned char b[4]; float f; } u;
+
+     if ( swap ) { u.b[0]=p[3]; u.b[1]=p[2]; u.b[2]=p[1]; u.b[3]=p[0]; }
+     else        { memcpy( u.b, p, 4 ); }
+     return u.f;
+}
+
+static inline int32_t int_8bytes( const unsigned char *p, int swap ) {
+
+     uint32_t w;
+     int64_t  v;
+
+     if ( swap ) { w = ((uint32_t ) p[4]<<24) | ((uint32_t ) p[5]<<16) | ((uint32_t ) p[6]<<8) | p[7]; }
+     else        { memcpy( &v, p, 8 ); w = (uint32_t ) v; }
+     return (int32_t ) w;
+}
+
+static inline int32_t int_4bytes( const unsigned char *p, int swap ) {
+
+     uint32_t w;
+
+     if ( swap ) { w = ((uint32_t ) p[0]<<24) | ((uint32_t ) p[1]<<16) | ((uint32_t ) p[2]<<8) | p[3]; }
+     else        { memcpy( &w, p, 4 ); }
+     return (int32_t ) w;
+}
+
+void endian_swap_float_8bytes( float *dst, const void *src, int N, float scale ) {
+     int i;
+     for ( i=0; i<N; i++ ) { dst[i] = scale*((float ) real_8bytes( (const unsigned char *) src + 8*i, 1 )); }
+}
+
+void endian_swap_double_8bytes( double *dst, const void *src, int N, float scale ) {
+     int i;
+     for ( i=0; i<N; i++ ) { dst[i] = (double ) (scale*((float ) real_8bytes( (const unsigned char *) src + 8*i, 1 ))); }
+}
+
+void endian_swap_int_8bytes( int *dst, const void *src, int N ) {
+     int i;
+     for ( i=0; i<N; i++ ) { dst[i] = int_8bytes( (const unsigned char *) src + 8*i, 1 ); }
+}
+
+void endian_swap_float_4bytes( float *dst, const void *src, int N, float scale ) {
+     int i;
+     for ( i=0; i<N; i++ ) { dst[i] = scale*real_4bytes( (const unsigned char *) src + 4*i, 1 ); }
+}
+
+void endian_swap_double_4bytes( double *dst, const void *src, int N, float scale ) {
+     int i;
+     for ( i=0; i<N; i++ ) { dst[i] = (double ) (scale*real_4bytes( (const unsigned char *) src + 4*i, 1 )); }
+}
+
+void endian_swap_int_4bytes( int *dst, const void *src, int N ) {
+     int i;
+     for ( i=0; i<N; i++ ) { dst[i] = int_4bytes( (const unsigned char *) src + 4*i, 1 ); }
+}
+
+void no_endian_swap_float_8bytes( float *dst, const void *src, int N, float scale ) {
+     int i;
+     for ( i=0; i<N; i++ ) { dst[i] = scale*((float ) real_8bytes( (const unsigned char *) src + 8*i, 0 )); }
+}
+
+void no_endian_swap_double_8bytes( double *dst, const void *src, int N, float scale ) {
+     int i;
+     for ( i=0; i<N; i++ ) { dst[i] = (double ) (scale*((float ) real_8bytes( (const unsigned char *) src + 8*i, 0 ))); }
+}
+
+void no_endian_swap_int_8bytes( int *dst, const void *src, int N ) {
+     int i;
+     for ( i=0; i<N; i++ ) { dst[i] = int_8bytes( (const unsigned char *) src + 8*i, 0 ); }
+}
+
+void no_endian_swap_float_4bytes( float *dst, const void *src, int N, float scale ) {
+     int i;
+     for ( i=0; i<N; i++ ) { dst[i] = scale*real_4bytes( (const unsigned char *) src + 4*i, 0 ); }
+}
+
+void no_endian_swap_double_4bytes( double *dst, const void *src, int N, float scale ) {
+     int i;
+     for ( i=0; i<N; i++ ) { dst[i] = (double ) (scale*real_4bytes( (const unsigned char *) src + 4*i, 0 )); }
+}
+
+void no_endian_swap_int_4bytes( int *dst, const void *src, int N ) {
+     int i;
+     for ( i=0; i<N; i++ ) { dst[i] = int_4bytes( (const unsigned char *) src + 4*i, 0 ); }
+}
+
+
+/***
+ *** WIDEN_INT_WORDS / WIDEN_REAL_WORDS
+ ***
+ *** Widen N 32-bit integer (real) words held at the start of an array of 
+ *** longs (doubles) into the whole array.  The words are widened from the
+ *** last one down so that no word is overwritten before it is read, which
+ *** lets 32-bit words be read straight into the arrays that hold them.
+ ***
+ ***  INPUT/OUTPUT: buf -> array holding N packed 32-bit words on input and 
+ ***                       their widened values on output
+ ***/
+
+void widen_int_words( long *buf, long N ) {
+
+     long    i;
+     int32_t w;
+
+     for ( i=N-1; i>=0; i-- ) {
+         memcpy( &w, (unsigned char *) buf + 4*i, 4 );
+         buf[i] = (long ) w;
+     }
+
+     return;
+}
+
+void widen_real_words( double *buf, long N ) {
+
+     long  i;
+     float w;
+
+     for ( i=N-1; i>=0; i-- ) {
+         memcpy( &w, (unsigned char *) buf + 4*i, 4 );
+         buf[i] = (double ) w;
+     }
+
+     return;
+}
+
+
+/***
+ *** READ_INT_WORDS / READ_REAL_WORDS
+ ***
+ *** Read N integer (real) words from the current position of the input UM
+ *** fields file into an array of longs (doubles), byte-swapping them if 
+ *** required.  The words of a 32-bit fieldsfile are read into the first half
+ *** of the array and widened in place.
+ ***
+ ***  INPUT:  ctx -> conversion context of the input UM fields file
+ ***          fh  -> file handle/pointer of the input UM fields file
+ ***          N   -> # of words to be read
+ ***
+ ***  OUTPUT: dst -> array of N longs (doubles) receiving the words
+ ***
+ *** Function returns the # of words read.
+ ***/
+
+long read_int_words( um2nc_ctx *ctx, FILE *fh, long *dst, long N ) {
+
+     long n;
+
+     n = (long ) fread( dst, ctx->wordsize, N, fh );
+     ctx->endian_swap( dst, (int ) n );
+     if ( ctx->wordsize==4 ) { widen_int_words( dst, n ); }
+
+     return n;
+}
+
+long read_real_words( um2nc_ctx *ctx, FILE *fh, double *dst, long N ) {
+
+     long n;
+
+     n = (long ) fread( dst, ctx->wordsize, N, fh );
+     ctx->endian_swap( dst, (int ) n );
+     if ( ctx->wordsize==4 ) { widen_real_words( dst, n ); }
+
+     return n;
+}
+
+
+/***
+ *** REAL_WORD
+ ***
+ *** Returns word N of a (byte-swapped but not widened) record of the input 
+ *** UM fields file as a real value.
+ ***/
+
+double real_word( um2nc_ctx *ctx, const void *rec, int n ) {
+
+     float  f;
+     double d;
+
+     if ( ctx->wordsize==4 ) {
+        memcpy( &f, (const unsigned char *) rec + 4*n, 4 );
+        return (double ) f;
+     }
+     memcpy( &d, (const unsigned char *) rec + 8*n, 8 );
+     return d;
+}
+
+
 /***
  *** GET_FILE_ENDIANNESS_WORDSIZE 
  ***
  *** Function that determines the appropriate wordsize and endianness of the 
- *** user-supplied input UM fields file. 
+ *** user-supplied input UM fields file, whose fixed-length header is read 
+ *** into the conversion context. 
  ***
- *** INPUT:  fh -> file handle/pointer of the input UM fields file
+ *** INPUT:  ctx -> conversion context of the input UM fields file
+ ***         fh  -> file handle/pointer of the input UM fields file
  ***
  ***   Mark Cheeseman, NIWA
  ***   January 16, 2014
  ***/
 
-int get_file_endianness_wordsize( FILE *fh ) {
+int get_file_endianness_wordsize( um2nc_ctx *ctx, FILE *fh ) {
 
     int word_size;
 
@@ -102,19 +326,15 @@ int get_file_endianness_wordsize( FILE *fh ) {
    *----------------------------------------------------------------------*/
     word_size = 8;
     fseek( fh, 0, SEEK_SET );
-    fread( header, word_size, 256, fh );
+    fread( ctx->header, word_size, 256, fh );
 
-    if ( (header[1]==1)&&(header[150]==64) ) {
-       endian_swap = &no_endian_swap;
-       endian_swap_4b = &no_endian_swap;
-       ibm2ieee_convert = &ibm2ieee_do_nothing;
+    if ( (ctx->header[1]==1)&&(ctx->header[150]==64) ) {
+       select_swap_kernels( ctx, 8, 0 );
        return word_size;
     } else {
-       endian_swap = &endian_swap_8bytes;
-       endian_swap_4b = &endian_swap_4bytes;
-       endian_swap( header, 256 );
-       ibm2ieee_convert = &ibm2ieee;
-       if ( (header[1]==1)&&(header[150]==64) ) {
+       select_swap_kernels( ctx, 8, 1 );
+       ctx->endian_swap( ctx->header, 256 );
+       if ( (ctx->header[1]==1)&&(ctx->header[150]==64) ) {
           return word_size;
        }
     }
@@ -125,20 +345,19 @@ int get_file_endianness_wordsize( FILE *fh ) {
    *----------------------------------------------------------------------*/
     word_size = 4;
     fseek( fh, 0, SEEK_SET );
-    fread( header, word_size, 256, fh );
-    printf( "%ld %ld\n", header[1], header[150] );
+    fread( ctx->header, word_size, 256, fh );
+    widen_int_words( ctx->header, 256 );
 
-    if ( (header[1]==1)&&(header[150]==64) ) {
-       endian_swap = &no_endian_swap;
-       endian_swap_4b = &no_endian_swap;
-       ibm2ieee_convert = &ibm2ieee_do_nothing;
+    if ( (ctx->header[1]==1)&&(ctx->header[150]==64) ) {
+       select_swap_kernels( ctx, 4, 0 );
        return word_size;
     } else {
-       endian_swap = &endian_swap_4bytes;
-       endian_swap_4b = &endian_swap_4bytes;
-       ibm2ieee_convert = &ibm2ieee;
-       endian_swap( header, 256 );
-       if ( (header[1]==1)&&(header[150]==64) ) {
+       select_swap_kernels( ctx, 4, 1 );
+       fseek( fh, 0, SEEK_SET );
+       fread( ctx->header, word_size, 256, fh );
+       ctx->endian_swap( ctx->header, 256 );
+       widen_int_words( ctx->header, 256 );
+       if ( (ctx->header[1]==1)&&(ctx->header[150]==64) ) {
           return word_size;
        }
     }
@@ -149,30 +368,448 @@ int get_file_endianness_wordsize( FILE *fh ) {
 }
 
 
+/***
+ *** STASH_SLOT
+ ***
+ *** Returns the hash slot holding STASH code CODE, or the empty slot where it
+ *** would be inserted (open addressing with linear probing).
+ ***/
+
+int stash_slot( stash_index *si, long code ) {
+
+     unsigned long h;
+
+     h = ((unsigned long ) code * 2654435761UL) & (unsigned long ) (si->size-1);
+     while ( (si->slot[h]!=-1)&&(si->code[si->slot[h]]!=code) ) { h = (h+1) & (unsigned long ) (si->size-1); }
+
+     return (int ) h;
+}
+
+
+/***
+ *** BUILD_STASH_INDEX
+ ***
+ *** Groups N entries by STASH code in 2 passes: the first counts the entries of
+ *** each unique code, the second places each entry in its code's group.
+ ***
+ ***  INPUT:  codes -> STASH code of each entry
+ ***         n     -> # of entries
+ ***
+ ***  OUTPUT: si    -> index of the entries by STASH code
+ ***/
+
+void build_stash_index( const long *codes, int n, stash_index *si ) {
+
+     int i, h, *fill;
+
+     si->size = 16;
+     while ( si->size<2*n ) { si->size *= 2; }
+     si->slot  = (int *) malloc( si->size*sizeof(int) );
+     si->code  = (long *) malloc( (n+1)*sizeof(long) );
+     si->count = (int *) calloc( n+1, sizeof(int) );
+     si->first = (int *) malloc( (n+1)*sizeof(int) );
+     si->entry = (int *) malloc( (n+1)*sizeof(int) );
+     si->num   = 0;
+     for ( i=0; i<si->size; i++ ) { si->slot[i] = -1; }
+
+  /** Count the entries of each unique code **/
+     for ( i=0; i<n; i++ ) {
+         h = stash_slot( si, codes[i] );
+         if ( si->slot[h]==-1 ) {
+            si->slot[h] = si->num;
+            si->code[si->num] = codes[i];
+            si->num++;
+         }
+         si->count[si->slot[h]]++;
+     }
+
+  /** Place the entries of each code one after the other, in their original order **/
+     fill = (int *) malloc( (si->num+1)*sizeof(int) );
+     h = 0;
+     for ( i=0; i<si->num; i++ ) { si->first[i] = h; fill[i] = h; h += si->count[i]; }
+     for ( i=0; i<n; i++ ) {
+         h = si->slot[stash_slot( si, codes[i] )];
+         si->entry[fill[h]] = i;
+         fill[h]++;
+     }
+     free( fill );
+
+     return;
+}
+
+
+/***
+ *** FIND_STASH
+ ***
+ *** Returns the group of STASH code CODE in a stash index, or -1 if the code
+ *** has no entries.
+ ***/
+
+int find_stash( stash_index *si, long code ) {
+
+     return si->slot[stash_slot( si, code )];
+}
+
+
+/***
+ *** FREE_STASH_INDEX
+ ***/
+
+void free_stash_index( stash_index *si ) {
+
+     free( si->slot );
+     free( si->code );
+     free( si->count );
+     free( si->first );
+     free( si->entry );
+     memset( si, 0, sizeof(stash_index) );
+
+     return;
+}
+
+
+/***
+ *** HAS_STASH_CODE
+ ***
+ *** Returns 1 if STASH code CODE is in a set of STASH codes, 0 if not.
+ ***/
+
+int has_stash_code( stash_set *set, int code ) {
+
+     unsigned long h;
+
+     if ( set->size==0 ) { return 0; }
+
+     h = ((unsigned long ) code * 2654435761UL) & (unsigned long ) (set->size-1);
+     while ( set->slot[h]!=-1 ) {
+           if ( set->slot[h]==code ) { return 1; }
+           h = (h+1) & (unsigned long ) (set->size-1);
+     }
+
+     return 0;
+}
+
+
+/***
+ *** ADD_STASH_CODE
+ ***
+ *** Adds STASH code CODE to a set of STASH codes, doubling the # of hash slots
+ *** whenever the set becomes half full.
+ ***/
+
+void add_stash_code( stash_set *set, int code ) {
+
+     int i, *old, old_size;
+     unsigned long h;
+
+     if ( has_stash_code( set, code )==1 ) { return; }
+
+     if ( 2*(set->num+1)>set->size ) {
+        old      = set->slot;
+        old_size = set->size;
+        set->size = ( old_size==0 ) ? 64 : 2*old_size;
+        set->slot = (int *) malloc( set->size*sizeof(int) );
+        for ( i=0; i<set->size; i++ ) { set->slot[i] = -1; }
+        set->num = 0;
+        for ( i=0; i<old_size; i++ ) 
+            if ( old[i]!=-1 ) { add_stash_code( set, old[i] ); }
+        free( old );
+     }
+
+     h = ((unsigned long ) code * 2654435761UL) & (unsigned long ) (set->size-1);
+     while ( set->slot[h]!=-1 ) { h = (h+1) & (unsigned long ) (set->size-1); }
+     set->slot[h] = code;
+     set->num++;
+
+     return;
+}
+
+
+/***
+ *** PARSE_STASH_SPEC
+ ***
+ *** Parses a STASH code specification given on the command line: a single
+ *** STASH code (16202), a range of STASH codes (16200-16299), a section & item
+ *** (16:202) or a whole section (16:*; 0:* covers items 1-999, as there is
+ *** no STASH code 0).  Returns 1 and the first & last STASH codes described
+ *** in LO & HI, or 0 if the argument is not a STASH code specification.
+ ***/
+
+int parse_stash_spec( const char *spec, long *lo, long *hi ) {
+
+     long  item;
+     char *end, *end2;
+
+     *lo = strtol( spec, &end, 10 );
+     if ( end==spec ) { return 0; }
+
+     if ( *end==':' ) {
+        if ( (*lo<0)||(*lo>99) ) { return 0; }
+        if ( strcmp( end+1, "*" )==0 ) { 
+           *hi = 1000*(*lo) + 999;
+           *lo = ( *lo==0 ) ? 1 : 1000*(*lo);
+        } else {
+           item = strtol( end+1, &end2, 10 );
+           if ( (end2==end+1)||(*end2!='\0')||(item<0)||(item>999) ) { return 0; }
+           *lo = 1000*(*lo) + item;
+           *hi = *lo;
+        }
+     } else if ( *end=='-' ) {
+        *hi = strtol( end+1, &end2, 10 );
+        if ( (end2==end+1)||(*end2!='\0') ) { return 0; }
+     } else if ( *end=='\0' ) {
+        *hi = *lo;
+     } else {
+        return 0;
+     }
+
+     if ( (*lo<1)||(*hi>99999)||(*lo>*hi) ) { return 0; }
+
+     return 1;
+}
+
+
+/***
+ *** ADD_STASH_SPEC
+ ***
+ *** Adds the STASH codes described by a command-line argument (see 
+ *** PARSE_STASH_SPEC) to a set of STASH codes.  Returns the # of STASH codes
+ *** described, or 0 if the argument is not a STASH code specification (which
+ *** ends a list of them).
+ ***/
+
+int add_stash_spec( stash_set *set, const char *spec ) {
+
+     long lo, hi, c;
+
+     if ( parse_stash_spec( spec, &lo, &hi )==0 ) { return 0; }
+
+     for ( c=lo; c<=hi; c++ ) { add_stash_code( set, (int ) c ); }
+
+     return (int ) (hi-lo+1);
+}
+
+
+/***
+ *** FREE_STASH_SET
+ ***/
+
+void free_stash_set( stash_set *set ) {
+
+     free( set->slot );
+     memset( set, 0, sizeof(stash_set) );
+
+     return;
+}
+
+
+/**
+ ** key_entry - Integer key (a time offset or LBPROC value) of an entry in a
+ **             list, sorted together with the entry's position in the list.
+ **/
+
+typedef struct key_entry {
+        long key;
+        int  pos;
+} key_entry;
+
+int compare_key_entries( const void *a, const void *b ) {
+
+     const key_entry *x = (const key_entry *) a, *y = (const key_entry *) b;
+
+     if ( x->key!=y->key ) { return ( x->key<y->key ) ? -1 : 1; }
+     return x->pos - y->pos;
+}
+
+int compare_ints( const void *a, const void *b ) {
+
+     return *(const int *) a - *(const int *) b;
+}
+
+
+/***
+ *** UNIQUE_KEYS
+ ***
+ *** Finds the unique values in a list of N integer keys by sorting the keys
+ *** (with their positions) and taking the first entry of each run of equal
+ *** keys.  Returns the # of unique keys.
+ ***
+ ***  INPUT:  key   -> list of keys
+ ***         n     -> # of keys
+ ***
+ ***  OUTPUT: first -> position of the first occurrence of each unique key, in
+ ***                   order of first appearance
+ ***/
+
+int unique_keys( const long *key, int n, int *first ) {
+
+     int i, num;
+     key_entry *ent;
+
+     ent = (key_entry *) malloc( (n+1)*sizeof(key_entry) );
+     for ( i=0; i<n; i++ ) { ent[i].key = key[i]; ent[i].pos = i; }
+     qsort( ent, n, sizeof(key_entry), compare_key_entries );
+
+     num = 0;
+     for ( i=0; i<n; i++ ) 
+         if ( (i==0)||(ent[i].key!=ent[i-1].key) ) { first[num] = ent[i].pos; num++; }
+     qsort( first, num, sizeof(int), compare_ints );
+
+     free( ent );
+     return num;
+}
+
+
+/***
+ *** SLICE_TIME_KEY
+ ***
+ *** Returns the offset (in minutes) between the validity time of a lookup
+ *** entry (words 0-4) and its data time (words 6-10).  Accumulated fields
+ *** record only a relative time offset (in hours) to a reference value stored
+ *** elsewhere in the lookup entry.
+ ***/
+
+long slice_time_key( um2nc_ctx *ctx, const long *rec ) {
+
+     long dt;
+
+     dt = (long ) (um_date_minutes( &rec[0], ctx->header[7] ) - um_date_minutes( &rec[6], ctx->header[7] ));
+     if ( dt<0 ) { dt = 60L*rec[13]; }
+
+     return dt;
+}
+
+
+/***
+ *** ALLOC_SLICE_TABLE
+ ***
+ *** Allocates room for N 2D data slices in the (empty) slice table of a
+ *** conversion context.
+ ***/
+
+void alloc_slice_table( um2nc_ctx *ctx, long n ) {
+
+     n++;
+     ctx->stored_slices.num       = 0;
+     ctx->stored_slices.id        = (long *) malloc( n*sizeof(long) );
+     ctx->stored_slices.location  = (long *) malloc( n*sizeof(long) );
+     ctx->stored_slices.reclength = (long *) malloc( n*sizeof(long) );
+     ctx->stored_slices.size      = (long *) malloc( n*sizeof(long) );
+     ctx->stored_slices.lbproc    = (int *) malloc( n*sizeof(int) );
+     ctx->stored_slices.level     = (unsigned short *) malloc( n*sizeof(unsigned short) );
+     ctx->stored_slices.lbpack    = (unsigned short *) malloc( n*sizeof(unsigned short) );
+     ctx->stored_slices.mdi       = (double *) malloc( n*sizeof(double) );
+     ctx->stored_slices.validity  = (int64_t *) malloc( n*sizeof(int64_t) );
+     ctx->stored_slices.datatime  = (int64_t *) malloc( n*sizeof(int64_t) );
+
+     return;
+}
+
+
+/***
+ *** FREE_SLICE_TABLE
+ ***/
+
+void free_slice_table( um2nc_ctx *ctx ) {
+
+     free( ctx->stored_slices.id );
+     free( ctx->stored_slices.location );
+     free( ctx->stored_slices.reclength );
+     free( ctx->stored_slices.size );
+     free( ctx->stored_slices.lbproc );
+     free( ctx->stored_slices.level );
+     free( ctx->stored_slices.lbpack );
+     free( ctx->stored_slices.mdi );
+     free( ctx->stored_slices.validity );
+     free( ctx->stored_slices.datatime );
+     memset( &ctx->stored_slices, 0, sizeof(slice_table) );
+
+     return;
+}
+
+
+/***
+ *** GROUP_SLICES
+ ***
+ *** Assigns N lookup entries (in file order) to the 2D data slices of a UM
+ *** variable, which are appended to the slice table.  The unique time offsets
+ *** of the entries, in order of first appearance, become the variable's times
+ *** and the entries fill the slices time by time.  Returns the # of entries 
+ *** left over if N is not a multiple of the # of unique times.
+ ***
+ ***  INPUT:  ids    -> lookup indices of the entries
+ ***         n      -> # of entries
+ ***         lookup -> lookup table of the input UM fields file
+ ***
+ ***  OUTPUT: var    -> UM variable with its times, slices and LBPROC set
+ ***/
+
+int group_slices( um2nc_ctx *ctx, new_um_variable *var, const int *ids, int n, long **lookup ) {
+
+     int  i, cnt, *first;
+     long *keys;
+
+     keys  = (long *) malloc( (n+1)*sizeof(long) );
+     first = (int *) malloc( (n+1)*sizeof(int) );
+     for ( i=0; i<n; i++ ) { keys[i] = slice_time_key( ctx, lookup[ids[i]] ); }
+
+     var->nt = unique_keys( keys, n, first );
+     var->nz = ( var->nt>0 ) ? n/var->nt : 0;
+     var->times = (float *) malloc( ((int )var->nt+1)*sizeof(float) );
+     for ( i=0; i<var->nt; i++ ) { var->times[i] = (float ) (keys[first[i]]/60.0); }
+
+     var->first_slice = ctx->stored_slices.num;
+     cnt = (int ) var->nt*var->nz;
+     for ( i=0; i<cnt; i++ ) { ctx->stored_slices.id[ctx->stored_slices.num+i] = (long ) ids[i]; }
+     ctx->stored_slices.num += cnt;
+     if ( n>0 ) { var->lbproc = (unsigned short ) lookup[ids[0]][24]; }
+
+     free( keys );
+     free( first );
+     return n - cnt;
+}
+
+
+/***
+ *** UNGROUP_SLICES
+ ***
+ *** Removes the 2D data slices of a UM variable, which must be the last ones
+ *** appended to the slice table, & frees its times.
+ ***/
+
+void ungroup_slices( um2nc_ctx *ctx, new_um_variable *var ) {
+
+     ctx->stored_slices.num = var->first_slice;
+     free( var->times );
+
+     return;
+}
+
+
 /***
  *** CHECK_UM_FILE 
  ***
  *** Subroutine that opens the user-specified UM input file and determines 
- *** its type, its endianness and wordsize. 
+ *** its type, its endianness and wordsize.  The valid lookup records are
+ *** indexed once by STASH code, so that the records of each UM variable are
+ *** found without rescanning the whole lookup table.  The variables' names &
+ *** CF metadata are assigned afterwards by ASSIGN_STASH_METADATA, once the
+ *** XML definitions of the STASH codes found here have been read.
  ***
  ***   Mark Cheeseman, NIWA
  ***   November 29, 2013
  ***/
 
-int check_um_file( char *filename, int rflag ) {
+int check_um_file( um2nc_ctx *ctx, const char *filename ) {
 
-     const int MAX_NUM_FIELDS=250;  /** Max # of UM variables that can be defined **/
-
-     unsigned short *temp, num_lbproc, *temp_id=NULL, ntmp;
-     int    i, j, k, kk, ind, flag, cnt, nrec, *lbprocs;
+     int    i, j, k, ind, g, cnt, nrec, *first, *temp_id=NULL, *group, num_lbproc, ntmp;
+     long   s, s1;
      int    modified_num_stored_um_fields;
-     long   **tmp, **lookup;
-     size_t n;
+     long   **lookup, *lookup_words, *raw, *codes, *keys, nwords, nrecs;
+     unsigned char *rec;
+     stash_index si;
      FILE   *fid;
-     struct tm t1, t2;
-     char   varname[60];
-     double *tdiff;
-     float tol;
+     double *bmdi;
 
 /**
  ** Attempt to open the file 
@@ -183,448 +820,222 @@ int check_um_file( char *filename, int rflag ) {
 /**
  ** Initialize the word size of the input UM fields file 
  **---------------------------------------------------------------------------*/
-     wordsize = get_file_endianness_wordsize( fid );
-     if ( wordsize==-1 ) {
+     ctx->wordsize = get_file_endianness_wordsize( ctx, fid );
+     if ( ctx->wordsize==-1 ) {
         printf( "ERROR: incorrect wordsize detected!\n" );
-        exit(1);  
+        fclose( fid );
+        return 0;  
      }
 
 /**
  ** Read in the REAL CONSTANTS array 
  **---------------------------------------------------------------------------*/
-     fseek( fid, (header[104]-1)*wordsize, SEEK_SET );
-     fread( real_constants, wordsize, 6, fid );
-     endian_swap( real_constants,6 );
+     fseek( fid, (ctx->header[104]-1)*ctx->wordsize, SEEK_SET );
+     read_real_words( ctx, fid, ctx->real_constants, 6 );
    
 /**
  ** Read in the INTEGER CONSTANTS array 
  **---------------------------------------------------------------------------*/
-     fseek( fid, (header[99]-1)*wordsize, SEEK_SET );
-     fread( int_constants, wordsize, 46, fid );
-     endian_swap( int_constants,46 );
+     fseek( fid, (ctx->header[99]-1)*ctx->wordsize, SEEK_SET );
+     read_int_words( ctx, fid, ctx->int_constants, 46 );
 
 /**
  ** Read in the LEVEL DEPENDENT CONSTANTS array 
  **---------------------------------------------------------------------------*/
-     fseek( fid, (header[109]-1)*wordsize, SEEK_SET );
-     level_constants = (double **) malloc( header[111]*sizeof(long *) );
-
-     for ( nrec=0; nrec<header[111]; nrec++ ) {
-         level_constants[nrec] = (double *) malloc( header[110]*sizeof(long) );
-         n = fread( level_constants[nrec], wordsize, header[110], fid );
-         endian_swap( level_constants[nrec],header[110] ); 
+     fseek( fid, (ctx->header[109]-1)*ctx->wordsize, SEEK_SET );
+     ctx->level_constants = (double **) malloc( ctx->header[111]*sizeof(double *) );
+     ctx->num_level_rows  = (int ) ctx->header[111];
+
+     for ( nrec=0; nrec<ctx->header[111]; nrec++ ) {
+         ctx->level_constants[nrec] = (double *) malloc( ctx->header[110]*sizeof(double) );
+         if ( read_real_words( ctx, fid, ctx->level_constants[nrec], ctx->header[110] )<ctx->header[110] ) {
+            printf( "ERROR: could not read the level dependent constants\n" );
+            ctx->num_level_rows = nrec + 1;
+            fclose( fid );
+            return 0;
+         }
      }
 
 /**
- ** Read in the LOOKUP table 
+ ** Read in the LOOKUP table (in a single read & byte-swap pass)
  **---------------------------------------------------------------------------*/
-     fseek( fid, (header[149]-1)*wordsize, SEEK_SET );
-     tmp = (long **) malloc( header[151]*sizeof(long *) );
-
-     for ( nrec=0; nrec<header[151]; nrec++ ) {
-         tmp[nrec] = (long *) malloc( header[150]*sizeof(long) );
-         n = fread( tmp[nrec], wordsize, header[150], fid );
-         endian_swap( tmp[nrec],header[150] ); 
-     }
+     fseek( fid, (ctx->header[149]-1)*ctx->wordsize, SEEK_SET );
+     nwords = ctx->header[150]*ctx->header[151];
+     raw    = (long *) malloc( (nwords+1)*sizeof(long) );
+     nwords = (long ) fread( raw, ctx->wordsize, nwords, fid );
+     ctx->endian_swap( raw, (int ) nwords ); 
+     nrecs  = ( ctx->header[150]>0 ) ? nwords/ctx->header[150] : 0;
 
 /**
- ** Determine how many read entries belong to valid UM data slices [NUM_UM_VARS] 
+ ** Gather the lookup entries that belong to valid UM data slices into a 
+ ** condensed block (called LOOKUP) [NUM_UM_VARS].  Only take the first 45 
+ ** words per UM field as there is a datatype change from long to double after
+ ** that point; word 63 (the missing data value) is a real.
  **---------------------------------------------------------------------------*/
+     lookup_words = (long *) malloc( (45*ctx->header[151]+1)*sizeof(long) );
+     lookup       = (long **) malloc( (ctx->header[151]+1)*sizeof(long *) );
+     bmdi         = (double *) malloc( (ctx->header[151]+1)*sizeof(double) );
+
      cnt = 0;
-     for ( nrec=0; nrec<header[151]; nrec++ ) {
-         if ( (tmp[nrec][28]!=-99) && (tmp[nrec][17]>0) && (tmp[nrec][18]>0) ) {
+     for ( nrec=0; nrec<nrecs; nrec++ ) {
+         rec = (unsigned char *) raw + nrec*ctx->header[150]*ctx->wordsize;
+         lookup[cnt] = lookup_words + 45*cnt;
+         memcpy( lookup[cnt], rec, 45*ctx->wordsize );
+         if ( ctx->wordsize==4 ) { widen_int_words( lookup[cnt], 45 ); }
+
+         if ( (lookup[cnt][28]!=-99) && (lookup[cnt][17]>0) && (lookup[cnt][18]>0) ) {
+            bmdi[cnt] = ( ctx->header[150]>62 ) ? real_word( ctx, rec, 62 ) : -1073741824.0;
             cnt++; 
          }
      }
-     num_um_vars = cnt;
+     ctx->num_um_vars = cnt;
+     free( raw );
 
 /**
- ** Gather all the valid lookup entries into a condensed array (called LOOKUP)) 
- ** Only take the first 45 entires per UM field as there is a datatype change
- ** from long to double after that point.
+ ** Index the valid lookup entries by STASH code 
  **---------------------------------------------------------------------------*/
-     lookup = (long **) malloc( cnt*sizeof(long *) );
-
-     cnt = 0;
-     for ( nrec=0; nrec<header[151]; nrec++ ) {
-         if ( (tmp[nrec][28]!=-99) && (tmp[nrec][17]>0) && (tmp[nrec][18]>0) ) {
-            lookup[cnt] = (long *) malloc( 45*sizeof(long) );
-            for ( n=0; n<45; n++ ) {
-                lookup[cnt][n] = tmp[nrec][n]; 
-            } 
-            cnt++;
-         }
-     }
-
-     for ( nrec=0; nrec<header[151]; nrec++ )
-           free( tmp[nrec] );
-     free( tmp );
+     codes = (long *) malloc( (ctx->num_um_vars+1)*sizeof(long) );
+     for ( i=0; i<ctx->num_um_vars; i++ ) { codes[i] = lookup[i][41]; }
+     build_stash_index( codes, ctx->num_um_vars, &si );
+     free( codes );
 
 /**
- ** If the user has NOT requested specific stash codes, determine # of unique 
- ** UM variables found in the input UM fields file 
+ ** The UM variables to be stored are the unique STASH codes found in the input
+ ** UM fields file (in order of first appearance) that the user selected (all
+ ** of them if none were selected) and did not blacklist.
  **---------------------------------------------------------------------------*/
-     if ( num_stored_um_fields==0) {
-        temp = (unsigned short *) malloc( MAX_NUM_FIELDS*sizeof(unsigned short) );
-
-        flag = 0;
-        for ( j=0; j<num_um_vars; j++ ) {
-
-            if ( num_stored_um_fields>0 ) {
-               flag = 0;
-               for ( i=0; i<num_stored_um_fields; i++ )
-                   if ( temp[i]==lookup[j][41] ) { flag=1; }
-            }
-
-            if ( flag==1 ) { continue; }  
-
-            temp[num_stored_um_fields] = (unsigned short ) lookup[j][41];
-            num_stored_um_fields++;
-        }
-
-     /*** Apply the blacklist (if necessary) ***/
-        if ( blacklist_cnt>0 ) {
-           for ( j=0; j<blacklist_cnt; j++ ) {
-               for ( i=0; i<num_stored_um_fields; i++ ) 
-                   if ( blacklist[j]==temp[i] ) { temp[i] = 999; }
-           }
-
-           cnt = 0;
-           for ( i=0; i<num_stored_um_fields; i++ )
-               if ( temp[i]!=999 )  { cnt++; } 
-
-           temp_id = (unsigned short int *) malloc( cnt*sizeof(unsigned short int) );
-           cnt = 0;
-           for ( i=0; i<num_stored_um_fields; i++ )
-               if ( temp[i]!=999 )  { temp_id[cnt] = temp[i]; cnt++; } 
-           
-           num_stored_um_fields = cnt;
-           temp = (unsigned short int *) realloc( temp, (int )num_stored_um_fields*sizeof(unsigned short int) );
-           for ( i=0; i<num_stored_um_fields; i++ )
-               temp[i] = temp_id[i];
-   
-           free( temp_id );
-        }
-
-     /*** Allocate UM variable data structure ***/ 
-        stored_um_vars = (new_um_variable *) malloc( num_stored_um_fields*sizeof(new_um_variable) );
-        for ( j=0; j<num_stored_um_fields; j++ ) {
-            stored_um_vars[j].stash_code = temp[j];
-            stored_um_vars[j].nz         = 0;
-            stored_um_vars[j].nt         = 0;
-        }
+     ctx->stored_um_vars = (new_um_variable *) malloc( (si.num+1)*sizeof(new_um_variable) );
+     ctx->num_stored_um_fields = 0;
+     for ( g=0; g<si.num; g++ ) {
+         if ( (ctx->selected_stash.num>0)&&(has_stash_code( &ctx->selected_stash, (int ) si.code[g] )==0) ) { continue; }
+         if ( has_stash_code( &ctx->blacklist, (int ) si.code[g] )==1 ) { continue; }
+
+         ctx->stored_um_vars[ctx->num_stored_um_fields].stash_code = (int ) si.code[g];
+         ctx->stored_um_vars[ctx->num_stored_um_fields].nz         = 0;
+         ctx->stored_um_vars[ctx->num_stored_um_fields].nt         = 0;
+         ctx->num_stored_um_fields++;
+     }
 
-        free( temp );
+     if ( ctx->num_stored_um_fields==0 ) { 
+        printf( "WARNING: none of the selected stash codes were found in the input UM fields file\n" );
      }
 
 /**
  ** Assign the 2D data slices found in the input UM data file to the 
  ** appropriate UM data structure. 
  **---------------------------------------------------------------------------*/
-     modified_num_stored_um_fields = num_stored_um_fields;
-     for ( j=0; j<num_stored_um_fields; j++ ) {
-
-     /** How many 2D data slices belong to this variable in total? **/
-         for ( i=0; i<num_um_vars; i++ ) 
-             if ( stored_um_vars[j].stash_code==(unsigned short )lookup[i][41] ) { stored_um_vars[j].nz++; }
- 
-     /** Which 2D data slices belong to this variable? **/
-         temp_id = (unsigned short *) malloc( (int )stored_um_vars[j].nz*sizeof(unsigned short) );
-         cnt = 0;
-         for ( i=0; i<num_um_vars; i++ ) {
-             if ( stored_um_vars[j].stash_code==(unsigned short )lookup[i][41] ) { 
-                temp_id[cnt] = (unsigned short int ) i;
-                cnt++;
-            }
-         }
-
-     /** What is the offset from the reference forecast time for each 2D data slice  **/
-     /** belonging to this variable?                                                 **/
-         tdiff = (double *) malloc( (int )stored_um_vars[j].nz*sizeof(double) );
-         for ( i=0; i<stored_um_vars[j].nz; i++ ) {
-
-         /* Read in validity time */
-             t1.tm_year = (int ) lookup[temp_id[i]][0];
-             t1.tm_mon  = (int ) (lookup[temp_id[i]][1]-1);
-             t1.tm_mday = (int ) lookup[temp_id[i]][2];
-             t1.tm_hour = (int ) lookup[temp_id[i]][3];
-             t1.tm_min  = (int ) lookup[temp_id[i]][4];
-             t1.tm_sec  = (int ) lookup[temp_id[i]][5];
-
-         /* Read in time of the instanteous output */
-             t2.tm_year = (int ) lookup[temp_id[i]][6];
-             t2.tm_mon  = (int ) (lookup[temp_id[i]][7]-1);
-             t2.tm_mday = (int ) lookup[temp_id[i]][8];
-             t2.tm_hour = (int ) lookup[temp_id[i]][9];
-             t2.tm_min  = (int ) lookup[temp_id[i]][10];
-             t2.tm_sec  = (int ) lookup[temp_id[i]][11];
-
-         /* Find the difference between the instantaneous and validity times in hours */
-             tdiff[i] = difftime ( mktime(&t1), mktime(&t2) )/3600.0; 
-
-         /*** Accumulated fields record only a relative time offset to a reference ***/
-         /*** value stored elsewhere in the lookup array.                          ***/
-             if ( tdiff[i]<0.0 ) { 
-                tdiff[i] = (float ) lookup[temp_id[i]][13]; 
-             } 
-         }
-
-         for ( i=0; i<stored_um_vars[j].nz; i++ ) {
-             tol = (tdiff[i]-999999.0)*(tdiff[i]-999999.0);
-             if ( tol>0.000001 ) {
-                for ( k=i+1; k<stored_um_vars[j].nz; k++ ) {
-                    tol = (tdiff[k]-tdiff[i])*(tdiff[k]-tdiff[i]);
-                    if ( tol<0.000001 ) { tdiff[k]=999999.0; }
-                }
-             } 
-         }
-
-     /** How many unique time offset values belong to this variable? **/
-         for ( i=0; i<stored_um_vars[j].nz; i++ ) { 
-             tol = (tdiff[i]-999999.0)*(tdiff[i]-999999.0);
-             if ( tol>0.000001 ) { stored_um_vars[j].nt++; }
-         }
-
-     /** Store the unique time offset values belonging to this variable **/
-         stored_um_vars[j].times = (float *) malloc( (int )stored_um_vars[j].nt*sizeof(float) );
-
-         k = 0;
-         for ( i=0; i<stored_um_vars[j].nz; i++ ) { 
-             tol = (tdiff[i]-999999.0)*(tdiff[i]-999999.0);
-             if ( tol>0.000001 ) { stored_um_vars[j].times[k]=tdiff[i]; k++; }
-         }
-
-     /** Does NT evenly divide into NZ? **/
-         ntmp = stored_um_vars[j].nz;
-         stored_um_vars[j].nz = stored_um_vars[j].nz/stored_um_vars[j].nt;
-
-     /** If so, go ahead and allocate memory for the 2D data slices belonging to **/
-     /** this UM variable.  Assign the proper IDs to the data slices.            **/
-         if ( ntmp==stored_um_vars[j].nz*stored_um_vars[j].nt ) { 
-            
-         /*** Allocate memory for the 2D data slice array ***/
-            stored_um_vars[j].slices = (um_dataslice **) malloc( stored_um_vars[j].nt*sizeof(um_dataslice *) );
-            for ( i=0; i<stored_um_vars[j].nt; i++ )
-                stored_um_vars[j].slices[i] = (um_dataslice *) malloc( stored_um_vars[j].nz*sizeof(um_dataslice) );
-
-         /*** Assign ID of each 2D data slice that belongs to this UM variable ***/
-            cnt = 0;
-            for ( i=0; i<stored_um_vars[j].nt; i++ ) {
-            for ( k=0; k<stored_um_vars[j].nz; k++ ) {
-                stored_um_vars[j].slices[i][k].id = (unsigned short ) temp_id[cnt];
-                cnt++;
-            }
-            }
-
-            stored_um_vars[j].lbproc = (unsigned short int ) lookup[temp_id[0]][24];  
+     alloc_slice_table( ctx, (long ) ctx->num_um_vars );
+     modified_num_stored_um_fields = ctx->num_stored_um_fields;
+     for ( j=0; j<ctx->num_stored_um_fields; j++ ) {
 
-         }
+     /** How many 2D data slices belong to this variable in total & which are they? **/
+         g = find_stash( &si, (long ) ctx->stored_um_vars[j].stash_code );
+         ctx->stored_um_vars[j].nz = ( g<0 ) ? 0 : si.count[g];
  
-     /** If not, this means that multiple processed fields have been amalgamated into the 1 **/
-     /** UM variable.  They need to be separated into individual UM_VAR struct elements.    **/
-         else {
-
-         /*** How many unique LBPROC values exist for this UM variable? ***/
-            lbprocs = (int *) malloc( ntmp*sizeof(int) );
+         temp_id = (int *) malloc( ((int )ctx->stored_um_vars[j].nz+1)*sizeof(int) );
+         for ( i=0; i<ctx->stored_um_vars[j].nz; i++ )
+             temp_id[i] = si.entry[si.first[g]+i];
+
+     /** Group the 2D data slices of this variable by their (unique) time offsets **/
+         ntmp = ctx->stored_um_vars[j].nz;
+         if ( group_slices( ctx, &ctx->stored_um_vars[j], temp_id, ntmp, lookup )!=0 ) {
+
+     /** If NT does not evenly divide into NZ, multiple processed fields have been      **/
+     /** amalgamated into the 1 UM variable.  They need to be separated into individual **/
+     /** UM_VAR struct elements, one for each unique LBPROC value.                      **/
+            ungroup_slices( ctx, &ctx->stored_um_vars[j] );
+
+            keys  = (long *) malloc( (ntmp+1)*sizeof(long) );
+            first = (int *) malloc( (ntmp+1)*sizeof(int) );
+            group = (int *) malloc( (ntmp+1)*sizeof(int) );
             for ( k=0; k<ntmp; k++ )
-                lbprocs[k] = (int ) lookup[temp_id[k]][24]; 
-
-            for ( k=0; k<ntmp; k++ ) {
-                if ( lbprocs[k]!=-1 ) {
-                   for ( i=k+1; i<ntmp; i++ ) 
-                      if ( lbprocs[k]==lbprocs[i] ) { lbprocs[i] = -1; } 
-                }
-            }
+                keys[k] = lookup[temp_id[k]][24]; 
+            num_lbproc = unique_keys( keys, ntmp, first );
 
-            num_lbproc = 0;
-            for ( k=0; k<ntmp; k++ ) 
-                if ( lbprocs[k]!=-1 ) { num_lbproc++; } 
+            ctx->stored_um_vars = (new_um_variable *) realloc( ctx->stored_um_vars, 
+                                                         ((int ) modified_num_stored_um_fields+num_lbproc-1)*sizeof(new_um_variable) ); 
 
-            modified_num_stored_um_fields += (num_lbproc-1);
-            stored_um_vars = (new_um_variable *) realloc( stored_um_vars, 
-                                                         ((int ) modified_num_stored_um_fields)*sizeof(new_um_variable) ); 
-
-         /*** Alter NT and NZ values to accommodate a multiply-defined UM variable ***/
-            stored_um_vars[j].nt -= (num_lbproc-1);
-            stored_um_vars[j].nz = ntmp/(num_lbproc*stored_um_vars[j].nt);
             for ( i=0; i<num_lbproc; i++ ) {
-                cnt = modified_num_stored_um_fields - i;
-                stored_um_vars[cnt].stash_code = stored_um_vars[j].stash_code;
-                stored_um_vars[cnt].nt = stored_um_vars[j].nt;
-                stored_um_vars[cnt].nz = stored_um_vars[j].nz;
-                stored_um_vars[cnt].times = (float *) malloc( (int )stored_um_vars[j].nt*sizeof(float) );
-                for ( k=0; k<stored_um_vars[j].nt; k++ )
-                    stored_um_vars[cnt].times[k] = stored_um_vars[j].times[k+i];
-            }
-
-         /*** Allocate memory for the 2D data slice array ***/
-            stored_um_vars[j].slices = (um_dataslice **) malloc( stored_um_vars[j].nt*sizeof(um_dataslice *) );
-            for ( i=0; i<stored_um_vars[j].nt; i++ ) 
-                stored_um_vars[j].slices[i] = (um_dataslice *) malloc( stored_um_vars[j].nz*sizeof(um_dataslice) );
-
-            for ( k=0; k<num_lbproc; k++ ) {
-                cnt = modified_num_stored_um_fields - k;
-                stored_um_vars[cnt].slices = (um_dataslice **) malloc( stored_um_vars[j].nt*sizeof(um_dataslice *) );
-                for ( i=0; i<stored_um_vars[j].nt; i++ ) 
-                    stored_um_vars[cnt].slices[i] = (um_dataslice *) malloc( stored_um_vars[j].nz*sizeof(um_dataslice) );
-            } 
-
-         /*** Assign ID of each 2D data slice that belongs to this UM variable ***/
-            cnt = 0;
-            for ( i=0; i<stored_um_vars[j].nt; i++ ) {
-            for ( k=0; k<stored_um_vars[j].nz; k++ ) {
-                stored_um_vars[j].slices[i][k].id = (unsigned short ) temp_id[cnt];
-                cnt++;
-                ind = modified_num_stored_um_fields - num_lbproc + 1;
-                for ( kk=0; kk<num_lbproc-1; kk++ ) {
-                    stored_um_vars[ind].slices[i][k].id = (unsigned short ) temp_id[cnt];
-                    cnt++;
-                    ind++;
-                }
-            }
-            }
-            free( lbprocs );
-
-          /*** Set the LBPROC value for the entire UM variable ***/
-            stored_um_vars[j].lbproc = (unsigned short ) lookup[0][24];
-            ind = modified_num_stored_um_fields - num_lbproc + 1;
-            for ( k=0; k<num_lbproc-1; k++ ) {
-                i = stored_um_vars[ind].slices[0][0].id;
-                stored_um_vars[ind].lbproc = (unsigned short int ) lookup[i][24];
-                ind++;
+                if ( i==0 ) { ind = j; }
+                else        { ind = modified_num_stored_um_fields; modified_num_stored_um_fields++; }
+                ctx->stored_um_vars[ind].stash_code = ctx->stored_um_vars[j].stash_code;
+
+                cnt = 0;
+                for ( k=0; k<ntmp; k++ )
+                    if ( keys[k]==keys[first[i]] ) { group[cnt] = temp_id[k]; cnt++; }
+                group_slices( ctx, &ctx->stored_um_vars[ind], group, cnt, lookup );
             }
 
+            free( keys );
+            free( first );
+            free( group );
          }
 
          free( temp_id );
-         free( tdiff );
      }
 
-     num_stored_um_fields = modified_num_stored_um_fields;
+     ctx->num_stored_um_fields = modified_num_stored_um_fields;
 
 /**
  ** Add some necessary attributes to each UM variables (and its associated 2D
- ** data slices) 
+ ** data slices).  The variable's attributes come from the last lookup entry
+ ** of its STASH code and each data slice's from its own lookup entry.
  **---------------------------------------------------------------------------*/
-     for ( j=0; j<num_stored_um_fields; j++ ) {
-     for ( i=0; i<num_um_vars; i++ ) {
-
-         if ( (unsigned short ) lookup[i][41]==stored_um_vars[j].stash_code ) {
-            stored_um_vars[j].coordinates = (unsigned short ) lookup[i][15];
-            stored_um_vars[j].ny          = (unsigned short ) lookup[i][17];
-            stored_um_vars[j].nx          = (unsigned short ) lookup[i][18];
-            stored_um_vars[j].lbvc        = (unsigned short ) lookup[i][25];
-            if ( rflag==0 ) {
-               if ( lookup[i][38]==1 ) { stored_um_vars[j].vartype = NC_DOUBLE; }
-               else                    { stored_um_vars[j].vartype = NC_LONG; }
-            } else {
-               if ( lookup[i][38]==1 ) { stored_um_vars[j].vartype = NC_FLOAT; }
-               else                    { stored_um_vars[j].vartype = NC_INT; }
-            }
-
-            for ( kk=0; kk<stored_um_vars[j].nt; kk++ ) {
-            for ( k=0;   k<stored_um_vars[j].nz;  k++ ) {
-                if ( stored_um_vars[j].slices[kk][k].id == (unsigned short int ) i ) {
-                   stored_um_vars[j].slices[kk][k].size      = lookup[i][14];
-                   stored_um_vars[j].slices[kk][k].location  = lookup[i][28];
-                   stored_um_vars[j].slices[kk][k].reclength = lookup[i][29];
-                   stored_um_vars[j].slices[kk][k].level     = (unsigned short ) lookup[i][32];
-                   stored_um_vars[j].slices[kk][k].lbproc    = lookup[i][24];
-                   stored_um_vars[j].slices[kk][k].lbpack    = (unsigned short ) lookup[i][20];
-                   stored_um_vars[j].slices[kk][k].mdi       = (double ) lookup[i][62];
-                   if ( stored_um_vars[j].lbproc!=0 ) {
-                      stored_um_vars[j].slices[kk][k].datatime.tm_year = (int ) header[20] - 1900;
-                      stored_um_vars[j].slices[kk][k].datatime.tm_mon  = (int ) header[21] - 1;
-                      stored_um_vars[j].slices[kk][k].datatime.tm_mday = (int ) header[22];
-                      stored_um_vars[j].slices[kk][k].datatime.tm_hour = (int ) header[23];
-                      stored_um_vars[j].slices[kk][k].datatime.tm_min  = (int ) header[24];
-                      stored_um_vars[j].slices[kk][k].datatime.tm_sec  = (int ) header[25];
-                   } else {
-                      stored_um_vars[j].slices[kk][k].datatime.tm_year = (int ) lookup[i][0] - 1900;
-                      stored_um_vars[j].slices[kk][k].datatime.tm_mon  = (int ) lookup[i][1] - 1;
-                      stored_um_vars[j].slices[kk][k].datatime.tm_mday = (int ) lookup[i][2];
-                      stored_um_vars[j].slices[kk][k].datatime.tm_hour = (int ) lookup[i][3];
-                      stored_um_vars[j].slices[kk][k].datatime.tm_min  = (int ) lookup[i][4];
-                      stored_um_vars[j].slices[kk][k].datatime.tm_sec  = (int ) lookup[i][5];
-                   }
-                }
-            }
-            }
-
-            if ( stored_um_vars[j].slices[0][0].lbproc==0 ) {
-               forecast_reference.tm_year = (int ) lookup[i][6] - 1900;
-               forecast_reference.tm_mon  = (int ) lookup[i][7] - 1; 
-               forecast_reference.tm_mday = (int ) lookup[i][8];
-               forecast_reference.tm_hour = (int ) lookup[i][9];
-               forecast_reference.tm_min  = (int ) lookup[i][10]; 
-               forecast_reference.tm_sec  = (int ) lookup[i][11];
-            }
-
+     for ( j=0; j<ctx->num_stored_um_fields; j++ ) {
+
+         g = find_stash( &si, (long ) ctx->stored_um_vars[j].stash_code );
+         if ( g<0 ) { continue; }
+         i = si.entry[si.first[g]+si.count[g]-1];
+
+         ctx->stored_um_vars[j].coordinates = (unsigned short ) lookup[i][15];
+         ctx->stored_um_vars[j].ny          = (int ) lookup[i][17];
+         ctx->stored_um_vars[j].nx          = (int ) lookup[i][18];
+         ctx->stored_um_vars[j].lbvc        = (unsigned short ) lookup[i][25];
+         if ( ctx->rflag==0 ) {
+            if ( lookup[i][38]==1 ) { ctx->stored_um_vars[j].vartype = NC_DOUBLE; }
+            else                    { ctx->stored_um_vars[j].vartype = NC_LONG; }
+         } else {
+            if ( lookup[i][38]==1 ) { ctx->stored_um_vars[j].vartype = NC_FLOAT; }
+            else                    { ctx->stored_um_vars[j].vartype = NC_INT; }
          }
-     }
-     }
-/**
- ** Set some default values for metadata fields that should be found in the 
- ** user-supplied XML stash file 
- **---------------------------------------------------------------------------*/
-     for ( i=0; i<num_stored_um_fields; i++ ) {
-         stored_um_vars[i].xml_index = 9999;
-         sprintf( stored_um_vars[i].name, "unknown_%d", i );
-         if ( stored_um_vars[i].ny==int_constants[6] ) { stored_um_vars[i].grid_type = 1; }
-         else                                          { stored_um_vars[i].grid_type = 11; }
-         stored_um_vars[i].accum       = 0;
-         stored_um_vars[i].level_type  = 2;
-         stored_um_vars[i].scale_factor= 1.0;
-     }
 
-/**
- ** Locate the index of the XML file where each unique UM variable is given
- ** its CF-compliant description.   
- **---------------------------------------------------------------------------*/
-     for ( i=0; i<num_stored_um_fields; i++ ) {
-     for ( j=0; j<num_xml_vars; j++ ) {
-         if ( stored_um_vars[i].stash_code == 1000*um_vars[j].section + um_vars[j].code ) {
-            stored_um_vars[i].xml_index   = j;
-            strcpy( stored_um_vars[i].name, um_vars[j].varname );
-            stored_um_vars[i].grid_type   = (unsigned short ) um_vars[j].umgrid;
-            stored_um_vars[i].accum       = (unsigned short ) um_vars[j].accum;
-            stored_um_vars[i].level_type  = (unsigned short ) um_vars[j].level_type;
-            stored_um_vars[i].scale_factor= um_vars[j].scale;
-            break;
+         s1 = ctx->stored_um_vars[j].first_slice + (long ) ctx->stored_um_vars[j].nt*ctx->stored_um_vars[j].nz;
+         for ( s=ctx->stored_um_vars[j].first_slice; s<s1; s++ ) {
+             ind = (int ) ctx->stored_slices.id[s];
+             ctx->stored_slices.size[s]      = lookup[ind][14];
+             ctx->stored_slices.location[s]  = lookup[ind][28];
+             ctx->stored_slices.reclength[s] = lookup[ind][29];
+             ctx->stored_slices.level[s]     = (unsigned short ) lookup[ind][32];
+             ctx->stored_slices.lbproc[s]    = (int ) lookup[ind][24];
+             ctx->stored_slices.lbpack[s]    = (unsigned short ) lookup[ind][20];
+             ctx->stored_slices.mdi[s]       = bmdi[ind];
+             if ( ctx->stored_um_vars[j].lbproc!=0 ) { ctx->stored_slices.validity[s] = um_date_minutes( &ctx->header[20], ctx->header[7] ); }
+             else                              { ctx->stored_slices.validity[s] = um_date_minutes( &lookup[ind][0], ctx->header[7] ); }
+             ctx->stored_slices.datatime[s]  = um_date_minutes( &lookup[ind][6], ctx->header[7] );
          }
-     }
-     }
 
-/**
- ** Add an appropriate prefix to the UM variable's name if post-processing was
- ** performed on the field. 
- **---------------------------------------------------------------------------*/
-     for ( i=0; i<num_stored_um_fields; i++ ) {
-         kk = stored_um_vars[i].lbproc;
-         if ( kk!=0 ) { 
-            if ( kk==64 )   { strcpy( varname, "mean_" ); }
-            if ( kk==4096 ) { strcpy( varname, "min_"  ); }
-            if ( kk==8192 ) { strcpy( varname, "max_"  ); }
-            if ( kk==128 ) {
-               if (stored_um_vars[i].accum==0 ) { strcpy( varname, "mean_" ); }
-               else                             { strcpy( varname, "sum_" ); }
-            }
-            strcat( varname, stored_um_vars[i].name );
-            strcpy( stored_um_vars[i].name, varname ); 
+         if ( ctx->stored_slices.lbproc[ctx->stored_um_vars[j].first_slice]==0 ) {
+            ctx->forecast_reference.tm_year = (int ) lookup[i][6] - 1900;
+            ctx->forecast_reference.tm_mon  = (int ) lookup[i][7] - 1; 
+            ctx->forecast_reference.tm_mday = (int ) lookup[i][8];
+            ctx->forecast_reference.tm_hour = (int ) lookup[i][9];
+            ctx->forecast_reference.tm_min  = (int ) lookup[i][10]; 
+            ctx->forecast_reference.tm_sec  = (int ) lookup[i][11];
          }
-     } 
+     }
+     free_stash_index( &si );
 
-     for ( i=0; i<num_stored_um_fields; i++ ) {
+     for ( i=0; i<ctx->num_stored_um_fields; i++ ) {
 /**
  ** For UM variables that are a temporal mean or accummulation, compute the 
  ** duration of each mean/accummulation. 
  **---------------------------------------------------------------------------*/
-         if ( (stored_um_vars[i].lbproc==32)||(stored_um_vars[i].lbproc==128)||
-              (stored_um_vars[i].lbproc==4096)||(stored_um_vars[i].lbproc==8192) ) {
+         if ( (ctx->stored_um_vars[i].lbproc==32)||(ctx->stored_um_vars[i].lbproc==128)||
+              (ctx->stored_um_vars[i].lbproc==4096)||(ctx->stored_um_vars[i].lbproc==8192) ) {
 
-            stored_um_vars[i].time_bnds = (float **) malloc( stored_um_vars[i].nt*sizeof(float *) );
-            for ( k=0; k<stored_um_vars[i].nt; k++ )
-                stored_um_vars[i].time_bnds[k] = (float *) calloc( 2,sizeof(float) );
+            ctx->stored_um_vars[i].time_bnds = (float **) malloc( ctx->stored_um_vars[i].nt*sizeof(float *) );
+            for ( k=0; k<ctx->stored_um_vars[i].nt; k++ )
+                ctx->stored_um_vars[i].time_bnds[k] = (float *) calloc( 2,sizeof(float) );
 
          }
 
@@ -632,9 +1043,9 @@ int check_um_file( char *filename, int rflag ) {
  ** For UM variables that are a spatial mean or accummulation, set the end 
  ** points for the accummulation operation.
  **---------------------------------------------------------------------------*/
-         if ( (stored_um_vars[i].lbproc==8)||(stored_um_vars[i].lbproc==64) ) {
-            stored_um_vars[i].space_bnds[0] = (float ) real_constants[3]; 
-            stored_um_vars[i].space_bnds[1] = (float ) (real_constants[3] + real_constants[0]*stored_um_vars[i].nx);
+         if ( (ctx->stored_um_vars[i].lbproc==8)||(ctx->stored_um_vars[i].lbproc==64) ) {
+            ctx->stored_um_vars[i].space_bnds[0] = (float ) ctx->real_constants[3]; 
+            ctx->stored_um_vars[i].space_bnds[1] = (float ) (ctx->real_constants[3] + ctx->real_constants[0]*ctx->stored_um_vars[i].nx);
          }  
 
      }
@@ -644,7 +1055,7 @@ int check_um_file( char *filename, int rflag ) {
  * START OF SANITY CHECK
  *==============================================================================* 
       for ( i=0; i<num_stored_um_fields; i++ ) {
-         printf( "%s %hu [%hu, %hu %hu, %hu]\n", stored_um_vars[i].name, stored_um_vars[i].stash_code,
+         printf( "%s %d [%d, %d %d, %d]\n", stored_um_vars[i].name, stored_um_vars[i].stash_code,
                                                stored_um_vars[i].nx, stored_um_vars[i].ny, stored_um_vars[i].nz,
                                                stored_um_vars[i].nt );
 //         printf( "%f\n", stored_um_vars[i].scale_factor );
@@ -654,7 +1065,7 @@ int check_um_file( char *filename, int rflag ) {
         printf( "SLICES: " );
         for ( j=0; j<stored_um_vars[i].nt; j++ ) { 
         for ( k=0; k<stored_um_vars[i].nz; k++ ) {
-            printf( "%hu ", stored_um_vars[i].slices[j][k].id ); 
+            printf( "%ld ", stored_slices.id[stored_um_vars[i].first_slice+j*stored_um_vars[i].nz+k] ); 
         }
         }
         printf( "\n" );
@@ -667,10 +1078,76 @@ int check_um_file( char *filename, int rflag ) {
 /**
  ** Free memory used by the LOOKUP 2D array
  **---------------------------------------------------------------------------*/
-     for ( nrec=0; nrec<num_um_vars; nrec++ )
-         free( lookup[nrec] );
+     free( lookup_words );
      free( lookup );
+     free( bmdi );
 
      fclose( fid );
      return 1; 
 }
+
+
+/***
+ *** ASSIGN_STASH_METADATA
+ ***
+ *** Subroutine that gives each UM variable found by CHECK_UM_FILE the name &
+ *** CF metadata of its definition in the XML stash file (see READ_STASH_FILE),
+ *** or default values if its STASH code is not defined there.
+ ***/
+
+void assign_stash_metadata( um2nc_ctx *ctx ) {
+
+     int  i, j, kk;
+     char varname[60];
+
+/**
+ ** Set some default values for metadata fields that should be found in the 
+ ** user-supplied XML stash file 
+ **---------------------------------------------------------------------------*/
+     for ( i=0; i<ctx->num_stored_um_fields; i++ ) {
+         ctx->stored_um_vars[i].xml_index = 9999;
+         sprintf( ctx->stored_um_vars[i].name, "unknown_%d", i );
+         if ( ctx->stored_um_vars[i].ny==ctx->int_constants[6] ) { ctx->stored_um_vars[i].grid_type = 1; }
+         else                                          { ctx->stored_um_vars[i].grid_type = 11; }
+         ctx->stored_um_vars[i].accum       = 0;
+         ctx->stored_um_vars[i].level_type  = 2;
+         ctx->stored_um_vars[i].scale_factor= 1.0;
+     }
+
+/**
+ ** Locate the index of the XML file where each unique UM variable is given
+ ** its CF-compliant description (the first definition of its STASH code).   
+ **---------------------------------------------------------------------------*/
+     for ( i=0; i<ctx->num_stored_um_fields; i++ ) {
+         j = find_stash_definition( ctx, ctx->stored_um_vars[i].stash_code );
+         if ( j<0 ) { continue; }
+
+         ctx->stored_um_vars[i].xml_index   = j;
+         strcpy( ctx->stored_um_vars[i].name, ctx->um_vars[j].varname );
+         ctx->stored_um_vars[i].grid_type   = (unsigned short ) ctx->um_vars[j].umgrid;
+         ctx->stored_um_vars[i].accum       = (unsigned short ) ctx->um_vars[j].accum;
+         ctx->stored_um_vars[i].level_type  = (unsigned short ) ctx->um_vars[j].level_type;
+         ctx->stored_um_vars[i].scale_factor= ctx->um_vars[j].scale;
+     }
+
+/**
+ ** Add an appropriate prefix to the UM variable's name if post-processing was
+ ** performed on the field. 
+ **---------------------------------------------------------------------------*/
+     for ( i=0; i<ctx->num_stored_um_fields; i++ ) {
+         kk = ctx->stored_um_vars[i].lbproc;
+         if ( kk!=0 ) { 
+            if ( kk==64 )   { strcpy( varname, "mean_" ); }
+            if ( kk==4096 ) { strcpy( varname, "min_"  ); }
+            if ( kk==8192 ) { strcpy( varname, "max_"  ); }
+            if ( kk==128 ) {
+               if (ctx->stored_um_vars[i].accum==0 ) { strcpy( varname, "mean_" ); }
+               else                             { strcpy( varname, "sum_" ); }
+            }
+            strcat( varname, ctx->stored_um_vars[i].name );
+            strcpy( ctx->stored_um_vars[i].name, varname ); 
+         }
+     }
+
+     return;
+}
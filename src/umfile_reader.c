@@ -0,0 +1,184 @@
+/**============================================================================
+                 U M 2 N e t C D F  V e r s i o n 2 . 0
+                 --------------------------------------
+
+    Main author: Mark Cheeseman
+                 National Institute of Water & Atmospheric Research (Ltd)
+                 Wellington, New Zealand
+                 February 2014
+
+    UM2NetCDF is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    UM2NetCDF is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    A copy of the GNU General Public License can be found in the main UM2NetCDF
+    directory.  Alternatively, please see <http://www.gnu.org/licenses/>.
+ **============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "field_def.h"
+
+
+/***
+ *** OPEN_UM_READER
+ ***
+ *** Opens the input UM fields file for reading of its 2D data slices.  The
+ *** whole file is mapped read-only into memory so that data slices can be
+ *** decoded directly from the mapping.  If the file cannot be mapped (eg. it
+ *** is a pipe or resides on a filesystem without mmap support) the reader
+ *** falls back to stdio reads into a private buffer.
+ ***
+ ***  INPUT:  rd       -> reader to be initialized
+ ***          filename -> name of the input UM fields file
+ ***
+ ***  Function returns 1 on success and 0 if the file could not be opened.
+ ***/
+
+int open_um_reader( um_reader *rd, char *filename ) {
+
+     struct stat sb;
+     void       *addr;
+
+     memset( rd, 0, sizeof(um_reader) );
+     rd->fd = -1;
+
+     rd->fd = open( filename, O_RDONLY );
+     if ( rd->fd==-1 ) { return 0; }
+
+  /** Attempt to map the entire file **/
+     if ( (fstat(rd->fd,&sb)==0) && S_ISREG(sb.st_mode) && (sb.st_size>0) ) {
+        addr = mmap( NULL, (size_t ) sb.st_size, PROT_READ, MAP_PRIVATE, rd->fd, 0 );
+        if ( addr!=MAP_FAILED ) {
+           rd->map      = (unsigned char *) addr;
+           rd->map_size = (size_t ) sb.st_size;
+           return 1;
+        }
+     }
+
+  /** Mapping not possible: use buffered stdio reads instead **/
+     rd->fh = fdopen( rd->fd, "r" );
+     if ( rd->fh==NULL ) {
+        close( rd->fd );
+        rd->fd = -1;
+        return 0;
+     }
+     return 1;
+}
+
+
+/***
+ *** READ_UM_RECORD
+ ***
+ *** Returns a pointer to NBYTES of raw data starting at byte OFFSET of the
+ *** input UM fields file.  For a mapped file the pointer refers directly into
+ *** the mapping (no copy is made).  Otherwise the data is read into the
+ *** reader's buffer, which is only valid until the next call.
+ ***
+ ***  INPUT:  rd     -> reader initialized by open_um_reader
+ ***          offset -> byte offset of the record in the UM fields file
+ ***          nbytes -> # of bytes requested
+ ***
+ ***  OUTPUT: avail  -> # of bytes actually available at the returned address
+ ***                    (may be less than NBYTES at the end of the file)
+ ***
+ ***  Function returns NULL if no data is available at OFFSET.
+ ***/
+
+unsigned char *read_um_record( um_reader *rd, long offset, long nbytes, long *avail ) {
+
+     size_t n;
+
+     *avail = 0;
+     if ( (offset<0)||(nbytes<=0) ) { return NULL; }
+
+     if ( rd->map!=NULL ) {
+        if ( (size_t ) offset>=rd->map_size ) { return NULL; }
+        if ( (size_t ) (offset+nbytes)>rd->map_size ) { nbytes = (long ) (rd->map_size - offset); }
+        *avail = nbytes;
+        return rd->map + offset;
+     }
+
+  /** stdio fallback: grow the private buffer if necessary & read the record **/
+     if ( (size_t ) nbytes>rd->buf_size ) {
+        free( rd->buf );
+        rd->buf = (unsigned char *) malloc( nbytes*sizeof(unsigned char) );
+        if ( rd->buf==NULL ) { rd->buf_size = 0; return NULL; }
+        rd->buf_size = (size_t ) nbytes;
+     }
+
+     if ( fseek(rd->fh,offset,SEEK_SET)!=0 ) { return NULL; }
+     n = fread( rd->buf, 1, (size_t ) nbytes, rd->fh );
+     if ( n==0 ) { return NULL; }
+
+     *avail = (long ) n;
+     return rd->buf;
+}
+
+
+/***
+ *** ADVISE_UM_RECORDS
+ ***
+ *** Tells the kernel that the NBYTES of the input UM fields file starting at
+ *** byte OFFSET will be needed shortly, so that they can be read ahead of the
+ *** decoding.  The hint is advisory only; failures are ignored.
+ ***
+ ***  INPUT:  rd     -> reader initialized by open_um_reader
+ ***          offset -> byte offset of the first record in the range
+ ***          nbytes -> # of bytes in the range
+ ***/
+
+void advise_um_records( um_reader *rd, long offset, long nbytes ) {
+
+     long page, start;
+
+     if ( (offset<0)||(nbytes<=0) ) { return; }
+
+     if ( rd->map!=NULL ) {
+        if ( (size_t ) offset>=rd->map_size ) { return; }
+        if ( (size_t ) (offset+nbytes)>rd->map_size ) { nbytes = (long ) (rd->map_size - offset); }
+#ifdef MADV_WILLNEED
+        page  = sysconf( _SC_PAGESIZE );
+        start = offset - offset%page;
+        madvise( rd->map + start, (size_t ) (nbytes + offset - start), MADV_WILLNEED );
+#endif
+     } else {
+#ifdef POSIX_FADV_WILLNEED
+        posix_fadvise( rd->fd, (off_t ) offset, (off_t ) nbytes, POSIX_FADV_WILLNEED );
+#endif
+     }
+
+     return;
+}
+
+
+/***
+ *** CLOSE_UM_READER
+ ***
+ *** Releases the mapping (or stdio handle) and any buffers held by a reader.
+ ***/
+
+void close_um_reader( um_reader *rd ) {
+
+     if ( rd->map!=NULL ) { munmap( rd->map, rd->map_size ); }
+     if ( rd->fh!=NULL )  { fclose( rd->fh ); }
+     else if ( rd->fd!=-1 ) { close( rd->fd ); }
+     free( rd->buf );
+
+     memset( rd, 0, sizeof(um_reader) );
+     rd->fd = -1;
+
+     return;
+}
@@ -56,123 +56,57 @@ void status_check( int status, char *message ) {
 
 
 /***
- *** IBM2IEEE 
+ *** IBM2IEEE_ARRAY 
  ***
- *** Subroutine that converts IBM 32-bit float data into IEEE 32-bit float
- *** data.
+ *** Subroutine that converts an array of IBM 32-bit floats into IEEE 32-bit
+ *** floats.  The mantissa is normalized in a single shift by the # of its
+ *** leading zero bits.  Values too small for IEEE single precision are 
+ *** flushed to zero and values too large are set to infinity and counted.
  ***
  *** INPUT:    n -> # of values to be converted
- ***         ibm -> character pointer to IBM float32 data
- ***        ieee -> 
+ ***         ibm -> IBM float32 data (already in the byte order of the host)
+ ***
+ *** OUTPUT: ieee -> IEEE float32 values (may be the same array as IBM)
+ ***
+ *** Function returns the # of values that overflowed.
  ***
  ***   Mark Cheeseman, NIWA
  ***   January 17, 2014
  ***/
 
-double ibm2ieee( uint32_t ibm ) {
+long ibm2ieee_array( const uint32_t *ibm, float *ieee, long n ) {
 
-       float    ieee;
-       double   val;
-       int32_t  ibe, it;
-       uint32_t ibs, ibt;
+       long     i, novf;
+       int32_t  ibe;
+       uint32_t w, ibs, ibt;
        int      k;
 
-       union { uint32_t i; float r; } u, res;
-
-       ibs = ibm & sign;
-       ibe = ibm & expon ;
-       ibt = ibm & tiss;
-       if (ibt == 0) {
-          ibe = 0 ;
-       } else {
-          if ( (ibe != 0) && (ibt & nrm) == 0 ) {
-             u.i = ibm ;
-             u.r = u.r + 0e0 ;
-             ibe = u.i & expon ;
-             ibt = u.i & tiss ;
-          }
-          /* mantissa */
-          it = ibt << 8;
-          for (k = 0; (k < 5) && (it >= 0); k++ ) {
-              it = it << 1;
-          }
-          if ( k < 4 ) {
-             ibt = (it >> 8) & etis;
-             ibe = (ibe >> 22) - 256 + 127 - k - 1;
-             if (ibe < 0) {
-                ibe = ibt = 0;
-             }
-             if (ibe >= 255) {
-                ibe = 255; ibt = 0;
-             }
-             ibe = ibe << 23;
-          }
-       }
-
-       res.i = ibs | ibe | ibt;
-       ieee = res.r;
-       if (ibe == 255<<23) {
-          printf( "ERROR: numerical overflow in ibm2ieee\n" );
-          exit(1);
+       union { uint32_t i; float r; } res;
+
+       novf = 0;
+       for ( i=0; i<n; i++ ) {
+           w   = ibm[i];
+           ibs = w & sign;
+           ibt = w & tiss;
+           res.i = ibs;
+
+           if ( ibt!=0 ) {
+              k   = __builtin_clz( ibt ) - 8;
+              ibe = (int32_t ) ((w & expon) >> 22) - 130 - k;
+              if ( ibe>=255 ) { 
+                 res.i = ibs | 0x7F800000; 
+                 novf++; 
+              } 
+              else if ( ibe>=0 ) { res.i = ibs | ((uint32_t ) ibe << 23) | ((ibt << k) & etis); }
+           }
+
+           ieee[i] = res.r;
        }
 
-       val = (double ) ieee;
-       return val;
+       return novf;
 }
 
 
-double ibm2ieee_do_nothing( uint32_t ibm ) {
-
-       float    ieee;
-       double   val;
-       int32_t  ibe, it;
-       uint32_t ibs, ibt;
-       int      k;
-
-       union { uint32_t i; float r; } u, res;
-
-       ibs = ibm & sign;
-       ibe = ibm & expon ;
-       ibt = ibm & tiss;
-       if (ibt == 0) {
-          ibe = 0 ;
-       } else {
-          if ( (ibe != 0) && (ibt & nrm) == 0 ) {
-             u.i = ibm ;
-             u.r = u.r + 0e0 ;
-             ibe = u.i & expon ;
-             ibt = u.i & tiss ;
-          }
-          /* mantissa */
-          it = ibt << 8;
-          for (k = 0; (k < 5) && (it >= 0); k++ ) {
-              it = it << 1;
-          }
-          if ( k < 4 ) {
-             ibt = (it >> 8) & etis;
-             ibe = (ibe >> 22) - 256 + 127 - k - 1;
-             if (ibe < 0) {
-                ibe = ibt = 0;
-             }
-             if (ibe >= 255) {
-                ibe = 255; ibt = 0;
-             }
-             ibe = ibe << 23;
-          }
-       }
-
-       res.i = ibs | ibe | ibt;
-       ieee = res.r;
-       if (ibe == 255<<23) {
-          printf( "ERROR: numerical overflow in ibm2ieee\n" );
-          exit(1);
-       }
-
-       val = (double ) ieee;
-       return val;
-
-}
-
 /***
  *** USAGE
  ***
@@ -195,18 +129,34 @@ void usage() {
      printf( "    -i interpolates all fields onto the thermodynamic grid (eg. P-points on an Arakawa-C grid)\n" );
      printf( "    -r fields written in reduced precision (eg. INT/FLOAT instead of LONG/DOUBLE)\n" );
      printf( "    -n output NetCDF file will not contain any NetCDF-4 features (chunking and/or compression)\n" );
+     printf( "    -d displays statistics on the order in which data slices are read from the input file\n" );
+     printf( "       (eg. the seek distance saved by reading the slices in file order)\n" );
+     printf( "    -p overlaps the reading, decoding and writing of data slices in separate threads\n" );
+     printf( "    -t <n> \n");
+     printf( "       used to specify the number of threads decoding data slices (implies -p). Example:\n\n" );
+     printf( "          um2netcdf.x -r -t 8 -o test.nc input.um stash.xml\n\n" );
+     printf( "    -w <n> \n");
+     printf( "       used to specify the number of threads unpacking the rows of a single large WGDOS-packed\n" );
+     printf( "       data slice\n" );
+     printf( "    -m <n> \n");
+     printf( "       converts & writes each data slice in bands of n rows, so that the memory used does not\n" );
+     printf( "       grow with the size of the grid (the -p and -t options are then ignored)\n" );
      printf( "    -o <filename> \n");
      printf( "       used to specify a filename to the output NetCDF file\n" );
      printf( "    -s used to specify a set of stash codes of UM variables that can be selectively extracted\n" );
      printf( "       from the input UM fields file into the NetCDF output file. Selected stash codes should\n" );
-     printf( "       be in a space-delimited list.  Example:\n\n" );
-     printf( "          um2netcdf.x -i -r -o test.nc -s 3209 3210 input.um stash.xml\n\n" );
+     printf( "       be in a space-delimited list; each entry may be a stash code (3209), a range of stash\n" );
+     printf( "       codes (16200-16299), a section & item (3:209) or a whole section (3:*).  Example:\n\n" );
+     printf( "          um2netcdf.x -i -r -o test.nc -s 3209 3210 16200-16299 input.um stash.xml\n\n" );
      printf( "    -c used to specify the name of the run configuration XML file\n" );
      printf( "    -b used to specify a set of stash codes of UM variables to be ignored if located in the\n" );
      printf( "       input UM fields file into the NetCDF output file. Specified stash codes should\n" );
-     printf( "       be in a space-delimited list.  Example:\n\n" );
+     printf( "       be in a space-delimited list (ranges & sections are given as for -s).  Example:\n\n" );
      printf( "            um2netcdf.x -i -r -o test.nc -b 3209 3210 input.um stash.xml -c config.xml\n\n" );
      printf( "   It does not matter which order you put the option flags.\n\n" );
+     printf( "  The XML stash file can be compiled into a binary form that is used in its place (as long\n" );
+     printf( "  as the XML file is unchanged) when it is named after the XML file with a .bin suffix:\n\n" );
+     printf( "          um2netcdf.x --compile-stash stash2cf.xml -o stash2cf.bin\n\n" );
 }
 
 
@@ -31,7 +31,8 @@
  ***
  *** Set the depth of each model soil layer used in the output from the UM fields
  *** file.
- ***   INPUT:   ncid -> ID of the newly created NetCDF file
+ ***   INPUT:    ctx -> conversion context of the input UM fields file
+ ***            ncid -> ID of the newly created NetCDF file
  ***               n -> number of soil levels to be filled
  ***              id -> index of the stored UM variable requiring this vertical
  ***                    dimension.
@@ -40,7 +41,7 @@
  ***   December 29, 2012
  ***/
 
-int set_soil_levels( int ncid, int n, int id ) {
+int set_soil_levels( um2nc_ctx *ctx, int ncid, int n, int id ) {
 
      int    ierr, i, var_id, dim_id[1], nn;
      char   dim_name[12];
@@ -67,8 +68,8 @@ int set_soil_levels( int ncid, int n, int id ) {
 
      buf = (float *) calloc( n,sizeof(float) );
      for ( i=0; i<n; i++ ) { 
-         nn = (int ) (stored_um_vars[id].slices[0][i].level - 1);
-         buf[i] = (float ) level_constants[3][nn]; 
+         nn = (int ) (ctx->stored_slices.level[ctx->stored_um_vars[id].first_slice+i] - 1);
+         buf[i] = (float ) ctx->level_constants[3][nn]; 
      }
 
      ierr = nc_put_var_float( ncid, var_id, buf );
@@ -83,7 +84,8 @@ int set_soil_levels( int ncid, int n, int id ) {
  ***
  *** Set the value of each model pressure layer used in the output from the UM fields
  *** file.
- ***   INPUT:   ncid -> ID of the newly created NetCDF file
+ ***   INPUT:    ctx -> conversion context of the input UM fields file
+ ***            ncid -> ID of the newly created NetCDF file
  ***               n -> number of pressure levels to be filled
  ***              id -> index of the stored UM variable requiring this vertical
  ***                    dimension.
@@ -92,7 +94,7 @@ int set_soil_levels( int ncid, int n, int id ) {
  ***   December 29, 2012
  ***/
 
-int set_pressure_levels( int ncid, int n, int id ) {
+int set_pressure_levels( um2nc_ctx *ctx, int ncid, int n, int id ) {
 
      int    i, ierr, var_id, dim_id[1];
      char   dim_name[10];
@@ -120,7 +122,7 @@ int set_pressure_levels( int ncid, int n, int id ) {
      ierr = nc_enddef( ncid );
 
      for ( i=0; i<n; i++ ) {
-         pressure = (float ) stored_um_vars[id].slices[0][i].level; 
+         pressure = (float ) ctx->stored_slices.level[ctx->stored_um_vars[id].first_slice+i]; 
          nc_index[0] = (size_t) i;
          ierr = nc_put_var1_float( ncid, var_id, nc_index, &pressure );
      }
@@ -134,7 +136,8 @@ int set_pressure_levels( int ncid, int n, int id ) {
  ***
  *** Set the height of each model altitude layer used in the output from the UM fields
  *** file.
- ***   INPUT:   ncid -> ID of the newly created NetCDF file
+ ***   INPUT:    ctx -> conversion context of the input UM fields file
+ ***            ncid -> ID of the newly created NetCDF file
  ***               n -> number of altitude levels to be filled
  ***              id -> index of the stored UM variable requiring this vertical
  ***                    dimension.
@@ -143,7 +146,7 @@ int set_pressure_levels( int ncid, int n, int id ) {
  ***   December 29, 2012
  ***/
 
-int set_altitude( int ncid, int n, int id ) {
+int set_altitude( um2nc_ctx *ctx, int ncid, int n, int id ) {
 
      int    i, ierr, var_id, dim_id[1];
      char   dim_name[10];
@@ -172,7 +175,7 @@ int set_altitude( int ncid, int n, int id ) {
      ierr = nc_enddef( ncid );
 
      for ( i=0; i<n; i++ ) {
-         height = (float ) stored_um_vars[id].slices[0][i].level;
+         height = (float ) ctx->stored_slices.level[ctx->stored_um_vars[id].first_slice+i];
          nc_index[0] = (size_t) i;
          ierr = nc_put_var1_float( ncid, var_id, nc_index, &height );
      }
@@ -186,7 +189,8 @@ int set_altitude( int ncid, int n, int id ) {
  ***
  *** Set the height of each model hybrid layer used in the output from the UM fields
  *** file.
- ***   INPUT:   ncid -> ID of the newly created NetCDF file
+ ***   INPUT:    ctx -> conversion context of the input UM fields file
+ ***            ncid -> ID of the newly created NetCDF file
  ***               n -> number of hybrid levels to be filled
  ***              id -> index of the stored UM variable requiring this vertical
  ***                    dimension.
@@ -195,13 +199,13 @@ int set_altitude( int ncid, int n, int id ) {
  ***   April 29, 2014
  ***/
 
-int set_hybrid_levels( int ncid, int n, int id ) {
+int set_hybrid_levels( um2nc_ctx *ctx, int ncid, int n, int id ) {
 
      int    i, ierr, var_id, dim_id[1], z_level;
      char   dim_name[9];
      float  *height;
 
-     if ( stored_um_vars[id].level_type==1 ) { sprintf( dim_name, "hybridr%d", n ); }
+     if ( ctx->stored_um_vars[id].level_type==1 ) { sprintf( dim_name, "hybridr%d", n ); }
      else                                    { sprintf( dim_name, "hybridt%d", n ); }
      
      ierr = nc_inq_dimid( ncid, dim_name, &dim_id[0] ); 
@@ -219,25 +223,25 @@ int set_hybrid_levels( int ncid, int n, int id ) {
      ierr = nc_put_att_text( ncid, var_id,     "axis",  1, "Z" );
 
   /** Check if a level mesh type is et for this variable **/
-    if ( (stored_um_vars[id].level_type!=1)&&(stored_um_vars[id].level_type!=2) ) {
-       printf( "WARNING: unknown vertical mesh type for STASH_CODE=%hu\n", stored_um_vars[id].stash_code );
+    if ( (ctx->stored_um_vars[id].level_type!=1)&&(ctx->stored_um_vars[id].level_type!=2) ) {
+       printf( "WARNING: unknown vertical mesh type for STASH_CODE=%d\n", ctx->stored_um_vars[id].stash_code );
        printf( "         setting to theta-point mesh by default\n" );
     }
 
   /** Set the vertical spacing type: Theta or Rho-based mesh **/
      height = (float *) malloc( n*sizeof(float) );
-     if ( stored_um_vars[id].level_type==1 )      { 
+     if ( ctx->stored_um_vars[id].level_type==1 )      { 
         ierr = nc_put_att_text( ncid, var_id, "long_name", 40, "height above sea level (rho levels used)" );
         for ( i=0; i<n; i++ ) {
-            z_level = (int ) stored_um_vars[id].slices[0][i].level - 1;
-            height[i] = (float ) level_constants[6][z_level];
+            z_level = (int ) ctx->stored_slices.level[ctx->stored_um_vars[id].first_slice+i] - 1;
+            height[i] = (float ) ctx->level_constants[6][z_level];
          }
      }
      else { 
         ierr = nc_put_att_text( ncid, var_id, "long_name", 42, "height above sea level (theta levels used)" );
         for ( i=0; i<n; i++ ) {
-            z_level = (int ) stored_um_vars[id].slices[0][i].level;
-            height[i] = (float ) level_constants[4][z_level];
+            z_level = (int ) ctx->stored_slices.level[ctx->stored_um_vars[id].first_slice+i];
+            height[i] = (float ) ctx->level_constants[4][z_level];
          }
      }
 
@@ -254,7 +258,8 @@ int set_hybrid_levels( int ncid, int n, int id ) {
  ***
  *** Set the value of each model surface layer used in the output from the UM fields
  *** file.
- ***   INPUT:   ncid -> ID of the newly created NetCDF file
+ ***   INPUT:    ctx -> conversion context of the input UM fields file
+ ***            ncid -> ID of the newly created NetCDF file
  ***               n -> number of surface levels to be filled
  ***              id -> index of the stored UM variable requiring this vertical
  ***                    dimension.
@@ -263,7 +268,7 @@ int set_hybrid_levels( int ncid, int n, int id ) {
  ***   December 29, 2012
  ***/
 
-int set_surface_levels( int ncid, int n, int id ) {
+int set_surface_levels( um2nc_ctx *ctx, int ncid, int n, int id ) {
 
      int    i, ierr, var_id, dim_id[1];
      char   dim_name[9];
@@ -300,7 +305,8 @@ int set_surface_levels( int ncid, int n, int id ) {
  ***
  *** Set the value of each model sea-surface layer used in the output from the UM fields
  *** file.
- ***   INPUT:   ncid -> ID of the newly created NetCDF file
+ ***   INPUT:    ctx -> conversion context of the input UM fields file
+ ***            ncid -> ID of the newly created NetCDF file
  ***               n -> number of sea-surface levels to be filled
  ***              id -> index of the stored UM variable requiring this vertical
  ***                    dimension.
@@ -309,7 +315,7 @@ int set_surface_levels( int ncid, int n, int id ) {
  ***   December 29, 2012
  ***/
 
-int set_sea_surface_levels( int ncid, int n, int id ) {
+int set_sea_surface_levels( um2nc_ctx *ctx, int ncid, int n, int id ) {
 
      int    i, ierr, var_id, dim_id[1];
      char   dim_name[13];
@@ -349,63 +355,61 @@ int set_sea_surface_levels( int ncid, int n, int id ) {
  *** describe the datafields in the UM fields file.  The dimensions are created
  *** in the new NetCDF file.
  ***
- *** INPUT:  ncid    -> id of the newly created NetCDF file
- ***         dim_ids -> array containing the NetCDF dimension IDs
- ***         ndim    -> # of previously defined NetCDF dimensions
- ***         rflag   -> equal to 1 if 32-bit output precision requested by user
+ *** INPUT:  ctx     -> conversion context of the input UM fields file
+ ***         ncid    -> id of the newly created NetCDF file
  ***
  ***    Mark Cheeseman, NIWA
  ***    December 19, 2013
  ***/
 
-void set_vertical_dimensions( int ncid, int rflag ) {
+void set_vertical_dimensions( um2nc_ctx *ctx, int ncid ) {
 
      int i, num_instances, dimID=0;
 
     /*** Check each stored UM variable its 'z-coordinate' ***/
-     for ( i=0; i<num_stored_um_fields; i++ ) {
+     for ( i=0; i<ctx->num_stored_um_fields; i++ ) {
 
        /** determine # of 'z-levels' for this variable */
-         num_instances = stored_um_vars[i].nz;
+         num_instances = ctx->stored_um_vars[i].nz;
 
        /** Create new dimension if variable is 4D **/
          if ( num_instances>1 ) {
-            switch ( stored_um_vars[i].lbvc ) {
+            switch ( ctx->stored_um_vars[i].lbvc ) {
                  case 1:
-                      dimID = set_altitude( ncid, num_instances, i );
+                      dimID = set_altitude( ctx, ncid, num_instances, i );
                       break;
                  case 6:
-                      dimID = set_soil_levels( ncid, num_instances, i );
+                      dimID = set_soil_levels( ctx, ncid, num_instances, i );
                       break;
                  case 8:
-                      dimID = set_pressure_levels( ncid, num_instances, i );
+                      dimID = set_pressure_levels( ctx, ncid, num_instances, i );
                       break;
                  case 65:
-                      dimID = set_hybrid_levels( ncid, num_instances, i );
+                      dimID = set_hybrid_levels( ctx, ncid, num_instances, i );
                       break;
                  case 128:
-                      dimID = set_sea_surface_levels( ncid, num_instances, i );
+                      dimID = set_sea_surface_levels( ctx, ncid, num_instances, i );
                       break;
                  case 129:
-                      dimID = set_surface_levels( ncid, num_instances, i );
+                      dimID = set_surface_levels( ctx, ncid, num_instances, i );
                       break;
                  default:
                       printf( "ERROR: unknown vertical coordinate (%hu) for STASH CODE=%d\n\n", 
-                              stored_um_vars[i].lbvc, stored_um_vars[i].stash_code );
+                              ctx->stored_um_vars[i].lbvc, ctx->stored_um_vars[i].stash_code );
                       break;
                     //  exit(1);
             }
-            stored_um_vars[i].z_dim = (unsigned short int ) dimID;
+            ctx->stored_um_vars[i].z_dim = (unsigned short int ) dimID;
          } else {
-            stored_um_vars[i].z_dim = 999;
+            ctx->stored_um_vars[i].z_dim = 999;
          }
 
      }
 
     /*** Define dimensions to hold length of ETA arrays ***/
-     i = nc_def_dim( ncid, "num_etaT_levels", (size_t ) header[110],
+     i = nc_def_dim( ncid, "num_etaT_levels", (size_t ) ctx->header[110],
                     &num_instances );
-     i = nc_def_dim( ncid, "num_etaR_levels", (size_t ) (header[110]-1),
+     i = nc_def_dim( ncid, "num_etaR_levels", (size_t ) (ctx->header[110]-1),
                     &num_instances );
 
 /*==============================================================================
@@ -413,7 +417,7 @@ void set_vertical_dimensions( int ncid, int rflag ) {
  *==============================================================================*
      i = nc_enddef( ncid );
      for ( i=0; i<num_stored_um_fields; i++ ) {
-         printf( "%hu %hu %hu %hu %hu\n", stored_um_vars[i].stash_code, stored_um_vars[i].x_dim,
+         printf( "%d %hu %hu %hu %hu\n", stored_um_vars[i].stash_code, stored_um_vars[i].x_dim,
                                   stored_um_vars[i].y_dim, stored_um_vars[i].z_dim, 
                                   stored_um_vars[i].t_dim );
       }
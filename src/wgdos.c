@@ -21,39 +21,185 @@
     directory.  Alternatively, please see <http://www.gnu.org/licenses/>.
  **============================================================================*/
 
-#include <assert.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 #include "field_def.h"
 
-#define   expon 0x7F000000
-#define   sign  0x80000000
-#define   tiss  0x00FFFFFF
-#define   etis  0x007FFFFF
-#define   nrm   0x00F00000
+#define   WGDOS_PARALLEL_POINTS 65536   /* fields smaller than this are unpacked by 1 thread */
+#define   WGDOS_MAX_THREADS     256     /* max # of threads unpacking a single field */
+
+/**
+ ** wgdos_bits - reader for the MSB-first stream of packed integers in a row.
+ **              The next bits of the stream are kept left-aligned in a 64-bit
+ **              accumulator which is refilled 32 bits at a time.
+ **/
+
+typedef struct wgdos_bits {
+        const unsigned char *p;      /* next byte of the stream to be loaded */
+        const unsigned char *end;    /* end of the packed row */
+        uint64_t             acc;    /* unread bits, most significant bit first */
+        int                  avail;  /* # of valid bits in ACC */
+} wgdos_bits;
 
 static inline
-uint32_t getbits(unsigned char* bp, int pos, int nbits)
+void bits_refill( wgdos_bits *br )
 {
-   assert(pos < 8 && nbits <= 32);
-
-   uint32_t res = 0;
-   int more = nbits;
-   while (1) {
-      int bits = ((8 - pos) < more) ? 8 - pos : more;
-      uint8_t mask = ((1 << bits) - 1) << (8 - pos - bits);
-      uint8_t val = (*bp & mask) >> (8 - pos - bits);
-      more -= bits;
-      res |= val << more;
-      if (!more) break;
-      bp++; pos = 0;
+   uint32_t w;
+   int      k;
+
+   if (br->avail > 32) return;
+
+   if (br->end - br->p >= 4) {
+      w = ((uint32_t) br->p[0] << 24) | ((uint32_t) br->p[1] << 16) |
+          ((uint32_t) br->p[2] << 8)  |  (uint32_t) br->p[3];
+      br->p += 4;
+   } else {
+      w = 0;
+      for (k = 0; k < 4; k++) {
+         w <<= 8;
+         if (br->p < br->end) w |= *br->p++;
+      }
    }
+   br->acc |= (uint64_t) w << (32 - br->avail);
+   br->avail += 32;
+}
 
-   return res;
+/** Removes the next NBITS (1..32) bits from the accumulator; AVAIL must be >= NBITS **/
+static inline
+uint32_t bits_take( wgdos_bits *br, int nbits )
+{
+   uint32_t v = (uint32_t) (br->acc >> (64 - nbits));
+   br->acc <<= nbits;
+   br->avail -= nbits;
+   return v;
+}
+
+static inline
+uint32_t bits_get( wgdos_bits *br, int nbits )
+{
+   bits_refill(br);
+   return bits_take(br, nbits);
+}
+
+/***
+ *** UNPACK_DENSE
+ ***
+ *** Unpacks COLS consecutive NBITS-wide integers into BASE + SCALE*X.  After a
+ *** refill the accumulator holds at least 33 bits, so 32/NBITS values can be
+ *** taken per refill.  Called with a constant NBITS the inner loop is fully
+ *** unrolled by the compiler.
+ ***/
+
+static inline
+void unpack_dense( wgdos_bits *br, const int nbits, int cols, float base, float scale, float *out )
+{
+   const int per = 32 / nbits;
+   int       i, k;
+
+   i = 0;
+   while (i + per <= cols) {
+      bits_refill(br);
+      for (k = 0; k < per; k++, i++)
+         out[i] = base + scale*bits_take(br, nbits);
+   }
+   for (; i < cols; i++)
+      out[i] = base + scale*bits_get(br, nbits);
+}
+
+#define UNPACK_WIDTH(N) case N: unpack_dense( br, N, cols, base, scale, out ); break;
+
+/***
+ *** UNPACK_ROW_VALUES
+ ***
+ *** Unpacks the packed integers of a row without bitmaps.  A specialized
+ *** path is selected once per row for the common widths of 1 to 16 bits.
+ ***/
+
+void unpack_row_values( wgdos_bits *br, int nbits, int cols, float base, float scale, float *out )
+{
+   switch (nbits) {
+      UNPACK_WIDTH(1)  UNPACK_WIDTH(2)  UNPACK_WIDTH(3)  UNPACK_WIDTH(4)
+      UNPACK_WIDTH(5)  UNPACK_WIDTH(6)  UNPACK_WIDTH(7)  UNPACK_WIDTH(8)
+      UNPACK_WIDTH(9)  UNPACK_WIDTH(10) UNPACK_WIDTH(11) UNPACK_WIDTH(12)
+      UNPACK_WIDTH(13) UNPACK_WIDTH(14) UNPACK_WIDTH(15) UNPACK_WIDTH(16)
+      default:
+         unpack_dense( br, nbits, cols, base, scale, out );
+         break;
+   }
+}
+
+#undef UNPACK_WIDTH
+
+
+/***
+ *** UNPACK_ROW_SCALAR
+ ***
+ *** Portable kernel unpacking the packed integers of a row into BASE + SCALE*X.
+ *** It is used when no SIMD kernel is available and to finish the points left
+ *** over by the SIMD kernels.
+ ***
+ *** For rows with bitmaps the packed integers only exist for the points whose
+ *** bit is clear in MASK.  Each 64 point word of the mask is handled at once:
+ *** a word with no bitmapped points is unpacked like a dense row, otherwise
+ *** the packed integers are scattered onto the clear bits of the word.
+ ***
+ *** INPUT:  bp     -> start of the stream of packed integers
+ ***         end    -> end of the packed row
+ ***         bitpos -> bit offset in the stream of the integer of point FIRST
+ ***         nbits  -> # of bits per packed integer
+ ***         first  -> first point of the row to be unpacked
+ ***         cols   -> # of points in the row
+ ***         mask   -> combined bitmap of the row, 1 bit per point (bit J of word
+ ***                   K is point 64K+J).  Points whose bit is set have no packed
+ ***                   integer and are left untouched.  NULL if the row has no bitmaps
+ ***
+ *** OUTPUT: out    -> unpacked values of the whole row
+ ***/
+
+void unpack_row_scalar( const unsigned char *bp, const unsigned char *end, long bitpos, int nbits,
+                        int first, int cols, float base, float scale, float *out, const uint64_t *mask )
+{
+   int        k, j, npts;
+   uint64_t   keep;
+   wgdos_bits br;
+
+   br.p     = bp + bitpos/8;
+   br.end   = end;
+   br.acc   = 0;
+   br.avail = 0;
+   if (bitpos % 8) {
+      bits_refill(&br);
+      bits_take(&br, (int) (bitpos % 8));
+   }
+
+   if (mask == NULL) {
+      unpack_row_values( &br, nbits, cols - first, base, scale, out + first );
+      return;
+   }
+
+   for (k = first / 64; 64*k < cols; k++) {
+      npts = cols - 64*k;
+      if (npts > 64) npts = 64;
+
+      keep = ~mask[k];
+      if (npts < 64) keep &= (UINT64_C(1) << npts) - 1;
+      if (k == first / 64) keep &= ~UINT64_C(0) << (first % 64);
+
+      if (keep == ~UINT64_C(0)) {
+         unpack_row_values( &br, nbits, 64, base, scale, out + 64*k );
+      } else {
+         while (keep) {
+            j = __builtin_ctzll(keep);
+            out[64*k + j] = base + scale*bits_get(&br, nbits);
+            keep &= keep - 1;
+         }
+      }
+   }
 }
 
 typedef union {
@@ -111,159 +257,177 @@ uint16_t byteswap16(unsigned char bytes[2])
 
 
 /***
- *** READ_BITMASKS
- ***
- *** Function that reads in the bitmap indicate where missing data points are
- *** located in the datafield. 
- ***
- ***  INPUT: bp -> pointer to the input data stream
- ***         nx -> # of columns present in the input 2D data slice
- ***
- ***  INPUT/OUTPUT: flag_array -> integer array that denotes if a MDI value
- ***                              should be written at the iTH position.
- ***
- ***  Function will return the number of 32 bit words read for the bitmap
- ***  extraction and decoding.  
+ *** BITMAP_WORD
  ***
- ***   Mark Cheeseman, NIWA
- ***   June 26, 2014
- ***/ 
+ *** Returns the 64 bits of a row's bitmaps starting at bit BITOFF of the row,
+ *** bit-reversed so that bit J of the result is the J-th bit of the stream
+ *** (ie. point J of the 64 point block).  Bytes past END read as zero.
+ ***/
 
-void readBitmap(unsigned char* bp, int start, int cols, bool reverse, float value, float data[], bool bmap[])
+static inline
+uint64_t bitmap_word( const unsigned char *row, const unsigned char *end, long bitoff )
 {
-   int           i, pos;
-   unsigned char byte;
-
-   byte = *bp;
-   if (reverse) byte = ~byte;
-   byte <<= start;
-   pos = start;
-   for ( i=0; i < cols; ++i) {
-      if (byte & 0x80) {
-         data[i] = value;
-         bmap[i] = true;
-      }
-      if (pos < 7) {
-         byte <<= 1;
-         pos++;
-      } else {
-         byte = *++bp;
-         if (reverse) byte = ~byte;
-         pos = 0;
-      }
+   const unsigned char *q = row + bitoff/8;
+   int                  sh = (int) (bitoff % 8), j;
+   uint64_t             w = 0;
+
+   if (end - q >= 9) {
+      for (j = 0; j < 8; j++) w = (w << 8) | q[j];
+      if (sh) w = (w << sh) | (q[8] >> (8 - sh));
+   } else {
+      for (j = 0; j < 8; j++) w = (w << 8) | ((q + j < end) ? q[j] : 0);
+      if (sh) w = (w << sh) | ((q + 8 < end) ? (q[8] >> (8 - sh)) : 0);
    }
+
+   /** Reverse the bit order: swap adjacent bits, pairs, nibbles, then bytes **/
+   w = ((w >> 1) & UINT64_C(0x5555555555555555)) | ((w & UINT64_C(0x5555555555555555)) << 1);
+   w = ((w >> 2) & UINT64_C(0x3333333333333333)) | ((w & UINT64_C(0x3333333333333333)) << 2);
+   w = ((w >> 4) & UINT64_C(0x0F0F0F0F0F0F0F0F)) | ((w & UINT64_C(0x0F0F0F0F0F0F0F0F)) << 4);
+   return __builtin_bswap64(w);
 }
 
-float ibm2ieee2(uint32_t ibm)
+/** Writes VALUE at every point of a 64 point block whose bit is set in BITS **/
+static inline
+void fill_bits( float *data, uint64_t bits, float value )
 {
-   int32_t ibe, it;
-   uint32_t ibs, ibt;
-   int k;
-   union { uint32_t i; float r; } u, res;
-
-   ibs = ibm & sign;
-   ibe = ibm & expon ;
-   ibt = ibm & tiss;
-   if (ibt == 0) {
-      ibe = 0 ;
+   int j;
+
+   if (bits == ~UINT64_C(0)) {
+      for (j = 0; j < 64; j++) data[j] = value;
+      return;
    }
-   else {
-      if ( (ibe != 0) && (ibt & nrm) == 0 ) {
-         u.i = ibm;
-         u.r = u.r + 0e0 ;
-         ibe = u.i & expon ;
-         ibt = u.i & tiss ;
+   while (bits) {
+      data[__builtin_ctzll(bits)] = value;
+      bits &= bits - 1;
+   }
+}
+
+
+/***
+ *** READ_BITMAPS
+ ***
+ *** Decodes the missing data (A), minimum value (B) and zero (C) bitmaps of a
+ *** row 64 points at a time.  The bitmaps follow each other in the stream, 
+ *** COLS bits each, and a point flagged by a later bitmap takes that bitmap's
+ *** value.  The C bitmap is stored inverted (a clear bit flags a zero).  As 
+ *** the row is initialized to BASE, the B bitmap only needs to be applied to
+ *** points already flagged by A.
+ ***
+ ***  INPUT: row  -> start of the row's bitmaps
+ ***         end  -> end of the packed row
+ ***         cols -> # of points in the row
+ ***         a, b, c -> which bitmaps are present
+ ***         mdi, base -> values written at points flagged by A & B
+ ***
+ ***  INPUT/OUTPUT: data -> unpacked row (initialized to BASE)
+ ***
+ ***  OUTPUT: mask -> combined bitmap: bit set where a point has no packed integer
+ ***
+ ***  Function returns the # of bits taken up by the bitmaps.
+ ***/ 
+
+long read_bitmaps( const unsigned char *row, const unsigned char *end, int cols, bool a, bool b, bool c,
+                   float mdi, float base, float *data, uint64_t *mask )
+{
+   int      k, npts;
+   long     off;
+   uint64_t valid, w, m;
+
+   for (k = 0; 64*k < cols; k++) {
+      npts  = cols - 64*k;
+      valid = (npts < 64) ? (UINT64_C(1) << npts) - 1 : ~UINT64_C(0);
+      off   = 64L*k;
+      m     = 0;
+
+      if (a) {
+         w = bitmap_word( row, end, off ) & valid;
+         fill_bits( data + 64*k, w, mdi );
+         m |= w;
+         off += cols;
       }
-      /* mantissa */
-      it = ibt << 8;
-      for (k = 0; (k < 5) && (it >= 0); k++ ) {
-         it = it << 1;
+      if (b) {
+         w = bitmap_word( row, end, off ) & valid;
+         fill_bits( data + 64*k, w & m, base );
+         m |= w;
+         off += cols;
       }
-      if ( k < 4 ) {
-         ibt = (it >> 8) & etis;
-         ibe = (ibe >> 22) - 256 + 127 - k - 1;
-         if (ibe < 0) {
-            ibe = ibt = 0;
-         }
-         if (ibe >= 255) {
-            ibe = 255; ibt = 0;
-         }
-         ibe = ibe << 23;
+      if (c) {
+         w = ~bitmap_word( row, end, off ) & valid;
+         fill_bits( data + 64*k, w, 0.0f );
+         m |= w;
       }
+      mask[k] = m;
    }
-   res.i = ibs | ibe | ibt;
-   return res.r;
+
+   return (long) ((a ? 1 : 0) + (b ? 1 : 0) + (c ? 1 : 0))*cols;
 }
 
 
 /***
- *** WGDOS UNPACK 
+ *** WGDOS_ROW_OFFSETS
  ***
- *** Subroutine that unpacks a 2D data slice that has undergone WGDOS packing &
- *** compression
+ *** First pass over a WGDOS-packed record: walks the row headers and stores
+ *** the address of each row's header.  Every row header holds the # of 32 bit
+ *** words N taken up by the row, so the start of row J+1 is the start of 
+ *** row J plus 8+4*N bytes.  Once this table is built the rows can be decoded
+ *** independently of each other.
  ***
- *** INPUT:   fh -> file handle to the input UM fields file
- ***         ind -> index to current UM variable being processed
+ *** INPUT:  rec  -> pointer to the start of the packed record
+ ***         end  -> pointer just past the last available byte of the record
+ ***         rows -> # of rows given in the field header
  ***
- *** OUTPUT: unpacked_data -> pointer to the array of values for the unpacked 2D data 
- ***                          slice     
+ *** OUTPUT: offs -> address of the header of each complete row
  ***
- ***   Mark Cheeseman, NIWA
- ***   June 26, 2014
+ *** Function returns the # of complete rows found in the record.
  ***/
 
-void wgdos_unpack( FILE *fh, double *unpacked_data, double mdi ) {
+int wgdos_row_offsets( unsigned char *rec, unsigned char *end, int rows, unsigned char **offs ) {
 
-     int            i, j, nbits, pos, new_pos;
-     uint16_t       cols, rows, n;
-     uint32_t       len;
-     int32_t        prec;
-     float          scale, base, *unpacked_row;
-     char           cba_nbit;
-     unsigned char  hdr[20], *buf, *bp;
-     bool           a, b, c, use_bmaps, *bmap;
-
-  /*
-   * Read & decode field header
-   *-------------------------------------------------------------------*/   
-     bp = hdr;
-     fread( hdr, 4, 5, fh );
+     int            j;
+     uint16_t       n;
+     unsigned char *bp;
 
-     len = byteswap32(bp);
-     bp += 4;
-     prec = byteswap32(bp);
-     scale = powf( 2.0, (float ) prec );
-     bp += 4;
-     cols = byteswap16(bp);
-     bp += 2;
-     rows = byteswap16(bp);
-     bp += 2;
+     bp = rec + 12;
+     for ( j=0; j<rows; j++ ) {
+         if ( bp+8>end ) { break; }
+         n = byteswap16( bp+6 );
+         if ( bp+8+n*4>end ) { break; }
+         offs[j] = bp;
+         bp += 8 + n*4;
+     }
 
-/*     printf( "scaling factor: %d %f\n", prec, scale );
-     printf( "# of rows: %d\n", rows );
-     printf( "# of columns: %d\n\n", cols ); */
+     return j;
+}
 
-  /*
-   * Allocate memory to hold unpacked data points in 1 row 
-   *-------------------------------------------------------------------*/   
-     unpacked_row = (float *) malloc( cols*sizeof(float) );
 
-  /*
-   * Allocate memory to hold bitmap mask for 1 unpacked row 
-   *-------------------------------------------------------------------*/   
-     bmap  = (bool *) malloc( cols*sizeof(bool) );
+/***
+ *** WGDOS_DECODE_ROW
+ ***
+ *** Unpacks a single row of a WGDOS-packed record.
+ ***
+ *** INPUT:  bp    -> pointer to the row's header
+ ***         base  -> minimum value of the row (IEEE value of the IBM float
+ ***                  at the start of the row's header)
+ ***         cols  -> # of points in the row
+ ***         scale -> 2^PREC scaling applied to the packed integers
+ ***         mdi   -> value used to denote a missing data point
+ ***         mask  -> scratch array holding (COLS+63)/64 bitmap words
+ ***
+ *** OUTPUT: unpacked_row -> unpacked values of the row
+ ***/
 
-  /*
-   * Allocate memory to hold entire packed row (+ up to 3 bitmaps) 
-   *-------------------------------------------------------------------*/   
-     pos = ((3*cols+7) / 8) + (cols*4) + 8;
-     buf = (unsigned char *) malloc( pos*sizeof(unsigned char) );
+void wgdos_decode_row( unsigned char *bp, float base, int cols, float scale, double mdi, float *unpacked_row,
+                       uint64_t *mask ) {
 
-     for ( j=0; j<rows; ++j) {
+     int            i, nbits;
+     uint16_t       n;
+     long           nbmbits;
+     char           cba_nbit;
+     unsigned char *row;
+     bool           a, b, c, use_bmaps;
 
   /*
-   * Decode a row's header
-   *   BASE -> minimum value of all points in unpacked row
+   * Decode a row's header (its BASE has already been converted)
    *   NBITS-> # of bits used for each packed data point in this row
    *   N    -> # of 32 bit words used to hold all packed data points
    *           and bitmaps for this row
@@ -271,94 +435,298 @@ void wgdos_unpack( FILE *fh, double *unpacked_data, double mdi ) {
    *   B    -> boolean that denotes if minimum value bitmap is present
    *   A    -> boolean that denotes if missing value bitmap is present
    *-------------------------------------------------------------------*/   
-         base = ibm2ieee2( byteswap32(bp) );
-         bp += 4;
-
-         cba_nbit = *(bp+1);
-         c = cba_nbit & 0x80;
-         b = cba_nbit & 0x40;
-         a = cba_nbit & 0x20;
-         use_bmaps = (a || b || c);
-         nbits = cba_nbit & 0x1F;
-         bp += 2;
-         n = byteswap16(bp);
-
-     /*    printf( "base value: %f\n", base );
-         printf( "nbit:       %d\n", nbits );
-         if ( a ) { printf( "zeros bitmap present\n" ); }
-         if ( b ) { printf( "min value bitmap present\n" ); }
-         if ( c ) { printf( "mdi bitmap present\n\n" ); }*/
+     bp += 4;
+
+     cba_nbit = *(bp+1);
+     c = cba_nbit & 0x80;
+     b = cba_nbit & 0x40;
+     a = cba_nbit & 0x20;
+     use_bmaps = (a || b || c);
+     nbits = cba_nbit & 0x1F;
+     bp += 2;
+     n = byteswap16(bp);
+     bp += 2;
 
   /*
    * Set all values in unpacked row to BASE initially.  If nbits==0,
    * we leave the data points to this uniform value 
    *-------------------------------------------------------------------*/   
-         for ( i=0; i<cols; i++ ) { unpacked_row[i] = base; }
+     for ( i=0; i<cols; i++ ) { unpacked_row[i] = base; }
 
   /*
-   * Read in contents of packed row (data points + bitmaps) 
+   * Packed row (data points + bitmaps) is decoded in place 
    *-------------------------------------------------------------------*/   
-         if ( fread(buf, 4, n+2, fh)<n+2 ) { break; }
-         bp = buf;
-         pos = 0;
+     row = bp;
 
   /*
-   * If required, extract the bitmap masks 
+   * If required, extract the bitmap masks.  The packed data points start
+   * at the next 32-bit word after the bitmaps.
    *-------------------------------------------------------------------*/   
-         if ( use_bmaps ) {
-            memset( bmap, 0, cols*sizeof(bool) );
-
-         /** Read in MISSING DATA VALUE bitmap (if pesent) **/
-            if (a) { 
-               readBitmap( bp, pos, cols, false, mdi, unpacked_row, bmap );
-               bp += cols / 8;
-               pos = cols % 8;
-            }
-         /** Read in MINIMUM DATA VALUE bitmap (if pesent) **/
-            if (b) { 
-               readBitmap(bp, pos, cols, false, base, unpacked_row, bmap);
-               bp += (pos + cols) / 8;
-               pos = (pos + cols) % 8;
-            }
-         /** Read in ZERO DATA VALUE bitmap (if pesent) **/
-            if (c) {  
-               readBitmap(bp, pos, cols, true, 0.0, unpacked_row, bmap);
-               bp += (pos + cols) / 8;
-               pos = (pos + cols) % 8;
-            }
-         /** Make sure data pointer is aligned with the next 32-bit word **/
-            if ( pos || (bp - buf) % 4 ) {
-               bp += 4 - ((bp - buf) % 4);
-               pos = 0;
-            }
-         }
+     if ( use_bmaps ) {
+        nbmbits = read_bitmaps( row, row+n*4, cols, a, b, c, (float ) mdi, base, unpacked_row, mask );
+        bp = row + ((nbmbits+31)/32)*4;
+     }
 
   /*
    * Extract the packed data points 
    *-------------------------------------------------------------------*/   
-         if ( nbits>0 ) {
-            for ( i=0; i<cols; ++i) {
-                if ( !(use_bmaps && bmap[i]) ) { 
-                   unpacked_row[i] = base + scale*getbits( bp, pos, nbits );
-                   new_pos = pos + nbits;
-                   bp += (new_pos) / 8;
-                   pos = (new_pos) % 8;
-                }
-
-            }
-         }
+     if ( (nbits>0)&&(bp<=row+n*4) ) { 
+        wgdos_unpack_row( bp, row+n*4, 0, nbits, 0, cols, base, scale, unpacked_row, use_bmaps ? mask : NULL );
+     }
+
+     return;
+}
+
+
+/**
+ ** wgdos_row_block - a contiguous block of rows of a WGDOS-packed record that
+ **                   is decoded by a single thread.
+ **/
+
+typedef struct wgdos_row_block {
+        unsigned char **offs;
+        float          *bases;
+        int             first, last;
+        int             row0;          /* row held at the start of DATA */
+        int             cols;
+        float           scale;
+        double          mdi;
+        float          *data;
+        uint64_t       *mask;          /* scratch bitmap words owned by the block's thread */
+} wgdos_row_block;
+
+
+void *wgdos_decode_rows( void *arg ) {
+
+     int              j;
+     wgdos_row_block *blk = (wgdos_row_block *) arg;
+
+     for ( j=blk->first; j<blk->last; j++ )
+         wgdos_decode_row( blk->offs[j], blk->bases[j], blk->cols, blk->scale, blk->mdi, blk->data+(long )(j-blk->row0)*blk->cols, blk->mask );
+
+     return NULL;
+}
+
+
+/***
+ *** WGDOS_RESERVE
+ ***
+ *** Makes sure a WGDOS workspace can hold the row table & row bases of a record
+ *** with ROWS rows and NTHREADS rows of bitmap words for COLS points.  Memory is only
+ *** allocated when the workspace is too small, so a workspace reused for
+ *** records of the same shape allocates nothing after the first record.
+ ***
+ *** Function returns 1 on success and 0 if memory could not be allocated.
+ ***/
+
+int wgdos_reserve( wgdos_workspace *ws, int rows, int cols, int nthreads ) {
+
+     long nwords;
+
+     if ( rows>ws->max_rows ) {
+        free( ws->offs );
+        free( ws->bases );
+        ws->offs  = (unsigned char **) malloc( rows*sizeof(unsigned char *) );
+        ws->bases = (float *) malloc( rows*sizeof(float) );
+        ws->max_rows = ( (ws->offs==NULL)||(ws->bases==NULL) ) ? 0 : rows;
+        if ( ws->max_rows==0 ) { return 0; }
+     }
+
+     nwords = (long ) ((cols+63)/64)*nthreads;
+     if ( nwords>ws->max_words ) {
+        free( ws->mask );
+        ws->mask = (uint64_t *) malloc( nwords*sizeof(uint64_t) );
+        ws->max_words = ( ws->mask==NULL ) ? 0 : nwords;
+        if ( ws->mask==NULL ) { return 0; }
+     }
+
+     return 1;
+}
+
+
+/***
+ *** FREE_WGDOS_WORKSPACE
+ ***
+ *** Releases the scratch space held by a WGDOS workspace.
+ ***/
+
+void free_wgdos_workspace( wgdos_workspace *ws ) {
+
+     free( ws->offs );
+     free( ws->bases );
+     free( ws->mask );
+     memset( ws, 0, sizeof(wgdos_workspace) );
+
+     return;
+}
+
+
+/***
+ *** WGDOS_INDEX_RECORD
+ ***
+ *** Decodes the header of a WGDOS-packed record, locates the start of every
+ *** row & converts the (IBM float) base values of all rows in one batch.  The
+ *** results are kept in the workspace, so that any range of rows of the record
+ *** can then be decoded with WGDOS_UNPACK_ROWS.  The whole packed record is 
+ *** already in memory (eg. in the memory mapping of the input UM fields file).
+ ***
+ *** The record length given in the WGDOS header (in 32 bit words) bounds the
+ *** decoding when it is shorter than the span of data available, and a record
+ *** with more than NPTS points is rejected.
+ ***
+ *** INPUT:  rec -> pointer to the start of the packed record
+ ***      nbytes -> # of bytes available at REC
+ ***        npts -> # of points in the 2D data slice
+ ***    nthreads -> max # of threads that will decode the rows
+ ***
+ *** INPUT/OUTPUT: ws -> scratch space reused from one record to the next (its 
+ ***                     NUM_OVERFLOWS gives the # of row bases too large
+ ***                     for IEEE single precision)
+ ***
+ *** Function returns 1 on success and 0 if the record could not be indexed.
+ ***/
+
+int wgdos_index_record( unsigned char *rec, long nbytes, long npts, int nthreads, wgdos_workspace *ws ) {
+
+     int              j;
+     uint16_t         cols, rows;
+     uint32_t         len;
+     int32_t          prec;
+
+  /*
+   * Decode field header
+   *-------------------------------------------------------------------*/   
+     ws->num_overflows = 0;
+     ws->cols  = 0;
+     ws->nrows = 0;
+     if ( nbytes<20 ) { return 0; }
+
+     len = byteswap32(rec);
+     if ( (len>=3)&&((long ) len*4<nbytes) ) { nbytes = (long ) len*4; }
+
+     prec = byteswap32(rec+4);
+     ws->scale = powf( 2.0, (float ) prec );
+     cols = byteswap16(rec+8);
+     rows = byteswap16(rec+10);
+
+     if ( (long ) cols*rows>npts ) { return 0; }
+     if ( rows==0 ) { return 1; }
+
+     if ( nthreads>WGDOS_MAX_THREADS ) { nthreads = WGDOS_MAX_THREADS; }
+     if ( nthreads<1 ) { nthreads = 1; }
+     if ( !wgdos_reserve( ws, (int ) rows, (int ) cols, nthreads ) ) { return 0; }
+
+  /*
+   * Locate the start of every row 
+   *-------------------------------------------------------------------*/   
+     ws->cols  = (int ) cols;
+     ws->nrows = wgdos_row_offsets( rec, rec+nbytes, (int ) rows, ws->offs );
+
+  /*
+   * Convert the (IBM float) base values of all rows in one batch 
+   *-------------------------------------------------------------------*/   
+     for ( j=0; j<ws->nrows; j++ ) { ((uint32_t *) ws->bases)[j] = byteswap32( ws->offs[j] ); }
+     ws->num_overflows = ibm2ieee_convert( (uint32_t *) ws->bases, ws->bases, (long ) ws->nrows );
+
+     return 1;
+}
 
-         for ( i=0; i<cols; ++i) 
-             unpacked_data[i+j*cols] = (double ) unpacked_row[i];
 
-         bp = buf + n*4;
+/***
+ *** WGDOS_UNPACK_ROWS
+ ***
+ *** Decodes rows FIRST to LAST-1 of a WGDOS-packed record indexed by 
+ *** WGDOS_INDEX_RECORD.  The rows are decoded by NTHREADS threads, each 
+ *** taking a contiguous block of rows; small blocks of rows are always decoded
+ *** serially.  Rows missing from a truncated record are left untouched.
+ ***
+ *** INPUT:  ws -> workspace holding the index of the record
+ ***      first -> index of the first row to decode
+ ***       last -> index just past the last row to decode
+ ***        mdi -> value used to denote a missing data point
+ ***   nthreads -> max # of threads used to decode the rows
+ ***       npts -> # of points that UNPACKED_DATA can hold
+ ***
+ *** OUTPUT: unpacked_data -> (single precision) values of the decoded rows, 
+ ***                          starting with row FIRST
+ ***/
+
+void wgdos_unpack_rows( wgdos_workspace *ws, int first, int last, double mdi, int nthreads, 
+                        long npts, float *unpacked_data ) {
 
-     } // End of NROWS for loop
+     int              t, nstarted;
+     pthread_t        tid[WGDOS_MAX_THREADS];
+     wgdos_row_block  blk[WGDOS_MAX_THREADS];
 
-     free( bmap );
-     free( unpacked_row );
-     free( buf );
+     if ( ws->cols<1 ) { return; }
+     if ( first<0 ) { first = 0; }
+     if ( last>ws->nrows ) { last = ws->nrows; }
+     if ( (long ) (last-first)*ws->cols>npts ) { last = first + (int ) (npts/ws->cols); }
+     if ( last<=first ) { return; }
+
+     if ( nthreads>WGDOS_MAX_THREADS ) { nthreads = WGDOS_MAX_THREADS; }
+     if ( nthreads<1 ) { nthreads = 1; }
+     if ( (long ) ws->cols*(last-first)<WGDOS_PARALLEL_POINTS ) { nthreads = 1; }
+     if ( nthreads>last-first ) { nthreads = last-first; }
+
+  /*
+   * Decode the rows, in blocks of consecutive rows per thread
+   *-------------------------------------------------------------------*/   
+     for ( t=0; t<nthreads; t++ ) {
+         blk[t].offs  = ws->offs;
+         blk[t].bases = ws->bases;
+         blk[t].first = first + (int ) (((long ) (last-first)*t)/nthreads);
+         blk[t].last  = first + (int ) (((long ) (last-first)*(t+1))/nthreads);
+         blk[t].row0  = first;
+         blk[t].cols  = ws->cols;
+         blk[t].scale = ws->scale;
+         blk[t].mdi   = mdi;
+         blk[t].data  = unpacked_data;
+         blk[t].mask  = ws->mask + (long ) t*((ws->cols+63)/64);
+     }
+
+  /** Blocks for which no thread could be started are decoded by the caller **/
+     nstarted = 1;
+     for ( t=1; t<nthreads; t++ ) {
+         if ( pthread_create( &tid[t], NULL, wgdos_decode_rows, &blk[t] )!=0 ) { break; }
+         nstarted++;
+     }
+     for ( t=nstarted; t<nthreads; t++ ) { wgdos_decode_rows( &blk[t] ); }
+     wgdos_decode_rows( &blk[0] );
+     for ( t=1; t<nstarted; t++ ) { pthread_join( tid[t], NULL ); }
 
      return;
 }
 
+
+/***
+ *** WGDOS UNPACK 
+ ***
+ *** Subroutine that unpacks a 2D data slice that has undergone WGDOS packing &
+ *** compression.  The record is indexed (see WGDOS_INDEX_RECORD) and all of
+ *** its rows are then decoded by up to NTHREADS threads (see WGDOS_UNPACK_ROWS).
+ ***
+ *** INPUT:  rec -> pointer to the start of the packed record
+ ***      nbytes -> # of bytes available at REC
+ ***        npts -> # of points that UNPACKED_DATA can hold
+ ***         mdi -> value used to denote a missing data point
+ ***    nthreads -> max # of threads used to decode the rows
+ ***
+ *** INPUT/OUTPUT: ws -> scratch space reused from one call to the next (its 
+ ***                     NUM_OVERFLOWS gives the # of row bases too large
+ ***                     for IEEE single precision)
+ ***
+ *** OUTPUT: unpacked_data -> pointer to the array of (single precision) values for 
+ ***                          the unpacked 2D data slice     
+ ***
+ *** Function returns 1 on success and 0 if the record could not be unpacked.
+ ***/
+
+int wgdos_unpack( unsigned char *rec, long nbytes, float *unpacked_data, long npts, double mdi,
+                  int nthreads, wgdos_workspace *ws ) {
+
+     if ( !wgdos_index_record( rec, nbytes, npts, nthreads, ws ) ) { return 0; }
+     wgdos_unpack_rows( ws, 0, ws->nrows, mdi, nthreads, npts, unpacked_data );
+
+     return 1;
+}
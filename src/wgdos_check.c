@@ -0,0 +1,484 @@
+/**============================================================================
+                 U M 2 N e t C D F  V e r s i o n 2 . 0
+                 --------------------------------------
+
+    Main author: Mark Cheeseman
+                 National Institute of Water & Atmospheric Research (Ltd)
+                 Wellington, New Zealand
+                 February 2014
+
+    UM2NetCDF is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    UM2NetCDF is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    A copy of the GNU General Public License can be found in the main UM2NetCDF
+    directory.  Alternatively, please see <http://www.gnu.org/licenses/>.
+ **============================================================================*/
+
+
+/***
+ *** WGDOS_CHECK
+ ***
+ *** Checks that every WGDOS row unpacking kernel supported by the CPU (scalar,
+ *** AVX2 & AVX-512) decodes random rows bit for bit like the original
+ *** getbits/readBitmap decoder.  Rows of 1 to 31 bit integers are generated
+ *** with every combination of the 3 bitmaps, with widths that are multiples
+ *** of 64 or leave 8 or 56 points in the last bitmap word as well as random
+ *** widths.  Each packed row and its bitmap workspace are placed against a
+ *** guard page, so that any read past their end stops the check.
+ ***
+ *** With the -b option, the rate at which the original decoder & each kernel
+ *** unpack the same random rows (without bitmaps) is measured instead, for
+ *** the common widths of 1 to 16 bits and for 24 bits.
+ ***
+ *** Built & run from the src directory with:  make ARCH=x86 CC=gcc wgdos_check
+ ***                                     or:  make ARCH=x86 CC=gcc wgdos_bench
+ ***/
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "field_def.h"
+
+#define NUM_ROWS  10000   /* # of random rows decoded by each kernel */
+#define MAX_COLS  2048    /* max # of points in a random row */
+
+#define BENCH_ROWS  2000  /* # of rows unpacked per pass when timing */
+#define BENCH_COLS  1024  /* # of points in each timed row */
+#define BENCH_PASSES  10  /* # of passes over the timed rows */
+
+#define ROW_BYTES  (8 + 4*(3*MAX_COLS/32 + 2) + 4*(MAX_COLS + 2) + 16)  /* room for any packed row */
+
+/** Function prototypes **/
+
+const char *select_wgdos_kernel( void );
+int force_wgdos_kernel( const char *name );
+void wgdos_decode_row( unsigned char *bp, float base, int cols, float scale, double mdi, float *unpacked_row,
+                       uint64_t *mask );
+
+/** A block of memory whose end is followed by an inaccessible page **/
+typedef struct guarded_block {
+        unsigned char *mem;     /* start of the mapping */
+        size_t         len;     /* length of the mapping */
+        size_t         size;    /* # of usable bytes before the guard page */
+} guarded_block;
+
+
+/***
+ *** GETBITS / READBITMAP
+ ***
+ *** The original WGDOS decoder, against which the kernels are checked.
+ ***/
+
+static uint32_t getbits( const unsigned char *bp, int pos, int nbits ) {
+
+     uint32_t res = 0;
+     int      more = nbits, bits;
+     uint8_t  mask, val;
+
+     while ( 1 ) {
+           bits = ((8 - pos) < more) ? 8 - pos : more;
+           mask = ((1 << bits) - 1) << (8 - pos - bits);
+           val  = (*bp & mask) >> (8 - pos - bits);
+           more -= bits;
+           res |= (uint32_t ) val << more;
+           if ( !more ) { break; }
+           bp++; pos = 0;
+     }
+
+     return res;
+}
+
+static void readBitmap( const unsigned char *bp, int start, int cols, bool reverse, float value, float data[], bool bmap[] ) {
+
+     int           i, pos;
+     unsigned char byte;
+
+     byte = *bp;
+     if ( reverse ) { byte = ~byte; }
+     byte <<= start;
+     pos = start;
+     for ( i=0; i<cols; ++i ) {
+         if ( byte & 0x80 ) {
+            data[i] = value;
+            bmap[i] = true;
+         }
+         if ( pos<7 ) {
+            byte <<= 1;
+            pos++;
+         } else {
+            byte = *++bp;
+            if ( reverse ) { byte = ~byte; }
+            pos = 0;
+         }
+     }
+
+     return;
+}
+
+
+/***
+ *** REFERENCE_DECODE_ROW
+ ***
+ *** Unpacks the N words of a packed row (following its 8 byte header) as the
+ *** original decoder did.  BUF must hold a few bytes past the row, which the
+ *** original decoder may read.
+ ***/
+
+static void reference_decode_row( const unsigned char *buf, int cols, int nbits, bool a, bool b, bool c,
+                                  float base, float scale, double mdi, float *out, bool *bmap ) {
+
+     int                  i, pos, new_pos;
+     const unsigned char *bp;
+     volatile float       p;
+
+     for ( i=0; i<cols; i++ ) { out[i] = base; }
+     memset( bmap, 0, cols*sizeof(bool) );
+
+     bp  = buf;
+     pos = 0;
+     if ( a||b||c ) {
+        if ( a ) {
+           readBitmap( bp, pos, cols, false, mdi, out, bmap );
+           bp += cols / 8;
+           pos = cols % 8;
+        }
+        if ( b ) {
+           readBitmap( bp, pos, cols, false, base, out, bmap );
+           bp += (pos + cols) / 8;
+           pos = (pos + cols) % 8;
+        }
+        if ( c ) {
+           readBitmap( bp, pos, cols, true, 0.0, out, bmap );
+           bp += (pos + cols) / 8;
+           pos = (pos + cols) % 8;
+        }
+        if ( pos || (bp - buf) % 4 ) {
+           bp += 4 - ((bp - buf) % 4);
+           pos = 0;
+        }
+     }
+
+     if ( nbits>0 ) {
+        for ( i=0; i<cols; ++i ) {
+            if ( !bmap[i] ) {
+               p = scale*getbits( bp, pos, nbits );     /* no fused multiply-add */
+               out[i] = base + p;
+               new_pos = pos + nbits;
+               bp += new_pos / 8;
+               pos = new_pos % 8;
+            }
+        }
+     }
+
+     return;
+}
+
+
+/***
+ *** PUT_BITS
+ ***
+ *** Writes the NBITS low bits of VAL MSB-first at bit BITPOS of BUF.
+ ***/
+
+static void put_bits( unsigned char *buf, long bitpos, int nbits, uint32_t val ) {
+
+     int k;
+
+     for ( k=nbits-1; k>=0; k--, bitpos++ ) {
+         if ( (val>>k) & 1 ) { buf[bitpos/8] |= (unsigned char ) (0x80 >> (bitpos%8)); }
+     }
+
+     return;
+}
+
+
+/***
+ *** GUARDED_ALLOC
+ ***
+ *** Maps SIZE usable bytes followed by an inaccessible guard page.
+ ***/
+
+static void guarded_alloc( guarded_block *g, size_t size ) {
+
+     size_t page = (size_t ) sysconf( _SC_PAGESIZE );
+
+     g->size = size;
+     g->len  = ((size + page - 1)/page + 1)*page;
+     g->mem  = (unsigned char *) mmap( NULL, g->len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0 );
+     if ( g->mem==MAP_FAILED ) { printf( "ERROR: could not map a guarded block\n" ); exit(1); }
+     mprotect( g->mem + g->len - page, page, PROT_NONE );
+
+     return;
+}
+
+
+/** Returns a pointer to the last N usable bytes of a guarded block **/
+static unsigned char *guarded_tail( guarded_block *g, size_t n ) {
+
+     return g->mem + (g->len - (size_t ) sysconf( _SC_PAGESIZE )) - n;
+}
+
+
+/***
+ *** PACK_ROW
+ ***
+ *** Packs a random row of COLS points with NBITS bit integers & the bitmaps
+ *** selected by A, B & C (its 8 byte header first) into BUF, which must hold
+ *** ROW_BYTES zeroed bytes.  A random row base & scale are also drawn.
+ ***
+ *** Function returns the # of 32 bit words following the row's header.
+ ***/
+
+static int pack_row( unsigned char *buf, int cols, int nbits, bool a, bool b, bool c, float *base, float *scale ) {
+
+     static bool flagged[MAX_COLS];
+
+     int  i, nbm, n;
+     long bitpos;
+
+     *base  = (float ) ((rand() % 20001) - 10000) / 64.0f;
+     *scale = ldexpf( 1.0f, (rand() % 16) - 10 );
+
+  /** Bitmaps: one bit per point in each bitmap present **/
+     nbm = (a ? 1 : 0) + (b ? 1 : 0) + (c ? 1 : 0);
+     memset( flagged, 0, cols*sizeof(bool) );
+     bitpos = 64;
+     if ( a ) {
+        for ( i=0; i<cols; i++ ) if ( rand()%4==0 ) { put_bits( buf, bitpos+i, 1, 1 ); flagged[i] = true; }
+        bitpos += cols;
+     }
+     if ( b ) {
+        for ( i=0; i<cols; i++ ) if ( rand()%4==0 ) { put_bits( buf, bitpos+i, 1, 1 ); flagged[i] = true; }
+        bitpos += cols;
+     }
+     if ( c ) {
+        for ( i=0; i<cols; i++ ) {
+            if ( rand()%4==0 ) { flagged[i] = true; }
+            else               { put_bits( buf, bitpos+i, 1, 1 ); }
+        }
+        bitpos += cols;
+     }
+     bitpos = 64 + ((long ) nbm*cols + 31)/32*32;
+
+  /** Packed integers of the points not flagged by a bitmap **/
+     for ( i=0; i<cols; i++ ) {
+         if ( flagged[i] ) { continue; }
+         put_bits( buf, bitpos, nbits, (uint32_t ) (((uint64_t ) rand() << 16 ^ (uint64_t ) rand()) & ((UINT64_C(1) << nbits) - 1)) );
+         bitpos += nbits;
+     }
+     n = (int ) ((bitpos - 64 + 31)/32);
+
+  /** Row header: base (unused by the kernels), flags & # of words **/
+     buf[5] = (unsigned char ) ((c ? 0x80 : 0) | (b ? 0x40 : 0) | (a ? 0x20 : 0) | nbits);
+     buf[6] = (unsigned char ) (n >> 8);
+     buf[7] = (unsigned char ) (n & 0xFF);
+
+     return n;
+}
+
+
+/***
+ *** CHECK_ROW
+ ***
+ *** Packs a random row of COLS points with NBITS bit integers & the bitmaps
+ *** selected by A, B & C, decodes it with the current kernel & the reference
+ *** decoder and compares the results bit for bit.
+ ***
+ *** Function returns 1 if the results agree and 0 otherwise.
+ ***/
+
+static int check_row( guarded_block *rowmem, guarded_block *maskmem, int cols, int nbits, bool a, bool b, bool c ) {
+
+     static unsigned char buf[ROW_BYTES];
+     static float         out[MAX_COLS], ref[MAX_COLS];
+     static bool          bmap[MAX_COLS];
+
+     int            i, n;
+     float          base, scale;
+     double         mdi;
+     unsigned char *row;
+     uint64_t      *mask;
+
+     memset( buf, 0, sizeof(buf) );
+     n   = pack_row( buf, cols, nbits, a, b, c, &base, &scale );
+     mdi = ( rand() % 2 ) ? -32768.0 : -1.073741824e9;
+
+  /** Place the row & its bitmap workspace against their guard pages **/
+     row  = guarded_tail( rowmem, 8 + 4*(size_t ) n );
+     memcpy( row, buf, 8 + 4*(size_t ) n );
+     mask = (uint64_t *) guarded_tail( maskmem, ((cols+63)/64)*sizeof(uint64_t) );
+
+     wgdos_decode_row( row, base, cols, scale, mdi, out, mask );
+     reference_decode_row( buf+8, cols, nbits, a, b, c, base, scale, mdi, ref, bmap );
+
+     if ( memcmp( out, ref, cols*sizeof(float) )!=0 ) {
+        for ( i=0; (i<cols)&&(memcmp( &out[i], &ref[i], sizeof(float) )==0); i++ );
+        printf( "   MISMATCH: cols=%d nbits=%d bitmaps=%d%d%d at point %d: %.9g instead of %.9g\n",
+                cols, nbits, a, b, c, i, out[i], ref[i] );
+        return 0;
+     }
+
+     return 1;
+}
+
+
+/** Returns the time elapsed since T0 in seconds **/
+static double seconds_since( const struct timespec *t0 ) {
+
+     struct timespec t1;
+
+     clock_gettime( CLOCK_MONOTONIC, &t1 );
+     return (double ) (t1.tv_sec - t0->tv_sec) + 1.0e-9*(double ) (t1.tv_nsec - t0->tv_nsec);
+}
+
+
+/***
+ *** BENCH_KERNELS
+ ***
+ *** Times the original decoder & each kernel supported by the CPU on the same
+ *** BENCH_ROWS random rows of BENCH_COLS points (without bitmaps) for each of
+ *** the widths 1 to 16 & 24, and prints their rates in millions of points
+ *** per second.
+ ***/
+
+static void bench_kernels( const char **kernels, int nkernels ) {
+
+     static const int widths[17] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 24 };
+
+     int            w, k, r, pass, supported[3];
+     float         *bases, *scales, *out;
+     bool          *bmap;
+     uint64_t       mask[(BENCH_COLS+63)/64];
+     unsigned char *rows;
+     double         t, npts;
+     struct timespec t0;
+
+     rows   = (unsigned char *) malloc( (size_t ) BENCH_ROWS*ROW_BYTES );
+     bases  = (float *) malloc( BENCH_ROWS*sizeof(float) );
+     scales = (float *) malloc( BENCH_ROWS*sizeof(float) );
+     out    = (float *) malloc( BENCH_COLS*sizeof(float) );
+     bmap   = (bool *) malloc( BENCH_COLS*sizeof(bool) );
+     npts   = (double ) BENCH_ROWS*BENCH_COLS*BENCH_PASSES;
+
+     printf( "Mpts/s for %d rows of %d points, %d passes\n\n", BENCH_ROWS, BENCH_COLS, BENCH_PASSES );
+     printf( "  nbits  original" );
+     for ( k=0; k<nkernels; k++ ) {
+         supported[k] = force_wgdos_kernel( kernels[k] );
+         if ( supported[k] ) { printf( " %9s", kernels[k] ); }
+     }
+     printf( "\n" );
+
+     srand( 12345 );
+     for ( w=0; w<17; w++ ) {
+         memset( rows, 0, (size_t ) BENCH_ROWS*ROW_BYTES );
+         for ( r=0; r<BENCH_ROWS; r++ ) {
+             pack_row( rows+(size_t ) r*ROW_BYTES, BENCH_COLS, widths[w], false, false, false, &bases[r], &scales[r] );
+         }
+
+         clock_gettime( CLOCK_MONOTONIC, &t0 );
+         for ( pass=0; pass<BENCH_PASSES; pass++ ) {
+         for ( r=0; r<BENCH_ROWS; r++ ) {
+             reference_decode_row( rows+(size_t ) r*ROW_BYTES+8, BENCH_COLS, widths[w], false, false, false,
+                                   bases[r], scales[r], -32768.0, out, bmap );
+         }
+         }
+         t = seconds_since( &t0 );
+         printf( "  %5d  %8.0f", widths[w], 1.0e-6*npts/t );
+
+         for ( k=0; k<nkernels; k++ ) {
+             if ( supported[k]==0 ) { continue; }
+             force_wgdos_kernel( kernels[k] );
+             clock_gettime( CLOCK_MONOTONIC, &t0 );
+             for ( pass=0; pass<BENCH_PASSES; pass++ ) {
+             for ( r=0; r<BENCH_ROWS; r++ ) {
+                 wgdos_decode_row( rows+(size_t ) r*ROW_BYTES, bases[r], BENCH_COLS, scales[r], -32768.0, out, mask );
+             }
+             }
+             t = seconds_since( &t0 );
+             printf( " %9.0f", 1.0e-6*npts/t );
+         }
+         printf( "\n" );
+     }
+     printf( "\n" );
+
+     free( rows );
+     free( bases );
+     free( scales );
+     free( out );
+     free( bmap );
+
+     return;
+}
+
+
+int main( int argc, char *argv[] ) {
+
+     static const char *kernels[3] = { "scalar", "AVX2", "AVX-512" };
+     static const int   tails[3]   = { 0, 8, 56 };
+
+     int           k, r, nbits, bm, cols, nfail, total;
+     guarded_block rowmem, maskmem;
+
+     select_wgdos_kernel();
+     if ( (argc>1)&&(strcmp( argv[1], "-b" )==0) ) {
+        bench_kernels( kernels, 3 );
+        return 0;
+     }
+
+     guarded_alloc( &rowmem, ROW_BYTES );
+     guarded_alloc( &maskmem, ((MAX_COLS+63)/64)*sizeof(uint64_t) );
+
+     total = 0;
+     for ( k=0; k<3; k++ ) {
+         if ( force_wgdos_kernel( kernels[k] )==0 ) {
+            printf( "%-8s: not supported by this CPU, skipped\n", kernels[k] );
+            continue;
+         }
+
+         srand( 12345 );
+         nfail = 0;
+
+      /** Every width & bitmap combination, for widths ending on each tail **/
+         for ( nbits=1; nbits<=31; nbits++ ) {
+         for ( bm=0; bm<8; bm++ ) {
+         for ( r=0; r<3; r++ ) {
+             cols = 64*(1 + rand()%8) + tails[r];
+             if ( tails[r]>0 ) { cols -= 64; }
+             nfail += 1 - check_row( &rowmem, &maskmem, cols, nbits, bm&1, bm&2, bm&4 );
+         }
+         }
+         }
+
+      /** Random rows **/
+         for ( r=0; r<NUM_ROWS; r++ ) {
+             cols  = 1 + rand()%MAX_COLS;
+             nbits = 1 + rand()%31;
+             bm    = ( rand()%2 ) ? 0 : rand()%8;
+             nfail += 1 - check_row( &rowmem, &maskmem, cols, nbits, bm&1, bm&2, bm&4 );
+         }
+
+         printf( "%-8s: %d mismatching rows\n", kernels[k], nfail );
+         total += nfail;
+     }
+
+     if ( total>0 ) {
+        printf( "\nFAILED: the WGDOS kernels do not match the original decoder\n\n" );
+        return 1;
+     }
+     printf( "\nPASSED\n\n" );
+
+     return 0;
+}
@@ -0,0 +1,306 @@
+/**============================================================================
+                 U M 2 N e t C D F  V e r s i o n 2 . 0
+                 --------------------------------------
+
+    Main author: Mark Cheeseman
+                 National Institute of Water & Atmospheric Research (Ltd)
+                 Wellington, New Zealand
+                 February 2014
+
+    UM2NetCDF is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    UM2NetCDF is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    A copy of the GNU General Public License can be found in the main UM2NetCDF
+    directory.  Alternatively, please see <http://www.gnu.org/licenses/>.
+ **============================================================================*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "field_def.h"
+
+/** Function prototypes **/
+
+void unpack_row_scalar( const unsigned char *bp, const unsigned char *end, long bitpos, int nbits,
+                        int first, int cols, float base, float scale, float *out, const uint64_t *mask );
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__PGI)
+#define WGDOS_SIMD
+#endif
+
+#ifdef WGDOS_SIMD
+
+#include <immintrin.h>
+
+/*
+ * Each packed integer is fetched with a 4 byte gather at the byte holding its
+ * first bit, so it must fit in 32 bits after a shift of up to 7 bits.  Rows
+ * with wider integers are unpacked by the scalar kernel.
+ */
+#define WGDOS_SIMD_MAX_BITS 25
+
+/*
+ * The product SCALE*X is passed through an empty asm statement so that the
+ * compiler cannot fuse it with the addition of BASE into an FMA; the kernels
+ * then round exactly like the scalar kernel.
+ */
+#define NO_CONTRACT(v) __asm__( "" : "+x"(v) )
+
+static uint8_t rank_lut[256][8];   /* rank of each lane among the unmasked lanes of an 8 bit mask */
+
+
+/** Returns the bitmap bits of points I to I+15 of a row (only valid while I+16<=cols) **/
+static inline unsigned int mask_bits( const uint64_t *mask, int i )
+{
+   int      s = i & 63;
+   uint64_t w = mask[i >> 6] >> s;
+
+   if (s > 48) w |= mask[(i >> 6) + 1] << (64 - s);
+   return (unsigned int) (w & 0xFFFF);
+}
+
+
+/** Returns the bitmap bits of points I to I+7 of a row (only valid while I+8<=cols) **/
+static inline unsigned int mask_bits8( const uint64_t *mask, int i )
+{
+   int      s = i & 63;
+   uint64_t w = mask[i >> 6] >> s;
+
+   if (s > 56) w |= mask[(i >> 6) + 1] << (64 - s);
+   return (unsigned int) (w & 0xFF);
+}
+
+
+/***
+ *** UNPACK_ROW_AVX2
+ ***
+ *** AVX2 kernel unpacking 8 packed integers at a time.  The bit offsets of
+ *** the 8 integers are turned into byte offsets for a gather, the gathered
+ *** big-endian words are byte-swapped and the integers shifted into place.
+ *** For rows with bitmaps the 8 bits of the combined bitmap covering each
+ *** block select which lanes take the next packed integers; the other lanes keep the value written by
+ *** the bitmap.  See unpack_row_scalar for the arguments.
+ ***/
+
+__attribute__((target("avx2")))
+static void unpack_row_avx2( const unsigned char *bp, const unsigned char *end, long bitpos, int nbits,
+                             int first, int cols, float base, float scale, float *out, const uint64_t *mask )
+{
+   const __m256i bswap  = _mm256_setr_epi8( 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                            3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 );
+   const __m256i lanebit = _mm256_setr_epi32( 1, 2, 4, 8, 16, 32, 64, 128 );
+   const __m256i seven  = _mm256_set1_epi32( 7 );
+   const __m256i vnbits = _mm256_set1_epi32( nbits );
+   const __m128i rshift = _mm_cvtsi32_si128( 32 - nbits );
+   const __m256  vbase  = _mm256_set1_ps( base );
+   const __m256  vscale = _mm256_set1_ps( scale );
+   const long    nbytes = (long) (end - bp);
+   __m256i       lanes, off, w, x, keep;
+   __m256        v, p;
+   int           i, m, k;
+
+   if (nbits > WGDOS_SIMD_MAX_BITS) {
+      unpack_row_scalar( bp, end, bitpos, nbits, first, cols, base, scale, out, mask );
+      return;
+   }
+
+   lanes = _mm256_mullo_epi32( _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 ), vnbits );
+   i = first;
+
+   if (mask == NULL) {
+      while ((i + 8 <= cols) && ((bitpos + 7L*nbits)/8 + 4 <= nbytes)) {
+         off = _mm256_add_epi32( _mm256_set1_epi32( (int) bitpos ), lanes );
+         w   = _mm256_i32gather_epi32( (const int *) bp, _mm256_srli_epi32( off, 3 ), 1 );
+         w   = _mm256_shuffle_epi8( w, bswap );
+         x   = _mm256_srl_epi32( _mm256_sllv_epi32( w, _mm256_and_si256( off, seven ) ), rshift );
+         p   = _mm256_mul_ps( vscale, _mm256_cvtepi32_ps( x ) );
+         NO_CONTRACT(p);
+         v   = _mm256_add_ps( vbase, p );
+         _mm256_storeu_ps( out + i, v );
+         i      += 8;
+         bitpos += 8L*nbits;
+      }
+   } else {
+      while (i + 8 <= cols) {
+         m = (int) mask_bits8( mask, i );
+         k = 8 - __builtin_popcount( m );
+         if (k == 0) { i += 8; continue; }
+         if ((bitpos + (long) (k - 1)*nbits)/8 + 4 > nbytes) break;
+
+         keep = _mm256_cmpeq_epi32( _mm256_and_si256( _mm256_set1_epi32( m ), lanebit ), _mm256_setzero_si256() );
+         off  = _mm256_cvtepu8_epi32( _mm_loadl_epi64( (const __m128i *) rank_lut[m] ) );
+         off  = _mm256_add_epi32( _mm256_set1_epi32( (int) bitpos ), _mm256_mullo_epi32( off, vnbits ) );
+         w    = _mm256_mask_i32gather_epi32( _mm256_setzero_si256(), (const int *) bp,
+                                             _mm256_srli_epi32( off, 3 ), keep, 1 );
+         w    = _mm256_shuffle_epi8( w, bswap );
+         x    = _mm256_srl_epi32( _mm256_sllv_epi32( w, _mm256_and_si256( off, seven ) ), rshift );
+         p    = _mm256_mul_ps( vscale, _mm256_cvtepi32_ps( x ) );
+         NO_CONTRACT(p);
+         v    = _mm256_add_ps( vbase, p );
+         v    = _mm256_blendv_ps( _mm256_loadu_ps( out + i ), v, _mm256_castsi256_ps( keep ) );
+         _mm256_storeu_ps( out + i, v );
+         i      += 8;
+         bitpos += (long) k*nbits;
+      }
+   }
+
+   if (i < cols)
+      unpack_row_scalar( bp, end, bitpos, nbits, i, cols, base, scale, out, mask );
+}
+
+
+/***
+ *** UNPACK_ROW_AVX512
+ ***
+ *** AVX-512 kernel unpacking 16 packed integers at a time.  For rows with
+ *** bitmaps the lane ranks are produced by an expand of the unmasked lanes and
+ *** only the unmasked lanes are gathered and stored.  See unpack_row_scalar
+ *** for the arguments.
+ ***/
+
+__attribute__((target("avx512f,avx512bw")))
+static void unpack_row_avx512( const unsigned char *bp, const unsigned char *end, long bitpos, int nbits,
+                               int first, int cols, float base, float scale, float *out, const uint64_t *mask )
+{
+   const __m512i bswap  = _mm512_set4_epi32( 0x0c0d0e0f, 0x08090a0b, 0x04050607, 0x00010203 );
+   const __m512i iota   = _mm512_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 );
+   const __m512i seven  = _mm512_set1_epi32( 7 );
+   const __m512i vnbits = _mm512_set1_epi32( nbits );
+   const __m128i rshift = _mm_cvtsi32_si128( 32 - nbits );
+   const __m512  vbase  = _mm512_set1_ps( base );
+   const __m512  vscale = _mm512_set1_ps( scale );
+   const long    nbytes = (long) (end - bp);
+   __m512i       lanes, off, w, x;
+   __m512        v, p;
+   __mmask16     keep;
+   int           i, k;
+
+   if (nbits > WGDOS_SIMD_MAX_BITS) {
+      unpack_row_scalar( bp, end, bitpos, nbits, first, cols, base, scale, out, mask );
+      return;
+   }
+
+   lanes = _mm512_mullo_epi32( iota, vnbits );
+   i = first;
+
+   if (mask == NULL) {
+      while ((i + 16 <= cols) && ((bitpos + 15L*nbits)/8 + 4 <= nbytes)) {
+         off = _mm512_add_epi32( _mm512_set1_epi32( (int) bitpos ), lanes );
+         w   = _mm512_i32gather_epi32( _mm512_srli_epi32( off, 3 ), (const void *) bp, 1 );
+         w   = _mm512_shuffle_epi8( w, bswap );
+         x   = _mm512_srl_epi32( _mm512_sllv_epi32( w, _mm512_and_si512( off, seven ) ), rshift );
+         p   = _mm512_mul_ps( vscale, _mm512_cvtepi32_ps( x ) );
+         NO_CONTRACT(p);
+         v   = _mm512_add_ps( vbase, p );
+         _mm512_storeu_ps( out + i, v );
+         i      += 16;
+         bitpos += 16L*nbits;
+      }
+   } else {
+      while (i + 16 <= cols) {
+         keep = (__mmask16) ~mask_bits( mask, i );
+         k = __builtin_popcount( (unsigned int) keep );
+         if (k == 0) { i += 16; continue; }
+         if ((bitpos + (long) (k - 1)*nbits)/8 + 4 > nbytes) break;
+
+         off = _mm512_maskz_expand_epi32( keep, iota );
+         off = _mm512_add_epi32( _mm512_set1_epi32( (int) bitpos ), _mm512_mullo_epi32( off, vnbits ) );
+         w   = _mm512_mask_i32gather_epi32( _mm512_setzero_si512(), keep, _mm512_srli_epi32( off, 3 ),
+                                            (const void *) bp, 1 );
+         w   = _mm512_shuffle_epi8( w, bswap );
+         x   = _mm512_srl_epi32( _mm512_sllv_epi32( w, _mm512_and_si512( off, seven ) ), rshift );
+         p   = _mm512_mul_ps( vscale, _mm512_cvtepi32_ps( x ) );
+         NO_CONTRACT(p);
+         v   = _mm512_add_ps( vbase, p );
+         _mm512_mask_storeu_ps( out + i, keep, v );
+         i      += 16;
+         bitpos += (long) k*nbits;
+      }
+   }
+
+   if (i < cols)
+      unpack_row_scalar( bp, end, bitpos, nbits, i, cols, base, scale, out, mask );
+}
+
+#endif
+
+
+/***
+ *** SELECT_WGDOS_KERNEL
+ ***
+ *** Sets the WGDOS row unpacking kernel to the widest SIMD kernel supported by
+ *** the CPU (as reported by CPUID), falling back on the portable scalar 
+ *** kernel.  All kernels give bit-identical results.
+ ***
+ *** Function returns the name of the selected kernel.
+ ***/
+
+const char *select_wgdos_kernel( void ) {
+
+#ifdef WGDOS_SIMD
+     int m, l, r;
+
+     for ( m=0; m<256; m++ ) {
+         r = 0;
+         for ( l=0; l<8; l++ ) {
+             rank_lut[m][l] = (uint8_t ) r;
+             if ( !(m&(1<<l)) ) { r++; }
+         }
+     }
+
+     __builtin_cpu_init();
+     if ( __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") ) {
+        wgdos_unpack_row = &unpack_row_avx512;
+        return "AVX-512";
+     }
+     if ( __builtin_cpu_supports("avx2") ) {
+        wgdos_unpack_row = &unpack_row_avx2;
+        return "AVX2";
+     }
+#endif
+
+     wgdos_unpack_row = &unpack_row_scalar;
+     return "scalar";
+}
+
+
+/***
+ *** FORCE_WGDOS_KERNEL
+ ***
+ *** Sets the WGDOS row unpacking kernel to the named one ("scalar", "AVX2" or
+ *** "AVX-512"), so that the kernels can be checked against each other.
+ *** SELECT_WGDOS_KERNEL must have been called first.
+ ***
+ *** Function returns 1 if the kernel is supported by the CPU and 0 otherwise.
+ ***/
+
+int force_wgdos_kernel( const char *name ) {
+
+     if ( strcmp( name, "scalar" )==0 ) {
+        wgdos_unpack_row = &unpack_row_scalar;
+        return 1;
+     }
+
+#ifdef WGDOS_SIMD
+     __builtin_cpu_init();
+     if ( (strcmp( name, "AVX-512" )==0)&&__builtin_cpu_supports("avx512f")&&__builtin_cpu_supports("avx512bw") ) {
+        wgdos_unpack_row = &unpack_row_avx512;
+        return 1;
+     }
+     if ( (strcmp( name, "AVX2" )==0)&&__builtin_cpu_supports("avx2") ) {
+        wgdos_unpack_row = &unpack_row_avx2;
+        return 1;
+     }
+#endif
+
+     return 0;
+}